@@ -0,0 +1,295 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "alloc_tracker.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "log.h"
+
+namespace dogtricks {
+
+namespace {
+
+/**
+ * The counters of one scope.
+ */
+struct ScopeCounters {
+  //! The number of allocations made.
+  std::atomic<uint64_t> allocations;
+
+  //! The number of bytes allocated.
+  std::atomic<uint64_t> bytes;
+
+  //! The number of allocations freed.
+  std::atomic<uint64_t> frees;
+
+  //! The number of bytes allocated and not yet freed.
+  std::atomic<int64_t> live_bytes;
+
+  //! The highest value of live_bytes.
+  std::atomic<int64_t> peak_live_bytes;
+
+  //! The number of scope instances that exceeded the budget.
+  std::atomic<uint64_t> budget_overruns;
+
+  //! The budget plus one, so that zero initialization means no budget.
+  std::atomic<size_t> budget_plus_one;
+};
+
+//! The counters of each scope. Zero initialized before any allocation.
+ScopeCounters gScopes[AllocTracker::kScopeCount];
+
+//! The number of bytes live across all scopes.
+std::atomic<int64_t> gLiveBytes;
+
+//! The highest value of gLiveBytes.
+std::atomic<int64_t> gPeakLiveBytes;
+
+/**
+ * Raises a peak to at least a value.
+ */
+void UpdatePeak(std::atomic<int64_t> *peak, int64_t value) {
+  int64_t current = peak->load(std::memory_order_relaxed);
+  while (value > current
+      && !peak->compare_exchange_weak(current, value,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+thread_local AllocTracker::Scope AllocTracker::current_scope_ =
+    AllocTracker::Scope::Other;
+thread_local size_t AllocTracker::scope_allocations_ = 0;
+
+const char *AllocTracker::GetScopeName(Scope scope) {
+  switch (scope) {
+    case Scope::Other:
+      return "other";
+    case Scope::TransportRx:
+      return "transport rx";
+    case Scope::RadioParse:
+      return "radio parse";
+    case Scope::RadioCommand:
+      return "radio command";
+    case Scope::HandlerDispatch:
+      return "handler dispatch";
+    case Scope::Output:
+      return "output";
+    case Scope::Count:
+      break;
+  }
+
+  return "unknown";
+}
+
+AllocTracker::ScopeStats AllocTracker::GetStats(Scope scope) {
+  const ScopeCounters& counters = gScopes[static_cast<size_t>(scope)];
+  ScopeStats stats;
+  stats.allocations = counters.allocations.load(std::memory_order_relaxed);
+  stats.bytes = counters.bytes.load(std::memory_order_relaxed);
+  stats.frees = counters.frees.load(std::memory_order_relaxed);
+  stats.live_bytes = counters.live_bytes.load(std::memory_order_relaxed);
+  stats.peak_live_bytes =
+      counters.peak_live_bytes.load(std::memory_order_relaxed);
+  stats.budget_overruns =
+      counters.budget_overruns.load(std::memory_order_relaxed);
+  return stats;
+}
+
+int64_t AllocTracker::GetLiveBytes() {
+  return gLiveBytes.load(std::memory_order_relaxed);
+}
+
+int64_t AllocTracker::GetPeakLiveBytes() {
+  return gPeakLiveBytes.load(std::memory_order_relaxed);
+}
+
+void AllocTracker::SetBudget(Scope scope, size_t max_allocations) {
+  gScopes[static_cast<size_t>(scope)].budget_plus_one.store(
+      max_allocations + 1, std::memory_order_relaxed);
+}
+
+size_t AllocTracker::GetBudget(Scope scope) {
+  return gScopes[static_cast<size_t>(scope)].budget_plus_one.load(
+      std::memory_order_relaxed) - 1;
+}
+
+AllocTracker::Scope AllocTracker::RecordAllocation(size_t size) {
+  Scope scope = current_scope_;
+  ++scope_allocations_;
+
+  ScopeCounters& counters = gScopes[static_cast<size_t>(scope)];
+  counters.allocations.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(size, std::memory_order_relaxed);
+  UpdatePeak(&counters.peak_live_bytes,
+             counters.live_bytes.fetch_add(size, std::memory_order_relaxed)
+                 + static_cast<int64_t>(size));
+  UpdatePeak(&gPeakLiveBytes,
+             gLiveBytes.fetch_add(size, std::memory_order_relaxed)
+                 + static_cast<int64_t>(size));
+  return scope;
+}
+
+void AllocTracker::RecordFree(Scope scope, size_t size) {
+  ScopeCounters& counters = gScopes[static_cast<size_t>(scope)];
+  counters.frees.fetch_add(1, std::memory_order_relaxed);
+  counters.live_bytes.fetch_sub(size, std::memory_order_relaxed);
+  gLiveBytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void AllocTracker::RecordOverrun(Scope scope, size_t allocations) {
+  ScopeCounters& counters = gScopes[static_cast<size_t>(scope)];
+  uint64_t overruns =
+      counters.budget_overruns.fetch_add(1, std::memory_order_relaxed);
+  if (overruns == 0) {
+    LOGE("Allocation budget of %zu for %s exceeded with %zu allocations",
+         GetBudget(scope), GetScopeName(scope), allocations);
+  }
+}
+
+}  // namespace dogtricks
+
+#ifdef DOGTRICKS_ENABLE_ALLOC_TRACKING
+
+namespace {
+
+/**
+ * The header stored before each tracked allocation so that frees can be
+ * attributed to the scope that allocated.
+ */
+struct alignas(alignof(std::max_align_t)) AllocHeader {
+  //! The number of bytes requested.
+  size_t size;
+
+  //! The offset of the returned block from the start of the malloc block.
+  uint32_t offset;
+
+  //! The scope that the allocation is attributed to.
+  dogtricks::AllocTracker::Scope scope;
+};
+
+/**
+ * Allocates a tracked block.
+ *
+ * @return the block, or nullptr if out of memory.
+ */
+void *TrackedAllocate(size_t size, size_t alignment) {
+  alignment = std::max(alignment, alignof(AllocHeader));
+  size_t padding = std::max(alignment, sizeof(AllocHeader));
+  char *base = static_cast<char *>(std::malloc(size + padding));
+  if (base == nullptr) {
+    return nullptr;
+  }
+
+  uintptr_t block = reinterpret_cast<uintptr_t>(base) + sizeof(AllocHeader);
+  block = (block + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+
+  AllocHeader *header = reinterpret_cast<AllocHeader *>(block) - 1;
+  header->size = size;
+  header->offset = static_cast<uint32_t>(
+      block - reinterpret_cast<uintptr_t>(base));
+  header->scope = dogtricks::AllocTracker::RecordAllocation(size);
+  return reinterpret_cast<void *>(block);
+}
+
+/**
+ * Allocates a tracked block, throwing std::bad_alloc if out of memory.
+ */
+void *TrackedAllocateOrThrow(size_t size, size_t alignment) {
+  void *block = TrackedAllocate(size, alignment);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return block;
+}
+
+/**
+ * Frees a tracked block.
+ */
+void TrackedFree(void *block) {
+  if (block == nullptr) {
+    return;
+  }
+
+  AllocHeader *header = static_cast<AllocHeader *>(block) - 1;
+  dogtricks::AllocTracker::RecordFree(header->scope, header->size);
+  std::free(static_cast<char *>(block) - header->offset);
+}
+
+}  // namespace
+
+void *operator new(size_t size) {
+  return TrackedAllocateOrThrow(size, 0);
+}
+
+void *operator new[](size_t size) {
+  return TrackedAllocateOrThrow(size, 0);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+  return TrackedAllocate(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return TrackedAllocate(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return TrackedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return TrackedAllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *block) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete[](void *block) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete(void *block, size_t) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete[](void *block, size_t) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete(void *block, std::align_val_t) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete[](void *block, std::align_val_t) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete(void *block, size_t, std::align_val_t) noexcept {
+  TrackedFree(block);
+}
+
+void operator delete[](void *block, size_t, std::align_val_t) noexcept {
+  TrackedFree(block);
+}
+
+#endif  // DOGTRICKS_ENABLE_ALLOC_TRACKING
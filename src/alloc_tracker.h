@@ -0,0 +1,219 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_ALLOC_TRACKER_H_
+#define DOGTRICKS_ALLOC_TRACKER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Allocation tracking replaces the global operator new and delete to count
+// heap use by the subsystem that caused it. Each thread attributes its
+// allocations to the innermost ALLOC_SCOPE that it is in, and frees are
+// credited to the scope that made the allocation. Scopes are compiled out
+// unless DOGTRICKS_ENABLE_ALLOC_TRACKING is defined, in which case each costs
+// two thread-local stores. Allocations made by malloc directly, such as
+// within stdio, are not seen.
+
+#define ALLOC_CONCAT_INNER(a, b) a ## b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+
+#ifdef DOGTRICKS_ENABLE_ALLOC_TRACKING
+
+#define ALLOC_SCOPE(scope) \
+    ::dogtricks::AllocScope ALLOC_CONCAT(alloc_scope_, __LINE__)( \
+        ::dogtricks::AllocTracker::Scope::scope)
+
+#else
+
+#define ALLOC_SCOPE(scope) do {} while (0)
+
+#endif  // DOGTRICKS_ENABLE_ALLOC_TRACKING
+
+namespace dogtricks {
+
+/**
+ * The process-wide allocation counters.
+ */
+class AllocTracker {
+ public:
+#ifdef DOGTRICKS_ENABLE_ALLOC_TRACKING
+  //! Set when allocation tracking is compiled in.
+  static constexpr bool kCompiledIn = true;
+#else
+  //! Set when allocation tracking is compiled in.
+  static constexpr bool kCompiledIn = false;
+#endif  // DOGTRICKS_ENABLE_ALLOC_TRACKING
+
+  /**
+   * The subsystems that allocations are attributed to.
+   */
+  enum class Scope : uint8_t {
+    //! Allocations outside any scope.
+    Other = 0,
+
+    //! Reading and framing bytes from the serial device.
+    TransportRx,
+
+    //! Parsing puts from the radio into events.
+    RadioParse,
+
+    //! Sending commands and parsing their responses, on the calling thread.
+    RadioCommand,
+
+    //! Delivering events to the event handler.
+    HandlerDispatch,
+
+    //! Formatting and writing records with an OutputWriter.
+    Output,
+
+    //! The number of scopes.
+    Count,
+  };
+
+  //! The number of scopes.
+  static constexpr size_t kScopeCount = static_cast<size_t>(Scope::Count);
+
+  /**
+   * The counters of one scope.
+   */
+  struct ScopeStats {
+    //! The number of allocations made.
+    uint64_t allocations;
+
+    //! The number of bytes allocated.
+    uint64_t bytes;
+
+    //! The number of allocations freed.
+    uint64_t frees;
+
+    //! The number of bytes allocated and not yet freed.
+    int64_t live_bytes;
+
+    //! The highest value of live_bytes.
+    int64_t peak_live_bytes;
+
+    //! The number of scope instances that exceeded the budget.
+    uint64_t budget_overruns;
+  };
+
+  /**
+   * @return the name of a scope for reports.
+   */
+  static const char *GetScopeName(Scope scope);
+
+  /**
+   * @return the counters of a scope. All zero unless compiled in.
+   */
+  static ScopeStats GetStats(Scope scope);
+
+  /**
+   * @return the number of bytes allocated and not yet freed across all
+   *         scopes.
+   */
+  static int64_t GetLiveBytes();
+
+  /**
+   * @return the highest number of bytes live at once across all scopes.
+   */
+  static int64_t GetPeakLiveBytes();
+
+  /**
+   * Sets the most allocations that a single instance of a scope may make,
+   * such as while handling one frame. Instances that make more are counted
+   * as budget overruns and logged the first time. Nested scopes count
+   * towards their own budget only.
+   *
+   * @param scope The scope to budget.
+   * @param max_allocations The allocation budget, or SIZE_MAX for none.
+   */
+  static void SetBudget(Scope scope, size_t max_allocations);
+
+  /**
+   * Records an allocation by the calling thread. For use by operator new.
+   *
+   * @param size The number of bytes allocated.
+   * @return the scope that the allocation is attributed to.
+   */
+  static Scope RecordAllocation(size_t size);
+
+  /**
+   * Records that an allocation was freed. For use by operator delete.
+   *
+   * @param scope The scope that the allocation was attributed to.
+   * @param size The number of bytes allocated.
+   */
+  static void RecordFree(Scope scope, size_t size);
+
+ private:
+  friend class AllocScope;
+
+  /**
+   * Counts a scope instance that exceeded its budget.
+   */
+  static void RecordOverrun(Scope scope, size_t allocations);
+
+  /**
+   * @return the budget of a scope.
+   */
+  static size_t GetBudget(Scope scope);
+
+  //! The scope that the calling thread is in.
+  static thread_local Scope current_scope_;
+
+  //! The allocations made by the calling thread in its current scope
+  //! instance.
+  static thread_local size_t scope_allocations_;
+};
+
+/**
+ * Attributes the allocations of the calling thread to a scope for the
+ * lifetime of this object, and checks them against the budget of the scope.
+ */
+class AllocScope {
+ public:
+  AllocScope(AllocTracker::Scope scope)
+      : previous_scope_(AllocTracker::current_scope_),
+        previous_allocations_(AllocTracker::scope_allocations_) {
+    AllocTracker::current_scope_ = scope;
+    AllocTracker::scope_allocations_ = 0;
+  }
+
+  ~AllocScope() {
+    size_t allocations = AllocTracker::scope_allocations_;
+    AllocTracker::Scope scope = AllocTracker::current_scope_;
+    AllocTracker::current_scope_ = previous_scope_;
+    AllocTracker::scope_allocations_ = previous_allocations_;
+    if (allocations > AllocTracker::GetBudget(scope)) {
+      AllocTracker::RecordOverrun(scope, allocations);
+    }
+  }
+
+  AllocScope(const AllocScope&) = delete;
+  AllocScope& operator=(const AllocScope&) = delete;
+
+ private:
+  //! The scope that the thread was in before this one.
+  AllocTracker::Scope previous_scope_;
+
+  //! The allocations made by the thread in the previous scope instance.
+  size_t previous_allocations_;
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_ALLOC_TRACKER_H_
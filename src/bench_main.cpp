@@ -0,0 +1,682 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tclap/CmdLine.h>
+#include <thread>
+#include <vector>
+
+#include "emulator.h"
+#include "log.h"
+#include "radio.h"
+#include "radio_group.h"
+#include "string_pool.h"
+#include "text_normalizer.h"
+
+using dogtricks::Emulator;
+using dogtricks::InternedMetadata;
+using dogtricks::LatencyHistogram;
+using dogtricks::Radio;
+using dogtricks::RadioGroup;
+using dogtricks::StringPool;
+using dogtricks::TextNormalizer;
+using dogtricks::Transport;
+
+//! A description of the program.
+constexpr char kDescription[] =
+    "Measures end-to-end latency and throughput against an emulated radio.";
+
+//! The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+//! The fraction of the offered rate that must be delivered for an event rate
+//! to be considered sustainable.
+constexpr double kSustainableFraction = 0.95;
+
+//! The time spent measuring the throughput of each text function.
+constexpr std::chrono::milliseconds kTextMeasurementTime(200);
+
+//! The time for which prefetched channel descriptors are cached.
+constexpr std::chrono::milliseconds kPrefetchTtl(30000);
+
+//! The time spent on each channel while flipping, beyond the time taken for
+//! its metadata to arrive.
+constexpr std::chrono::milliseconds kFlipDwellMargin(10);
+
+//! The queries that are cached while measuring cache hits.
+constexpr Transport::OpCode kCachedQueries[] = {
+  Transport::OpCode::GetSignalRequest,
+  Transport::OpCode::GetChannelListRequest,
+  Transport::OpCode::GetChannelRequest,
+};
+
+//! The number of fields in each text corpus.
+constexpr int kTextCorpusSize = 1024;
+
+//! A sum of the results of the text functions, which keeps them from being
+//! optimized away.
+volatile size_t text_checksum = 0;
+
+/**
+ * Records the latency of metadata events by decoding the timestamp that the
+ * emulator embeds in each event. The latest metadata of each channel is
+ * retained through a string pool to measure interning.
+ */
+class BenchEventHandler : public Radio::EventHandler {
+ public:
+  virtual void OnMetadataChange(uint8_t channel_id,
+                                const Radio::Metadata& event) override {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    event_count_++;
+    retained_[channel_id].Apply(&string_pool_, event);
+    if (event.comments.has_value()
+        && std::string_view(event.comments.value()).substr(0, 2) == "t=") {
+      int64_t sent_ns = strtoll(event.comments.value().c_str() + 2,
+                                nullptr, 10);
+      latencies_ns_.push_back(now_ns - sent_ns);
+    }
+  }
+
+  /**
+   * @return the number of events received.
+   */
+  uint64_t GetEventCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return event_count_;
+  }
+
+  /**
+   * @return the latencies recorded since the last call.
+   */
+  std::vector<int64_t> TakeLatencies() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int64_t> latencies;
+    latencies.swap(latencies_ns_);
+    return latencies;
+  }
+
+  /**
+   * @return the metrics of the pool that retained metadata is interned in.
+   */
+  StringPool::Stats GetStringPoolStats() const {
+    return string_pool_.GetStats();
+  }
+
+ private:
+  //! The mutex to lock the recorded events.
+  std::mutex mutex_;
+
+  //! The number of events received.
+  uint64_t event_count_ = 0;
+
+  //! The latencies of events with a timestamp in nanoseconds.
+  std::vector<int64_t> latencies_ns_;
+
+  //! The pool that retained metadata is interned in.
+  StringPool string_pool_;
+
+  //! The latest metadata of each channel.
+  InternedMetadata retained_[UINT8_MAX + 1];
+};
+
+/**
+ * Appends a JSON object summarizing the supplied samples.
+ *
+ * @param output The string to append to.
+ * @param name The key for the object.
+ * @param samples The samples to summarize, which are sorted.
+ * @param scale The divisor to convert samples to the reported unit.
+ */
+void AppendSummary(std::string *output, const char *name,
+                   std::vector<int64_t> *samples, double scale) {
+  std::sort(samples->begin(), samples->end());
+  double sum = 0.0;
+  for (int64_t sample : *samples) {
+    sum += sample;
+  }
+
+  auto percentile = [samples, scale](double fraction) {
+    if (samples->empty()) {
+      return 0.0;
+    }
+
+    size_t index = static_cast<size_t>(fraction * (samples->size() - 1));
+    return (*samples)[index] / scale;
+  };
+
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "\"%s\":{\"count\":%zu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+           "\"p99\":%.3f,\"max\":%.3f}",
+           name, samples->size(),
+           samples->empty() ? 0.0 : sum / samples->size() / scale,
+           percentile(0.5), percentile(0.9), percentile(0.99),
+           percentile(1.0));
+  output->append(buffer);
+}
+
+/**
+ * Appends a JSON object summarizing the supplied histogram in microseconds.
+ *
+ * @param output The string to append to.
+ * @param name The key for the object.
+ * @param histogram The histogram to summarize.
+ */
+void AppendHistogram(std::string *output, const char *name,
+                     const LatencyHistogram& histogram) {
+  auto micros = [](std::chrono::nanoseconds value) {
+    return value.count() / 1000.0;
+  };
+
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "\"%s\":{\"count\":%" PRIu64 ",\"p50\":%.3f,\"p90\":%.3f,"
+           "\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+           name, histogram.GetCount(), micros(histogram.GetPercentile(0.5)),
+           micros(histogram.GetPercentile(0.9)),
+           micros(histogram.GetPercentile(0.99)),
+           micros(histogram.GetPercentile(0.999)), micros(histogram.GetMax()));
+  output->append(buffer);
+}
+
+/**
+ * Builds a corpus of metadata fields from a format taking a single integer.
+ *
+ * @param format The format of each field.
+ * @return the corpus.
+ */
+std::vector<std::string> MakeTextCorpus(const char *format) {
+  std::vector<std::string> corpus;
+  for (int i = 0; i < kTextCorpusSize; i++) {
+    char buffer[UINT8_MAX + 1];
+    int size = snprintf(buffer, sizeof(buffer), format, i);
+    corpus.emplace_back(buffer, std::min<size_t>(size, UINT8_MAX));
+  }
+
+  return corpus;
+}
+
+/**
+ * Measures the throughput of a text function over a corpus.
+ *
+ * @param corpus The fields to pass to the function.
+ * @param function The function, taking a field, an output buffer and its
+ *                 capacity and returning a size.
+ * @return the throughput in megabytes of input per second.
+ */
+template <typename Function>
+double MeasureTextThroughput(const std::vector<std::string>& corpus,
+                             Function function) {
+  size_t corpus_bytes = 0;
+  for (const auto& field : corpus) {
+    corpus_bytes += field.size();
+  }
+
+  char output[Radio::kMaxNormalizedSize];
+  uint64_t bytes = 0;
+  size_t checksum = 0;
+  auto start_time = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  do {
+    for (const auto& field : corpus) {
+      checksum += function(field, output, sizeof(output));
+    }
+    bytes += corpus_bytes;
+    elapsed = std::chrono::steady_clock::now() - start_time;
+  } while (elapsed < kTextMeasurementTime);
+
+  // Keep the results live so that the calls are not optimized away.
+  text_checksum += checksum;
+  return bytes / elapsed.count() / 1e6;
+}
+
+/**
+ * Appends a JSON object with the throughput of the text normalizer.
+ *
+ * @param output The string to append to.
+ */
+void AppendTextThroughput(std::string *output) {
+  auto ascii = MakeTextCorpus(
+      "  The Midnight Eurobeat Allstars %04d - Running In The 90s (Extended "
+      "Mix)    ");
+  auto utf8 = MakeTextCorpus(
+      "Beyonc\xc3\xa9 & Sigur R\xc3\xb3s %04d \xe2\x80\x93 "
+      "Caf\xc3\xa9 del Mar \xe6\x9d\xb1\xe4\xba\xac (Remix)");
+  auto latin1 = MakeTextCorpus(
+      "Beyonc\xe9 & Sigur R\xf3s %04d - Caf\xe9 del Mar, M\xfcnchen "
+      "(Remix)");
+
+  auto validate = [](std::string_view text, char *, size_t) {
+    return static_cast<size_t>(TextNormalizer::IsValidUtf8(text));
+  };
+
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "\"text_mb_per_s\":{\"validate_ascii\":%.1f,"
+           "\"validate_utf8\":%.1f,\"normalize_ascii\":%.1f,"
+           "\"normalize_utf8\":%.1f,\"normalize_latin1\":%.1f,"
+           "\"fold_case\":%.1f}",
+           MeasureTextThroughput(ascii, validate),
+           MeasureTextThroughput(utf8, validate),
+           MeasureTextThroughput(ascii, TextNormalizer::Normalize),
+           MeasureTextThroughput(utf8, TextNormalizer::Normalize),
+           MeasureTextThroughput(latin1, TextNormalizer::Normalize),
+           MeasureTextThroughput(ascii, TextNormalizer::FoldCase));
+  output->append(buffer);
+}
+
+int main(int argc, char **argv) {
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<std::string> label_arg("", "label",
+      "a label for this build to include in the results",
+      false /* req */, "", "label", cmd);
+  TCLAP::ValueArg<int> max_rate_arg("", "max_rate",
+      "the highest event rate to attempt when finding the sustainable rate",
+      false /* req */, 32000, "rate", cmd);
+  TCLAP::ValueArg<int> step_ms_arg("", "step_ms",
+      "the duration of each event rate measurement",
+      false /* req */, 1000, "milliseconds", cmd);
+  TCLAP::ValueArg<int> metadata_rate_arg("", "metadata_rate",
+      "the event rate used to measure metadata latency",
+      false /* req */, 500, "rate", cmd);
+  TCLAP::ValueArg<int> latency_arg("", "latency_us",
+      "the time taken by the emulator to respond to each command",
+      false /* req */, 0, "microseconds", cmd);
+  TCLAP::ValueArg<int> tune_latency_arg("", "tune_latency_us",
+      "the time taken by the emulator to push a newly tuned channel's metadata",
+      false /* req */, 50000, "microseconds", cmd);
+  TCLAP::ValueArg<double> corruption_arg("", "corruption_rate",
+      "the probability that the emulator corrupts a transmitted frame",
+      false /* req */, 0.0, "probability", cmd);
+  TCLAP::ValueArg<double> retransmit_arg("", "retransmit_rate",
+      "the probability that the emulator sends a frame twice",
+      false /* req */, 0.0, "probability", cmd);
+  TCLAP::ValueArg<int> lineup_size_arg("", "lineup_size",
+      "the number of channels in the emulated lineup",
+      false /* req */, 100, "channels", cmd);
+  TCLAP::ValueArg<int> iterations_arg("", "iterations",
+      "the number of commands used to measure round-trip time",
+      false /* req */, 1000, "count", cmd);
+  TCLAP::ValueArg<int> group_size_arg("", "group_size",
+      "the number of emulated radios to refresh the lineup across as a group",
+      false /* req */, 4, "count", cmd);
+  TCLAP::ValueArg<int> flips_arg("", "flips",
+      "the number of channel changes used to measure tuning",
+      false /* req */, 50, "count", cmd);
+  TCLAP::ValueArg<int> prefetch_arg("", "prefetch_descriptors",
+      "the number of adjacent channel descriptors to prefetch after tuning",
+      false /* req */, 0, "count", cmd);
+  TCLAP::ValueArg<int> query_cache_arg("", "query_cache_ms",
+      "the query cache lifetime used while measuring cache hits under a "
+      "metadata stream, or zero to skip the measurement",
+      false /* req */, 1000, "milliseconds", cmd);
+  TCLAP::ValueArg<int> metadata_parts_arg("", "metadata_parts",
+      "the number of puts that the emulator splits each metadata change into",
+      false /* req */, 1, "count", cmd);
+  TCLAP::ValueArg<int> coalesce_arg("", "coalesce_metadata_ms",
+      "the window to coalesce the metadata puts for a channel within",
+      false /* req */, 0, "milliseconds", cmd);
+  TCLAP::SwitchArg normalize_text_arg("", "normalize_text",
+      "normalizes the text of metadata as it is parsed", cmd);
+  cmd.parse(argc, argv);
+
+  Emulator::Config config;
+  config.lineup_size = lineup_size_arg.getValue();
+  config.corruption_rate = corruption_arg.getValue();
+  config.retransmit_rate = retransmit_arg.getValue();
+  config.response_latency = std::chrono::microseconds(latency_arg.getValue());
+  config.tune_latency = std::chrono::microseconds(tune_latency_arg.getValue());
+  config.metadata_parts = std::max(1, metadata_parts_arg.getValue());
+  Emulator emulator(config);
+  if (!emulator.Open()) {
+    return -1;
+  }
+
+  std::thread emulator_thread([&emulator]() { emulator.Start(); });
+
+  BenchEventHandler event_handler;
+  Radio radio(emulator.GetPath(), &event_handler);
+  radio.SetTextNormalizationEnabled(normalize_text_arg.isSet());
+  if (coalesce_arg.getValue() > 0) {
+    radio.SetMetadataCoalescing(
+        std::chrono::milliseconds(coalesce_arg.getValue()));
+  }
+
+  std::thread receive_thread([&radio]() {
+    if (!radio.Start()) {
+      LOGE("Failed to start receive loop for radio");
+    }
+  });
+
+  bool success = radio.IsOpen()
+      && radio.SetPowerMode(Radio::PowerState::FullMode);
+
+  // Measure the round-trip time of a small command.
+  std::vector<int64_t> command_rtts;
+  uint64_t command_failures = 0;
+  for (int i = 0; success && i < iterations_arg.getValue(); i++) {
+    Radio::SignalStrength summary;
+    Radio::SignalStrength satellite;
+    Radio::SignalStrength terrestrial;
+    auto start_time = std::chrono::steady_clock::now();
+    if (radio.GetSignalStrength(&summary, &satellite, &terrestrial)) {
+      command_rtts.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_time).count());
+    } else {
+      command_failures++;
+    }
+  }
+
+  // Measure the time taken to refresh every channel descriptor.
+  auto lineup_start_time = std::chrono::steady_clock::now();
+  Radio::ChannelList channels;
+  size_t lineup_count = 0;
+  if (success && radio.GetChannelList(&channels)) {
+    for (uint8_t channel : channels) {
+      Radio::ChannelDescriptor descriptor;
+      lineup_count += radio.GetChannelDescriptor(channel, &descriptor);
+    }
+  }
+
+  double lineup_refresh_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - lineup_start_time).count();
+
+  // Measure the same refresh split across a group of radios, each with its
+  // own emulator.
+  std::vector<std::unique_ptr<Emulator>> group_emulators;
+  std::vector<std::unique_ptr<Radio>> group_radios;
+  std::vector<std::thread> group_threads;
+  std::vector<Radio *> group_members = {&radio};
+  BenchEventHandler group_event_handler;
+  for (int i = 1; success && i < group_size_arg.getValue(); i++) {
+    auto group_emulator = std::make_unique<Emulator>(config);
+    if (!group_emulator->Open()) {
+      success = false;
+      break;
+    }
+
+    Emulator *emulator_ptr = group_emulator.get();
+    group_threads.emplace_back([emulator_ptr]() { emulator_ptr->Start(); });
+    auto group_radio = std::make_unique<Radio>(group_emulator->GetPath(),
+                                               &group_event_handler);
+    Radio *radio_ptr = group_radio.get();
+    group_threads.emplace_back([radio_ptr]() { radio_ptr->Start(); });
+    success = radio_ptr->IsOpen()
+        && radio_ptr->SetPowerMode(Radio::PowerState::FullMode);
+    group_members.push_back(radio_ptr);
+    group_emulators.push_back(std::move(group_emulator));
+    group_radios.push_back(std::move(group_radio));
+  }
+
+  RadioGroup group(group_members);
+  std::vector<Radio::ChannelDescriptor> group_lineup;
+  auto group_start_time = std::chrono::steady_clock::now();
+  bool group_success = success && group.GetLineup(&group_lineup);
+  double group_lineup_refresh_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - group_start_time).count();
+  if (!group_success) {
+    group_lineup.clear();
+  }
+
+  for (auto& group_radio : group_radios) {
+    group_radio->Stop();
+  }
+
+  for (auto& group_emulator : group_emulators) {
+    group_emulator->Stop();
+  }
+
+  for (auto& thread : group_threads) {
+    thread.join();
+  }
+
+  // Measure the latency from the emulator writing an event to the handler.
+  success = success && radio.SetGlobalMetadataMonitoringEnabled(true);
+  auto step = std::chrono::milliseconds(step_ms_arg.getValue());
+  std::vector<int64_t> metadata_latencies;
+  double events_per_change = 0.0;
+  if (success) {
+    uint64_t sent_start = emulator.GetStats().metadata_sent;
+    uint64_t received_start = event_handler.GetEventCount();
+    emulator.SetMetadataRate(metadata_rate_arg.getValue());
+    std::this_thread::sleep_for(step);
+    emulator.SetMetadataRate(0.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    metadata_latencies = event_handler.TakeLatencies();
+    uint64_t sent = emulator.GetStats().metadata_sent - sent_start;
+    if (sent > 0) {
+      events_per_change = static_cast<double>(
+          event_handler.GetEventCount() - received_start) / sent;
+    }
+  }
+
+  // Measure how often repeated queries are answered from the cache while
+  // metadata puts are invalidating the descriptors of the channels they name.
+  uint64_t cache_queries = 0;
+  Radio::QueryStats cache_stats = {};
+  auto cache_ttl = std::chrono::milliseconds(query_cache_arg.getValue());
+  if (success && cache_ttl.count() > 0 && !channels.empty()) {
+    for (auto op_code : kCachedQueries) {
+      radio.SetCacheTtl(op_code, cache_ttl);
+    }
+
+    Radio::QueryStats start_stats = radio.GetQueryStats();
+    emulator.SetMetadataRate(metadata_rate_arg.getValue());
+    auto end_time = std::chrono::steady_clock::now() + step;
+    for (size_t i = 0; std::chrono::steady_clock::now() < end_time; i++) {
+      Radio::SignalStrength summary;
+      Radio::SignalStrength satellite;
+      Radio::SignalStrength terrestrial;
+      Radio::ChannelList lineup;
+      Radio::ChannelDescriptor descriptor;
+      if (!radio.GetSignalStrength(&summary, &satellite, &terrestrial)
+          || !radio.GetChannelList(&lineup)
+          || !radio.GetChannelDescriptor(channels[i % channels.size()],
+                                         &descriptor)) {
+        command_failures++;
+      }
+
+      cache_queries += 3;
+    }
+
+    emulator.SetMetadataRate(0.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Radio::QueryStats end_stats = radio.GetQueryStats();
+    cache_stats.wire_requests =
+        end_stats.wire_requests - start_stats.wire_requests;
+    cache_stats.cache_hits = end_stats.cache_hits - start_stats.cache_hits;
+    cache_stats.coalesced = end_stats.coalesced - start_stats.coalesced;
+    for (auto op_code : kCachedQueries) {
+      radio.SetCacheTtl(op_code, std::chrono::milliseconds(0));
+    }
+
+    if (cache_stats.cache_hits == 0) {
+      LOGE("No queries were answered from the cache");
+    }
+
+    event_handler.TakeLatencies();
+  }
+
+  // Measure the time from changing channel to showing its descriptor, as a
+  // user flipping through the lineup would, dwelling long enough on each
+  // channel for its metadata to arrive. Prefetching is enabled only now so
+  // that the lineup refresh above does not warm the cache.
+  if (success && prefetch_arg.getValue() > 0) {
+    radio.SetDescriptorPrefetch(prefetch_arg.getValue(), kPrefetchTtl);
+  }
+
+  std::vector<int64_t> channel_change_times;
+  auto dwell = std::chrono::microseconds(tune_latency_arg.getValue())
+      + kFlipDwellMargin;
+  for (int i = 0; success && !channels.empty() && i < flips_arg.getValue();
+       i++) {
+    uint8_t channel = channels[i % channels.size()];
+    Radio::ChannelDescriptor descriptor;
+    auto start_time = std::chrono::steady_clock::now();
+    if (radio.SetChannel(channel)
+        && radio.GetChannelDescriptor(channel, &descriptor)) {
+      channel_change_times.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_time).count());
+    } else {
+      command_failures++;
+    }
+
+    std::this_thread::sleep_for(dwell);
+  }
+
+  event_handler.TakeLatencies();
+
+  // Find the highest event rate that is delivered without falling behind.
+  std::string rate_steps;
+  int max_sustainable_rate = 0;
+  for (int rate = 500; success && rate <= max_rate_arg.getValue(); rate *= 2) {
+    uint64_t sent_start = emulator.GetStats().metadata_sent;
+    uint64_t received_start = event_handler.GetEventCount();
+    emulator.SetMetadataRate(rate);
+    std::this_thread::sleep_for(step);
+    uint64_t sent = emulator.GetStats().metadata_sent - sent_start;
+    uint64_t received = event_handler.GetEventCount() - received_start;
+    emulator.SetMetadataRate(0.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    event_handler.TakeLatencies();
+
+    double seconds = std::chrono::duration<double>(step).count();
+    double offered = sent / seconds;
+    double delivered = received / seconds;
+    bool sustainable = (offered >= rate * kSustainableFraction
+        && delivered >= offered * kSustainableFraction
+            * (1.0 - config.corruption_rate));
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer),
+             "%s{\"rate\":%d,\"offered\":%.1f,\"delivered\":%.1f}",
+             rate_steps.empty() ? "" : ",", rate, offered, delivered);
+    rate_steps.append(buffer);
+    if (!sustainable) {
+      break;
+    }
+
+    max_sustainable_rate = rate;
+  }
+
+  radio.Stop();
+  receive_thread.join();
+  emulator.Stop();
+  emulator_thread.join();
+
+  auto emulator_stats = emulator.GetStats();
+  auto tx_stats = radio.GetTransport().GetTxQueueStats();
+  std::string output = "{\"benchmark\":\"dogtricks\",\"version\":\"";
+  output.append(kVersion);
+  output.append("\",\"label\":\"");
+  output.append(label_arg.getValue());
+  output.append("\",");
+
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer),
+           "\"config\":{\"iterations\":%d,\"lineup_size\":%d,"
+           "\"corruption_rate\":%.4f,\"retransmit_rate\":%.4f,"
+           "\"latency_us\":%d,"
+           "\"tune_latency_us\":%d,\"group_size\":%d,\"flips\":%d,"
+           "\"prefetch_descriptors\":%d,\"metadata_parts\":%d,"
+           "\"coalesce_metadata_ms\":%d,"
+           "\"metadata_rate\":%d,\"step_ms\":%d,\"normalize_text\":%s},",
+           iterations_arg.getValue(), lineup_size_arg.getValue(),
+           corruption_arg.getValue(), retransmit_arg.getValue(),
+           latency_arg.getValue(), tune_latency_arg.getValue(),
+           group_size_arg.getValue(), flips_arg.getValue(),
+           prefetch_arg.getValue(), metadata_parts_arg.getValue(),
+           coalesce_arg.getValue(), metadata_rate_arg.getValue(),
+           step_ms_arg.getValue(),
+           normalize_text_arg.isSet() ? "true" : "false");
+  output.append(buffer);
+  AppendSummary(&output, "command_rtt_us", &command_rtts, 1000.0);
+  output.append(",");
+  AppendSummary(&output, "metadata_latency_us", &metadata_latencies, 1000.0);
+  output.append(",");
+  snprintf(buffer, sizeof(buffer),
+           "\"query_cache\":{\"ttl_ms\":%d,\"queries\":%" PRIu64
+           ",\"wire_requests\":%" PRIu64 ",\"cache_hits\":%" PRIu64
+           ",\"coalesced\":%" PRIu64 "},",
+           query_cache_arg.getValue(), cache_queries,
+           cache_stats.wire_requests, cache_stats.cache_hits,
+           cache_stats.coalesced);
+  output.append(buffer);
+  auto coalescing_stats = radio.GetCoalescingStats();
+  snprintf(buffer, sizeof(buffer),
+           "\"events_per_metadata_change\":%.3f,"
+           "\"coalescing\":{\"puts\":%" PRIu64 ",\"events\":%" PRIu64
+           ",\"early_flushes\":%" PRIu64 "},",
+           events_per_change, coalescing_stats.packets,
+           coalescing_stats.events, coalescing_stats.early_flushes);
+  output.append(buffer);
+  AppendHistogram(&output, "dispatch_latency_us",
+                  radio.GetTransport().GetDispatchLatency());
+  output.append(",");
+  AppendSummary(&output, "channel_change_us", &channel_change_times, 1000.0);
+  output.append(",");
+  AppendHistogram(&output, "tune_latency_us", radio.GetTuneLatency());
+  auto query_stats = radio.GetQueryStats();
+  snprintf(buffer, sizeof(buffer),
+           ",\"prefetches\":%" PRIu64 ",\"prefetch_hits\":%" PRIu64,
+           query_stats.prefetches, query_stats.prefetch_hits);
+  output.append(buffer);
+  snprintf(buffer, sizeof(buffer),
+           ",\"command_failures\":%" PRIu64 ",\"lineup_channels\":%zu,"
+           "\"lineup_refresh_ms\":%.3f,\"group_lineup_channels\":%zu,"
+           "\"group_lineup_refresh_ms\":%.3f,\"max_sustainable_rate\":%d,"
+           "\"invalid_frames_at_emulator\":%" PRIu64 ","
+           "\"frames_corrupted\":%" PRIu64 ","
+           "\"frames_retransmitted\":%" PRIu64 ","
+           "\"duplicate_frames\":%" PRIu64 ",\"tx_write_calls\":%" PRIu64
+           ",\"tx_frames_written\":%" PRIu64 ",\"rate_steps\":[",
+           command_failures, lineup_count, lineup_refresh_ms,
+           group_lineup.size(), group_lineup_refresh_ms, max_sustainable_rate,
+           emulator_stats.invalid_frames, emulator_stats.frames_corrupted,
+           emulator_stats.frames_retransmitted,
+           radio.GetTransport().GetLinkStats().duplicate_frames,
+           tx_stats.write_calls, tx_stats.frames_written);
+  output.append(buffer);
+  output.append(rate_steps);
+
+  auto pool_stats = event_handler.GetStringPoolStats();
+  snprintf(buffer, sizeof(buffer),
+           "],\"string_pool\":{\"strings\":%zu,\"bytes\":%zu,"
+           "\"lookups\":%" PRIu64 ",\"hit_rate\":%.4f,"
+           "\"bytes_saved\":%" PRIu64 "},",
+           pool_stats.strings, pool_stats.bytes, pool_stats.lookups,
+           pool_stats.lookups == 0 ? 0.0
+               : static_cast<double>(pool_stats.hits) / pool_stats.lookups,
+           pool_stats.bytes_saved);
+  output.append(buffer);
+  AppendTextThroughput(&output);
+  output.append("}\n");
+  fputs(output.c_str(), stdout);
+
+  return (success ? 0 : -1);
+}
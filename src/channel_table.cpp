@@ -0,0 +1,175 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "channel_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "radio_group.h"
+
+namespace dogtricks {
+
+void ChannelTable::Clear() {
+  memset(present_, 0, sizeof(present_));
+  memset(category_id_, 0, sizeof(category_id_));
+  memset(short_name_, 0, sizeof(short_name_));
+  memset(long_name_, 0, sizeof(long_name_));
+  memset(category_present_, 0, sizeof(category_present_));
+  memset(short_category_name_, 0, sizeof(short_category_name_));
+  memset(long_category_name_, 0, sizeof(long_category_name_));
+  memset(category_begin_, 0, sizeof(category_begin_));
+  channel_count_ = 0;
+  category_count_ = 0;
+  names_.clear();
+}
+
+void ChannelTable::Set(const Radio::ChannelDescriptor& descriptor) {
+  uint8_t channel_id = descriptor.channel_id;
+  uint8_t category_id = descriptor.category_id;
+  if (!present_[channel_id]
+      || GetName(short_name_[channel_id]) != descriptor.short_name
+      || GetName(long_name_[channel_id]) != descriptor.long_name) {
+    short_name_[channel_id] = AddName(descriptor.short_name);
+    long_name_[channel_id] = AddName(descriptor.long_name);
+  }
+
+  present_[channel_id] = true;
+  category_id_[channel_id] = category_id;
+
+  if (!category_present_[category_id]
+      || GetShortCategoryName(category_id) != descriptor.short_category_name
+      || GetLongCategoryName(category_id) != descriptor.long_category_name) {
+    category_present_[category_id] = true;
+    short_category_name_[category_id] =
+        AddName(descriptor.short_category_name);
+    long_category_name_[category_id] = AddName(descriptor.long_category_name);
+  }
+}
+
+void ChannelTable::Finalize() {
+  // Count the channels in each category, then place each channel at the
+  // running offset of its category. Visiting channels in ascending order keeps
+  // each category sorted.
+  uint16_t counts[kMaxChannels] = {};
+  channel_count_ = 0;
+  for (size_t i = 0; i < kMaxChannels; i++) {
+    if (present_[i]) {
+      channels_[channel_count_++] = static_cast<uint8_t>(i);
+      counts[category_id_[i]]++;
+    }
+  }
+
+  category_count_ = 0;
+  category_begin_[0] = 0;
+  for (size_t i = 0; i < kMaxChannels; i++) {
+    category_begin_[i + 1] = category_begin_[i] + counts[i];
+    if (counts[i] > 0) {
+      categories_[category_count_++] = static_cast<uint8_t>(i);
+    }
+  }
+
+  uint16_t next[kMaxChannels];
+  memcpy(next, category_begin_, sizeof(next));
+  for (size_t i = 0; i < channel_count_; i++) {
+    uint8_t channel_id = channels_[i];
+    category_channels_[next[category_id_[channel_id]]++] = channel_id;
+  }
+
+  CompactNames();
+}
+
+void ChannelTable::CompactNames() {
+  // Names replaced by Set are left in the buffer until they are dropped here.
+  size_t live_size = 0;
+  for (size_t i = 0; i < kMaxChannels; i++) {
+    if (present_[i]) {
+      live_size += short_name_[i].length + long_name_[i].length;
+    }
+
+    if (category_present_[i]) {
+      live_size += short_category_name_[i].length
+          + long_category_name_[i].length;
+    }
+  }
+
+  if (live_size == names_.size()) {
+    return;
+  }
+
+  std::string names;
+  names.reserve(live_size);
+  auto move_name = [this, &names](NameRef *ref) {
+    std::string_view name = GetName(*ref);
+    ref->offset = static_cast<uint32_t>(names.size());
+    names.append(name.data(), name.size());
+  };
+
+  for (size_t i = 0; i < kMaxChannels; i++) {
+    if (present_[i]) {
+      move_name(&short_name_[i]);
+      move_name(&long_name_[i]);
+    }
+
+    if (category_present_[i]) {
+      move_name(&short_category_name_[i]);
+      move_name(&long_category_name_[i]);
+    }
+  }
+
+  names_.swap(names);
+}
+
+bool ChannelTable::Load(Radio *radio) {
+  Clear();
+  Radio::ChannelList channels;
+  bool success = radio->GetChannelList(&channels);
+  for (size_t i = 0; success && i < channels.size(); i++) {
+    Radio::ChannelDescriptor descriptor;
+    success = radio->GetChannelDescriptor(channels[i], &descriptor);
+    if (success) {
+      Set(descriptor);
+    }
+  }
+
+  Finalize();
+  return success;
+}
+
+bool ChannelTable::Load(RadioGroup *group) {
+  Clear();
+  std::vector<Radio::ChannelDescriptor> descriptors;
+  bool success = group->GetLineup(&descriptors);
+  if (success) {
+    for (const auto& descriptor : descriptors) {
+      Set(descriptor);
+    }
+  }
+
+  Finalize();
+  return success;
+}
+
+ChannelTable::NameRef ChannelTable::AddName(std::string_view name) {
+  NameRef ref;
+  ref.offset = static_cast<uint32_t>(names_.size());
+  ref.length = static_cast<uint8_t>(std::min(name.size(), size_t(UINT8_MAX)));
+  names_.append(name.data(), ref.length);
+  return ref;
+}
+
+}  // namespace dogtricks
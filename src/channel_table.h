@@ -0,0 +1,248 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_CHANNEL_TABLE_H_
+#define DOGTRICKS_CHANNEL_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "non_copyable.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+class RadioGroup;
+
+/**
+ * A table of the channel lineup indexed directly by channel ID. The table is
+ * stored as a struct of arrays with all names packed into one buffer and
+ * category names stored once per category. Once populated, lookups by channel,
+ * browsing by category and iteration do not allocate.
+ */
+class ChannelTable : public NonCopyable {
+ public:
+  //! The number of possible channel and category IDs.
+  static constexpr size_t kMaxChannels = UINT8_MAX + 1;
+
+  /**
+   * A contiguous range of channel IDs that is valid until the table is next
+   * modified.
+   */
+  class ChannelRange {
+   public:
+    ChannelRange(const uint8_t *begin, const uint8_t *end)
+        : begin_(begin), end_(end) {}
+
+    const uint8_t *begin() const { return begin_; }
+    const uint8_t *end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+
+   private:
+    //! The first channel in the range.
+    const uint8_t *begin_;
+
+    //! One past the last channel in the range.
+    const uint8_t *end_;
+  };
+
+  /**
+   * Setup an empty table.
+   */
+  ChannelTable() { Clear(); }
+
+  /**
+   * Removes all channels and categories from the table.
+   */
+  void Clear();
+
+  /**
+   * Adds or replaces a channel. Names are only stored the first time a channel
+   * or category is seen, or if they change. Finalize must be called before the
+   * channel lists are queried; it also reclaims the replaced names.
+   *
+   * @param descriptor The descriptor of the channel to add.
+   */
+  void Set(const Radio::ChannelDescriptor& descriptor);
+
+  /**
+   * Builds the sorted list of all channels and the per-category channel
+   * lists, and reclaims the space of names replaced since the last call.
+   */
+  void Finalize();
+
+  /**
+   * Replaces the contents of the table with the lineup of the radio.
+   *
+   * @param radio The radio to read the lineup from.
+   * @return true if successful, false otherwise.
+   */
+  bool Load(Radio *radio);
+
+  /**
+   * Replaces the contents of the table with the lineup read in parallel
+   * across a group of radios. See RadioGroup::GetLineup.
+   *
+   * @param group The radios to read the lineup from.
+   * @return true if successful, false otherwise.
+   */
+  bool Load(RadioGroup *group);
+
+  /**
+   * @return true if the supplied channel is in the table.
+   */
+  bool Contains(uint8_t channel_id) const {
+    return present_[channel_id];
+  }
+
+  /**
+   * @return the category of the supplied channel. Zero if not in the table.
+   */
+  uint8_t GetCategoryId(uint8_t channel_id) const {
+    return category_id_[channel_id];
+  }
+
+  /**
+   * @return the short name of the supplied channel, empty if not present.
+   */
+  std::string_view GetShortName(uint8_t channel_id) const {
+    return GetName(short_name_[channel_id]);
+  }
+
+  /**
+   * @return the long name of the supplied channel, empty if not present.
+   */
+  std::string_view GetLongName(uint8_t channel_id) const {
+    return GetName(long_name_[channel_id]);
+  }
+
+  /**
+   * @return the short name of the supplied category, empty if not present.
+   */
+  std::string_view GetShortCategoryName(uint8_t category_id) const {
+    return GetName(short_category_name_[category_id]);
+  }
+
+  /**
+   * @return the long name of the supplied category, empty if not present.
+   */
+  std::string_view GetLongCategoryName(uint8_t category_id) const {
+    return GetName(long_category_name_[category_id]);
+  }
+
+  /**
+   * @return all channels in the table in ascending order.
+   */
+  ChannelRange GetChannels() const {
+    return ChannelRange(channels_, channels_ + channel_count_);
+  }
+
+  /**
+   * @return the channels of the supplied category in ascending order.
+   */
+  ChannelRange GetCategoryChannels(uint8_t category_id) const {
+    return ChannelRange(category_channels_ + category_begin_[category_id],
+                        category_channels_ + category_begin_[category_id + 1]);
+  }
+
+  /**
+   * @return all categories in the table in ascending order.
+   */
+  ChannelRange GetCategories() const {
+    return ChannelRange(categories_, categories_ + category_count_);
+  }
+
+ private:
+  /**
+   * The location of a name in the name buffer.
+   */
+  struct NameRef {
+    //! The offset of the name in the buffer.
+    uint32_t offset;
+
+    //! The length of the name.
+    uint8_t length;
+  };
+
+  //! Set for each channel ID that is in the table.
+  bool present_[kMaxChannels];
+
+  //! The category of each channel.
+  uint8_t category_id_[kMaxChannels];
+
+  //! The short name of each channel.
+  NameRef short_name_[kMaxChannels];
+
+  //! The long name of each channel.
+  NameRef long_name_[kMaxChannels];
+
+  //! Set for each category ID that has names stored.
+  bool category_present_[kMaxChannels];
+
+  //! The short name of each category.
+  NameRef short_category_name_[kMaxChannels];
+
+  //! The long name of each category.
+  NameRef long_category_name_[kMaxChannels];
+
+  //! All channels in ascending order.
+  uint8_t channels_[kMaxChannels];
+
+  //! The number of channels in the table.
+  size_t channel_count_;
+
+  //! All categories in ascending order.
+  uint8_t categories_[kMaxChannels];
+
+  //! The number of categories in the table.
+  size_t category_count_;
+
+  //! The channels of each category, grouped by category in ascending order.
+  uint8_t category_channels_[kMaxChannels];
+
+  //! The index of the first channel of each category in category_channels_.
+  //! The channels of a category end at the beginning of the next one.
+  uint16_t category_begin_[kMaxChannels + 1];
+
+  //! The buffer containing all names.
+  std::string names_;
+
+  /**
+   * @return the name referenced by the supplied location.
+   */
+  std::string_view GetName(const NameRef& ref) const {
+    return std::string_view(names_.data() + ref.offset, ref.length);
+  }
+
+  /**
+   * Appends a name to the buffer.
+   *
+   * @return the location of the name.
+   */
+  NameRef AddName(std::string_view name);
+
+  /**
+   * Rebuilds the name buffer with only the names still referenced.
+   */
+  void CompactNames();
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_CHANNEL_TABLE_H_
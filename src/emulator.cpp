@@ -0,0 +1,628 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "emulator.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace dogtricks {
+
+namespace {
+
+//! Op codes handled by the emulator. These mirror Transport::OpCode.
+constexpr uint16_t kSetPowerModeRequest = 0x0008;
+constexpr uint16_t kSetResetRequest = 0x0009;
+constexpr uint16_t kSetChannelRequest = 0x000a;
+constexpr uint16_t kSetFeatureMonitorRequest = 0x000d;
+constexpr uint16_t kGetChannelRequest = 0x4008;
+constexpr uint16_t kGetChannelListRequest = 0x400b;
+constexpr uint16_t kGetSignalRequest = 0x4018;
+constexpr uint16_t kPutModuleReadyResponse = 0x8000;
+constexpr uint16_t kPutPdtResponse = 0x8001;
+constexpr uint16_t kPutChannelResponse = 0x800a;
+
+//! The bit added to a request op code to form its response.
+constexpr uint16_t kResponseBit = 0x2000;
+
+//! The feature monitor bits, matching Radio::MonitorFeature.
+constexpr uint8_t kMonitorTunedChannel = (1 << 1);
+constexpr uint8_t kMonitorGlobalMetadata = (1 << 3);
+
+//! The number of distinct artists to generate metadata for.
+constexpr uint64_t kArtistCount = 500;
+
+//! The number of categories that the lineup is divided into.
+constexpr uint8_t kCategoryCount = 16;
+
+//! The delay between the puts of a metadata change that is split.
+constexpr std::chrono::microseconds kMetadataPartGap =
+    std::chrono::microseconds(2000);
+
+//! The largest lineup that fits in a channel list response.
+constexpr size_t kMaxLineupSize = 224;
+
+/**
+ * Appends a length-prefixed string to the payload.
+ */
+void AppendString(const std::string& str, std::vector<uint8_t> *payload) {
+  size_t length = std::min(str.size(), size_t(UINT8_MAX));
+  payload->push_back(static_cast<uint8_t>(length));
+  payload->insert(payload->end(), str.begin(), str.begin() + length);
+}
+
+/**
+ * Appends a metadata field to the payload.
+ */
+void AppendField(uint8_t type, const std::string& str,
+                 std::vector<uint8_t> *payload) {
+  payload->push_back(type);
+  AppendString(str, payload);
+}
+
+}  // namespace
+
+Emulator::Emulator(const Config& config)
+    : config_(config), metadata_rate_(config.metadata_rate),
+      random_(config.seed) {}
+
+Emulator::~Emulator() {
+  if (master_fd_ >= 0) {
+    close(master_fd_);
+  }
+
+  if (slave_fd_ >= 0) {
+    close(slave_fd_);
+  }
+
+  if (wake_fds_[0] >= 0) {
+    close(wake_fds_[0]);
+    close(wake_fds_[1]);
+  }
+}
+
+bool Emulator::Open() {
+  bool success = (pipe(wake_fds_) == 0);
+  if (success) {
+    fcntl(wake_fds_[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds_[1], F_SETFL, O_NONBLOCK);
+    master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+    success = (master_fd_ >= 0 && grantpt(master_fd_) == 0
+        && unlockpt(master_fd_) == 0
+        && fcntl(master_fd_, F_SETFL, O_NONBLOCK) == 0);
+  }
+
+  if (success) {
+    const char *path = ptsname(master_fd_);
+    success = (path != nullptr);
+    if (success) {
+      path_ = path;
+      slave_fd_ = open(path, O_RDWR | O_NOCTTY);
+      success = (slave_fd_ >= 0);
+    }
+  }
+
+  if (success) {
+    // Raw mode on the slave prevents the line discipline from translating
+    // the binary protocol before the host has configured it.
+    struct termios options;
+    success = (tcgetattr(slave_fd_, &options) == 0);
+    if (success) {
+      cfmakeraw(&options);
+      success = (tcsetattr(slave_fd_, TCSANOW, &options) == 0);
+    }
+  }
+
+  if (!success) {
+    LOGE("Failed to open pseudo-terminal: %s (%d)", strerror(errno), errno);
+  }
+
+  return success;
+}
+
+bool Emulator::Start() {
+  bool success = (master_fd_ >= 0);
+  running_ = success;
+  next_metadata_time_ = std::chrono::steady_clock::now();
+  while (running_) {
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + std::chrono::milliseconds(100);
+    double rate = metadata_rate_;
+    if (metadata_rate_changed_.exchange(false)) {
+      next_metadata_time_ = now;
+    }
+
+    if (rate > 0.0 && (monitor_mask_ & kMonitorGlobalMetadata)) {
+      deadline = std::min(deadline, next_metadata_time_);
+    } else {
+      next_metadata_time_ = now;
+    }
+
+    if (!deferred_frames_.empty()) {
+      deadline = std::min(deadline, deferred_frames_.front().time);
+    }
+
+    int timeout_ms = static_cast<int>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - now).count());
+    struct pollfd fds[2] = {};
+    fds[0].fd = master_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds_[0];
+    fds[1].events = POLLIN;
+    poll(fds, 2, std::max(timeout_ms, 0));
+
+    if (fds[1].revents & POLLIN) {
+      uint8_t drain[16];
+      while (read(wake_fds_[0], drain, sizeof(drain)) > 0) {}
+    }
+
+    if (fds[0].revents & POLLIN) {
+      uint8_t buffer[512];
+      ssize_t result = read(master_fd_, buffer, sizeof(buffer));
+      if (result > 0) {
+        ParseBytes(buffer, static_cast<size_t>(result));
+      }
+    }
+
+    SendDueFrames();
+    SendDueMetadata();
+  }
+
+  return success;
+}
+
+bool Emulator::Replay(const std::vector<ReplayChunk>& chunks) {
+  bool success = (master_fd_ >= 0);
+  running_ = success;
+
+  // Each chunk is written at an offset from the start of the replay, with
+  // long gaps in the recording shortened.
+  std::vector<std::chrono::nanoseconds> offsets;
+  std::chrono::nanoseconds offset(0);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (i > 0) {
+      offset += std::min<std::chrono::nanoseconds>(
+          chunks[i].time - chunks[i - 1].time, kMaxReplayGap);
+    }
+    offsets.push_back(offset);
+  }
+
+  bool started = false;
+  std::chrono::steady_clock::time_point start_time;
+  size_t next_chunk = 0;
+  while (running_) {
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + std::chrono::milliseconds(100);
+    if (started && next_chunk < chunks.size()) {
+      deadline = std::min(deadline, start_time + offsets[next_chunk]);
+    }
+
+    int timeout_ms = static_cast<int>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - now).count());
+    struct pollfd fds[2] = {};
+    fds[0].fd = master_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds_[0];
+    fds[1].events = POLLIN;
+    poll(fds, 2, std::max(timeout_ms, 0));
+
+    if (fds[1].revents & POLLIN) {
+      uint8_t drain[16];
+      while (read(wake_fds_[0], drain, sizeof(drain)) > 0) {}
+    }
+
+    if (fds[0].revents & POLLIN) {
+      uint8_t buffer[512];
+      if (read(master_fd_, buffer, sizeof(buffer)) > 0 && !started) {
+        LOGI("Host connected, replaying %zu chunks", chunks.size());
+        started = true;
+        start_time = std::chrono::steady_clock::now();
+      }
+    }
+
+    now = std::chrono::steady_clock::now();
+    while (started && running_ && next_chunk < chunks.size()
+        && now >= start_time + offsets[next_chunk]) {
+      const ReplayChunk& chunk = chunks[next_chunk++];
+      WriteBytes(chunk.bytes.data(), chunk.bytes.size());
+      if (next_chunk == chunks.size()) {
+        LOGI("Replay complete");
+      }
+    }
+  }
+
+  return success;
+}
+
+void Emulator::Stop() {
+  running_ = false;
+  uint8_t value = 0;
+  ssize_t result = write(wake_fds_[1], &value, sizeof(value));
+  (void)result;
+}
+
+void Emulator::SetMetadataRate(double rate) {
+  metadata_rate_ = rate;
+  metadata_rate_changed_ = true;
+  uint8_t value = 0;
+  ssize_t result = write(wake_fds_[1], &value, sizeof(value));
+  (void)result;
+}
+
+Emulator::Stats Emulator::GetStats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+void Emulator::ParseBytes(const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    uint8_t byte = bytes[i];
+    if (byte == kSyncByte) {
+      // A sync always starts a new frame, abandoning any partial frame.
+      rx_frame_.clear();
+      rx_frame_.push_back(byte);
+      parse_state_ = ParseState::Frame;
+      continue;
+    }
+
+    if (parse_state_ == ParseState::Sync) {
+      continue;
+    } else if (parse_state_ == ParseState::Escape) {
+      parse_state_ = ParseState::Frame;
+      if (byte == kEscapedSyncByte) {
+        byte = kSyncByte;
+      } else if (byte != kEscapeByte) {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.invalid_frames++;
+        parse_state_ = ParseState::Sync;
+        continue;
+      }
+    } else if (byte == kEscapeByte) {
+      parse_state_ = ParseState::Escape;
+      continue;
+    }
+
+    rx_frame_.push_back(byte);
+    if (rx_frame_.size() > kHeaderSize
+        && rx_frame_.size() == kHeaderSize + rx_frame_[5] + 1) {
+      parse_state_ = ParseState::Sync;
+      if (ComputeSum(rx_frame_) != 0) {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.invalid_frames++;
+      } else {
+        HandleFrame(rx_frame_);
+      }
+    }
+  }
+}
+
+void Emulator::HandleFrame(const std::vector<uint8_t>& frame) {
+  uint8_t sequence_number = frame[3];
+  uint8_t frame_type = frame[4];
+  if (frame_type == kAckFrame) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.acks_received++;
+  } else if (frame_type == kMessageFrame && frame[5] >= 2) {
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      stats_.frames_received++;
+    }
+
+    SendAckFrame(sequence_number);
+    uint16_t op_code = static_cast<uint16_t>((frame[6] << 8) | frame[7]);
+    HandleCommand(op_code, &frame[8], frame[5] - 2);
+  } else {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.invalid_frames++;
+  }
+}
+
+void Emulator::HandleCommand(uint16_t op_code, const uint8_t *payload,
+                             size_t size) {
+  std::vector<uint8_t> response = {0, 0};
+  uint16_t response_op_code = op_code | kResponseBit;
+  switch (op_code) {
+    case kSetPowerModeRequest:
+      power_state_ = (size > 0) ? payload[0] : 0;
+      response.push_back(power_state_);
+      response.push_back(0);
+      break;
+    case kSetResetRequest:
+      SendDeferred(response_op_code, response);
+      monitor_mask_ = 0;
+      SendDeferred(kPutModuleReadyResponse, {0, 0});
+      return;
+    case kSetChannelRequest:
+      channel_id_ = (size > 0) ? payload[0] : channel_id_;
+      response.push_back(channel_id_);
+      SendDeferred(response_op_code, response);
+      if (monitor_mask_ & kMonitorTunedChannel) {
+        SendDeferred(kPutChannelResponse, {channel_id_});
+      }
+      if (monitor_mask_ & kMonitorGlobalMetadata) {
+        std::vector<uint8_t> metadata = {channel_id_};
+        AppendMetadata(&metadata);
+        SendDeferred(kPutPdtResponse, std::move(metadata),
+                     config_.response_latency + config_.tune_latency);
+      }
+      return;
+    case kSetFeatureMonitorRequest:
+      monitor_mask_ = (size > 3) ? payload[3] : 0;
+      break;
+    case kGetChannelRequest:
+      AppendChannelDescriptor((size > 0) ? payload[0] : 0, &response);
+      break;
+    case kGetChannelListRequest: {
+      size_t count = std::min(config_.lineup_size, kMaxLineupSize);
+      response.push_back(static_cast<uint8_t>(count));
+      for (size_t i = 1; i <= count; i++) {
+        response.push_back(static_cast<uint8_t>(i));
+      }
+      break;
+    }
+    case kGetSignalRequest:
+      response.insert(response.end(), {0x02, 0x03, 0x01, 0x00});
+      break;
+    default:
+      LOGD("Emulator received unsupported op code 0x%04" PRIx16, op_code);
+      response[0] = 0xff;
+      response[1] = 0xff;
+      break;
+  }
+
+  SendDeferred(response_op_code, response);
+}
+
+void Emulator::SendDeferred(uint16_t op_code, std::vector<uint8_t> payload) {
+  SendDeferred(op_code, std::move(payload), config_.response_latency);
+}
+
+void Emulator::SendDeferred(uint16_t op_code, std::vector<uint8_t> payload,
+                            std::chrono::microseconds delay) {
+  DeferredFrame frame;
+  frame.time = std::chrono::steady_clock::now() + delay;
+  frame.op_code = op_code;
+  frame.payload = std::move(payload);
+  auto position = std::upper_bound(
+      deferred_frames_.begin(), deferred_frames_.end(), frame.time,
+      [](auto time, const DeferredFrame& other) { return time < other.time; });
+  deferred_frames_.insert(position, std::move(frame));
+}
+
+void Emulator::SendDueFrames() {
+  auto now = std::chrono::steady_clock::now();
+  while (!deferred_frames_.empty() && deferred_frames_.front().time <= now) {
+    SendMessageFrame(deferred_frames_.front().op_code,
+                     deferred_frames_.front().payload);
+    deferred_frames_.pop_front();
+  }
+}
+
+void Emulator::SendDueMetadata() {
+  double rate = metadata_rate_;
+  if (rate <= 0.0 || !(monitor_mask_ & kMonitorGlobalMetadata)) {
+    return;
+  }
+
+  std::chrono::steady_clock::duration interval =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / rate));
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kMaxMetadataBurst && next_metadata_time_ <= now; i++) {
+    size_t lineup_size = std::max(
+        size_t(1), std::min(config_.lineup_size, kMaxLineupSize));
+    std::vector<uint8_t> payload;
+    payload.push_back(
+        static_cast<uint8_t>(1 + (metadata_count_ % lineup_size)));
+    AppendMetadata(&payload);
+    if (config_.metadata_parts > 1) {
+      SendMetadataParts(payload);
+    } else {
+      SendMessageFrame(kPutPdtResponse, payload);
+    }
+
+    next_metadata_time_ += interval;
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.metadata_sent++;
+  }
+}
+
+void Emulator::SendMetadataParts(const std::vector<uint8_t>& payload) {
+  // Find the start of each field after the channel and field count.
+  std::vector<size_t> field_offsets;
+  for (size_t offset = 2; offset + 1 < payload.size();
+       offset += 2 + payload[offset + 1]) {
+    field_offsets.push_back(offset);
+  }
+
+  field_offsets.push_back(payload.size());
+  size_t field_count = field_offsets.size() - 1;
+  size_t parts = std::min(config_.metadata_parts, field_count);
+  for (size_t i = 0; i < parts; i++) {
+    size_t first = i * field_count / parts;
+    size_t last = (i + 1) * field_count / parts;
+    std::vector<uint8_t> part = {
+      payload[0], static_cast<uint8_t>(last - first),
+    };
+    part.insert(part.end(), payload.begin() + field_offsets[first],
+                payload.begin() + field_offsets[last]);
+    if (i == 0) {
+      SendMessageFrame(kPutPdtResponse, part);
+    } else {
+      SendDeferred(kPutPdtResponse, std::move(part),
+                   kMetadataPartGap * static_cast<int>(i));
+    }
+  }
+}
+
+void Emulator::AppendChannelDescriptor(uint8_t channel_id,
+                                       std::vector<uint8_t> *payload) {
+  uint8_t category_id = channel_id % kCategoryCount;
+  char buffer[32];
+  payload->push_back(channel_id);
+  payload->push_back(0);
+  payload->push_back(category_id);
+  payload->push_back(0);
+  payload->push_back(0);
+
+  snprintf(buffer, sizeof(buffer), "CH%03u", channel_id);
+  AppendString(buffer, payload);
+  snprintf(buffer, sizeof(buffer), "Channel %u", channel_id);
+  AppendString(buffer, payload);
+  snprintf(buffer, sizeof(buffer), "Cat%u", category_id);
+  AppendString(buffer, payload);
+  snprintf(buffer, sizeof(buffer), "Category %u", category_id);
+  AppendString(buffer, payload);
+  AppendMetadata(payload);
+}
+
+void Emulator::AppendMetadata(std::vector<uint8_t> *payload) {
+  uint64_t artist = random_() % kArtistCount;
+  uint64_t song = metadata_count_++;
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  char buffer[48];
+
+  payload->push_back(4);
+  snprintf(buffer, sizeof(buffer), "Artist %" PRIu64, artist);
+  AppendField(0x01, buffer, payload);
+  snprintf(buffer, sizeof(buffer), "Song %" PRIu64, song % 10000);
+  AppendField(0x02, buffer, payload);
+  snprintf(buffer, sizeof(buffer), "Album %" PRIu64, artist * 3 + song % 3);
+  AppendField(0x03, buffer, payload);
+  snprintf(buffer, sizeof(buffer), "t=%" PRId64, static_cast<int64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()));
+  AppendField(kTimestampMetadataType, buffer, payload);
+}
+
+void Emulator::SendMessageFrame(uint16_t op_code,
+                                const std::vector<uint8_t>& payload) {
+  size_t size = std::min(payload.size(), size_t(UINT8_MAX - 2));
+  std::vector<uint8_t> frame = {
+    kSyncByte, kProtocolByte, 0x00, sequence_number_++, kMessageFrame,
+    static_cast<uint8_t>(size + 2),
+    static_cast<uint8_t>(op_code >> 8), static_cast<uint8_t>(op_code),
+  };
+
+  frame.insert(frame.end(), payload.begin(), payload.begin() + size);
+  frame.push_back(0);
+  frame.back() = -ComputeSum(frame);
+
+  bool corrupt = (config_.corruption_rate > 0.0
+      && std::uniform_real_distribution<double>(0.0, 1.0)(random_)
+          < config_.corruption_rate);
+  if (corrupt) {
+    // Corruption is applied before escaping so that it looks like a checksum
+    // or framing error rather than an invalid escape sequence.
+    size_t index = 1 + (random_() % (frame.size() - 1));
+    frame[index] ^= static_cast<uint8_t>(1 << (random_() % 8));
+  }
+
+  WriteFrame(frame);
+
+  // A retransmission repeats the frame as sent, with the same sequence
+  // number.
+  bool retransmit = (config_.retransmit_rate > 0.0
+      && std::uniform_real_distribution<double>(0.0, 1.0)(random_)
+          < config_.retransmit_rate);
+  if (retransmit) {
+    WriteFrame(frame);
+  }
+
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.frames_sent++;
+  if (corrupt) {
+    stats_.frames_corrupted++;
+  }
+
+  if (retransmit) {
+    stats_.frames_retransmitted++;
+  }
+}
+
+void Emulator::SendAckFrame(uint8_t sequence_number) {
+  std::vector<uint8_t> frame = {
+    kSyncByte, kProtocolByte, 0x00, sequence_number, kAckFrame, 0, 0,
+  };
+
+  frame.back() = -ComputeSum(frame);
+  WriteFrame(frame);
+}
+
+uint8_t Emulator::ComputeSum(const std::vector<uint8_t>& frame) {
+  uint8_t sum = 0;
+  for (uint8_t byte : frame) {
+    sum += byte;
+  }
+
+  return sum;
+}
+
+void Emulator::WriteFrame(const std::vector<uint8_t>& frame) {
+  std::vector<uint8_t> encoded;
+  encoded.reserve(frame.size() * 2);
+  encoded.push_back(kSyncByte);
+  for (size_t i = 1; i < frame.size(); i++) {
+    if (frame[i] == kSyncByte) {
+      encoded.push_back(kEscapeByte);
+      encoded.push_back(kEscapedSyncByte);
+    } else if (frame[i] == kEscapeByte) {
+      encoded.push_back(kEscapeByte);
+      encoded.push_back(kEscapeByte);
+    } else {
+      encoded.push_back(frame[i]);
+    }
+  }
+
+  WriteBytes(encoded.data(), encoded.size());
+}
+
+void Emulator::WriteBytes(const uint8_t *bytes, size_t size) {
+  size_t pos = 0;
+  while (pos < size && running_) {
+    ssize_t result = write(master_fd_, &bytes[pos], size - pos);
+    if (result > 0) {
+      pos += static_cast<size_t>(result);
+    } else if (result < 0 && errno == EAGAIN) {
+      // The host is not keeping up. Wait for it to drain the terminal, which
+      // throttles the emulator to the rate that the host can sustain.
+      struct pollfd fds[2] = {};
+      fds[0].fd = master_fd_;
+      fds[0].events = POLLOUT;
+      fds[1].fd = wake_fds_[0];
+      fds[1].events = POLLIN;
+      poll(fds, 2, 100);
+    } else if (result < 0 && errno != EINTR) {
+      LOGE("Emulator failed to write: %s (%d)", strerror(errno), errno);
+      break;
+    }
+  }
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_EMULATOR_H_
+#define DOGTRICKS_EMULATOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "non_copyable.h"
+
+namespace dogtricks {
+
+/**
+ * A software radio that speaks the same framing as the Transport over a
+ * pseudo-terminal. This permits load testing and benchmarking without a
+ * physical radio. The emulator has its own codec, independent of the
+ * Transport, so that it serves as a reference for the protocol.
+ */
+class Emulator : public NonCopyable {
+ public:
+  /**
+   * The behaviour of the emulated radio.
+   */
+  struct Config {
+    //! The number of channels in the lineup, starting at channel 1.
+    size_t lineup_size = 100;
+
+    //! The number of metadata changes to push per second when global
+    //! metadata monitoring is enabled.
+    double metadata_rate = 0.0;
+
+    //! The probability that a transmitted frame has a byte corrupted.
+    double corruption_rate = 0.0;
+
+    //! The time taken to respond to a command.
+    std::chrono::microseconds response_latency = std::chrono::microseconds(0);
+
+    //! The time taken to acquire the metadata of a newly tuned channel, after
+    //! which it is pushed if global metadata monitoring is enabled.
+    std::chrono::microseconds tune_latency = std::chrono::microseconds(0);
+
+    //! The probability that a transmitted message frame is sent again, as
+    //! though the ack from the host was lost.
+    double retransmit_rate = 0.0;
+
+    //! The number of puts that each pushed metadata change is split across,
+    //! as the radio does for some song changes.
+    size_t metadata_parts = 1;
+
+    //! The seed for the generator of metadata and corruption.
+    uint32_t seed = 1;
+  };
+
+  /**
+   * Counters describing the traffic handled by the emulator.
+   */
+  struct Stats {
+    //! The number of valid message frames received from the host.
+    uint64_t frames_received;
+
+    //! The number of ack frames received from the host.
+    uint64_t acks_received;
+
+    //! The number of received frames that were discarded as invalid.
+    uint64_t invalid_frames;
+
+    //! The number of message frames sent to the host.
+    uint64_t frames_sent;
+
+    //! The number of sent frames that were deliberately corrupted.
+    uint64_t frames_corrupted;
+
+    //! The number of message frames that were sent a second time.
+    uint64_t frames_retransmitted;
+
+    //! The number of metadata puts sent to the host.
+    uint64_t metadata_sent;
+  };
+
+  /**
+   * A chunk of bytes recorded from a radio, to be replayed to the host.
+   */
+  struct ReplayChunk {
+    //! The time of the chunk, relative to the start of the recording.
+    std::chrono::nanoseconds time;
+
+    //! The raw bytes sent by the radio.
+    std::vector<uint8_t> bytes;
+  };
+
+  //! The longest pause between replayed chunks. Longer gaps in a recording
+  //! are shortened to this.
+  static constexpr std::chrono::seconds kMaxReplayGap =
+      std::chrono::seconds(1);
+
+  /**
+   * The metadata type used to carry the time at which a metadata put was
+   * written, in nanoseconds of the steady clock formatted as "t=<ns>". This
+   * permits measuring end-to-end latency within one process.
+   */
+  static constexpr uint8_t kTimestampMetadataType = 0x08;
+
+  /**
+   * Setup the emulator with the supplied configuration. The pseudo-terminal
+   * is not created until Open.
+   */
+  Emulator(const Config& config);
+
+  /**
+   * Clean up after the emulator. Closes the pseudo-terminal.
+   */
+  ~Emulator();
+
+  /**
+   * Creates the pseudo-terminal that the host connects to.
+   *
+   * @return true if successful, false otherwise.
+   */
+  bool Open();
+
+  /**
+   * @return the path of the device for the host to open. Valid after Open.
+   */
+  const char *GetPath() const {
+    return path_.c_str();
+  }
+
+  /**
+   * Services the host until stopped. This function blocks.
+   *
+   * @return true when stopped, false if the emulator is not open.
+   */
+  bool Start();
+
+  /**
+   * Writes recorded bytes to the host with their original spacing instead of
+   * emulating a radio. The replay starts once the host writes its first
+   * bytes. Bytes from the host are otherwise ignored. Once every chunk has
+   * been written the host is left connected. This function blocks until
+   * stopped.
+   *
+   * @param chunks The chunks to replay, in order.
+   * @return true when stopped, false if the emulator is not open.
+   */
+  bool Replay(const std::vector<ReplayChunk>& chunks);
+
+  /**
+   * Stops the loop in Start or Replay.
+   */
+  void Stop();
+
+  /**
+   * Changes the rate of metadata puts while running.
+   */
+  void SetMetadataRate(double rate);
+
+  /**
+   * @return a snapshot of the traffic counters.
+   */
+  Stats GetStats() const;
+
+ private:
+  //! The sync byte used to indicate a start of message.
+  static constexpr uint8_t kSyncByte = 0xa4;
+
+  //! The escape byte used to encode a sync.
+  static constexpr uint8_t kEscapeByte = 0x1b;
+
+  //! The byte sent after an escape to encode a sync.
+  static constexpr uint8_t kEscapedSyncByte = 0x53;
+
+  //! The fixed byte to indicate the protocol version.
+  static constexpr uint8_t kProtocolByte = 0x03;
+
+  //! The value for a message frame.
+  static constexpr uint8_t kMessageFrame = 0x00;
+
+  //! The value for an ack frame.
+  static constexpr uint8_t kAckFrame = 0x80;
+
+  //! The size of the header, from the sync byte through the length.
+  static constexpr size_t kHeaderSize = 6;
+
+  //! The largest number of metadata puts sent in one pass of the loop, to
+  //! avoid starving command handling at high rates.
+  static constexpr size_t kMaxMetadataBurst = 64;
+
+  /**
+   * The states of the receive parser.
+   */
+  enum class ParseState : uint8_t {
+    Sync,
+    Frame,
+    Escape,
+  };
+
+  /**
+   * A frame scheduled to be written after the response latency.
+   */
+  struct DeferredFrame {
+    //! The time at which to write the frame.
+    std::chrono::steady_clock::time_point time;
+
+    //! The op code of the frame.
+    uint16_t op_code;
+
+    //! The payload of the frame.
+    std::vector<uint8_t> payload;
+  };
+
+  //! The behaviour of the emulated radio.
+  const Config config_;
+
+  //! The master side of the pseudo-terminal.
+  int master_fd_ = -1;
+
+  //! The slave side, held open so that the host can reconnect.
+  int slave_fd_ = -1;
+
+  //! The pipe used to wake the loop. The read end is at index 0.
+  int wake_fds_[2] = {-1, -1};
+
+  //! The path of the slave device.
+  std::string path_;
+
+  //! Set to true while the loop is running.
+  std::atomic<bool> running_ = false;
+
+  //! The rate of metadata puts per second.
+  std::atomic<double> metadata_rate_;
+
+  //! Set to true when the rate has changed, restarting the schedule of puts
+  //! rather than catching up on puts missed at the previous rate.
+  std::atomic<bool> metadata_rate_changed_ = false;
+
+  //! The mutex to lock the counters.
+  mutable std::mutex stats_mutex_;
+
+  //! The traffic counters.
+  Stats stats_ = {};
+
+  //! The generator for metadata and corruption.
+  std::mt19937 random_;
+
+  //! The state of the receive parser.
+  ParseState parse_state_ = ParseState::Sync;
+
+  //! The unescaped bytes of the frame being received.
+  std::vector<uint8_t> rx_frame_;
+
+  //! The next sequence number to send.
+  uint8_t sequence_number_ = 0;
+
+  //! The feature monitor mask configured by the host.
+  uint8_t monitor_mask_ = 0;
+
+  //! The channel being decoded.
+  uint8_t channel_id_ = 1;
+
+  //! The power state configured by the host.
+  uint8_t power_state_ = 0;
+
+  //! The number of metadata changes generated, used to vary the content.
+  uint64_t metadata_count_ = 0;
+
+  //! The frames waiting for the response latency to elapse.
+  std::deque<DeferredFrame> deferred_frames_;
+
+  //! The time at which the next metadata put is due.
+  std::chrono::steady_clock::time_point next_metadata_time_;
+
+  /**
+   * Parses received bytes, handling each complete frame.
+   */
+  void ParseBytes(const uint8_t *bytes, size_t size);
+
+  /**
+   * Handles a complete unescaped frame with a valid checksum.
+   */
+  void HandleFrame(const std::vector<uint8_t>& frame);
+
+  /**
+   * Handles a command from the host by scheduling the response.
+   */
+  void HandleCommand(uint16_t op_code, const uint8_t *payload, size_t size);
+
+  /**
+   * Schedules a message frame after the response latency.
+   */
+  void SendDeferred(uint16_t op_code, std::vector<uint8_t> payload);
+
+  /**
+   * Schedules a message frame after the supplied delay, keeping the deferred
+   * frames in order of time.
+   */
+  void SendDeferred(uint16_t op_code, std::vector<uint8_t> payload,
+                    std::chrono::microseconds delay);
+
+  /**
+   * Writes the deferred frames that are due.
+   */
+  void SendDueFrames();
+
+  /**
+   * Writes the metadata puts that are due at the configured rate.
+   */
+  void SendDueMetadata();
+
+  /**
+   * Sends a metadata put split across Config::metadata_parts puts, the first
+   * immediately and the rest deferred a short time apart.
+   *
+   * @param payload The payload of the unsplit put.
+   */
+  void SendMetadataParts(const std::vector<uint8_t>& payload);
+
+  /**
+   * Appends the channel descriptor response for the supplied channel.
+   */
+  void AppendChannelDescriptor(uint8_t channel_id,
+                               std::vector<uint8_t> *payload);
+
+  /**
+   * Appends a metadata field count and fields for a new song to the payload.
+   */
+  void AppendMetadata(std::vector<uint8_t> *payload);
+
+  /**
+   * Encodes and writes a message frame, corrupting it as configured.
+   */
+  void SendMessageFrame(uint16_t op_code, const std::vector<uint8_t>& payload);
+
+  /**
+   * Encodes and writes an ack frame for the supplied sequence number.
+   */
+  void SendAckFrame(uint8_t sequence_number);
+
+  /**
+   * Computes the sum of the bytes of an unescaped frame. The checksum byte is
+   * chosen to make the sum of a valid frame zero.
+   */
+  static uint8_t ComputeSum(const std::vector<uint8_t>& frame);
+
+  /**
+   * Escapes and writes an unescaped frame, blocking until it is written.
+   */
+  void WriteFrame(const std::vector<uint8_t>& frame);
+
+  /**
+   * Writes raw bytes to the host, blocking until they are written.
+   */
+  void WriteBytes(const uint8_t *bytes, size_t size);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_EMULATOR_H_
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <tclap/CmdLine.h>
+#include <unistd.h>
+#include <vector>
+
+#include "emulator.h"
+#include "flight_recorder.h"
+#include "log.h"
+
+using dogtricks::Emulator;
+using dogtricks::FlightRecorder;
+
+//! A description of the program.
+constexpr char kDescription[] = "An emulated satellite radio dog for testing.";
+
+//! The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+//! The emulator instance that will be stopped when SIGINT is raised.
+Emulator *gEmulatorInstance = nullptr;
+
+/**
+ * Handle signals to stop the emulator loop gracefully.
+ */
+void SignalHandler(int signal) {
+  if (gEmulatorInstance != nullptr) {
+    gEmulatorInstance->Stop();
+  }
+}
+
+int main(int argc, char **argv) {
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<std::string> link_arg("", "link",
+      "a symlink to create to the emulated device",
+      false /* req */, "", "path", cmd);
+  TCLAP::ValueArg<int> latency_arg("", "latency_us",
+      "the time taken to respond to each command",
+      false /* req */, 0, "microseconds", cmd);
+  TCLAP::ValueArg<int> tune_latency_arg("", "tune_latency_us",
+      "the time taken to push the metadata of a newly tuned channel",
+      false /* req */, 0, "microseconds", cmd);
+  TCLAP::ValueArg<double> corruption_arg("", "corruption_rate",
+      "the probability that a transmitted frame is corrupted",
+      false /* req */, 0.0, "probability", cmd);
+  TCLAP::ValueArg<double> retransmit_arg("", "retransmit_rate",
+      "the probability that a transmitted frame is sent again",
+      false /* req */, 0.0, "probability", cmd);
+  TCLAP::ValueArg<double> metadata_rate_arg("", "metadata_rate",
+      "the number of metadata changes pushed per second when monitored",
+      false /* req */, 1.0, "rate", cmd);
+  TCLAP::ValueArg<int> metadata_parts_arg("", "metadata_parts",
+      "the number of puts that each metadata change is split across",
+      false /* req */, 1, "count", cmd);
+  TCLAP::ValueArg<int> lineup_size_arg("", "lineup_size",
+      "the number of channels in the lineup",
+      false /* req */, 100, "channels", cmd);
+  TCLAP::ValueArg<std::string> replay_arg("", "replay",
+      "replays the bytes received in a flight recorder dump instead",
+      false /* req */, "", "path", cmd);
+  cmd.parse(argc, argv);
+
+  // Consecutive records with the same timestamp were read together.
+  std::vector<Emulator::ReplayChunk> replay_chunks;
+  if (replay_arg.isSet()) {
+    std::vector<FlightRecorder::DumpRecord> records;
+    if (!FlightRecorder::ReadDump(replay_arg.getValue().c_str(), &records)) {
+      LOGE("Failed to read flight recorder dump %s",
+           replay_arg.getValue().c_str());
+      return -1;
+    }
+
+    uint64_t first_timestamp_ns = 0;
+    uint64_t last_timestamp_ns = 0;
+    for (const auto& record : records) {
+      if (record.type != FlightRecorder::RecordType::RxBytes) {
+        continue;
+      }
+
+      if (replay_chunks.empty()) {
+        first_timestamp_ns = record.timestamp_ns;
+      }
+
+      if (replay_chunks.empty() || record.timestamp_ns != last_timestamp_ns) {
+        replay_chunks.push_back({std::chrono::nanoseconds(
+            record.timestamp_ns - first_timestamp_ns), {}});
+      }
+
+      auto& bytes = replay_chunks.back().bytes;
+      bytes.insert(bytes.end(), record.data.begin(), record.data.end());
+      last_timestamp_ns = record.timestamp_ns;
+    }
+  }
+
+  Emulator::Config config;
+  config.lineup_size = lineup_size_arg.getValue();
+  config.metadata_rate = metadata_rate_arg.getValue();
+  config.metadata_parts = std::max(1, metadata_parts_arg.getValue());
+  config.corruption_rate = corruption_arg.getValue();
+  config.retransmit_rate = retransmit_arg.getValue();
+  config.response_latency = std::chrono::microseconds(latency_arg.getValue());
+  config.tune_latency = std::chrono::microseconds(tune_latency_arg.getValue());
+
+  Emulator emulator(config);
+  bool success = emulator.Open();
+  if (success) {
+    std::string path = emulator.GetPath();
+    if (link_arg.isSet()) {
+      std::string temp_link = link_arg.getValue() + ".tmp";
+      unlink(temp_link.c_str());
+      success = (symlink(path.c_str(), temp_link.c_str()) == 0
+          && rename(temp_link.c_str(), link_arg.getValue().c_str()) == 0);
+      if (!success) {
+        LOGE("Failed to create link %s", link_arg.getValue().c_str());
+      } else {
+        path = link_arg.getValue();
+      }
+    }
+
+    printf("%s\n", path.c_str());
+    fflush(stdout);
+  }
+
+  if (success) {
+    gEmulatorInstance = &emulator;
+    std::signal(SIGINT, SignalHandler);
+    std::signal(SIGTERM, SignalHandler);
+    if (replay_arg.isSet()) {
+      emulator.Replay(replay_chunks);
+    } else {
+      emulator.Start();
+    }
+
+    auto stats = emulator.GetStats();
+    LOGI("Emulator:");
+    LOGI("  frames received: %" PRIu64, stats.frames_received);
+    LOGI("  acks received: %" PRIu64, stats.acks_received);
+    LOGI("  invalid frames: %" PRIu64, stats.invalid_frames);
+    LOGI("  frames sent: %" PRIu64, stats.frames_sent);
+    LOGI("  frames corrupted: %" PRIu64, stats.frames_corrupted);
+    LOGI("  frames retransmitted: %" PRIu64, stats.frames_retransmitted);
+    LOGI("  metadata sent: %" PRIu64, stats.metadata_sent);
+  }
+
+  return (success ? 0 : -1);
+}
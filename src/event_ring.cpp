@@ -0,0 +1,232 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "event_ring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace dogtricks {
+
+EventRingWriter::EventRingWriter(const char *name, uint32_t slot_count,
+                                 uint32_t slot_size)
+    : name_(name), slot_count_(slot_count), slot_size_(slot_size) {}
+
+EventRingWriter::~EventRingWriter() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+    shm_unlink(name_.c_str());
+  }
+}
+
+bool EventRingWriter::Open() {
+  // Remove any ring left behind by a writer that did not exit cleanly so that
+  // readers of it are not confused by a resized mapping.
+  shm_unlink(name_.c_str());
+
+  uint32_t slot_stride = EventRing::GetSlotStride(slot_size_);
+  size_t mapping_size = EventRing::GetMappingSize(slot_count_, slot_stride);
+  int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  bool success = (fd >= 0);
+  if (!success) {
+    LOGE("Failed to create event ring %s: %s", name_.c_str(), strerror(errno));
+  } else {
+    success = (ftruncate(fd, mapping_size) == 0);
+    if (!success) {
+      LOGE("Failed to size event ring %s: %s", name_.c_str(), strerror(errno));
+    } else {
+      void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+      success = (mapping != MAP_FAILED);
+      if (!success) {
+        LOGE("Failed to map event ring %s: %s", name_.c_str(),
+             strerror(errno));
+      } else {
+        // The mapping is zero filled, so every slot starts unpublished.
+        auto *header = static_cast<EventRing::Header *>(mapping);
+        header->version = EventRing::kVersion;
+        header->slot_count = slot_count_;
+        header->slot_size = slot_size_;
+        header->slot_stride = slot_stride;
+        header->write_seq.store(0, std::memory_order_relaxed);
+        header->magic.store(EventRing::kMagic, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        mapping_ = mapping;
+        mapping_size_ = mapping_size;
+      }
+    }
+
+    close(fd);
+    if (!success) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  return success;
+}
+
+bool EventRingWriter::Publish(const char *data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool success = (mapping_ != nullptr && size <= slot_size_);
+  if (mapping_ != nullptr && !success) {
+    stats_.oversized++;
+  } else if (success) {
+    auto *header = static_cast<EventRing::Header *>(mapping_);
+    uint64_t seq = header->write_seq.load(std::memory_order_relaxed);
+    auto *slot = reinterpret_cast<EventRing::Slot *>(
+        static_cast<char *>(mapping_) + sizeof(EventRing::Header)
+        + (seq % slot_count_) * header->slot_stride);
+
+    // Mark the slot as being written before the payload changes so that
+    // readers still holding the previous record detect the overwrite.
+    slot->seq.store(seq * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(reinterpret_cast<char *>(slot + 1), data, size);
+    slot->size.store(size, std::memory_order_relaxed);
+    slot->seq.store(seq * 2 + 2, std::memory_order_release);
+    header->write_seq.store(seq + 1, std::memory_order_release);
+    stats_.published++;
+  }
+
+  return success;
+}
+
+EventRingWriter::Stats EventRingWriter::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+EventRingReader::EventRingReader(const char *name) : name_(name) {}
+
+EventRingReader::~EventRingReader() {
+  if (mapping_ != nullptr) {
+    munmap(const_cast<void *>(mapping_), mapping_size_);
+  }
+}
+
+bool EventRingReader::Open() {
+  int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+  bool success = (fd >= 0);
+  if (!success) {
+    LOGE("Failed to open event ring %s: %s", name_.c_str(), strerror(errno));
+  } else {
+    struct stat file_stat;
+    success = (fstat(fd, &file_stat) == 0
+        && static_cast<size_t>(file_stat.st_size) >= sizeof(EventRing::Header));
+    if (!success) {
+      LOGE("Event ring %s is not initialized", name_.c_str());
+    } else {
+      size_t mapping_size = file_stat.st_size;
+      void *mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+      success = (mapping != MAP_FAILED);
+      if (!success) {
+        LOGE("Failed to map event ring %s: %s", name_.c_str(),
+             strerror(errno));
+      } else {
+        auto *header = static_cast<const EventRing::Header *>(mapping);
+        success = (header->magic.load(std::memory_order_acquire)
+                == EventRing::kMagic
+            && header->version == EventRing::kVersion
+            && header->slot_count > 0
+            && EventRing::GetMappingSize(header->slot_count,
+                                         header->slot_stride) <= mapping_size);
+        if (!success) {
+          LOGE("Event ring %s has an unsupported layout", name_.c_str());
+          munmap(mapping, mapping_size);
+        } else {
+          mapping_ = mapping;
+          mapping_size_ = mapping_size;
+          header_ = header;
+          cursor_ = header->write_seq.load(std::memory_order_acquire);
+        }
+      }
+    }
+
+    close(fd);
+  }
+
+  return success;
+}
+
+bool EventRingReader::Peek(std::string_view *record) {
+  bool available = false;
+  while (header_ != nullptr && !available) {
+    uint64_t write_seq = header_->write_seq.load(std::memory_order_acquire);
+    if (write_seq == cursor_) {
+      break;
+    }
+
+    // Skip to the oldest record that is retained if the writer has lapped
+    // this reader.
+    if (write_seq - cursor_ > header_->slot_count) {
+      uint64_t oldest = write_seq - header_->slot_count;
+      overruns_ += oldest - cursor_;
+      cursor_ = oldest;
+    }
+
+    const EventRing::Slot *slot = GetSlot(cursor_);
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq != cursor_ * 2 + 2) {
+      // The slot has already been reused for a newer record.
+      overruns_++;
+      cursor_++;
+    } else {
+      uint32_t size = slot->size.load(std::memory_order_relaxed);
+      if (size > header_->slot_size) {
+        size = 0;
+      }
+
+      *record = std::string_view(reinterpret_cast<const char *>(slot + 1),
+                                 size);
+      peek_slot_ = slot;
+      peek_seq_ = seq;
+      available = true;
+    }
+  }
+
+  return available;
+}
+
+bool EventRingReader::Consume() {
+  bool intact = false;
+  if (peek_slot_ != nullptr) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    intact = (peek_slot_->seq.load(std::memory_order_relaxed) == peek_seq_);
+    if (!intact) {
+      overruns_++;
+    }
+
+    peek_slot_ = nullptr;
+    cursor_++;
+  }
+
+  return intact;
+}
+
+const EventRing::Slot *EventRingReader::GetSlot(uint64_t seq) const {
+  return reinterpret_cast<const EventRing::Slot *>(
+      static_cast<const char *>(mapping_) + sizeof(EventRing::Header)
+      + (seq % header_->slot_count) * header_->slot_stride);
+}
+
+}  // namespace dogtricks
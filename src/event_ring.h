@@ -0,0 +1,289 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_EVENT_RING_H_
+#define DOGTRICKS_EVENT_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "non_copyable.h"
+#include "output_writer.h"
+
+namespace dogtricks {
+
+/**
+ * The layout of a broadcast ring of records in shared memory. One process
+ * publishes records and any number of processes read them, each with its own
+ * cursor. The publisher never waits for readers. A reader that falls more than
+ * a ring behind detects the overrun and skips to the oldest retained record.
+ *
+ * Each slot is guarded by a sequence word that is odd while the slot is being
+ * written. Readers consume records in place and validate the sequence word
+ * afterwards, so the fast path is free of copies and syscalls.
+ */
+class EventRing {
+ public:
+  //! Identifies a mapping as an event ring.
+  static constexpr uint32_t kMagic = 0x474f4454;
+
+  //! The version of the layout.
+  static constexpr uint32_t kVersion = 1;
+
+  //! The default number of slots.
+  static constexpr uint32_t kDefaultSlotCount = 1024;
+
+  //! The default payload capacity of a slot.
+  static constexpr uint32_t kDefaultSlotSize = 2048;
+
+  /**
+   * The header at the start of the mapping.
+   */
+  struct alignas(64) Header {
+    //! Set to kMagic once the ring is initialized.
+    std::atomic<uint32_t> magic;
+
+    //! Set to kVersion.
+    uint32_t version;
+
+    //! The number of slots in the ring.
+    uint32_t slot_count;
+
+    //! The payload capacity of each slot.
+    uint32_t slot_size;
+
+    //! The distance in bytes between slots.
+    uint32_t slot_stride;
+
+    //! The sequence number of the next record to be published.
+    alignas(64) std::atomic<uint64_t> write_seq;
+  };
+
+  /**
+   * The header of each slot, followed by the payload.
+   */
+  struct Slot {
+    //! Twice the sequence number of the record plus one while it is being
+    //! written and plus two once it is published.
+    std::atomic<uint64_t> seq;
+
+    //! The size of the payload.
+    std::atomic<uint32_t> size;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "The event ring requires lock-free 64-bit atomics");
+
+  /**
+   * @return the size of the mapping for the supplied geometry.
+   */
+  static size_t GetMappingSize(uint32_t slot_count, uint32_t slot_stride) {
+    return sizeof(Header) + static_cast<size_t>(slot_count) * slot_stride;
+  }
+
+  /**
+   * @return the stride between slots for the supplied payload capacity.
+   */
+  static uint32_t GetSlotStride(uint32_t slot_size) {
+    return (sizeof(Slot) + slot_size + 63) & ~static_cast<uint32_t>(63);
+  }
+};
+
+/**
+ * Creates an event ring and publishes records into it. The ring is removed
+ * when the writer is destroyed, although readers that are attached may keep
+ * reading records that were published.
+ */
+class EventRingWriter : public NonCopyable {
+ public:
+  /**
+   * Metrics collected by the writer.
+   */
+  struct Stats {
+    //! The number of records published.
+    uint64_t published = 0;
+
+    //! The number of records dropped because they exceed the slot size.
+    uint64_t oversized = 0;
+  };
+
+  /**
+   * Setup the writer with the name of the ring and its geometry. Open must be
+   * called before records are published.
+   *
+   * @param name The name of the shared memory object, such as "/dogtricks".
+   * @param slot_count The number of records retained.
+   * @param slot_size The maximum size of a record.
+   */
+  EventRingWriter(const char *name,
+                  uint32_t slot_count = EventRing::kDefaultSlotCount,
+                  uint32_t slot_size = EventRing::kDefaultSlotSize);
+
+  /**
+   * Unmaps and removes the ring.
+   */
+  ~EventRingWriter();
+
+  /**
+   * Creates and maps the ring, replacing any stale ring of the same name.
+   *
+   * @return true if successful, false otherwise.
+   */
+  bool Open();
+
+  /**
+   * Publishes a record. Records larger than the slot size are dropped.
+   *
+   * @param data The record to publish.
+   * @param size The size of the record.
+   * @return true if the record was published, false otherwise.
+   */
+  bool Publish(const char *data, size_t size);
+
+  /**
+   * @return the metrics collected by the writer.
+   */
+  Stats GetStats() const;
+
+ private:
+  //! The name of the shared memory object.
+  const std::string name_;
+
+  //! The number of slots.
+  const uint32_t slot_count_;
+
+  //! The payload capacity of each slot.
+  const uint32_t slot_size_;
+
+  //! The mutex to serialize publishers.
+  mutable std::mutex mutex_;
+
+  //! The mapping, or nullptr if not open.
+  void *mapping_ = nullptr;
+
+  //! The size of the mapping.
+  size_t mapping_size_ = 0;
+
+  //! The metrics collected by the writer.
+  Stats stats_;
+};
+
+/**
+ * Attaches to an event ring and reads records from it. Records published
+ * before the reader attached are not read.
+ */
+class EventRingReader : public NonCopyable {
+ public:
+  /**
+   * Setup the reader with the name of the ring. Open must be called before
+   * records are read.
+   */
+  EventRingReader(const char *name);
+
+  /**
+   * Unmaps the ring.
+   */
+  ~EventRingReader();
+
+  /**
+   * Maps the ring for reading.
+   *
+   * @return true if successful, false otherwise.
+   */
+  bool Open();
+
+  /**
+   * Obtains the next record without copying it. The record must be released
+   * with Consume before the next is obtained.
+   *
+   * @param record The view to populate with the record.
+   * @return true if a record is available, false if the reader is caught up.
+   */
+  bool Peek(std::string_view *record);
+
+  /**
+   * Releases the record obtained by Peek and advances the cursor.
+   *
+   * @return true if the record was intact, false if the writer overwrote it
+   *         while it was being read and it must be discarded.
+   */
+  bool Consume();
+
+  /**
+   * @return the number of records that were overwritten before they were read.
+   */
+  uint64_t GetOverrunCount() const {
+    return overruns_;
+  }
+
+ private:
+  //! The name of the shared memory object.
+  const std::string name_;
+
+  //! The mapping, or nullptr if not open.
+  const void *mapping_ = nullptr;
+
+  //! The size of the mapping.
+  size_t mapping_size_ = 0;
+
+  //! The header of the mapping.
+  const EventRing::Header *header_ = nullptr;
+
+  //! The sequence number of the next record to read.
+  uint64_t cursor_ = 0;
+
+  //! The sequence word of the record obtained by Peek.
+  uint64_t peek_seq_ = 0;
+
+  //! The slot of the record obtained by Peek, or nullptr.
+  const EventRing::Slot *peek_slot_ = nullptr;
+
+  //! The number of records that were overwritten before they were read.
+  uint64_t overruns_ = 0;
+
+  /**
+   * @return the slot for the supplied sequence number.
+   */
+  const EventRing::Slot *GetSlot(uint64_t seq) const;
+};
+
+/**
+ * Publishes events into an event ring as binary records.
+ */
+class EventRingPublisher : public BinaryWriter {
+ public:
+  /**
+   * Setup the publisher to publish to the supplied ring.
+   */
+  EventRingPublisher(EventRingWriter *ring) : BinaryWriter(-1), ring_(ring) {}
+
+ protected:
+  void WriteBuffer(const char *data, size_t size) override {
+    ring_->Publish(data, size);
+  }
+
+ private:
+  //! The ring to publish to.
+  EventRingWriter *ring_;
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_EVENT_RING_H_
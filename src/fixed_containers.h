@@ -0,0 +1,125 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_FIXED_CONTAINERS_H_
+#define DOGTRICKS_FIXED_CONTAINERS_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+namespace dogtricks {
+
+/**
+ * A string with inline storage for up to N bytes. Longer values are
+ * truncated. This provides the subset of the std::string interface used for
+ * radio strings so that either may be used.
+ */
+template <size_t N>
+class FixedString {
+ public:
+  FixedString() = default;
+
+  FixedString(const char *data, size_t size) {
+    assign(data, size);
+  }
+
+  explicit FixedString(std::string_view value) {
+    assign(value.data(), value.size());
+  }
+
+  /**
+   * Replaces the value, truncating it to the capacity of the string.
+   */
+  void assign(const char *data, size_t size) {
+    size_ = std::min(size, N);
+    memcpy(data_, data, size_);
+    data_[size_] = '\0';
+  }
+
+  const char *c_str() const { return data_; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  static constexpr size_t capacity() { return N; }
+
+  operator std::string_view() const {
+    return std::string_view(data_, size_);
+  }
+
+  bool operator==(std::string_view other) const {
+    return std::string_view(*this) == other;
+  }
+
+  bool operator!=(std::string_view other) const {
+    return std::string_view(*this) != other;
+  }
+
+ private:
+  //! The size of the value.
+  size_t size_ = 0;
+
+  //! The value, followed by a terminator.
+  char data_[N + 1] = {};
+};
+
+/**
+ * A vector with inline storage for up to N elements. Elements beyond the
+ * capacity are rejected rather than growing the storage. This provides the
+ * subset of the std::vector interface used for radio lists.
+ */
+template <typename T, size_t N>
+class FixedVector {
+ public:
+  /**
+   * Appends an element.
+   *
+   * @return true if the element was appended, false if the vector is full.
+   */
+  bool push_back(const T& value) {
+    bool success = (size_ < N);
+    if (success) {
+      items_[size_++] = value;
+    }
+
+    return success;
+  }
+
+  void clear() { size_ = 0; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  static constexpr size_t capacity() { return N; }
+
+  T& operator[](size_t index) { return items_[index]; }
+  const T& operator[](size_t index) const { return items_[index]; }
+
+  T *begin() { return items_; }
+  T *end() { return items_ + size_; }
+  const T *begin() const { return items_; }
+  const T *end() const { return items_ + size_; }
+
+ private:
+  //! The number of elements in use.
+  size_t size_ = 0;
+
+  //! The storage for the elements.
+  T items_[N] = {};
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_FIXED_CONTAINERS_H_
@@ -0,0 +1,330 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flight_recorder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dogtricks {
+
+namespace {
+
+//! The number of words holding the type, size and data of a record.
+constexpr size_t kWords = 6;
+
+static_assert(FlightRecorder::kRecordDataSize == kWords * sizeof(uint64_t) - 2,
+              "A record holds a type and size byte followed by the data");
+
+//! The size of a record header in a dump.
+constexpr size_t kDumpRecordHeaderSize = 10;
+
+//! The size of the file header of a dump.
+constexpr size_t kDumpHeaderSize = 32;
+
+/**
+ * A slot in the ring, guarded by a sequence lock. The sequence is odd while
+ * the slot is being written and is derived from the index of the record so
+ * that readers can tell which record a slot holds.
+ */
+struct alignas(64) Slot {
+  //! The sequence of the slot, 2 * index + 2 once the record is written.
+  std::atomic<uint64_t> seq;
+
+  //! The monotonic clock when the record was written, in nanoseconds.
+  std::atomic<uint64_t> timestamp_ns;
+
+  //! The type, size and data of the record.
+  std::atomic<uint64_t> words[kWords];
+};
+
+//! The ring of records.
+Slot gSlots[FlightRecorder::kSlotCount];
+
+//! The index of the next record to write.
+std::atomic<uint64_t> gNextIndex(0);
+
+//! The path written by the signal handlers.
+char gDumpPath[PATH_MAX] = {};
+
+/**
+ * @return the supplied clock in nanoseconds. This is async-signal-safe.
+ */
+uint64_t GetClockNs(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000
+      + static_cast<uint64_t>(now.tv_nsec);
+}
+
+/**
+ * Writes one record of at most kRecordDataSize bytes into the next slot.
+ */
+void RecordSlot(FlightRecorder::RecordType type, const uint8_t *data,
+                size_t size, uint64_t timestamp_ns) {
+  uint8_t bytes[kWords * sizeof(uint64_t)] = {};
+  bytes[0] = static_cast<uint8_t>(type);
+  bytes[1] = static_cast<uint8_t>(size);
+  memcpy(&bytes[2], data, size);
+  uint64_t words[kWords];
+  memcpy(words, bytes, sizeof(words));
+
+  uint64_t index = gNextIndex.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = gSlots[index % FlightRecorder::kSlotCount];
+  slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timestamp_ns.store(timestamp_ns, std::memory_order_relaxed);
+  for (size_t i = 0; i < kWords; i++) {
+    slot.words[i].store(words[i], std::memory_order_relaxed);
+  }
+
+  slot.seq.store(2 * index + 2, std::memory_order_release);
+}
+
+/**
+ * Appends a little-endian value to a buffer.
+ */
+void AppendLittleEndian(uint64_t value, size_t size, uint8_t *buffer,
+                        size_t *pos) {
+  for (size_t i = 0; i < size; i++) {
+    buffer[(*pos)++] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+/**
+ * @return a little-endian value read from a buffer.
+ */
+uint64_t ReadLittleEndian(const uint8_t *buffer, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+  }
+
+  return value;
+}
+
+/**
+ * Writes a buffer to a file descriptor in full. This is async-signal-safe.
+ */
+bool WriteAll(int fd, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ssize_t result = write(fd, data, size);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    data += result;
+    size -= static_cast<size_t>(result);
+  }
+
+  return true;
+}
+
+/**
+ * Writes a dump when requested by a signal.
+ */
+void HandleDumpSignal(int signal) {
+  int saved_errno = errno;
+  if (gDumpPath[0] != '\0') {
+    FlightRecorder::Dump(gDumpPath);
+  }
+
+  errno = saved_errno;
+}
+
+/**
+ * Writes a dump when the process is about to die, then takes the default
+ * action of the signal, which was restored when the handler was invoked.
+ */
+void HandleFatalSignal(int signal) {
+  HandleDumpSignal(signal);
+  raise(signal);
+}
+
+}  // anonymous namespace
+
+void FlightRecorder::Record(RecordType type, const void *data, size_t size) {
+  auto *bytes = static_cast<const uint8_t *>(data);
+  uint64_t timestamp_ns = GetClockNs(CLOCK_MONOTONIC);
+  do {
+    size_t chunk_size = std::min(size, kRecordDataSize);
+    RecordSlot(type, bytes, chunk_size, timestamp_ns);
+    bytes += chunk_size;
+    size -= chunk_size;
+  } while (size > 0);
+}
+
+void FlightRecorder::RecordNote(const char *format, ...) {
+  char note[kRecordDataSize + 1];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(note, sizeof(note), format, args);
+  va_end(args);
+  if (size > 0) {
+    Record(RecordType::Note, note,
+           std::min(static_cast<size_t>(size), kRecordDataSize));
+  }
+}
+
+uint64_t FlightRecorder::GetRecordCount() {
+  return gNextIndex.load(std::memory_order_relaxed);
+}
+
+bool FlightRecorder::SetDumpPath(const char *path) {
+  size_t length = strlen(path);
+  if (length >= sizeof(gDumpPath)) {
+    return false;
+  }
+
+  memcpy(gDumpPath, path, length + 1);
+  return true;
+}
+
+bool FlightRecorder::InstallSignalHandlers(int dump_signal) {
+  struct sigaction action = {};
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = HandleFatalSignal;
+  action.sa_flags = SA_RESETHAND;
+  bool success = true;
+  for (int signal : {SIGABRT, SIGSEGV, SIGBUS}) {
+    success &= (sigaction(signal, &action, nullptr) == 0);
+  }
+
+  action.sa_handler = HandleDumpSignal;
+  action.sa_flags = SA_RESTART;
+  success &= (sigaction(dump_signal, &action, nullptr) == 0);
+  return success;
+}
+
+bool FlightRecorder::Dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool success = Dump(fd);
+  success &= (close(fd) == 0);
+  return success;
+}
+
+bool FlightRecorder::Dump(int fd) {
+  uint8_t buffer[4096];
+  size_t pos = 0;
+  uint64_t end = gNextIndex.load(std::memory_order_acquire);
+  AppendLittleEndian(kMagic, sizeof(uint32_t), buffer, &pos);
+  AppendLittleEndian(kVersion, sizeof(uint16_t), buffer, &pos);
+  AppendLittleEndian(0, sizeof(uint16_t), buffer, &pos);
+  AppendLittleEndian(GetClockNs(CLOCK_MONOTONIC), sizeof(uint64_t),
+                     buffer, &pos);
+  AppendLittleEndian(GetClockNs(CLOCK_REALTIME), sizeof(uint64_t),
+                     buffer, &pos);
+  AppendLittleEndian(end, sizeof(uint64_t), buffer, &pos);
+
+  bool success = true;
+  uint64_t start = (end > kSlotCount) ? (end - kSlotCount) : 0;
+  for (uint64_t index = start; success && index < end; index++) {
+    const Slot& slot = gSlots[index % kSlotCount];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != 2 * index + 2) {
+      // The slot is being written or has already been reused.
+      continue;
+    }
+
+    uint64_t timestamp_ns = slot.timestamp_ns.load(std::memory_order_relaxed);
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; i++) {
+      words[i] = slot.words[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    uint8_t bytes[sizeof(words)];
+    memcpy(bytes, words, sizeof(words));
+    size_t size = std::min(static_cast<size_t>(bytes[1]), kRecordDataSize);
+    if (pos + kDumpRecordHeaderSize + size > sizeof(buffer)) {
+      success = WriteAll(fd, buffer, pos);
+      pos = 0;
+    }
+
+    AppendLittleEndian(timestamp_ns, sizeof(uint64_t), buffer, &pos);
+    buffer[pos++] = bytes[0];
+    buffer[pos++] = static_cast<uint8_t>(size);
+    memcpy(&buffer[pos], &bytes[2], size);
+    pos += size;
+  }
+
+  return success && WriteAll(fd, buffer, pos);
+}
+
+bool FlightRecorder::ReadDump(const char *path,
+                              std::vector<DumpRecord> *records) {
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  std::vector<uint8_t> contents;
+  uint8_t buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents.insert(contents.end(), buffer, buffer + size);
+  }
+
+  fclose(file);
+  bool success = (contents.size() >= kDumpHeaderSize
+      && ReadLittleEndian(&contents[0], sizeof(uint32_t)) == kMagic
+      && ReadLittleEndian(&contents[4], sizeof(uint16_t)) == kVersion);
+  size_t pos = kDumpHeaderSize;
+  while (success && pos < contents.size()) {
+    success = (contents.size() - pos >= kDumpRecordHeaderSize);
+    if (success) {
+      DumpRecord record;
+      record.timestamp_ns = ReadLittleEndian(&contents[pos],
+                                             sizeof(uint64_t));
+      record.type = static_cast<RecordType>(contents[pos + 8]);
+      size_t data_size = contents[pos + 9];
+      pos += kDumpRecordHeaderSize;
+      success = (contents.size() - pos >= data_size);
+      if (success) {
+        record.data.assign(&contents[pos], &contents[pos] + data_size);
+        records->push_back(std::move(record));
+        pos += data_size;
+      }
+    }
+  }
+
+  return success;
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_FLIGHT_RECORDER_H_
+#define DOGTRICKS_FLIGHT_RECORDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dogtricks {
+
+/**
+ * The process-wide flight recorder. It always records the raw bytes read from
+ * and written to the serial device, the decoded header of each frame and
+ * notes about link failures into a fixed ring of slots in static storage, so
+ * the moments leading up to a failure can be examined after the fact.
+ * Recording is lock-free and takes a handful of relaxed atomic stores per
+ * slot. Readers skip slots that are being rewritten.
+ *
+ * The dump format is little-endian. A file header is followed by the
+ * retained records, oldest first:
+ *
+ *   u32 magic 'DGFR', u16 version, u16 reserved,
+ *   u64 monotonic clock at the dump in ns, u64 realtime clock at the dump in
+ *   ns, u64 records written since start.
+ *
+ *   Each record: u64 monotonic timestamp in ns, u8 RecordType, u8 size,
+ *   followed by size bytes of data.
+ *
+ * Chunks of bytes longer than one slot are split across consecutive records
+ * with the same timestamp. `dogtricks_emulator --replay` plays the RxBytes
+ * records of a dump back to a host.
+ */
+class FlightRecorder {
+ public:
+  //! The magic at the start of a dump, 'DGFR' in little-endian.
+  static constexpr uint32_t kMagic = 0x52464744;
+
+  //! The version of the dump format.
+  static constexpr uint16_t kVersion = 1;
+
+  //! The number of records retained. Older records are overwritten.
+  static constexpr size_t kSlotCount = 4096;
+
+  //! The largest number of bytes of data in one record.
+  static constexpr size_t kRecordDataSize = 46;
+
+  /**
+   * The types of records.
+   */
+  enum class RecordType : uint8_t {
+    //! Raw bytes read from the device.
+    RxBytes = 1,
+
+    //! Raw bytes written to the device.
+    TxBytes = 2,
+
+    //! The FrameHeader of a frame received from the device.
+    RxFrame = 3,
+
+    //! The FrameHeader of a frame queued to be written to the device.
+    TxFrame = 4,
+
+    //! A text note, such as the reason for a failure.
+    Note = 5,
+  };
+
+  /**
+   * The decoded header of a frame, recorded for RxFrame and TxFrame.
+   */
+  struct FrameHeader {
+    //! The sequence number of the frame.
+    uint8_t sequence_number;
+
+    //! The type of the frame, a message or an ack.
+    uint8_t frame_type;
+
+    //! The length of the payload.
+    uint8_t length;
+
+    //! The big-endian op code of a message frame, zero otherwise.
+    uint8_t op_code[2];
+
+    //! Set to one if the checksum of the frame is valid.
+    uint8_t checksum_valid;
+  };
+
+  /**
+   * A record read back from a dump.
+   */
+  struct DumpRecord {
+    //! The monotonic clock when the record was written, in nanoseconds.
+    uint64_t timestamp_ns;
+
+    //! The type of the record.
+    RecordType type;
+
+    //! The data of the record.
+    std::vector<uint8_t> data;
+  };
+
+  /**
+   * Records a chunk of data, split across as many records as needed. This is
+   * safe to call from any thread.
+   *
+   * @param type The type of the record.
+   * @param data The data to record.
+   * @param size The size of the data.
+   */
+  static void Record(RecordType type, const void *data, size_t size);
+
+  /**
+   * Records a formatted note, truncated to one record.
+   */
+  static void RecordNote(const char *format, ...)
+      __attribute__((format(printf, 1, 2)));
+
+  /**
+   * @return the number of records written since the process started.
+   */
+  static uint64_t GetRecordCount();
+
+  /**
+   * Sets the path written by the signal handlers. The path is copied.
+   *
+   * @return false if the path is too long.
+   */
+  static bool SetDumpPath(const char *path);
+
+  /**
+   * Installs handlers that write a dump to the dump path when the process
+   * aborts or crashes, and whenever the supplied signal is raised. The
+   * default action of a fatal signal is taken after the dump is written.
+   *
+   * @param dump_signal The signal that requests a dump, such as SIGUSR2.
+   * @return true if successful, false otherwise.
+   */
+  static bool InstallSignalHandlers(int dump_signal);
+
+  /**
+   * Writes the retained records to a file, replacing it. This is
+   * async-signal-safe.
+   *
+   * @param path The path of the file to write.
+   * @return true if successful, false otherwise.
+   */
+  static bool Dump(const char *path);
+
+  /**
+   * Writes the retained records to a file descriptor. This is
+   * async-signal-safe.
+   *
+   * @param fd The file descriptor to write to.
+   * @return true if successful, false otherwise.
+   */
+  static bool Dump(int fd);
+
+  /**
+   * Reads the records of a dump.
+   *
+   * @param path The path of the dump to read.
+   * @param records Populated with the records, oldest first.
+   * @return true if successful, false if the file is missing or malformed.
+   */
+  static bool ReadDump(const char *path, std::vector<DumpRecord> *records);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_FLIGHT_RECORDER_H_
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <tclap/CmdLine.h>
+#include <thread>
+#include <unistd.h>
+
+#include "emulator.h"
+#include "log.h"
+#include "now_playing_table.h"
+#include "radio.h"
+
+using dogtricks::Emulator;
+using dogtricks::NowPlaying;
+using dogtricks::NowPlayingTable;
+using dogtricks::Radio;
+using dogtricks::Transport;
+
+//! A description of the program.
+constexpr char kDescription[] =
+    "Checks that the radio core does not use the heap after init.";
+
+//! The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+//! Set once the radio is initialized. Any heap use after this aborts.
+std::atomic<bool> gHeapForbidden(false);
+
+//! The number of allocations made.
+std::atomic<uint64_t> gAllocationCount(0);
+
+//! The number of bytes allocated.
+std::atomic<uint64_t> gAllocationBytes(0);
+
+//! Set on threads that are not part of the radio core, such as the emulator.
+thread_local bool tHeapExempt = false;
+
+/**
+ * Aborts if the heap is used by the radio core after init.
+ *
+ * @param operation The heap operation being performed.
+ */
+void CheckHeapUse(const char *operation) {
+  if (gHeapForbidden.load(std::memory_order_relaxed) && !tHeapExempt) {
+    // Avoid stdio here as it may itself allocate.
+    static const char kPrefix[] = "Heap check failed: ";
+    ssize_t result = write(STDERR_FILENO, kPrefix, sizeof(kPrefix) - 1);
+    result = write(STDERR_FILENO, operation, strlen(operation));
+    result = write(STDERR_FILENO, " after init\n", 12);
+    (void)result;
+    abort();
+  }
+}
+
+void *operator new(size_t size) {
+  CheckHeapUse("allocation");
+  gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+  gAllocationBytes.fetch_add(size, std::memory_order_relaxed);
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  CheckHeapUse("allocation");
+  gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+  gAllocationBytes.fetch_add(size, std::memory_order_relaxed);
+  size_t align = static_cast<size_t>(alignment);
+  void *ptr = aligned_alloc(align, (size + align - 1) / align * align);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr != nullptr) {
+    CheckHeapUse("free");
+  }
+
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept {
+  if (ptr != nullptr) {
+    CheckHeapUse("free");
+  }
+
+  free(ptr);
+}
+
+/**
+ * Counts events without retaining them.
+ */
+class HeapCheckEventHandler : public Radio::EventHandler {
+ public:
+  virtual void OnMetadataChange(uint8_t channel_id,
+                                const Radio::Metadata& event) override {
+    metadata_count_++;
+  }
+
+  virtual void OnSignalStrengthChange(
+      Radio::SignalStrength summary, Radio::SignalStrength satellite,
+      Radio::SignalStrength terrestrial) override {
+    signal_count_++;
+  }
+
+  virtual void OnTunedChannelChange(uint8_t channel_id) override {
+    channel_count_++;
+  }
+
+  //! The number of metadata changes received.
+  std::atomic<uint64_t> metadata_count_ = 0;
+
+  //! The number of signal strength changes received.
+  std::atomic<uint64_t> signal_count_ = 0;
+
+  //! The number of tuned channel changes received.
+  std::atomic<uint64_t> channel_count_ = 0;
+};
+
+int main(int argc, char **argv) {
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<int> duration_ms_arg("", "duration_ms",
+      "how long to receive events for after exercising each command",
+      false /* req */, 2000, "milliseconds", cmd);
+  TCLAP::ValueArg<int> metadata_rate_arg("", "metadata_rate",
+      "the number of metadata changes pushed per second",
+      false /* req */, 500, "rate", cmd);
+  TCLAP::ValueArg<int> lineup_size_arg("", "lineup_size",
+      "the number of channels in the emulated lineup",
+      false /* req */, 100, "channels", cmd);
+  TCLAP::ValueArg<int> metadata_parts_arg("", "metadata_parts",
+      "the number of puts that each metadata change is split across",
+      false /* req */, 3, "count", cmd);
+  TCLAP::ValueArg<int> coalesce_arg("", "coalesce_metadata_ms",
+      "the window to coalesce the metadata puts for a channel within",
+      false /* req */, 10, "milliseconds", cmd);
+  cmd.parse(argc, argv);
+
+  Emulator::Config config;
+  config.lineup_size = lineup_size_arg.getValue();
+  config.metadata_rate = metadata_rate_arg.getValue();
+  config.metadata_parts = std::max(1, metadata_parts_arg.getValue());
+  Emulator emulator(config);
+  if (!emulator.Open()) {
+    LOGE("Failed to open emulator");
+    return -1;
+  }
+
+  std::thread emulator_thread([&emulator]() {
+    tHeapExempt = true;
+    emulator.Start();
+  });
+
+  HeapCheckEventHandler event_handler;
+  Radio radio(emulator.GetPath(), &event_handler);
+  if (coalesce_arg.getValue() > 0) {
+    radio.SetMetadataCoalescing(
+        std::chrono::milliseconds(coalesce_arg.getValue()));
+  }
+
+  std::thread receive_thread([&radio]() {
+    if (!radio.Start()) {
+      LOGE("Failed to start receive loop for radio");
+    }
+  });
+
+  // The first command completing ensures that the receive and restore
+  // threads have been started, which ends init.
+  bool success = radio.IsOpen()
+      && radio.SetPowerMode(Radio::PowerState::FullMode);
+  uint64_t init_count = gAllocationCount;
+  uint64_t init_bytes = gAllocationBytes;
+  gHeapForbidden = true;
+
+  uint64_t commands = 1;
+  Radio::SignalStrength summary;
+  Radio::SignalStrength satellite;
+  Radio::SignalStrength terrestrial;
+  success = success
+      && radio.GetSignalStrength(&summary, &satellite, &terrestrial);
+  commands++;
+
+  Radio::ChannelList channels;
+  success = success && radio.GetChannelList(&channels);
+  commands++;
+  for (uint8_t channel : channels) {
+    Radio::ChannelDescriptor descriptor;
+    success = success && radio.GetChannelDescriptor(channel, &descriptor);
+    commands++;
+  }
+
+  if (success && !channels.empty()) {
+    success = radio.SetChannel(channels[0]);
+    commands++;
+  }
+
+  success = success
+      && radio.SetGlobalMetadataMonitoringEnabled(true)
+      && radio.SetMonitoringEnabled(Radio::MonitorFeature::SignalStrength, true)
+      && radio.SetMonitoringEnabled(Radio::MonitorFeature::TunedChannel, true);
+  commands += 3;
+
+  // Poll the now playing table while events arrive, as a dashboard would.
+  uint64_t now_playing_reads = 0;
+  auto deadline = std::chrono::steady_clock::now()
+      + std::chrono::milliseconds(duration_ms_arg.getValue());
+  while (success && std::chrono::steady_clock::now() < deadline) {
+    NowPlaying entry;
+    for (size_t i = 0; i < NowPlayingTable::kMaxChannels; i++) {
+      radio.GetNowPlayingTable().Get(static_cast<uint8_t>(i), &entry);
+      now_playing_reads++;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  success = success
+      && radio.SetGlobalMetadataMonitoringEnabled(false)
+      && radio.SetPowerMode(Radio::PowerState::SleepMode);
+  commands += 2;
+
+  // Stopping frees the state of the receive and restore threads, which is
+  // teardown rather than steady state.
+  gHeapForbidden = false;
+  radio.Stop();
+  receive_thread.join();
+  emulator.Stop();
+  emulator_thread.join();
+
+  LOGI("Heap check: %s", success ? "passed" : "failed");
+  LOGI("  init allocations: %" PRIu64 " (%" PRIu64 " bytes)",
+       init_count, init_bytes);
+  LOGI("  commands: %" PRIu64, commands);
+  LOGI("  metadata events: %" PRIu64, event_handler.metadata_count_.load());
+  LOGI("  metadata puts coalesced: %" PRIu64,
+       radio.GetCoalescingStats().packets);
+  LOGI("  signal events: %" PRIu64, event_handler.signal_count_.load());
+  LOGI("  channel events: %" PRIu64, event_handler.channel_count_.load());
+  LOGI("  now playing reads: %" PRIu64, now_playing_reads);
+  LOGI("Static footprint:");
+  LOGI("  Radio: %zu bytes", sizeof(Radio));
+  LOGI("  Transport: %zu bytes (included in Radio)", sizeof(Transport));
+  LOGI("  now playing slots: %zu bytes (allocated at init)",
+       NowPlayingTable::GetStorageSize());
+  LOGI("  Radio::Metadata: %zu bytes", sizeof(Radio::Metadata));
+  LOGI("  Radio::ChannelDescriptor: %zu bytes",
+       sizeof(Radio::ChannelDescriptor));
+  LOGI("  Radio::ChannelList: %zu bytes", sizeof(Radio::ChannelList));
+  return (success ? 0 : -1);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_histogram.h"
+
+namespace dogtricks {
+
+void LatencyHistogram::Record(std::chrono::nanoseconds latency) {
+  uint64_t value = (latency.count() < 0) ? 0 : latency.count();
+  counts_[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t max = max_ns_.load(std::memory_order_relaxed);
+  while (value > max && !max_ns_.compare_exchange_weak(
+      max, value, std::memory_order_relaxed)) {}
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetPercentile(
+    double fraction) const {
+  uint64_t count = GetCount();
+  if (count == 0) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  // The rank of the percentile, counting from one.
+  uint64_t rank = static_cast<uint64_t>(fraction * count + 0.5);
+  rank = (rank < 1) ? 1 : (rank > count) ? count : rank;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBucketCount; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // The bucket bound may exceed the largest value actually recorded.
+      uint64_t bound = GetBucketUpperBound(i);
+      uint64_t max = max_ns_.load(std::memory_order_relaxed);
+      return std::chrono::nanoseconds((bound < max) ? bound : max);
+    }
+  }
+
+  return GetMax();
+}
+
+void LatencyHistogram::Reset() {
+  for (size_t i = 0; i < kBucketCount; i++) {
+    counts_[i].store(0, std::memory_order_relaxed);
+  }
+
+  count_.store(0, std::memory_order_relaxed);
+  max_ns_.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::GetBucket(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - kSubBucketBits;
+  size_t sub_bucket = (value >> shift) & (kSubBuckets - 1);
+  return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(size_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+
+  int shift = static_cast<int>(bucket / kSubBuckets) - 1;
+  uint64_t sub_bucket = bucket % kSubBuckets;
+  uint64_t lower = (kSubBuckets + sub_bucket) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
+
+}  // namespace dogtricks
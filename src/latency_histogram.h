@@ -0,0 +1,107 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_LATENCY_HISTOGRAM_H_
+#define DOGTRICKS_LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "non_copyable.h"
+
+namespace dogtricks {
+
+/**
+ * A histogram of latencies with log-linear buckets, giving percentiles within
+ * 12.5% of the recorded values from nanoseconds to hours. Recording is a few
+ * relaxed atomic increments and may happen concurrently with reading.
+ */
+class LatencyHistogram : public NonCopyable {
+ public:
+  /**
+   * Setup an empty histogram.
+   */
+  LatencyHistogram() { Reset(); }
+
+  /**
+   * Records a latency. Negative latencies are recorded as zero.
+   */
+  void Record(std::chrono::nanoseconds latency);
+
+  /**
+   * @return the number of latencies recorded.
+   */
+  uint64_t GetCount() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @return the largest latency recorded.
+   */
+  std::chrono::nanoseconds GetMax() const {
+    return std::chrono::nanoseconds(max_ns_.load(std::memory_order_relaxed));
+  }
+
+  /**
+   * Obtains an upper bound for a percentile of the recorded latencies.
+   *
+   * @param fraction The percentile as a fraction between 0 and 1.
+   * @return the upper bound of the bucket containing the percentile, or zero
+   *         if nothing has been recorded.
+   */
+  std::chrono::nanoseconds GetPercentile(double fraction) const;
+
+  /**
+   * Discards all recorded latencies.
+   */
+  void Reset();
+
+ private:
+  //! The number of bits of precision below the most significant bit.
+  static constexpr int kSubBucketBits = 3;
+
+  //! The number of buckets for each power of two.
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+
+  //! The total number of buckets needed for 64-bit values.
+  static constexpr size_t kBucketCount =
+      (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  //! The number of latencies in each bucket.
+  std::atomic<uint64_t> counts_[kBucketCount];
+
+  //! The number of latencies recorded.
+  std::atomic<uint64_t> count_;
+
+  //! The largest latency recorded in nanoseconds.
+  std::atomic<uint64_t> max_ns_;
+
+  /**
+   * @return the bucket for a value.
+   */
+  static size_t GetBucket(uint64_t value);
+
+  /**
+   * @return the largest value in a bucket.
+   */
+  static uint64_t GetBucketUpperBound(size_t bucket);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_LATENCY_HISTOGRAM_H_
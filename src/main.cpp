@@ -14,17 +14,45 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cinttypes>
 #include <cstdio>
 #include <csignal>
+#include <memory>
+#include <pthread.h>
 #include <string>
 #include <tclap/CmdLine.h>
 #include <thread>
+#include <unistd.h>
 
+#include "alloc_tracker.h"
+#include "channel_table.h"
+#include "event_ring.h"
+#include "flight_recorder.h"
 #include "log.h"
+#include "metadata_analytics.h"
+#include "output_writer.h"
 #include "radio.h"
+#include "realtime.h"
+#include "script_runner.h"
+#include "state_file.h"
+#include "trace.h"
 
+using dogtricks::AllocTracker;
+using dogtricks::AnalyticsServer;
+using dogtricks::ChannelTable;
+using dogtricks::EventRingPublisher;
+using dogtricks::EventRingWriter;
+using dogtricks::FlightRecorder;
+using dogtricks::MetadataAnalytics;
+using dogtricks::OutputWriter;
 using dogtricks::Radio;
+using dogtricks::Realtime;
+using dogtricks::ScriptRunner;
+using dogtricks::StateFile;
+using dogtricks::Trace;
+using dogtricks::Transport;
 
 //! A description of the program.
 constexpr char kDescription[] = "A tool for making satellite radio dogs do tricks.";
@@ -32,6 +60,9 @@ constexpr char kDescription[] = "A tool for making satellite radio dogs do trick
 //! The version of the program.
 constexpr char kVersion[] = "0.0.1";
 
+//! The time for which prefetched channel descriptors are cached.
+constexpr std::chrono::milliseconds kPrefetchTtl(30000);
+
 //! The radio instance that will be stopped when SIGINT is raised.
 Radio *gRadioInstance = nullptr;
 
@@ -46,66 +77,150 @@ void SignalHandler(int signal) {
 }
 
 /**
- * Logs the supplied event with a two-space indent.
+ * Starts a thread that writes the trace to the supplied path each time
+ * SIGUSR1 is raised. This must be called before other threads are started so
+ * that they inherit the blocked signal mask.
  *
- * @param event The event to log.
+ * @param path The path to write the trace to.
  */
-void LogMetadata(const Radio::Metadata& event) {
-  if (event.artist.has_value()) {
-    LOGD("  artist: %s", event.artist.value().c_str());
-  }
+void StartTraceSignalThread(const std::string& path) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
-  if (event.title.has_value()) {
-    LOGD("  title: %s", event.title.value().c_str());
-  }
+  std::thread trace_thread([path, signals]() {
+    int signal;
+    while (sigwait(&signals, &signal) == 0) {
+      Trace::WriteJson(path.c_str());
+    }
+  });
+  trace_thread.detach();
+}
 
-  if (event.album.has_value()) {
-    LOGD("  album: %s", event.album.value().c_str());
+/**
+ * Logs the channels of the supplied table grouped by category.
+ *
+ * @param table The table to log.
+ */
+void LogCategories(const ChannelTable& table) {
+  for (uint8_t category_id : table.GetCategories()) {
+    std::string_view name = table.GetLongCategoryName(category_id);
+    LOGI("Category %" PRIu8 ": %.*s", category_id,
+         static_cast<int>(name.size()), name.data());
+    for (uint8_t channel_id : table.GetCategoryChannels(category_id)) {
+      name = table.GetLongName(channel_id);
+      LOGI("  %" PRIu8 ": %.*s", channel_id,
+           static_cast<int>(name.size()), name.data());
+    }
   }
+}
 
-  if (event.record_label.has_value()) {
-    LOGD("  record label: %s", event.record_label.value().c_str());
-  }
+/**
+ * Logs the metrics collected by the radio and its transport.
+ *
+ * @param radio The radio to log metrics for.
+ * @param event_ring The event ring to log metrics for, or nullptr.
+ * @param analytics The metadata statistics to log, or nullptr.
+ */
+void LogStats(const Radio& radio, const EventRingWriter *event_ring,
+              const MetadataAnalytics *analytics) {
+  auto tx_stats = radio.GetTransport().GetTxQueueStats();
+  LOGI("Transmit queue:");
+  LOGI("  depth: %zu", tx_stats.depth);
+  LOGI("  peak depth: %zu", tx_stats.peak_depth);
+  LOGI("  frames queued: %" PRIu64, tx_stats.frames_queued);
+  LOGI("  frames written: %" PRIu64, tx_stats.frames_written);
+  LOGI("  write calls: %" PRIu64, tx_stats.write_calls);
+  LOGI("  would block: %" PRIu64, tx_stats.would_block_count);
+  LOGI("  dropped acks: %" PRIu64, tx_stats.dropped_acks);
 
-  if (event.composer.has_value()) {
-    LOGD("  composer: %s", event.composer.value().c_str());
-  }
+  auto link_stats = radio.GetTransport().GetLinkStats();
+  LOGI("Link:");
+  LOGI("  connected: %s", link_stats.connected ? "yes" : "no");
+  LOGI("  disconnects: %" PRIu64, link_stats.disconnects);
+  LOGI("  reconnects: %" PRIu64, link_stats.reconnects);
+  LOGI("  last reconnect: %" PRId64 " ms",
+       static_cast<int64_t>(link_stats.last_reconnect_duration.count()));
+  LOGI("  total downtime: %" PRId64 " ms",
+       static_cast<int64_t>(link_stats.total_downtime.count()));
+  LOGI("  last restore: %" PRId64 " ms",
+       static_cast<int64_t>(radio.GetLastRestoreDuration().count()));
+  LOGI("  duplicate frames: %" PRIu64, link_stats.duplicate_frames);
 
-  if (event.alt_artist.has_value()) {
-    LOGD("  alt artist: %s", event.alt_artist.value().c_str());
-  }
+  auto query_stats = radio.GetQueryStats();
+  LOGI("Queries:");
+  LOGI("  wire requests: %" PRIu64, query_stats.wire_requests);
+  LOGI("  coalesced: %" PRIu64, query_stats.coalesced);
+  LOGI("  cache hits: %" PRIu64, query_stats.cache_hits);
+  LOGI("  prefetches: %" PRIu64, query_stats.prefetches);
+  LOGI("  prefetch hits: %" PRIu64, query_stats.prefetch_hits);
 
-  if (event.comments.has_value()) {
-    LOGD("  comments: %s", event.comments.value().c_str());
-  }
+  auto coalescing_stats = radio.GetCoalescingStats();
+  LOGI("Metadata coalescing:");
+  LOGI("  puts: %" PRIu64, coalescing_stats.packets);
+  LOGI("  events: %" PRIu64, coalescing_stats.events);
+  LOGI("  merge ratio: %.2f", coalescing_stats.events > 0 ?
+      static_cast<double>(coalescing_stats.packets) / coalescing_stats.events
+      : 0.0);
+  LOGI("  early flushes: %" PRIu64, coalescing_stats.early_flushes);
+
+  const auto& tune_latency = radio.GetTuneLatency();
+  LOGI("Tune latency:");
+  LOGI("  tunes: %" PRIu64, tune_latency.GetCount());
+  LOGI("  p50: %" PRId64 " ms", static_cast<int64_t>(
+      tune_latency.GetPercentile(0.5).count() / 1000000));
+  LOGI("  p99: %" PRId64 " ms", static_cast<int64_t>(
+      tune_latency.GetPercentile(0.99).count() / 1000000));
+  LOGI("  max: %" PRId64 " ms", static_cast<int64_t>(
+      tune_latency.GetMax().count() / 1000000));
 
-  for (size_t i = 0; i < event.promo_text.size(); i++) {
-    LOGD("  promo %zu: %s", i, event.promo_text[i].c_str());
+  const auto& latency = radio.GetTransport().GetDispatchLatency();
+  LOGI("Dispatch latency:");
+  LOGI("  frames: %" PRIu64, latency.GetCount());
+  LOGI("  p50: %" PRId64 " us", static_cast<int64_t>(
+      latency.GetPercentile(0.5).count() / 1000));
+  LOGI("  p99: %" PRId64 " us", static_cast<int64_t>(
+      latency.GetPercentile(0.99).count() / 1000));
+  LOGI("  p99.9: %" PRId64 " us", static_cast<int64_t>(
+      latency.GetPercentile(0.999).count() / 1000));
+  LOGI("  max: %" PRId64 " us", static_cast<int64_t>(
+      latency.GetMax().count() / 1000));
+
+  if (AllocTracker::kCompiledIn) {
+    uint64_t frames = std::max<uint64_t>(latency.GetCount(), 1);
+    LOGI("Allocations:");
+    LOGI("  live: %" PRId64 " bytes", AllocTracker::GetLiveBytes());
+    LOGI("  peak live: %" PRId64 " bytes", AllocTracker::GetPeakLiveBytes());
+    for (size_t i = 0; i < AllocTracker::kScopeCount; i++) {
+      auto scope = static_cast<AllocTracker::Scope>(i);
+      auto stats = AllocTracker::GetStats(scope);
+      LOGI("  %s: %" PRIu64 " allocs, %" PRIu64 " bytes, %.2f allocs/frame, "
+           "%" PRId64 " live, %" PRId64 " peak, %" PRIu64 " over budget",
+           AllocTracker::GetScopeName(scope), stats.allocations, stats.bytes,
+           static_cast<double>(stats.allocations) / frames, stats.live_bytes,
+           stats.peak_live_bytes, stats.budget_overruns);
+    }
   }
-}
 
-/**
- * Logs the supplied channel descriptor.
- *
- * @param desc The descriptor to log.
- */
-void LogChannelDescriptor(const Radio::ChannelDescriptor& desc) {
-  LOGI("Channel %" PRId8 ":", desc.channel_id);
-  LOGI("  category id: %" PRId8 ":", desc.category_id);
-  LOGI("  short name: %s", desc.short_name.c_str());
-  LOGI("  long name: %s", desc.long_name.c_str());
-  LOGI("  short category name: %s", desc.short_category_name.c_str());
-  LOGI("  long category name: %s", desc.long_category_name.c_str());
-  LogMetadata(desc.metadata);
-}
+  if (event_ring != nullptr) {
+    auto ring_stats = event_ring->GetStats();
+    LOGI("Event ring:");
+    LOGI("  published: %" PRIu64, ring_stats.published);
+    LOGI("  oversized: %" PRIu64, ring_stats.oversized);
+  }
 
-void LogSignalStrength(Radio::SignalStrength summary,
-                       Radio::SignalStrength satellite,
-                       Radio::SignalStrength terrestrial) {
-  LOGI("Signal strength:");
-  LOGI("  summary: %s", Radio::GetSignalDescription(summary));
-  LOGI("  satellite: %s", Radio::GetSignalDescription(satellite));
-  LOGI("  terrestrial: %s", Radio::GetSignalDescription(terrestrial));
+  if (analytics != nullptr) {
+    LOGI("Analytics:");
+    LOGI("  plays: %" PRIu64, analytics->GetPlayCount());
+    LOGI("  distinct songs: %" PRIu64, analytics->GetDistinctSongCount());
+    auto pool_stats = analytics->GetStringPoolStats();
+    LOGI("  retained strings: %zu (%zu bytes)", pool_stats.strings,
+         pool_stats.bytes);
+    LOGI("  retained string hits: %" PRIu64 "/%" PRIu64 " (%" PRIu64
+         " bytes saved)", pool_stats.hits, pool_stats.lookups,
+         pool_stats.bytes_saved);
+  }
 }
 
 /**
@@ -113,38 +228,266 @@ void LogSignalStrength(Radio::SignalStrength summary,
  */
 class RadioEventHandler : public Radio::EventHandler {
  public:
+  /**
+   * Setup the event handler to write events to the supplied writers.
+   *
+   * @param writer The writer for the selected output format.
+   * @param publisher The writer for the event ring, or nullptr.
+   * @param analytics The statistics to update with metadata, or nullptr.
+   */
+  RadioEventHandler(OutputWriter *writer, OutputWriter *publisher,
+                    MetadataAnalytics *analytics)
+      : writer_(writer), publisher_(publisher), analytics_(analytics) {}
+
   virtual void OnMetadataChange(uint8_t channel_id,
                                 const Radio::Metadata& event) override {
-    LOGD("Metadata changed:");
-    LOGD("  channel_id: %" PRId8, channel_id);
-    LogMetadata(event);
+    writer_->WriteMetadata(channel_id, event);
+    if (publisher_ != nullptr) {
+      publisher_->WriteMetadata(channel_id, event);
+    }
+
+    if (analytics_ != nullptr) {
+      analytics_->AddMetadata(channel_id, event);
+    }
+  }
+
+  virtual void OnSignalStrengthChange(
+      Radio::SignalStrength summary, Radio::SignalStrength satellite,
+      Radio::SignalStrength terrestrial) override {
+    writer_->WriteSignalStrength(summary, satellite, terrestrial);
+    if (publisher_ != nullptr) {
+      publisher_->WriteSignalStrength(summary, satellite, terrestrial);
+    }
   }
+
+  virtual void OnTunedChannelChange(uint8_t channel_id) override {
+    writer_->WriteTunedChannel(channel_id);
+    if (publisher_ != nullptr) {
+      publisher_->WriteTunedChannel(channel_id);
+    }
+  }
+
+ private:
+  //! The writer to write events to.
+  OutputWriter *writer_;
+
+  //! The writer to publish events to the event ring, or nullptr.
+  OutputWriter *publisher_;
+
+  //! The statistics to update with metadata, or nullptr.
+  MetadataAnalytics *analytics_;
 };
 
 int main(int argc, char **argv) {
+  auto start_time = std::chrono::steady_clock::now();
   TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
   TCLAP::ValueArg<std::string> path_arg("", "path",
       "the path of the serial device to communicate with",
       false /* req */, "/dev/ttyUSB0", "path", cmd);
   TCLAP::SwitchArg reset_arg("", "reset",
       "reset the radio before executing other commands", cmd);
+  TCLAP::ValueArg<std::string> format_arg("", "format",
+      "the format to write channels and events in: text, ndjson or binary",
+      false /* req */, "text", "format", cmd);
+  TCLAP::ValueArg<std::string> event_ring_arg("", "event_ring",
+      "the name of a shared memory ring to publish events to",
+      false /* req */, "/dogtricks", "name", cmd);
+  TCLAP::ValueArg<int> rt_priority_arg("", "rt_priority",
+      "runs the receive thread with this SCHED_FIFO priority",
+      false /* req */, 50, "priority", cmd);
+  TCLAP::ValueArg<int> rt_cpu_arg("", "rt_cpu",
+      "pins the receive thread to this CPU",
+      false /* req */, 0, "cpu", cmd);
+  TCLAP::SwitchArg lock_memory_arg("", "lock_memory",
+      "locks the process into memory and prefaults the receive thread stack",
+      cmd);
+  TCLAP::ValueArg<std::string> trace_file_arg("", "trace_file",
+      "records a trace and writes it to this path on SIGUSR1 and at exit",
+      false /* req */, "", "path", cmd);
+  TCLAP::ValueArg<std::string> flight_recorder_arg("", "flight_recorder",
+      "writes the recent serial traffic to this path on a crash and on SIGUSR2",
+      false /* req */, "", "path", cmd);
+  TCLAP::ValueArg<std::string> analytics_socket_arg("", "analytics_socket",
+      "keeps statistics over the metadata stream and answers queries on this "
+      "Unix socket", false /* req */, "", "path", cmd);
+  TCLAP::ValueArg<std::string> analytics_query_arg("", "analytics_query",
+      "sends a query to the analytics socket of a running instance, prints "
+      "the response and exits", false /* req */, "summary", "query", cmd);
+  TCLAP::SwitchArg log_stats_arg("", "log_stats",
+      "logs link metrics before exiting", cmd);
+  TCLAP::ValueArg<size_t> alloc_budget_arg("", "alloc_budget",
+      "the most heap allocations allowed while receiving and dispatching "
+      "each frame, with overruns counted in the statistics",
+      false /* req */, 0, "allocations", cmd);
+  TCLAP::ValueArg<std::string> state_file_arg("", "state_file",
+      "the path of a file to persist the radio session state in",
+      false /* req */, "", "path", cmd);
+  TCLAP::SwitchArg warm_start_arg("", "warm_start",
+      "only reset or reconfigure the radio when its state requires it", cmd);
+  TCLAP::SwitchArg reconnect_arg("", "reconnect",
+      "reopen the serial device and restore the session if it is lost", cmd);
+  TCLAP::SwitchArg normalize_text_arg("", "normalize_text",
+      "converts text from the radio to clean UTF-8 as it is parsed", cmd);
+  TCLAP::ValueArg<int> prefetch_descriptors_arg("", "prefetch_descriptors",
+      "prefetches the descriptors of this many channels either side of each "
+      "newly tuned channel", false /* req */, 2, "count", cmd);
+  TCLAP::ValueArg<int> query_cache_arg("", "query_cache_ms",
+      "answers repeated signal, lineup and channel queries from a cache for "
+      "this long, or until an event changes them",
+      false /* req */, 0, "milliseconds", cmd);
+  TCLAP::ValueArg<int> coalesce_metadata_arg("", "coalesce_metadata_ms",
+      "merges the metadata changes for a channel that arrive within this "
+      "window into one event", false /* req */, 0, "milliseconds", cmd);
   TCLAP::SwitchArg log_signal_strength_arg("", "log_signal_strength",
       "logs the current signal strength", cmd);
   TCLAP::SwitchArg log_global_metadata_arg("", "log_global_metadata",
       "logs all changes in channel metadata", cmd);
+  TCLAP::SwitchArg log_signal_changes_arg("", "log_signal_changes",
+      "logs all changes in signal strength", cmd);
+  TCLAP::SwitchArg log_channel_changes_arg("", "log_channel_changes",
+      "logs all changes in the tuned channel", cmd);
   TCLAP::SwitchArg list_channels_arg("", "list_channels",
       "logs the list of channels available", cmd);
+  TCLAP::SwitchArg list_categories_arg("", "list_categories",
+      "logs the channels available grouped by category", cmd);
   TCLAP::ValueArg<int> get_channel_arg("", "get_channel",
       "gets the channel descriptor and logs it",
       false /* req */, 51 /* unce unce unce */, "channel", cmd);
   TCLAP::ValueArg<int> set_channel_arg("", "set_channel",
       "sets the channel that the radio is decoding",
       false /* req */, 51 /* eurobeat intensifies */, "channel", cmd);
+  TCLAP::ValueArg<std::string> script_arg("", "script",
+      "runs the commands in this file, or - for stdin, in one session",
+      false /* req */, "", "path", cmd);
   cmd.parse(argc, argv);
 
-  RadioEventHandler event_handler;
+  if (analytics_query_arg.isSet()) {
+    std::string response;
+    if (!analytics_socket_arg.isSet()) {
+      LOGE("A query requires --analytics_socket");
+      return -1;
+    } else if (!AnalyticsServer::SendQuery(
+        analytics_socket_arg.getValue().c_str(),
+        analytics_query_arg.getValue(), &response)) {
+      return -1;
+    }
+
+    fwrite(response.data(), 1, response.size(), stdout);
+    return 0;
+  }
+
+  OutputWriter::Format format;
+  if (!OutputWriter::ParseFormat(format_arg.getValue(), &format)) {
+    LOGE("Unknown output format: %s", format_arg.getValue().c_str());
+    return -1;
+  }
+
+  std::unique_ptr<ScriptRunner> script_runner;
+  if (script_arg.isSet()) {
+    script_runner = std::make_unique<ScriptRunner>();
+    if (!script_runner->Load(script_arg.getValue().c_str())) {
+      return -1;
+    }
+  }
+
+  if (trace_file_arg.isSet()) {
+    if (!Trace::kCompiledIn) {
+      LOGE("Tracing is not compiled in, rebuild with DOGTRICKS_ENABLE_TRACE");
+    } else {
+      StartTraceSignalThread(trace_file_arg.getValue());
+      Trace::SetThreadName("main");
+      Trace::SetEnabled(true);
+    }
+  }
+
+  if (alloc_budget_arg.isSet()) {
+    if (!AllocTracker::kCompiledIn) {
+      LOGE("Allocation tracking is not compiled in, rebuild with "
+           "DOGTRICKS_ENABLE_ALLOC_TRACKING");
+    } else {
+      for (auto scope : {AllocTracker::Scope::TransportRx,
+                         AllocTracker::Scope::RadioParse,
+                         AllocTracker::Scope::HandlerDispatch}) {
+        AllocTracker::SetBudget(scope, alloc_budget_arg.getValue());
+      }
+    }
+  }
+
+  if (flight_recorder_arg.isSet()) {
+    if (!FlightRecorder::SetDumpPath(flight_recorder_arg.getValue().c_str())
+        || !FlightRecorder::InstallSignalHandlers(SIGUSR2)) {
+      LOGE("Failed to configure the flight recorder");
+      return -1;
+    }
+  }
+
+  std::unique_ptr<OutputWriter> writer =
+      OutputWriter::Create(format, STDOUT_FILENO);
+  std::unique_ptr<EventRingWriter> event_ring;
+  std::unique_ptr<OutputWriter> publisher;
+  if (event_ring_arg.isSet()) {
+    event_ring = std::make_unique<EventRingWriter>(
+        event_ring_arg.getValue().c_str());
+    if (!event_ring->Open()) {
+      return -1;
+    }
+
+    publisher = std::make_unique<EventRingPublisher>(event_ring.get());
+  }
+
+  std::unique_ptr<MetadataAnalytics> analytics;
+  std::unique_ptr<AnalyticsServer> analytics_server;
+  if (analytics_socket_arg.isSet()) {
+    analytics = std::make_unique<MetadataAnalytics>();
+    analytics_server = std::make_unique<AnalyticsServer>(
+        analytics.get(), analytics_socket_arg.getValue().c_str());
+    if (!analytics_server->Start()) {
+      return -1;
+    }
+  }
+
+  RadioEventHandler event_handler(writer.get(), publisher.get(),
+                                  analytics.get());
   Radio radio(path_arg.getValue().c_str(), &event_handler);
-  std::thread receive_thread([&radio](){
+  radio.SetReconnectEnabled(reconnect_arg.isSet());
+  radio.SetTextNormalizationEnabled(normalize_text_arg.isSet());
+  if (query_cache_arg.getValue() > 0) {
+    for (auto op_code : {Transport::OpCode::GetSignalRequest,
+                         Transport::OpCode::GetChannelListRequest,
+                         Transport::OpCode::GetChannelRequest}) {
+      radio.SetCacheTtl(op_code,
+                        std::chrono::milliseconds(query_cache_arg.getValue()));
+    }
+  }
+
+  if (prefetch_descriptors_arg.isSet()) {
+    radio.SetDescriptorPrefetch(prefetch_descriptors_arg.getValue(),
+                                kPrefetchTtl);
+  }
+
+  if (coalesce_metadata_arg.getValue() > 0) {
+    radio.SetMetadataCoalescing(
+        std::chrono::milliseconds(coalesce_metadata_arg.getValue()));
+  }
+
+  if (lock_memory_arg.isSet()) {
+    Realtime::LockMemory();
+  }
+
+  std::thread receive_thread([&](){
+    // Each of these logs and carries on without if it is not permitted.
+    if (rt_cpu_arg.isSet()) {
+      Realtime::SetCpuAffinity(rt_cpu_arg.getValue());
+    }
+
+    if (rt_priority_arg.isSet()) {
+      Realtime::SetFifoPriority(rt_priority_arg.getValue());
+    }
+
+    if (lock_memory_arg.isSet()) {
+      Realtime::PrefaultStack();
+    }
+
     if (!radio.Start()) {
       LOGE("Failed to start receive loop for radio");
     }
@@ -153,14 +496,59 @@ int main(int argc, char **argv) {
   gRadioInstance = &radio;
   std::signal(SIGINT, SignalHandler);
 
-  bool quit = true;  // Set to true when the program should quit.
+  std::unique_ptr<StateFile> state_file;
+  if (state_file_arg.isSet()) {
+    state_file = std::make_unique<StateFile>(state_file_arg.getValue().c_str());
+  }
+
+  uint8_t monitor_mask = 0;
+  if (log_global_metadata_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::GlobalMetadata);
+  }
+
+  if (log_signal_changes_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::SignalStrength);
+  }
+
+  if (log_channel_changes_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::TunedChannel);
+  }
+
+  // Set to true when the program should quit.
+  bool quit = (monitor_mask == 0);
   bool success = radio.IsOpen();
-  if (success && reset_arg.isSet()) {
-    success &= radio.Reset();
+  bool warm_start = warm_start_arg.isSet();
+  if (success && warm_start) {
+    Radio::SessionState last_known;
+    if (state_file != nullptr) {
+      state_file->Load(&last_known);
+    }
+
+    success &= radio.WarmStart(last_known, reset_arg.isSet());
+
+    Radio::SessionState desired = radio.GetSessionState();
+    desired.power_state = Radio::PowerState::FullMode;
+    desired.monitor_mask = monitor_mask;
+    if (set_channel_arg.isSet()) {
+      desired.channel_id = set_channel_arg.getValue();
+    }
+
+    if (success) {
+      success &= radio.ApplySessionState(desired);
+    }
+  } else {
+    if (success && reset_arg.isSet()) {
+      success &= radio.Reset();
+    }
+
+    // Ensure that the radio is in full power mode.
+    radio.SetPowerMode(Radio::PowerState::FullMode);
   }
 
-  // Ensure that the radio is in full power mode.
-  radio.SetPowerMode(Radio::PowerState::FullMode);
+  auto startup_duration = std::chrono::steady_clock::now() - start_time;
+  LOGD("Time to first command: %" PRId64 " ms", static_cast<int64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          startup_duration).count()));
 
   if (success && log_signal_strength_arg.isSet()) {
     Radio::SignalStrength summary;
@@ -168,44 +556,79 @@ int main(int argc, char **argv) {
     Radio::SignalStrength terrestrial;
     success &= radio.GetSignalStrength(&summary, &satellite, &terrestrial);
     if (success) {
-      LogSignalStrength(summary, satellite, terrestrial);
-    } 
+      writer->WriteSignalStrength(summary, satellite, terrestrial);
+    }
   }
 
   if (success && list_channels_arg.isSet()) {
     Radio::ChannelList channels;
     success &= radio.GetChannelList(&channels);
+    writer->BeginBatch();
     for (uint8_t channel : channels) {
       Radio::ChannelDescriptor desc;
       success &= radio.GetChannelDescriptor(channel, &desc);
       if (success) {
-        LogChannelDescriptor(desc);
+        writer->WriteChannelDescriptor(desc);
       }
     }
+    writer->EndBatch();
   }
 
-  if (success && log_global_metadata_arg.isSet()) {
+  if (success && list_categories_arg.isSet()) {
+    ChannelTable table;
+    success &= table.Load(&radio);
+    if (success) {
+      LogCategories(table);
+    }
+  }
+
+  if (success && !warm_start && log_global_metadata_arg.isSet()) {
     success &= radio.SetGlobalMetadataMonitoringEnabled(true);
-    quit = false;
+  }
+
+  if (success && !warm_start && log_signal_changes_arg.isSet()) {
+    success &= radio.SetMonitoringEnabled(
+        Radio::MonitorFeature::SignalStrength, true);
+  }
+
+  if (success && !warm_start && log_channel_changes_arg.isSet()) {
+    success &= radio.SetMonitoringEnabled(
+        Radio::MonitorFeature::TunedChannel, true);
   }
 
   if (success && get_channel_arg.isSet()) {
     Radio::ChannelDescriptor desc;
     success &= radio.GetChannelDescriptor(get_channel_arg.getValue(), &desc);
     if (success) {
-      LogChannelDescriptor(desc);
+      writer->WriteChannelDescriptor(desc);
     }
   }
 
-  if (success && set_channel_arg.isSet()) {
+  if (success && !warm_start && set_channel_arg.isSet()) {
     success &= radio.SetChannel(set_channel_arg.getValue());
   }
 
+  if (success && script_runner != nullptr) {
+    success &= script_runner->Run(&radio, writer.get());
+  }
+
   if (quit) {
     radio.Stop();
   }
 
   receive_thread.join();
 
+  if (state_file != nullptr && radio.IsOpen()) {
+    state_file->Save(radio.GetSessionState());
+  }
+
+  if (log_stats_arg.isSet()) {
+    LogStats(radio, event_ring.get(), analytics.get());
+  }
+
+  if (Trace::IsEnabled()) {
+    Trace::WriteJson(trace_file_arg.getValue().c_str());
+  }
+
   return (success ? 0 : -1);
 }
@@ -0,0 +1,586 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "metadata_analytics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+
+#include "log.h"
+#include "output_writer.h"
+#include "text_normalizer.h"
+
+namespace dogtricks {
+namespace {
+
+//! The FNV-1a offset basis.
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325;
+
+//! The FNV-1a prime.
+constexpr uint64_t kFnvPrime = 0x100000001b3;
+
+//! Separates the artist from the title in song keys and names.
+constexpr std::string_view kSongSeparator = " - ";
+
+//! The number of nanoseconds in a second.
+constexpr uint64_t kSecondNs = 1000000000;
+
+//! The number of nanoseconds in a minute.
+constexpr uint64_t kMinuteNs = 60 * kSecondNs;
+
+//! The time allowed for a client to send its query.
+constexpr int kRequestTimeoutMs = 1000;
+
+/**
+ * @return the current monotonic time in nanoseconds.
+ */
+uint64_t GetNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Continues an FNV-1a hash over the supplied bytes.
+ */
+uint64_t HashBytes(std::string_view value, uint64_t hash = kFnvOffsetBasis) {
+  for (char c : value) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * kFnvPrime;
+  }
+
+  return hash;
+}
+
+/**
+ * Continues an FNV-1a hash over the case-folded form of a name.
+ */
+uint64_t HashFolded(std::string_view name, uint64_t hash = kFnvOffsetBasis) {
+  char folded[MetadataAnalytics::kMaxNameSize];
+  size_t size = TextNormalizer::FoldCase(name, folded, sizeof(folded));
+  return HashBytes(std::string_view(folded, size), hash);
+}
+
+/**
+ * Finalizes a hash so that every bit depends on every input bit. The
+ * HyperLogLog sketches index by the high bits, which FNV-1a mixes poorly.
+ */
+uint64_t MixHash(uint64_t hash) {
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+/**
+ * Truncates a name to kMaxNameSize bytes without splitting a UTF-8
+ * sequence.
+ */
+std::string_view TruncateName(std::string_view name) {
+  size_t size = name.size();
+  if (size > MetadataAnalytics::kMaxNameSize) {
+    size = MetadataAnalytics::kMaxNameSize;
+    while (size > 0 && (static_cast<uint8_t>(name[size]) & 0xc0) == 0x80) {
+      size--;
+    }
+  }
+
+  return name.substr(0, size);
+}
+
+/**
+ * @return the fraction of plays that repeated an earlier song.
+ */
+double GetRepeatRate(uint64_t plays, uint64_t distinct) {
+  return (plays == 0 || distinct >= plays)
+      ? 0.0 : 1.0 - static_cast<double>(distinct) / plays;
+}
+
+/**
+ * Appends the key of a JSON member, preceded by a comma unless it is the
+ * first member of an object.
+ */
+void AppendKey(const char *key, std::string *output) {
+  if (output->back() != '{') {
+    output->push_back(',');
+  }
+
+  output->push_back('"');
+  output->append(key);
+  output->append("\":");
+}
+
+/**
+ * Appends an integer member.
+ */
+void AppendInteger(const char *key, uint64_t value, std::string *output) {
+  AppendKey(key, output);
+  char digits[24];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  output->append(digits, result.ptr);
+}
+
+/**
+ * Appends a fraction member with three decimal places.
+ */
+void AppendFraction(const char *key, double value, std::string *output) {
+  AppendKey(key, output);
+  char digits[24];
+  snprintf(digits, sizeof(digits), "%.3f", value);
+  output->append(digits);
+}
+
+/**
+ * Appends the retained keys of a heavy hitter sketch as an array of
+ * objects, most frequent first.
+ */
+template <typename Top>
+void AppendTop(const char *key, const Top& top, std::string *output) {
+  typename Top::Entry entries[Top::kCapacity];
+  size_t count = top.GetTop(entries);
+
+  AppendKey(key, output);
+  output->push_back('[');
+  for (size_t i = 0; i < count; i++) {
+    output->append((i == 0) ? "{\"name\":" : ",{\"name\":");
+    NdjsonWriter::AppendString(entries[i].GetName(), output);
+    AppendInteger("count", entries[i].count, output);
+    AppendInteger("error", entries[i].error, output);
+    output->push_back('}');
+  }
+  output->push_back(']');
+}
+
+/**
+ * Appends the metadata now playing on a channel as an object with a member
+ * for each field that is known.
+ */
+void AppendNowPlaying(const InternedMetadata& metadata, std::string *output) {
+  const std::pair<const char *, const StringPool::Handle *> fields[] = {
+    {"artist", &metadata.artist},
+    {"title", &metadata.title},
+    {"album", &metadata.album},
+    {"record_label", &metadata.record_label},
+    {"composer", &metadata.composer},
+    {"alt_artist", &metadata.alt_artist},
+    {"comments", &metadata.comments},
+  };
+
+  AppendKey("now_playing", output);
+  output->push_back('{');
+  for (const auto& field : fields) {
+    if (!field.second->empty()) {
+      AppendKey(field.first, output);
+      NdjsonWriter::AppendString(field.second->Get(), output);
+    }
+  }
+  output->push_back('}');
+}
+
+}  // namespace
+
+MetadataAnalytics::ChannelState::ChannelState()
+    : recent_plays(5 * kMinuteNs) {}
+
+MetadataAnalytics::MetadataAnalytics()
+    : plays_last_minute_(kSecondNs),
+      plays_last_hour_(kMinuteNs),
+      distinct_songs_last_hour_(10 * kMinuteNs) {}
+
+void MetadataAnalytics::AddMetadata(uint8_t channel_id,
+                                    const Radio::Metadata& metadata) {
+  uint64_t now_ns = GetNowNs();
+  std::lock_guard<std::mutex> lock(mutex_);
+  CountSettledPlays(now_ns);
+
+  // A new title ends the song before it, so its play is counted before the
+  // put is applied.
+  ChannelState& channel = channels_[channel_id];
+  if (channel.play_pending && metadata.title.has_value()) {
+    CountPlay(&channel, now_ns);
+  }
+
+  channel.now_playing.Apply(&pool_, metadata);
+  if (metadata.title.has_value()) {
+    uint64_t due_ns = now_ns + std::chrono::duration_cast<
+        std::chrono::nanoseconds>(kPlaySettleTime).count();
+    if (pending_plays_ == 0 || due_ns < next_play_due_ns_) {
+      next_play_due_ns_ = due_ns;
+    }
+
+    channel.play_pending = true;
+    channel.play_due_ns = due_ns;
+    pending_plays_++;
+  }
+}
+
+void MetadataAnalytics::CountSettledPlays(uint64_t now_ns) {
+  if (pending_plays_ == 0 || now_ns < next_play_due_ns_) {
+    return;
+  }
+
+  uint64_t next_due_ns = UINT64_MAX;
+  for (ChannelState& channel : channels_) {
+    if (!channel.play_pending) {
+      continue;
+    }
+
+    if (now_ns >= channel.play_due_ns) {
+      CountPlay(&channel, now_ns);
+    } else {
+      next_due_ns = std::min(next_due_ns, channel.play_due_ns);
+    }
+  }
+
+  next_play_due_ns_ = next_due_ns;
+}
+
+void MetadataAnalytics::CountPlay(ChannelState *channel, uint64_t now_ns) {
+  channel->play_pending = false;
+  pending_plays_--;
+
+  std::string_view artist = TruncateName(channel->now_playing.artist.Get());
+  std::string_view title = TruncateName(channel->now_playing.title.Get());
+  if (title.empty()) {
+    return;
+  }
+
+  // A song is keyed by its artist and title together.
+  uint64_t artist_hash = HashFolded(artist);
+  uint64_t song_hash = MixHash(HashFolded(title,
+      HashBytes(kSongSeparator, artist_hash)));
+  artist_hash = MixHash(artist_hash);
+  if (song_hash == channel->song_hash) {
+    return;
+  }
+
+  channel->song_hash = song_hash;
+
+  char song_buffer[2 * kMaxNameSize + kSongSeparator.size()];
+  size_t song_size = 0;
+  if (!artist.empty()) {
+    memcpy(song_buffer, artist.data(), artist.size());
+    memcpy(&song_buffer[artist.size()], kSongSeparator.data(),
+           kSongSeparator.size());
+    song_size = artist.size() + kSongSeparator.size();
+  }
+
+  memcpy(&song_buffer[song_size], title.data(), title.size());
+  song_size += title.size();
+  std::string_view song_name =
+      TruncateName(std::string_view(song_buffer, song_size));
+
+  channel->plays++;
+  channel->recent_plays.Add(now_ns);
+  channel->distinct_songs.Add(song_hash);
+  channel->top_songs.Add(song_hash, song_name);
+
+  plays_++;
+  plays_last_minute_.Add(now_ns);
+  plays_last_hour_.Add(now_ns);
+  distinct_songs_.Add(song_hash);
+  distinct_songs_last_hour_.Add(now_ns, song_hash);
+  top_songs_.Add(song_hash, song_name);
+
+  if (!artist.empty()) {
+    channel->top_artists.Add(artist_hash, artist);
+    distinct_artists_.Add(artist_hash);
+    artist_plays_.Add(artist_hash);
+    top_artists_.Add(artist_hash, artist);
+  }
+}
+
+bool MetadataAnalytics::Query(std::string_view request,
+                              std::string *response) const {
+  while (!request.empty() && isspace(static_cast<uint8_t>(request.back()))) {
+    request.remove_suffix(1);
+  }
+
+  std::string_view command = request;
+  std::string_view argument;
+  size_t space = request.find(' ');
+  if (space != std::string_view::npos) {
+    command = request.substr(0, space);
+    argument = request.substr(space + 1);
+  }
+
+  uint64_t now_ns = GetNowNs();
+  bool success = true;
+  response->assign("{");
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (command.empty() || command == "summary") {
+      FormatSummary(now_ns, response);
+    } else if (command == "channel") {
+      unsigned int channel_id = 0;
+      auto result = std::from_chars(argument.data(),
+                                    argument.data() + argument.size(),
+                                    channel_id);
+      success = (result.ec == std::errc() && result.ptr == argument.end()
+          && channel_id <= UINT8_MAX);
+      if (success) {
+        FormatChannel(static_cast<uint8_t>(channel_id), now_ns, response);
+      }
+    } else if (command == "artist" && !argument.empty()) {
+      FormatArtist(argument, response);
+    } else {
+      success = false;
+    }
+  }
+
+  if (!success) {
+    response->assign("{\"error\":");
+    NdjsonWriter::AppendString("invalid query", response);
+  }
+
+  response->append("}\n");
+  return success;
+}
+
+uint64_t MetadataAnalytics::GetPlayCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return plays_;
+}
+
+uint64_t MetadataAnalytics::GetDistinctSongCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return distinct_songs_.Estimate();
+}
+
+void MetadataAnalytics::FormatSummary(uint64_t now_ns,
+                                      std::string *response) const {
+  uint64_t plays_last_hour = plays_last_hour_.GetSum(now_ns);
+  uint64_t distinct_last_hour = distinct_songs_last_hour_.Estimate(now_ns);
+  AppendInteger("plays", plays_, response);
+  AppendInteger("plays_last_minute", plays_last_minute_.GetSum(now_ns),
+                response);
+  AppendInteger("plays_last_hour", plays_last_hour, response);
+  AppendInteger("distinct_songs", distinct_songs_.Estimate(), response);
+  AppendInteger("distinct_artists", distinct_artists_.Estimate(), response);
+  AppendInteger("distinct_songs_last_hour", distinct_last_hour, response);
+  AppendFraction("repeat_rate_last_hour",
+                 GetRepeatRate(plays_last_hour, distinct_last_hour), response);
+  AppendTop("top_artists", top_artists_, response);
+  AppendTop("top_songs", top_songs_, response);
+}
+
+void MetadataAnalytics::FormatChannel(uint8_t channel_id, uint64_t now_ns,
+                                      std::string *response) const {
+  const ChannelState& channel = channels_[channel_id];
+  uint64_t distinct_songs = channel.distinct_songs.Estimate();
+  AppendInteger("channel_id", channel_id, response);
+  AppendInteger("plays", channel.plays, response);
+  AppendInteger("plays_last_hour", channel.recent_plays.GetSum(now_ns),
+                response);
+  AppendInteger("distinct_songs", distinct_songs, response);
+  AppendFraction("repeat_rate", GetRepeatRate(channel.plays, distinct_songs),
+                 response);
+  AppendTop("top_artists", channel.top_artists, response);
+  AppendTop("top_songs", channel.top_songs, response);
+  AppendNowPlaying(channel.now_playing, response);
+}
+
+void MetadataAnalytics::FormatArtist(std::string_view name,
+                                     std::string *response) const {
+  AppendKey("artist", response);
+  NdjsonWriter::AppendString(name, response);
+  AppendInteger("plays", artist_plays_.Estimate(
+      MixHash(HashFolded(TruncateName(name)))), response);
+}
+
+AnalyticsServer::AnalyticsServer(const MetadataAnalytics *analytics,
+                                 const char *path)
+    : analytics_(analytics), path_(path) {}
+
+AnalyticsServer::~AnalyticsServer() {
+  Stop();
+}
+
+bool AnalyticsServer::Start() {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  bool success = (path_.size() < sizeof(address.sun_path));
+  if (!success) {
+    LOGE("Analytics socket path is too long: %s", path_.c_str());
+  } else {
+    memcpy(address.sun_path, path_.c_str(), path_.size() + 1);
+
+    // Remove any socket left behind by a server that did not exit cleanly.
+    unlink(path_.c_str());
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    success = (listen_fd_ >= 0
+        && bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&address),
+                sizeof(address)) == 0
+        && listen(listen_fd_, SOMAXCONN) == 0
+        && pipe(wake_fds_) == 0);
+    if (!success) {
+      LOGE("Failed to create analytics socket %s: %s", path_.c_str(),
+           strerror(errno));
+      Stop();
+    } else {
+      fcntl(wake_fds_[0], F_SETFL, O_NONBLOCK);
+      thread_ = std::thread(&AnalyticsServer::Serve, this);
+    }
+  }
+
+  return success;
+}
+
+void AnalyticsServer::Stop() {
+  if (thread_.joinable()) {
+    char value = 1;
+    ssize_t result = write(wake_fds_[1], &value, sizeof(value));
+    (void)result;
+    thread_.join();
+  }
+
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(path_.c_str());
+  }
+
+  for (int& fd : wake_fds_) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+}
+
+bool AnalyticsServer::SendQuery(const char *path, std::string_view request,
+                                std::string *response) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  bool success = (strlen(path) < sizeof(address.sun_path));
+  if (!success) {
+    LOGE("Analytics socket path is too long: %s", path);
+  } else {
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    success = (fd >= 0
+        && connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                   sizeof(address)) == 0);
+    if (success) {
+      std::string line(request);
+      line.push_back('\n');
+      success = (send(fd, line.data(), line.size(), MSG_NOSIGNAL)
+          == static_cast<ssize_t>(line.size()));
+      shutdown(fd, SHUT_WR);
+
+      // The server closes the connection after the response.
+      response->clear();
+      char buffer[4096];
+      ssize_t size;
+      while (success && (size = read(fd, buffer, sizeof(buffer))) != 0) {
+        success = (size > 0 || errno == EINTR);
+        if (size > 0) {
+          response->append(buffer, size);
+        }
+      }
+    }
+
+    if (!success) {
+      LOGE("Failed to query analytics socket %s: %s", path, strerror(errno));
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  return success;
+}
+
+void AnalyticsServer::Serve() {
+  while (true) {
+    struct pollfd fds[2] = {};
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds_[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      LOGE("Failed to poll analytics socket: %s", strerror(errno));
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        HandleConnection(fd);
+        close(fd);
+      }
+    }
+  }
+}
+
+void AnalyticsServer::HandleConnection(int fd) {
+  // The query is read with a timeout so that an idle client does not hold
+  // up others.
+  char request[kMaxRequestSize];
+  size_t size = 0;
+  bool complete = false;
+  while (!complete && size < sizeof(request)) {
+    struct pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, kRequestTimeoutMs) <= 0) {
+      return;
+    }
+
+    ssize_t result = read(fd, &request[size], sizeof(request) - size);
+    if (result < 0 && errno != EINTR) {
+      return;
+    }
+
+    complete = (result == 0);
+    if (result > 0) {
+      complete = (memchr(&request[size], '\n', result) != nullptr);
+      size += result;
+    }
+  }
+
+  std::string_view line(request, size);
+  line = line.substr(0, line.find('\n'));
+
+  std::string response;
+  analytics_->Query(line, &response);
+  size_t pos = 0;
+  while (pos < response.size()) {
+    ssize_t result = send(fd, &response[pos], response.size() - pos,
+                          MSG_NOSIGNAL);
+    if (result < 0 && errno != EINTR) {
+      break;
+    }
+
+    pos += std::max<ssize_t>(result, 0);
+  }
+}
+
+}  // namespace dogtricks
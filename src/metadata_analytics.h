@@ -0,0 +1,309 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_METADATA_ANALYTICS_H_
+#define DOGTRICKS_METADATA_ANALYTICS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "non_copyable.h"
+#include "radio.h"
+#include "sketches.h"
+#include "string_pool.h"
+
+namespace dogtricks {
+
+/**
+ * Maintains live statistics over the metadata stream in fixed memory. Each
+ * event that carries a title starts a play of the song now playing on its
+ * channel. The play is counted once the channel has had no new title for
+ * kPlaySettleTime, so that an artist sent in a separate put just after the
+ * title is included, or as soon as the next title arrives. A play of the same
+ * artist and title as the last one counted on the channel is not counted
+ * again. Per-channel and global heavy hitters, distinct counts and play rates
+ * are updated in constant time per event. Settled plays are counted as events
+ * are added, so the statistics lag the stream by up to kPlaySettleTime plus
+ * the gap to the next event.
+ *
+ * The metadata now playing on each channel is retained in a string pool, so
+ * names shared by several channels are stored once and a name is freed when
+ * no channel plays it any more.
+ *
+ * Artists and songs are keyed by their case-folded names, truncated to
+ * kMaxNameSize bytes. Events may be added and queried from different
+ * threads.
+ */
+class MetadataAnalytics : public NonCopyable {
+ public:
+  //! The number of artists and songs retained per channel.
+  static constexpr size_t kChannelTopCount = 8;
+
+  //! The number of artists and songs retained across all channels.
+  static constexpr size_t kGlobalTopCount = 32;
+
+  //! The longest artist, title or song name retained.
+  static constexpr size_t kMaxNameSize = 64;
+
+  //! The time after a title within which the other puts of the same song
+  //! are expected.
+  static constexpr std::chrono::milliseconds kPlaySettleTime{100};
+
+  /**
+   * Setup empty statistics.
+   */
+  MetadataAnalytics();
+
+  /**
+   * Updates the statistics with a metadata event.
+   *
+   * @param channel_id The channel the event applies to.
+   * @param metadata The fields that changed.
+   */
+  void AddMetadata(uint8_t channel_id, const Radio::Metadata& metadata);
+
+  /**
+   * Answers a query with one JSON object followed by a newline. The
+   * supported queries are:
+   *
+   *   summary          plays, rates, distinct counts and top artists and
+   *                    songs across all channels
+   *   channel <id>     the same for one channel, and the metadata now
+   *                    playing on it
+   *   artist <name>    the estimated number of plays of any artist
+   *
+   * An empty query is a summary.
+   *
+   * @param request The query.
+   * @param response The string to write the response to.
+   * @return true if the query was answered, false if it is not valid, in
+   *         which case the response has an "error" member.
+   */
+  bool Query(std::string_view request, std::string *response) const;
+
+  /**
+   * @return the number of plays counted across all channels.
+   */
+  uint64_t GetPlayCount() const;
+
+  /**
+   * @return the estimated number of distinct songs across all channels.
+   */
+  uint64_t GetDistinctSongCount() const;
+
+  /**
+   * @return the metrics of the pool holding the metadata now playing.
+   */
+  StringPool::Stats GetStringPoolStats() const {
+    return pool_.GetStats();
+  }
+
+ private:
+  //! The heavy hitters retained per channel.
+  typedef SpaceSaving<kChannelTopCount, kMaxNameSize> ChannelTop;
+
+  //! The heavy hitters retained across all channels.
+  typedef SpaceSaving<kGlobalTopCount, kMaxNameSize> GlobalTop;
+
+  /**
+   * The statistics for a channel.
+   */
+  struct ChannelState {
+    ChannelState();
+
+    //! The metadata now playing.
+    InternedMetadata now_playing;
+
+    //! The key of the song last counted as a play, or zero if none.
+    uint64_t song_hash = 0;
+
+    //! Set to true while a play is waiting for its puts to settle.
+    bool play_pending = false;
+
+    //! The time at which the pending play is counted.
+    uint64_t play_due_ns = 0;
+
+    //! The number of plays.
+    uint64_t plays = 0;
+
+    //! The plays over the last hour in five minute buckets.
+    SlidingWindowCounter<12> recent_plays;
+
+    //! The distinct songs played.
+    HyperLogLog<8> distinct_songs;
+
+    //! The most played artists.
+    ChannelTop top_artists;
+
+    //! The most played songs.
+    ChannelTop top_songs;
+  };
+
+  //! The mutex to serialize updates and queries.
+  mutable std::mutex mutex_;
+
+  //! The pool holding the metadata now playing on every channel.
+  StringPool pool_;
+
+  //! The statistics for each channel.
+  ChannelState channels_[UINT8_MAX + 1];
+
+  //! The number of plays across all channels.
+  uint64_t plays_ = 0;
+
+  //! The number of channels with a pending play.
+  size_t pending_plays_ = 0;
+
+  //! The earliest time at which a pending play is due, if any are pending.
+  uint64_t next_play_due_ns_ = 0;
+
+  //! The plays over the last minute in one second buckets.
+  SlidingWindowCounter<60> plays_last_minute_;
+
+  //! The plays over the last hour in one minute buckets.
+  SlidingWindowCounter<60> plays_last_hour_;
+
+  //! The distinct songs played.
+  HyperLogLog<12> distinct_songs_;
+
+  //! The distinct artists played.
+  HyperLogLog<12> distinct_artists_;
+
+  //! The distinct songs played over the last hour in ten minute buckets.
+  SlidingWindowDistinct<10, 6> distinct_songs_last_hour_;
+
+  //! The estimated plays of every artist.
+  CountMinSketch<4, 4096> artist_plays_;
+
+  //! The most played artists.
+  GlobalTop top_artists_;
+
+  //! The most played songs.
+  GlobalTop top_songs_;
+
+  /**
+   * Counts the pending plays that are due. Must be called with the lock held.
+   */
+  void CountSettledPlays(uint64_t now_ns);
+
+  /**
+   * Counts the pending play of a channel unless it repeats the last song
+   * counted. Must be called with the lock held.
+   */
+  void CountPlay(ChannelState *channel, uint64_t now_ns);
+
+  /**
+   * Formats the summary across all channels. Must be called with the lock
+   * held.
+   */
+  void FormatSummary(uint64_t now_ns, std::string *response) const;
+
+  /**
+   * Formats the statistics of a channel. Must be called with the lock held.
+   */
+  void FormatChannel(uint8_t channel_id, uint64_t now_ns,
+                     std::string *response) const;
+
+  /**
+   * Formats the estimated plays of an artist. Must be called with the lock
+   * held.
+   */
+  void FormatArtist(std::string_view name, std::string *response) const;
+};
+
+/**
+ * Answers analytics queries over a Unix domain socket. Each connection sends
+ * one query terminated by a newline or by shutting down its write side, and
+ * receives the response before the connection is closed.
+ */
+class AnalyticsServer : public NonCopyable {
+ public:
+  //! The longest query accepted.
+  static constexpr size_t kMaxRequestSize = 512;
+
+  /**
+   * Setup the server to answer queries for the supplied statistics. Start
+   * must be called before queries are answered.
+   *
+   * @param analytics The statistics to query.
+   * @param path The path of the socket.
+   */
+  AnalyticsServer(const MetadataAnalytics *analytics, const char *path);
+
+  /**
+   * Stops the server and removes the socket.
+   */
+  ~AnalyticsServer();
+
+  /**
+   * Creates the socket, replacing any stale socket at the path, and starts
+   * a thread to answer queries.
+   *
+   * @return true if successful, false otherwise.
+   */
+  bool Start();
+
+  /**
+   * Stops answering queries and removes the socket.
+   */
+  void Stop();
+
+  /**
+   * Sends a query to a server and waits for the response.
+   *
+   * @param path The path of the socket.
+   * @param request The query.
+   * @param response The string to write the response to.
+   * @return true if a response was received, false otherwise.
+   */
+  static bool SendQuery(const char *path, std::string_view request,
+                        std::string *response);
+
+ private:
+  //! The statistics to query.
+  const MetadataAnalytics *analytics_;
+
+  //! The path of the socket.
+  const std::string path_;
+
+  //! The listening socket, or -1 if not started.
+  int listen_fd_ = -1;
+
+  //! The pipe used to wake the server thread when stopping.
+  int wake_fds_[2] = {-1, -1};
+
+  //! The thread that answers queries.
+  std::thread thread_;
+
+  /**
+   * Accepts connections and answers queries until stopped.
+   */
+  void Serve();
+
+  /**
+   * Reads a query from a connection and writes the response.
+   */
+  void HandleConnection(int fd);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_METADATA_ANALYTICS_H_
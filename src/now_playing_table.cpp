@@ -0,0 +1,76 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "now_playing_table.h"
+
+#include <thread>
+
+namespace dogtricks {
+
+NowPlayingTable::NowPlayingTable()
+    : slots_(std::make_unique<Slot[]>(kMaxChannels)) {}
+
+bool NowPlayingTable::Get(uint8_t channel_id, NowPlaying *entry) const {
+  const Slot& slot = slots_[channel_id];
+  for (;;) {
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if ((seq & 1) != 0) {
+      // The writer holds the slot only for the length of one copy.
+      std::this_thread::yield();
+      continue;
+    }
+
+    LoadWords(slot, entry);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == seq) {
+      return (entry->update_count > 0);
+    }
+  }
+}
+
+void NowPlayingTable::Clear() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NowPlaying entry = {};
+  for (size_t i = 0; i < kMaxChannels; i++) {
+    entry.channel_id = static_cast<uint8_t>(i);
+    StoreWords(entry, &slots_[i]);
+  }
+}
+
+void NowPlayingTable::LoadWords(const Slot& slot, NowPlaying *entry) {
+  uint64_t words[kWords];
+  for (size_t i = 0; i < kWords; i++) {
+    words[i] = slot.words[i].load(std::memory_order_relaxed);
+  }
+
+  memcpy(static_cast<void *>(entry), words, sizeof(NowPlaying));
+}
+
+void NowPlayingTable::StoreWords(const NowPlaying& entry, Slot *slot) {
+  uint64_t words[kWords] = {};
+  memcpy(words, &entry, sizeof(NowPlaying));
+
+  uint64_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < kWords; i++) {
+    slot->words[i].store(words[i], std::memory_order_relaxed);
+  }
+
+  slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+}  // namespace dogtricks
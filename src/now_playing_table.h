@@ -0,0 +1,222 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_NOW_PLAYING_TABLE_H_
+#define DOGTRICKS_NOW_PLAYING_TABLE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+
+#include "non_copyable.h"
+
+namespace dogtricks {
+
+/**
+ * What is currently playing on a channel. This is trivially copyable so that
+ * it can be copied in and out of the table under a sequence lock.
+ */
+struct NowPlaying {
+  /**
+   * A metadata string stored inline. The radio limits strings to 255 bytes.
+   */
+  class Field {
+   public:
+    /**
+     * Replaces the value, truncating it to the capacity of the field.
+     */
+    void Set(std::string_view value) {
+      size_ = static_cast<uint8_t>(std::min(value.size(), sizeof(data_)));
+      memcpy(data_, value.data(), size_);
+    }
+
+    /**
+     * Clears the value.
+     */
+    void Clear() {
+      size_ = 0;
+    }
+
+    /**
+     * @return the value. This is valid for the lifetime of the field.
+     */
+    std::string_view Get() const {
+      return std::string_view(data_, size_);
+    }
+
+    /**
+     * @return true if the value is empty.
+     */
+    bool empty() const {
+      return size_ == 0;
+    }
+
+   private:
+    //! The size of the value.
+    uint8_t size_;
+
+    //! The value, which is not terminated.
+    char data_[UINT8_MAX];
+  };
+
+  //! The channel that this entry describes.
+  uint8_t channel_id;
+
+  //! The number of updates applied to this entry. Zero if nothing is known
+  //! about the channel.
+  uint64_t update_count;
+
+  //! The time of the most recent update.
+  std::chrono::steady_clock::time_point updated_at;
+
+  //! The current artist.
+  Field artist;
+
+  //! The current title.
+  Field title;
+
+  //! The current album.
+  Field album;
+
+  //! The current record label.
+  Field record_label;
+
+  //! The current composer.
+  Field composer;
+
+  //! The current alternate artist.
+  Field alt_artist;
+
+  //! The current comments.
+  Field comments;
+};
+
+static_assert(std::is_trivially_copyable<NowPlaying>::value,
+              "NowPlaying is copied under a sequence lock");
+
+/**
+ * A live table of what is playing on every channel, indexed directly by
+ * channel ID. Each slot is guarded by a sequence lock so that readers on any
+ * thread obtain consistent snapshots without taking a lock or delaying the
+ * writer. Readers retry only if the slot they are copying is updated
+ * concurrently. The slot contents are stored as atomic words so that the
+ * racing copies are well defined.
+ */
+class NowPlayingTable : public NonCopyable {
+ public:
+  //! The number of possible channel IDs.
+  static constexpr size_t kMaxChannels = UINT8_MAX + 1;
+
+  /**
+   * Setup an empty table.
+   */
+  NowPlayingTable();
+
+  /**
+   * Copies the entry for a channel.
+   *
+   * @param channel_id The channel to obtain the entry for.
+   * @param entry The entry to populate.
+   * @return true if anything is known about the channel, false otherwise.
+   */
+  bool Get(uint8_t channel_id, NowPlaying *entry) const;
+
+  /**
+   * Obtains a counter that increases each time the entry for a channel is
+   * updated. This allows pollers to skip copying entries that are unchanged.
+   *
+   * @param channel_id The channel to obtain the version of.
+   * @return the version of the entry.
+   */
+  uint64_t GetVersion(uint8_t channel_id) const {
+    return slots_[channel_id].seq.load(std::memory_order_acquire) / 2;
+  }
+
+  /**
+   * Modifies the entry for a channel and publishes it to readers. Writers are
+   * serialized with each other but never wait for readers.
+   *
+   * @param channel_id The channel to update.
+   * @param mutator Invoked with the current entry to modify it in place.
+   */
+  template <typename Mutator>
+  void Update(uint8_t channel_id, Mutator mutator) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    NowPlaying entry;
+    Slot& slot = slots_[channel_id];
+    LoadWords(slot, &entry);
+    mutator(&entry);
+    entry.channel_id = channel_id;
+    entry.update_count++;
+    entry.updated_at = std::chrono::steady_clock::now();
+    StoreWords(entry, &slot);
+  }
+
+  /**
+   * Forgets everything known about every channel.
+   */
+  void Clear();
+
+  /**
+   * @return the size of the storage allocated for the slots when the table
+   *         is constructed.
+   */
+  static constexpr size_t GetStorageSize() {
+    return kMaxChannels * sizeof(Slot);
+  }
+
+ private:
+  //! The number of words required to store an entry.
+  static constexpr size_t kWords = (sizeof(NowPlaying) + 7) / 8;
+
+  /**
+   * The storage for one channel.
+   */
+  struct alignas(64) Slot {
+    //! Odd while the slot is being written.
+    std::atomic<uint64_t> seq;
+
+    //! The entry, stored as words.
+    std::atomic<uint64_t> words[kWords];
+  };
+
+  //! The mutex to serialize writers.
+  std::mutex write_mutex_;
+
+  //! The slots, indexed by channel ID.
+  std::unique_ptr<Slot[]> slots_;
+
+  /**
+   * Copies the words of a slot into an entry without checking the sequence.
+   */
+  static void LoadWords(const Slot& slot, NowPlaying *entry);
+
+  /**
+   * Publishes an entry into a slot. Must be called with the write lock held.
+   */
+  static void StoreWords(const NowPlaying& entry, Slot *slot);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_NOW_PLAYING_TABLE_H_
@@ -0,0 +1,553 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "output_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cinttypes>
+#include <cstring>
+#include <unistd.h>
+
+#include "alloc_tracker.h"
+#include "log.h"
+#include "radio_reactor.h"
+#include "text_normalizer.h"
+
+namespace dogtricks {
+
+namespace {
+
+//! The hexadecimal digits used for JSON unicode escapes.
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+/**
+ * Returns the replacement for a byte that must be escaped in a JSON string,
+ * or nullptr if the byte can be copied as is. Control characters without a
+ * short escape return an empty string and are written as \u00XX.
+ */
+const char *GetJsonEscape(unsigned char c) {
+  switch (c) {
+    case '"':
+      return "\\\"";
+    case '\\':
+      return "\\\\";
+    case '\b':
+      return "\\b";
+    case '\f':
+      return "\\f";
+    case '\n':
+      return "\\n";
+    case '\r':
+      return "\\r";
+    case '\t':
+      return "\\t";
+    default:
+      return (c < 0x20) ? "" : nullptr;
+  }
+}
+
+}  // namespace
+
+bool OutputWriter::ParseFormat(const std::string& name, Format *format) {
+  bool success = true;
+  if (name == "text") {
+    *format = Format::Text;
+  } else if (name == "ndjson") {
+    *format = Format::Ndjson;
+  } else if (name == "binary") {
+    *format = Format::Binary;
+  } else {
+    success = false;
+  }
+
+  return success;
+}
+
+std::unique_ptr<OutputWriter> OutputWriter::Create(Format format, int fd) {
+  switch (format) {
+    case Format::Ndjson:
+      return std::make_unique<NdjsonWriter>(fd);
+    case Format::Binary:
+      return std::make_unique<BinaryWriter>(fd);
+    case Format::Text:
+    default:
+      return std::make_unique<TextWriter>();
+  }
+}
+
+void OutputWriter::WriteChannelDescriptor(
+    const Radio::ChannelDescriptor& descriptor) {
+  ALLOC_SCOPE(Output);
+  std::lock_guard<std::mutex> lock(mutex_);
+  FormatChannelDescriptor(descriptor);
+  CommitRecord();
+}
+
+void OutputWriter::WriteSignalStrength(Radio::SignalStrength summary,
+                                       Radio::SignalStrength satellite,
+                                       Radio::SignalStrength terrestrial,
+                                       const EventSource *source) {
+  ALLOC_SCOPE(Output);
+  std::lock_guard<std::mutex> lock(mutex_);
+  source_ = source;
+  FormatSignalStrength(summary, satellite, terrestrial);
+  source_ = nullptr;
+  CommitRecord();
+}
+
+void OutputWriter::WriteMetadata(uint8_t channel_id,
+                                 const Radio::Metadata& metadata,
+                                 const EventSource *source) {
+  ALLOC_SCOPE(Output);
+  std::lock_guard<std::mutex> lock(mutex_);
+  source_ = source;
+  FormatMetadata(channel_id, metadata);
+  source_ = nullptr;
+  CommitRecord();
+}
+
+void OutputWriter::WriteTunedChannel(uint8_t channel_id,
+                                     const EventSource *source) {
+  ALLOC_SCOPE(Output);
+  std::lock_guard<std::mutex> lock(mutex_);
+  source_ = source;
+  FormatTunedChannel(channel_id);
+  source_ = nullptr;
+  CommitRecord();
+}
+
+void OutputWriter::WriteCommandResult(size_t line, std::string_view command,
+                                      bool success,
+                                      std::chrono::microseconds elapsed) {
+  ALLOC_SCOPE(Output);
+  std::lock_guard<std::mutex> lock(mutex_);
+  FormatCommandResult(line, command, success, elapsed);
+  CommitRecord();
+}
+
+void OutputWriter::BeginBatch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  batching_ = true;
+}
+
+void OutputWriter::EndBatch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  batching_ = false;
+  CommitRecord();
+}
+
+void OutputWriter::WriteBuffer(const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno != EINTR) {
+        LOGE("Failed to write output: %s", strerror(errno));
+        break;
+      }
+    } else {
+      data += written;
+      size -= written;
+    }
+  }
+}
+
+void OutputWriter::CommitRecord() {
+  if (!batching_ && !buffer_.empty()) {
+    WriteBuffer(buffer_.data(), buffer_.size());
+    buffer_.clear();
+  }
+}
+
+void TextWriter::FormatChannelDescriptor(
+    const Radio::ChannelDescriptor& descriptor) {
+  LOGI("Channel %" PRIu8 ":", descriptor.channel_id);
+  LOGI("  category id: %" PRIu8, descriptor.category_id);
+  LOGI("  short name: %s", descriptor.short_name.c_str());
+  LOGI("  long name: %s", descriptor.long_name.c_str());
+  LOGI("  short category name: %s", descriptor.short_category_name.c_str());
+  LOGI("  long category name: %s", descriptor.long_category_name.c_str());
+  FormatMetadataFields(descriptor.metadata);
+}
+
+void TextWriter::FormatSignalStrength(Radio::SignalStrength summary,
+                                      Radio::SignalStrength satellite,
+                                      Radio::SignalStrength terrestrial) {
+  LOGI("Signal strength:");
+  FormatSource();
+  LOGI("  summary: %s", Radio::GetSignalDescription(summary));
+  LOGI("  satellite: %s", Radio::GetSignalDescription(satellite));
+  LOGI("  terrestrial: %s", Radio::GetSignalDescription(terrestrial));
+}
+
+void TextWriter::FormatMetadata(uint8_t channel_id,
+                                const Radio::Metadata& metadata) {
+  LOGD("Metadata changed:");
+  FormatSource();
+  LOGD("  channel_id: %" PRIu8, channel_id);
+  FormatMetadataFields(metadata);
+}
+
+void TextWriter::FormatTunedChannel(uint8_t channel_id) {
+  LOGD("Tuned channel changed:");
+  FormatSource();
+  LOGD("  channel_id: %" PRIu8, channel_id);
+}
+
+void TextWriter::FormatCommandResult(size_t line, std::string_view command,
+                                     bool success,
+                                     std::chrono::microseconds elapsed) {
+  LOGI("Command on line %zu:", line);
+  LOGI("  command: %.*s", static_cast<int>(command.size()), command.data());
+  LOGI("  result: %s", success ? "success" : "failure");
+  LOGI("  elapsed: %" PRId64 " us", static_cast<int64_t>(elapsed.count()));
+}
+
+void TextWriter::FormatSource() {
+  if (source_ != nullptr) {
+    LOGD("  device: %" PRIu32, source_->device_id);
+    LOGD("  timestamp: %" PRId64 " ns", source_->timestamp_ns);
+  }
+}
+
+void TextWriter::FormatMetadataFields(const Radio::Metadata& metadata) {
+  if (metadata.artist.has_value()) {
+    LOGD("  artist: %s", metadata.artist.value().c_str());
+  }
+
+  if (metadata.title.has_value()) {
+    LOGD("  title: %s", metadata.title.value().c_str());
+  }
+
+  if (metadata.album.has_value()) {
+    LOGD("  album: %s", metadata.album.value().c_str());
+  }
+
+  if (metadata.record_label.has_value()) {
+    LOGD("  record label: %s", metadata.record_label.value().c_str());
+  }
+
+  if (metadata.composer.has_value()) {
+    LOGD("  composer: %s", metadata.composer.value().c_str());
+  }
+
+  if (metadata.alt_artist.has_value()) {
+    LOGD("  alt artist: %s", metadata.alt_artist.value().c_str());
+  }
+
+  if (metadata.comments.has_value()) {
+    LOGD("  comments: %s", metadata.comments.value().c_str());
+  }
+
+  for (size_t i = 0; i < metadata.promo_text.size(); i++) {
+    LOGD("  promo %zu: %s", i, metadata.promo_text[i].c_str());
+  }
+}
+
+void NdjsonWriter::FormatChannelDescriptor(
+    const Radio::ChannelDescriptor& descriptor) {
+  buffer_.append("{\"type\":\"channel\"");
+  AppendIntegerMember("channel_id", descriptor.channel_id);
+  AppendIntegerMember("category_id", descriptor.category_id);
+  AppendStringMember("short_name", descriptor.short_name);
+  AppendStringMember("long_name", descriptor.long_name);
+  AppendStringMember("short_category_name", descriptor.short_category_name);
+  AppendStringMember("long_category_name", descriptor.long_category_name);
+  buffer_.append(",\"metadata\":{");
+  size_t members_start = buffer_.size();
+  AppendMetadataMembers(descriptor.metadata);
+  if (buffer_.size() > members_start) {
+    // Drop the leading comma of the first member.
+    buffer_.erase(members_start, 1);
+  }
+  buffer_.append("}}\n");
+}
+
+void NdjsonWriter::FormatSignalStrength(Radio::SignalStrength summary,
+                                        Radio::SignalStrength satellite,
+                                        Radio::SignalStrength terrestrial) {
+  buffer_.append("{\"type\":\"signal\"");
+  AppendSourceMembers();
+  AppendStringMember("summary", Radio::GetSignalDescription(summary));
+  AppendStringMember("satellite", Radio::GetSignalDescription(satellite));
+  AppendStringMember("terrestrial", Radio::GetSignalDescription(terrestrial));
+  buffer_.append("}\n");
+}
+
+void NdjsonWriter::FormatMetadata(uint8_t channel_id,
+                                  const Radio::Metadata& metadata) {
+  buffer_.append("{\"type\":\"metadata\"");
+  AppendSourceMembers();
+  AppendIntegerMember("channel_id", channel_id);
+  AppendMetadataMembers(metadata);
+  buffer_.append("}\n");
+}
+
+void NdjsonWriter::FormatTunedChannel(uint8_t channel_id) {
+  buffer_.append("{\"type\":\"tuned_channel\"");
+  AppendSourceMembers();
+  AppendIntegerMember("channel_id", channel_id);
+  buffer_.append("}\n");
+}
+
+void NdjsonWriter::FormatCommandResult(size_t line, std::string_view command,
+                                       bool success,
+                                       std::chrono::microseconds elapsed) {
+  buffer_.append("{\"type\":\"command\"");
+  AppendIntegerMember("line", line);
+  AppendStringMember("command", command);
+  buffer_.append(success ? ",\"success\":true" : ",\"success\":false");
+  AppendIntegerMember("elapsed_us", elapsed.count());
+  buffer_.append("}\n");
+}
+
+void NdjsonWriter::AppendSourceMembers() {
+  if (source_ != nullptr) {
+    AppendIntegerMember("device", source_->device_id);
+    AppendIntegerMember("timestamp_ns", source_->timestamp_ns);
+  }
+}
+
+void NdjsonWriter::AppendMetadataMembers(const Radio::Metadata& metadata) {
+  if (metadata.artist.has_value()) {
+    AppendStringMember("artist", metadata.artist.value());
+  }
+
+  if (metadata.title.has_value()) {
+    AppendStringMember("title", metadata.title.value());
+  }
+
+  if (metadata.album.has_value()) {
+    AppendStringMember("album", metadata.album.value());
+  }
+
+  if (metadata.record_label.has_value()) {
+    AppendStringMember("record_label", metadata.record_label.value());
+  }
+
+  if (metadata.composer.has_value()) {
+    AppendStringMember("composer", metadata.composer.value());
+  }
+
+  if (metadata.alt_artist.has_value()) {
+    AppendStringMember("alt_artist", metadata.alt_artist.value());
+  }
+
+  if (metadata.comments.has_value()) {
+    AppendStringMember("comments", metadata.comments.value());
+  }
+
+  if (!metadata.promo_text.empty()) {
+    buffer_.append(",\"promo_text\":[");
+    for (size_t i = 0; i < metadata.promo_text.size(); i++) {
+      if (i > 0) {
+        buffer_.push_back(',');
+      }
+
+      AppendString(metadata.promo_text[i], &buffer_);
+    }
+    buffer_.push_back(']');
+  }
+}
+
+void NdjsonWriter::AppendStringMember(const char *key,
+                                      std::string_view value) {
+  buffer_.append(",\"");
+  buffer_.append(key);
+  buffer_.append("\":");
+  AppendString(value, &buffer_);
+}
+
+void NdjsonWriter::AppendIntegerMember(const char *key, uint64_t value) {
+  buffer_.append(",\"");
+  buffer_.append(key);
+  buffer_.append("\":");
+  char digits[20];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  buffer_.append(digits, result.ptr);
+}
+
+void NdjsonWriter::AppendString(std::string_view value,
+                                std::string *output) {
+  output->push_back('"');
+
+  // Text that is not valid UTF-8 is assumed to be Latin-1, as in
+  // TextNormalizer, and its high bytes are escaped as the matching code points
+  // so that every line stays valid JSON.
+  bool latin1 = !TextNormalizer::IsValidUtf8(value);
+
+  // Copy runs of bytes that do not require escaping in one append.
+  size_t run_start = 0;
+  for (size_t i = 0; i < value.size(); i++) {
+    unsigned char c = static_cast<unsigned char>(value[i]);
+    const char *escape = (latin1 && c >= 0x80) ? "" : GetJsonEscape(c);
+    if (escape != nullptr) {
+      output->append(value.data() + run_start, i - run_start);
+      if (escape[0] != '\0') {
+        output->append(escape);
+      } else {
+        const char unicode_escape[] = {
+          '\\', 'u', '0', '0', kHexDigits[c >> 4], kHexDigits[c & 0x0f],
+        };
+        output->append(unicode_escape, sizeof(unicode_escape));
+      }
+
+      run_start = i + 1;
+    }
+  }
+
+  output->append(value.data() + run_start, value.size() - run_start);
+  output->push_back('"');
+}
+
+void BinaryWriter::FormatChannelDescriptor(
+    const Radio::ChannelDescriptor& descriptor) {
+  BeginRecord(RecordType::ChannelDescriptor);
+  AppendField(FieldTag::ChannelId, descriptor.channel_id);
+  AppendField(FieldTag::CategoryId, descriptor.category_id);
+  AppendField(FieldTag::ShortName, descriptor.short_name);
+  AppendField(FieldTag::LongName, descriptor.long_name);
+  AppendField(FieldTag::ShortCategoryName, descriptor.short_category_name);
+  AppendField(FieldTag::LongCategoryName, descriptor.long_category_name);
+  AppendMetadataFields(descriptor.metadata);
+  EndRecord();
+}
+
+void BinaryWriter::FormatSignalStrength(Radio::SignalStrength summary,
+                                        Radio::SignalStrength satellite,
+                                        Radio::SignalStrength terrestrial) {
+  BeginRecord(RecordType::SignalStrength);
+  AppendSourceFields();
+  AppendField(FieldTag::Summary, static_cast<uint8_t>(summary));
+  AppendField(FieldTag::Satellite, static_cast<uint8_t>(satellite));
+  AppendField(FieldTag::Terrestrial, static_cast<uint8_t>(terrestrial));
+  EndRecord();
+}
+
+void BinaryWriter::FormatMetadata(uint8_t channel_id,
+                                  const Radio::Metadata& metadata) {
+  BeginRecord(RecordType::Metadata);
+  AppendSourceFields();
+  AppendField(FieldTag::ChannelId, channel_id);
+  AppendMetadataFields(metadata);
+  EndRecord();
+}
+
+void BinaryWriter::FormatTunedChannel(uint8_t channel_id) {
+  BeginRecord(RecordType::TunedChannel);
+  AppendSourceFields();
+  AppendField(FieldTag::ChannelId, channel_id);
+  EndRecord();
+}
+
+void BinaryWriter::FormatCommandResult(size_t line, std::string_view command,
+                                       bool success,
+                                       std::chrono::microseconds elapsed) {
+  BeginRecord(RecordType::CommandResult);
+  AppendField(FieldTag::Line, static_cast<uint32_t>(
+      std::min<size_t>(line, UINT32_MAX)));
+  AppendField(FieldTag::Command, command);
+  AppendField(FieldTag::Success, static_cast<uint8_t>(success));
+  AppendField(FieldTag::ElapsedUs, static_cast<uint32_t>(
+      std::min<int64_t>(elapsed.count(), UINT32_MAX)));
+  EndRecord();
+}
+
+void BinaryWriter::BeginRecord(RecordType type) {
+  record_start_ = buffer_.size();
+  buffer_.append(kLengthSize, '\0');
+  buffer_.push_back(static_cast<char>(type));
+}
+
+void BinaryWriter::EndRecord() {
+  size_t length = buffer_.size() - record_start_ - kLengthSize;
+  buffer_[record_start_] = static_cast<char>(length & 0xff);
+  buffer_[record_start_ + 1] = static_cast<char>((length >> 8) & 0xff);
+}
+
+void BinaryWriter::AppendSourceFields() {
+  if (source_ != nullptr) {
+    AppendField(FieldTag::Device, source_->device_id);
+    AppendField(FieldTag::TimestampNs,
+                static_cast<uint64_t>(source_->timestamp_ns));
+  }
+}
+
+void BinaryWriter::AppendMetadataFields(const Radio::Metadata& metadata) {
+  if (metadata.artist.has_value()) {
+    AppendField(FieldTag::Artist, metadata.artist.value());
+  }
+
+  if (metadata.title.has_value()) {
+    AppendField(FieldTag::Title, metadata.title.value());
+  }
+
+  if (metadata.album.has_value()) {
+    AppendField(FieldTag::Album, metadata.album.value());
+  }
+
+  if (metadata.record_label.has_value()) {
+    AppendField(FieldTag::RecordLabel, metadata.record_label.value());
+  }
+
+  if (metadata.composer.has_value()) {
+    AppendField(FieldTag::Composer, metadata.composer.value());
+  }
+
+  if (metadata.alt_artist.has_value()) {
+    AppendField(FieldTag::AltArtist, metadata.alt_artist.value());
+  }
+
+  if (metadata.comments.has_value()) {
+    AppendField(FieldTag::Comments, metadata.comments.value());
+  }
+
+  for (const auto& promo_text : metadata.promo_text) {
+    AppendField(FieldTag::PromoText, promo_text);
+  }
+}
+
+void BinaryWriter::AppendField(FieldTag tag, std::string_view value) {
+  size_t size = std::min(value.size(), static_cast<size_t>(UINT8_MAX));
+  buffer_.push_back(static_cast<char>(tag));
+  buffer_.push_back(static_cast<char>(size));
+  buffer_.append(value.data(), size);
+}
+
+void BinaryWriter::AppendField(FieldTag tag, uint8_t value) {
+  buffer_.push_back(static_cast<char>(tag));
+  buffer_.push_back(1);
+  buffer_.push_back(static_cast<char>(value));
+}
+
+void BinaryWriter::AppendField(FieldTag tag, uint32_t value) {
+  buffer_.push_back(static_cast<char>(tag));
+  buffer_.push_back(4);
+  for (int shift = 0; shift < 32; shift += 8) {
+    buffer_.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+void BinaryWriter::AppendField(FieldTag tag, uint64_t value) {
+  buffer_.push_back(static_cast<char>(tag));
+  buffer_.push_back(8);
+  for (int shift = 0; shift < 64; shift += 8) {
+    buffer_.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,393 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_OUTPUT_WRITER_H_
+#define DOGTRICKS_OUTPUT_WRITER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "non_copyable.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+struct EventSource;
+
+/**
+ * Writes channel descriptors, signal strength and events as records. Records
+ * are formatted into a reusable buffer and written with one write per record,
+ * or one per batch when batching. Records may be written from many threads.
+ */
+class OutputWriter : public NonCopyable {
+ public:
+  /**
+   * The supported output formats.
+   */
+  enum class Format {
+    //! Human readable logs. This is written to the log rather than the file.
+    Text,
+
+    //! One JSON object per line.
+    Ndjson,
+
+    //! Length-prefixed binary records. See BinaryWriter for the layout.
+    Binary,
+  };
+
+  /**
+   * Parses the name of a format.
+   *
+   * @param name One of "text", "ndjson" or "binary".
+   * @param format The format to populate.
+   * @return true if the name is valid, false otherwise.
+   */
+  static bool ParseFormat(const std::string& name, Format *format);
+
+  /**
+   * Creates a writer for the supplied format.
+   *
+   * @param format The format to write.
+   * @param fd The file descriptor to write records to.
+   */
+  static std::unique_ptr<OutputWriter> Create(Format format, int fd);
+
+  /**
+   * Setup the writer to write to the supplied file descriptor.
+   */
+  OutputWriter(int fd) : fd_(fd) {}
+
+  virtual ~OutputWriter() {}
+
+  /**
+   * Writes a channel descriptor record.
+   */
+  void WriteChannelDescriptor(const Radio::ChannelDescriptor& descriptor);
+
+  /**
+   * Writes a signal strength record. Event records carry the supplied
+   * source, if any, when merged from many radios.
+   */
+  void WriteSignalStrength(Radio::SignalStrength summary,
+                           Radio::SignalStrength satellite,
+                           Radio::SignalStrength terrestrial,
+                           const EventSource *source = nullptr);
+
+  /**
+   * Writes a metadata change record.
+   */
+  void WriteMetadata(uint8_t channel_id, const Radio::Metadata& metadata,
+                     const EventSource *source = nullptr);
+
+  /**
+   * Writes a tuned channel change record.
+   */
+  void WriteTunedChannel(uint8_t channel_id,
+                         const EventSource *source = nullptr);
+
+  /**
+   * Writes a record reporting the outcome of a script command.
+   *
+   * @param line The line of the script that the command is on.
+   * @param command The text of the command.
+   * @param success Whether the command succeeded.
+   * @param elapsed The time taken to execute the command.
+   */
+  void WriteCommandResult(size_t line, std::string_view command, bool success,
+                          std::chrono::microseconds elapsed);
+
+  /**
+   * Holds records in the buffer until EndBatch so that they are written
+   * together.
+   */
+  void BeginBatch();
+
+  /**
+   * Writes the records held since BeginBatch.
+   */
+  void EndBatch();
+
+ protected:
+  //! The buffer that records are formatted into. This retains its capacity
+  //! between records.
+  std::string buffer_;
+
+  //! The source of the event record being formatted, or nullptr.
+  const EventSource *source_ = nullptr;
+
+  /**
+   * Formats a channel descriptor record into the buffer.
+   */
+  virtual void FormatChannelDescriptor(
+      const Radio::ChannelDescriptor& descriptor) = 0;
+
+  /**
+   * Formats a signal strength record into the buffer.
+   */
+  virtual void FormatSignalStrength(Radio::SignalStrength summary,
+                                    Radio::SignalStrength satellite,
+                                    Radio::SignalStrength terrestrial) = 0;
+
+  /**
+   * Formats a metadata change record into the buffer.
+   */
+  virtual void FormatMetadata(uint8_t channel_id,
+                              const Radio::Metadata& metadata) = 0;
+
+  /**
+   * Formats a tuned channel change record into the buffer.
+   */
+  virtual void FormatTunedChannel(uint8_t channel_id) = 0;
+
+  /**
+   * Formats a command result record into the buffer.
+   */
+  virtual void FormatCommandResult(size_t line, std::string_view command,
+                                   bool success,
+                                   std::chrono::microseconds elapsed) = 0;
+
+  /**
+   * Writes the supplied bytes to the output. The default implementation
+   * writes to the file descriptor.
+   */
+  virtual void WriteBuffer(const char *data, size_t size);
+
+ private:
+  //! The file descriptor to write records to.
+  int fd_;
+
+  //! The mutex to lock the buffer.
+  std::mutex mutex_;
+
+  //! Set to true between BeginBatch and EndBatch.
+  bool batching_ = false;
+
+  /**
+   * Writes the buffer unless batching. Must be called with the lock held.
+   */
+  void CommitRecord();
+};
+
+/**
+ * Writes human readable records to the log.
+ */
+class TextWriter : public OutputWriter {
+ public:
+  TextWriter() : OutputWriter(-1) {}
+
+ protected:
+  void FormatChannelDescriptor(
+      const Radio::ChannelDescriptor& descriptor) override;
+  void FormatSignalStrength(Radio::SignalStrength summary,
+                            Radio::SignalStrength satellite,
+                            Radio::SignalStrength terrestrial) override;
+  void FormatMetadata(uint8_t channel_id,
+                      const Radio::Metadata& metadata) override;
+  void FormatTunedChannel(uint8_t channel_id) override;
+  void FormatCommandResult(size_t line, std::string_view command,
+                           bool success,
+                           std::chrono::microseconds elapsed) override;
+  void WriteBuffer(const char *data, size_t size) override {}
+
+ private:
+  /**
+   * Logs the source of the event, if any, with a two-space indent.
+   */
+  void FormatSource();
+
+  /**
+   * Logs the metadata fields with a two-space indent.
+   */
+  void FormatMetadataFields(const Radio::Metadata& metadata);
+};
+
+/**
+ * Writes one JSON object per line. Each object has a "type" of "channel",
+ * "signal", "metadata", "tuned_channel" or "command". Event objects merged
+ * from many radios also have a "device" and a "timestamp_ns".
+ */
+class NdjsonWriter : public OutputWriter {
+ public:
+  NdjsonWriter(int fd) : OutputWriter(fd) {}
+
+  /**
+   * Appends a quoted JSON string, escaping it in a single pass. Bytes of a
+   * string that is not valid UTF-8 are escaped as Latin-1 code points.
+   *
+   * @param value The string to append.
+   * @param output The string to append to.
+   */
+  static void AppendString(std::string_view value, std::string *output);
+
+ protected:
+  void FormatChannelDescriptor(
+      const Radio::ChannelDescriptor& descriptor) override;
+  void FormatSignalStrength(Radio::SignalStrength summary,
+                            Radio::SignalStrength satellite,
+                            Radio::SignalStrength terrestrial) override;
+  void FormatMetadata(uint8_t channel_id,
+                      const Radio::Metadata& metadata) override;
+  void FormatTunedChannel(uint8_t channel_id) override;
+  void FormatCommandResult(size_t line, std::string_view command,
+                           bool success,
+                           std::chrono::microseconds elapsed) override;
+
+ private:
+  /**
+   * Appends the source of the event, if any, as JSON members.
+   */
+  void AppendSourceMembers();
+
+  /**
+   * Appends the metadata fields as JSON members, each preceded by a comma.
+   */
+  void AppendMetadataMembers(const Radio::Metadata& metadata);
+
+  /**
+   * Appends a string member preceded by a comma.
+   */
+  void AppendStringMember(const char *key, std::string_view value);
+
+  /**
+   * Appends an integer member preceded by a comma.
+   */
+  void AppendIntegerMember(const char *key, uint64_t value);
+};
+
+/**
+ * Writes length-prefixed binary records that can be parsed in place.
+ *
+ * Each record is a little-endian uint16_t length of the remainder of the
+ * record, followed by a uint8_t RecordType and a sequence of fields. Each
+ * field is a uint8_t FieldTag, a uint8_t length and the value. Integer values
+ * are one byte long, except for the line and elapsed time of command results
+ * and the device of merged events which are little-endian uint32_t values,
+ * and the timestamp of merged events which is a little-endian uint64_t.
+ * Strings are not terminated. Promo text fields may repeat.
+ */
+class BinaryWriter : public OutputWriter {
+ public:
+  /**
+   * The types of binary records.
+   */
+  enum class RecordType : uint8_t {
+    ChannelDescriptor = 1,
+    SignalStrength = 2,
+    Metadata = 3,
+    TunedChannel = 4,
+    CommandResult = 5,
+  };
+
+  /**
+   * The tags of binary record fields.
+   */
+  enum class FieldTag : uint8_t {
+    ChannelId = 1,
+    CategoryId = 2,
+    ShortName = 3,
+    LongName = 4,
+    ShortCategoryName = 5,
+    LongCategoryName = 6,
+    Artist = 16,
+    Title = 17,
+    Album = 18,
+    RecordLabel = 19,
+    Composer = 20,
+    AltArtist = 21,
+    Comments = 22,
+    PromoText = 23,
+    Summary = 32,
+    Satellite = 33,
+    Terrestrial = 34,
+    Line = 48,
+    Command = 49,
+    Success = 50,
+    ElapsedUs = 51,
+    Device = 64,
+    TimestampNs = 65,
+  };
+
+  //! The size of the length prefix of a record.
+  static constexpr size_t kLengthSize = 2;
+
+  BinaryWriter(int fd) : OutputWriter(fd) {}
+
+ protected:
+  void FormatChannelDescriptor(
+      const Radio::ChannelDescriptor& descriptor) override;
+  void FormatSignalStrength(Radio::SignalStrength summary,
+                            Radio::SignalStrength satellite,
+                            Radio::SignalStrength terrestrial) override;
+  void FormatMetadata(uint8_t channel_id,
+                      const Radio::Metadata& metadata) override;
+  void FormatTunedChannel(uint8_t channel_id) override;
+  void FormatCommandResult(size_t line, std::string_view command,
+                           bool success,
+                           std::chrono::microseconds elapsed) override;
+
+ private:
+  //! The offset of the length prefix of the record being formatted.
+  size_t record_start_ = 0;
+
+  /**
+   * Appends the length placeholder and type of a new record.
+   */
+  void BeginRecord(RecordType type);
+
+  /**
+   * Populates the length of the record being formatted.
+   */
+  void EndRecord();
+
+  /**
+   * Appends the source of the event, if any.
+   */
+  void AppendSourceFields();
+
+  /**
+   * Appends the metadata fields.
+   */
+  void AppendMetadataFields(const Radio::Metadata& metadata);
+
+  /**
+   * Appends a string field, truncated to 255 bytes.
+   */
+  void AppendField(FieldTag tag, std::string_view value);
+
+  /**
+   * Appends a one byte integer field.
+   */
+  void AppendField(FieldTag tag, uint8_t value);
+
+  /**
+   * Appends a four byte integer field.
+   */
+  void AppendField(FieldTag tag, uint32_t value);
+
+  /**
+   * Appends an eight byte integer field.
+   */
+  void AppendField(FieldTag tag, uint64_t value);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_OUTPUT_WRITER_H_
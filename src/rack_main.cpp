@@ -0,0 +1,257 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <memory>
+#include <string>
+#include <tclap/CmdLine.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "log.h"
+#include "output_writer.h"
+#include "radio.h"
+#include "radio_reactor.h"
+
+using dogtricks::EventSource;
+using dogtricks::OutputWriter;
+using dogtricks::Radio;
+using dogtricks::RadioReactor;
+
+//! A description of the program.
+constexpr char kDescription[] =
+    "Monitors a rack of radios from one process, merging their events.";
+
+//! The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+//! The interval at which the main thread checks for a signal to exit.
+constexpr std::chrono::milliseconds kStopPollInterval(100);
+
+//! Cleared when SIGINT or SIGTERM is raised.
+std::atomic<bool> gRunning(true);
+
+/**
+ * Handle signals to stop the reactor gracefully.
+ */
+void SignalHandler(int signal) {
+  gRunning = false;
+}
+
+/**
+ * Writes the merged event stream of the reactor.
+ */
+class RackEventHandler : public RadioReactor::EventHandler {
+ public:
+  /**
+   * Setup the event handler to write events to the supplied writer.
+   */
+  RackEventHandler(OutputWriter *writer) : writer_(writer) {}
+
+  virtual void OnMetadataChange(const EventSource& source, uint8_t channel_id,
+                                const Radio::Metadata& metadata) override {
+    writer_->WriteMetadata(channel_id, metadata, &source);
+  }
+
+  virtual void OnSignalStrengthChange(
+      const EventSource& source, Radio::SignalStrength summary,
+      Radio::SignalStrength satellite,
+      Radio::SignalStrength terrestrial) override {
+    writer_->WriteSignalStrength(summary, satellite, terrestrial, &source);
+  }
+
+  virtual void OnTunedChannelChange(const EventSource& source,
+                                    uint8_t channel_id) override {
+    writer_->WriteTunedChannel(channel_id, &source);
+  }
+
+ private:
+  //! The writer for the selected output format.
+  OutputWriter *writer_;
+};
+
+/**
+ * The configuration to apply to a radio once the reactor is started.
+ */
+struct DeviceSetup {
+  //! The id of the radio.
+  uint32_t device_id;
+
+  //! The path of the serial device.
+  std::string path;
+
+  //! The monitoring features to enable.
+  uint8_t monitor_mask;
+};
+
+/**
+ * Logs the failure of a setup command.
+ */
+void OnSetupCommandComplete(void *context, bool success,
+                            const uint8_t *response, size_t size) {
+  const DeviceSetup *setup = static_cast<const DeviceSetup *>(context);
+  if (!success) {
+    LOGE("Failed to configure radio %" PRIu32 " (%s)", setup->device_id,
+         setup->path.c_str());
+  }
+}
+
+/**
+ * Powers up a radio and enables the requested monitoring. This runs on the
+ * thread of the shard that owns the radio.
+ */
+void SetupDevice(Radio *radio, void *context) {
+  DeviceSetup *setup = static_cast<DeviceSetup *>(context);
+  bool success = radio->SetPowerModeAsync(Radio::PowerState::FullMode,
+      OnSetupCommandComplete, setup);
+  for (auto feature : {Radio::MonitorFeature::SignalStrength,
+                       Radio::MonitorFeature::TunedChannel,
+                       Radio::MonitorFeature::GlobalMetadata}) {
+    if (success && (setup->monitor_mask & Radio::GetMonitorBit(feature))) {
+      success &= radio->SetMonitoringEnabledAsync(feature, true,
+          OnSetupCommandComplete, setup);
+    }
+  }
+
+  if (!success) {
+    LOGE("Failed to queue setup of radio %" PRIu32, setup->device_id);
+  }
+}
+
+/**
+ * Logs the counters of the reactor and of each radio.
+ */
+void LogStats(RadioReactor *reactor, const std::vector<DeviceSetup>& setups) {
+  for (size_t i = 0; i < reactor->GetShardCount(); i++) {
+    auto stats = reactor->GetShardStats(i);
+    LOGI("Shard %zu:", i);
+    LOGI("  devices: %zu", stats.devices);
+    LOGI("  wakeups: %" PRIu64, stats.wakeups);
+    LOGI("  io events: %" PRIu64, stats.io_events);
+    LOGI("  timer expirations: %" PRIu64, stats.timer_expirations);
+    LOGI("  tasks: %" PRIu64, stats.tasks);
+  }
+
+  for (const auto& setup : setups) {
+    const Radio *radio = reactor->GetRadio(setup.device_id);
+    auto link_stats = radio->GetTransport().GetLinkStats();
+    const auto& latency = radio->GetTransport().GetDispatchLatency();
+    LOGI("Device %" PRIu32 " (%s):", setup.device_id, setup.path.c_str());
+    LOGI("  connected: %s", link_stats.connected ? "yes" : "no");
+    LOGI("  disconnects: %" PRIu64, link_stats.disconnects);
+    LOGI("  frames: %" PRIu64, latency.GetCount());
+    LOGI("  duplicate frames: %" PRIu64, link_stats.duplicate_frames);
+    LOGI("  dispatch p99: %" PRId64 " us", static_cast<int64_t>(
+        latency.GetPercentile(0.99).count() / 1000));
+  }
+}
+
+int main(int argc, char **argv) {
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::MultiArg<std::string> path_arg("", "path",
+      "the path of a serial device to communicate with, repeated per radio",
+      true /* req */, "path", cmd);
+  TCLAP::ValueArg<int> shards_arg("", "shards",
+      "the number of threads to drive the radios with, one per CPU if unset",
+      false /* req */, 0, "count", cmd);
+  TCLAP::SwitchArg pin_shards_arg("", "pin_shards",
+      "pins each shard thread to its own CPU", cmd);
+  TCLAP::ValueArg<std::string> format_arg("", "format",
+      "the format to write events in: text, ndjson or binary",
+      false /* req */, "ndjson", "format", cmd);
+  TCLAP::SwitchArg reconnect_arg("", "reconnect",
+      "reopen a serial device and restore its session if it is lost", cmd);
+  TCLAP::SwitchArg normalize_text_arg("", "normalize_text",
+      "converts text from the radios to clean UTF-8 as it is parsed", cmd);
+  TCLAP::ValueArg<int> coalesce_metadata_arg("", "coalesce_metadata_ms",
+      "merges the metadata changes for a channel that arrive within this "
+      "window into one event", false /* req */, 0, "milliseconds", cmd);
+  TCLAP::SwitchArg log_global_metadata_arg("", "log_global_metadata",
+      "logs all changes in channel metadata", cmd);
+  TCLAP::SwitchArg log_signal_changes_arg("", "log_signal_changes",
+      "logs all changes in signal strength", cmd);
+  TCLAP::SwitchArg log_channel_changes_arg("", "log_channel_changes",
+      "logs all changes in the tuned channel", cmd);
+  TCLAP::SwitchArg log_stats_arg("", "log_stats",
+      "logs shard and link metrics before exiting", cmd);
+  cmd.parse(argc, argv);
+
+  OutputWriter::Format format;
+  if (!OutputWriter::ParseFormat(format_arg.getValue(), &format)) {
+    LOGE("Unknown output format: %s", format_arg.getValue().c_str());
+    return -1;
+  }
+
+  uint8_t monitor_mask = 0;
+  if (log_global_metadata_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::GlobalMetadata);
+  }
+
+  if (log_signal_changes_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::SignalStrength);
+  }
+
+  if (log_channel_changes_arg.isSet()) {
+    monitor_mask |= Radio::GetMonitorBit(Radio::MonitorFeature::TunedChannel);
+  }
+
+  std::unique_ptr<OutputWriter> writer =
+      OutputWriter::Create(format, STDOUT_FILENO);
+  RackEventHandler event_handler(writer.get());
+  RadioReactor reactor(&event_handler, shards_arg.getValue());
+
+  // A radio that fails to open is left out rather than taking down the rack.
+  std::vector<DeviceSetup> setups;
+  setups.reserve(path_arg.getValue().size());
+  for (const std::string& path : path_arg.getValue()) {
+    uint32_t device_id;
+    if (reactor.AddDevice(path.c_str(), &device_id)) {
+      Radio *radio = reactor.GetRadio(device_id);
+      radio->SetReconnectEnabled(reconnect_arg.isSet());
+      radio->SetTextNormalizationEnabled(normalize_text_arg.isSet());
+      if (coalesce_metadata_arg.getValue() > 0) {
+        radio->SetMetadataCoalescing(
+            std::chrono::milliseconds(coalesce_metadata_arg.getValue()));
+      }
+
+      setups.push_back({device_id, path, monitor_mask});
+    }
+  }
+
+  bool success = !setups.empty() && reactor.Start(pin_shards_arg.isSet());
+  if (success) {
+    std::signal(SIGINT, SignalHandler);
+    std::signal(SIGTERM, SignalHandler);
+    for (auto& setup : setups) {
+      success &= reactor.Post(setup.device_id, SetupDevice, &setup);
+    }
+
+    while (gRunning) {
+      std::this_thread::sleep_for(kStopPollInterval);
+    }
+
+    reactor.Stop();
+    if (log_stats_arg.isSet()) {
+      LogStats(&reactor, setups);
+    }
+  }
+
+  return (success ? 0 : -1);
+}
@@ -16,11 +16,16 @@
 
 #include "radio.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cstring>
+#include <thread>
 
+#include "alloc_tracker.h"
 #include "log.h"
+#include "text_normalizer.h"
+#include "trace.h"
 
 using namespace std::chrono_literals;
 
@@ -46,7 +51,54 @@ const char *Radio::GetSignalDescription(SignalStrength signal_strength) {
   }
 }
 
+bool Radio::Start() {
+  Trace::SetThreadName("receive");
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    started_ = true;
+  }
+
+  std::thread restore_thread([this]() { RestoreLoop(); });
+  bool running = transport_.Start();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    restore_exit_ = true;
+  }
+
+  restore_cv_.notify_all();
+  restore_thread.join();
+
+  // Changes held for coalescing are not lost when the loop stops.
+  FlushCoalescedMetadata(std::chrono::steady_clock::time_point::max());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  restore_exit_ = false;
+  started_ = false;
+  return running;
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+    Radio::GetNextDeadline() {
+  auto deadline = transport_.GetNextDeadline();
+  auto timer_deadline = GetTimerDeadline();
+  if (timer_deadline.has_value() && (!deadline.has_value()
+      || timer_deadline.value() < deadline.value())) {
+    deadline = timer_deadline;
+  }
+
+  return deadline;
+}
+
+void Radio::ProcessDeadline() {
+  transport_.ProcessDeadline();
+  OnTimer();
+}
+
 bool Radio::Reset() {
+  // The radio restarts its sequence numbers, so its first frames after the
+  // reset, which may arrive right behind the response, could match frames
+  // from before it. Those are forgotten before the reset is requested.
+  transport_.ResetRxWindow();
   uint8_t response[2];
   bool success = SendCommand(
       Transport::OpCode::SetResetRequest,
@@ -65,9 +117,75 @@ bool Radio::Reset() {
     }
   }
 
+  {
+    // Nothing can be assumed about the configuration of a reset radio.
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    session_ = SessionState();
+  }
+
+  // The metadata of a reset radio is sent again once it is tuned.
+  now_playing_.Clear();
+  InvalidateAllQueries();
+  return success;
+}
+
+bool Radio::WarmStart(const SessionState& last_known, bool allow_reset) {
+  SignalStrength summary;
+  SignalStrength satellite;
+  SignalStrength terrestrial;
+  bool success = GetSignalStrength(&summary, &satellite, &terrestrial);
+  if (!success) {
+    LOGD("Radio did not respond to probe, starting cold");
+    success = !allow_reset || Reset();
+    if (success) {
+      success = SetPowerMode(PowerState::FullMode);
+    }
+  } else if (last_known.power_state != PowerState::FullMode
+      || summary == SignalStrength::None) {
+    // The radio may have been power cycled or put to sleep since the state
+    // was saved, so the rest of the saved state is not trusted either.
+    LOGD("Radio is not warm, setting power mode");
+    success = SetPowerMode(PowerState::FullMode);
+  } else {
+    // The probe cannot tell whether monitoring survived, for example an
+    // external power cycle, so only the power mode and channel are adopted.
+    LOGD("Radio is warm, skipping power mode");
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    session_.power_state = last_known.power_state;
+    session_.channel_id = last_known.channel_id;
+  }
+
   return success;
 }
 
+bool Radio::ApplySessionState(const SessionState& desired) {
+  SessionState current = GetSessionState();
+  bool success = true;
+  if (desired.power_state.has_value()
+      && desired.power_state != current.power_state) {
+    success &= SetPowerMode(desired.power_state.value());
+  }
+
+  if (success && desired.channel_id.has_value()
+      && desired.channel_id != current.channel_id) {
+    success &= SetChannel(desired.channel_id.value());
+  }
+
+  // The monitoring state of the radio cannot be probed, so it is always
+  // reissued. The command is idempotent.
+  if (success) {
+    monitor_mask_ = desired.monitor_mask;
+    success &= SetMonitoringState();
+  }
+
+  return success;
+}
+
+Radio::SessionState Radio::GetSessionState() const {
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  return session_;
+}
+
 bool Radio::SetPowerMode(PowerState power_state) {
   uint8_t payload[] = { static_cast<uint8_t>(power_state), };
   uint8_t response[4];
@@ -78,6 +196,11 @@ bool Radio::SetPowerMode(PowerState power_state) {
   if (success) {
     auto status = UnpackStatus(response);
     success = (status == Status::Success);
+    if (!success) {
+      LOGE("Set power mode request failed with 0x%04" PRIx16, status);
+    } else {
+      ApplyCommand(Transport::OpCode::SetPowerModeRequest, payload);
+    }
   }
 
   return success;
@@ -86,6 +209,7 @@ bool Radio::SetPowerMode(PowerState power_state) {
 bool Radio::SetChannel(uint8_t channel_id) {
   uint8_t payload[] = { channel_id, 0, 0, 0 };
   uint8_t response[UINT8_MAX];
+  BeginTune(channel_id);
   bool success = SendCommand(
       Transport::OpCode::SetChannelRequest,
       Transport::OpCode::SetChannelResponse,
@@ -95,9 +219,15 @@ bool Radio::SetChannel(uint8_t channel_id) {
     success = (status == Status::Success);
     if (!success) {
       LOGE("Set channel request failed with 0x%04" PRIx16, status);
+    } else {
+      ApplyCommand(Transport::OpCode::SetChannelRequest, payload);
     }
   }
 
+  if (!success) {
+    CancelTune(channel_id);
+  }
+
   return success;
 }
 
@@ -105,7 +235,7 @@ bool Radio::GetSignalStrength(SignalStrength *summary,
                               SignalStrength *satellite,
                               SignalStrength *terrestrial) {
   uint8_t response[6];
-  bool success = SendCommand(
+  bool success = SendQuery(
       Transport::OpCode::GetSignalRequest,
       Transport::OpCode::GetSignalResponse,
       nullptr, 0, response, sizeof(response), 100ms);
@@ -127,11 +257,76 @@ bool Radio::GetSignalStrength(SignalStrength *summary,
   return success;
 }
 
-bool Radio::SetGlobalMetadataMonitoringEnabled(bool enabled) {
-  global_metadata_monitoring_enabled_ = enabled;
+bool Radio::SetMonitoringEnabled(MonitorFeature feature, bool enabled) {
+  uint8_t bit = GetMonitorBit(feature);
+  if (enabled) {
+    monitor_mask_ |= bit;
+  } else {
+    monitor_mask_ &= ~bit;
+  }
+
   return SetMonitoringState();
 }
 
+bool Radio::SendCommandAsync(Transport::OpCode request_op_code,
+                             Transport::OpCode response_op_code,
+                             const uint8_t *command, size_t command_size,
+                             std::chrono::milliseconds timeout,
+                             CommandCallback callback, void *context) {
+  assert(command_size <= UINT8_MAX);
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (async_count_ == kAsyncCommandQueueSize) {
+    LOGE("Request 0x%04" PRIx16 " dropped, command queue is full",
+         static_cast<uint16_t>(request_op_code));
+    return false;
+  }
+
+  AsyncCommand& entry = async_queue_[
+      (async_head_ + async_count_) % kAsyncCommandQueueSize];
+  entry.request_op_code = request_op_code;
+  entry.response_op_code = response_op_code;
+  memcpy(entry.command, command, command_size);
+  entry.command_size = command_size;
+  entry.timeout = timeout;
+  entry.callback = callback;
+  entry.context = context;
+  async_count_++;
+  PumpAsyncCommands(lock);
+  return true;
+}
+
+bool Radio::SetPowerModeAsync(PowerState power_state,
+                              CommandCallback callback, void *context) {
+  uint8_t payload[] = { static_cast<uint8_t>(power_state), };
+  return SendCommandAsync(
+      Transport::OpCode::SetPowerModeRequest,
+      Transport::OpCode::SetPowerModeResponse,
+      payload, sizeof(payload), 100ms, callback, context);
+}
+
+bool Radio::SetChannelAsync(uint8_t channel_id, CommandCallback callback,
+                            void *context) {
+  uint8_t payload[] = { channel_id, 0, 0, 0 };
+  BeginTune(channel_id);
+  return SendCommandAsync(
+      Transport::OpCode::SetChannelRequest,
+      Transport::OpCode::SetChannelResponse,
+      payload, sizeof(payload), 100ms, callback, context);
+}
+
+bool Radio::SetMonitoringEnabledAsync(MonitorFeature feature, bool enabled,
+                                      CommandCallback callback,
+                                      void *context) {
+  uint8_t bit = GetMonitorBit(feature);
+  if (enabled) {
+    monitor_mask_ |= bit;
+  } else {
+    monitor_mask_ &= ~bit;
+  }
+
+  return SetMonitoringStateAsync(callback, context);
+}
+
 bool Radio::GetChannelList(ChannelList *channels) {
   // List all channels.
   uint8_t request[] = {
@@ -141,7 +336,7 @@ bool Radio::GetChannelList(ChannelList *channels) {
       0 /* overrides */
   };
   uint8_t response[UINT8_MAX];
-  bool success = SendCommand(
+  bool success = SendQuery(
       Transport::OpCode::GetChannelListRequest,
       Transport::OpCode::GetChannelListResponse,
       request, sizeof(request), response, sizeof(response), 100ms);
@@ -155,14 +350,75 @@ bool Radio::GetChannelList(ChannelList *channels) {
       for (uint8_t i = 0; i < channel_count; i++) {
         channels->push_back(response[3 + i]);
       }
+
+#ifndef DOGTRICKS_NO_HEAP
+      std::lock_guard<std::mutex> lock(query_mutex_);
+      lineup_.assign(&response[3], &response[3 + channel_count]);
+#endif  // DOGTRICKS_NO_HEAP
     }
   }
 
   return success;
 }
 
+void Radio::SetCacheTtl(Transport::OpCode request_op_code,
+                        std::chrono::milliseconds ttl) {
+#ifdef DOGTRICKS_NO_HEAP
+  LOGE("Query caching is not available without a heap");
+#else
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  if (ttl.count() > 0) {
+    query_cache_ttls_[request_op_code] = ttl;
+  } else {
+    query_cache_ttls_.erase(request_op_code);
+  }
+
+  for (auto& flight : query_flights_) {
+    flight.second->stale = true;
+  }
+
+  query_cache_.clear();
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::SetDescriptorPrefetch(size_t adjacent_count,
+                                  std::chrono::milliseconds ttl) {
+#ifdef DOGTRICKS_NO_HEAP
+  LOGE("Descriptor prefetching is not available without a heap");
+#else
+  if (adjacent_count > 0) {
+    SetCacheTtl(Transport::OpCode::GetChannelRequest, ttl);
+  }
+
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  prefetch_adjacent_count_ = adjacent_count;
+  if (adjacent_count == 0) {
+    prefetch_queue_.clear();
+  }
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::SetMetadataCoalescing(std::chrono::milliseconds window) {
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  coalesce_window_ = window;
+  if (window.count() > 0 && coalesce_slots_.empty()) {
+    coalesce_slots_.resize(UINT8_MAX + 1);
+  }
+}
+
+Radio::CoalescingStats Radio::GetCoalescingStats() const {
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  return coalescing_stats_;
+}
+
+Radio::QueryStats Radio::GetQueryStats() const {
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  return query_stats_;
+}
+
 bool Radio::GetChannelDescriptor(uint8_t channel_id,
                                  ChannelDescriptor *descriptor) {
+  ALLOC_SCOPE(RadioCommand);
   uint8_t request[] = {
     channel_id,
     0 /* direction: direct */,
@@ -170,7 +426,7 @@ bool Radio::GetChannelDescriptor(uint8_t channel_id,
     0 /* overrides */,
   };
   uint8_t response[UINT8_MAX];
-  bool success = SendCommand(
+  bool success = SendQuery(
       Transport::OpCode::GetChannelRequest,
       Transport::OpCode::GetChannelResponse,
       request, sizeof(request), response, sizeof(response), 100ms);
@@ -185,29 +441,35 @@ bool Radio::GetChannelDescriptor(uint8_t channel_id,
 
       size_t offset = 7;
       size_t length = response[offset++];
-      descriptor->short_name = std::string(
-          reinterpret_cast<const char *>(&response[offset]), length);
+      descriptor->short_name = MakeString(std::string_view(
+          reinterpret_cast<const char *>(&response[offset]), length));
 
       offset += length;
       length = response[offset++];
-      descriptor->long_name = std::string(
-          reinterpret_cast<const char *>(&response[offset]), length);
+      descriptor->long_name = MakeString(std::string_view(
+          reinterpret_cast<const char *>(&response[offset]), length));
 
       offset += length;
       length = response[offset++];
-      descriptor->short_category_name = std::string(
-          reinterpret_cast<const char *>(&response[offset]), length);
+      descriptor->short_category_name = MakeString(std::string_view(
+          reinterpret_cast<const char *>(&response[offset]), length));
 
       offset += length;
       length = response[offset++];
-      descriptor->long_category_name = std::string(
-          reinterpret_cast<const char *>(&response[offset]), length);
+      descriptor->long_category_name = MakeString(std::string_view(
+          reinterpret_cast<const char *>(&response[offset]), length));
 
       // TODO: Pass in the length of the packet. This is bypassed for now as
       // the sie of the response is not currently passed back after sending a
       // command.
       offset += length;
       ParseMetadata(&response[offset], SIZE_MAX, &descriptor->metadata);
+
+      // The descriptor carries the complete metadata for the channel.
+      now_playing_.Update(descriptor->channel_id, [&](NowPlaying *entry) {
+        *entry = {};
+        ApplyMetadata(descriptor->metadata, entry);
+      });
     }
   }
 
@@ -216,28 +478,277 @@ bool Radio::GetChannelDescriptor(uint8_t channel_id,
 
 void Radio::OnPacketReceived(Transport::OpCode op_code, const uint8_t *payload,
                              size_t payload_size) {
-  if (op_code == response_op_code_) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (async_active_
+      && op_code == async_queue_[async_head_].response_op_code) {
+    async_response_size_ = std::min(payload_size, sizeof(async_response_));
+    memcpy(async_response_, payload, async_response_size_);
+    TRACE_INSTANT_ARG("ResponseMatched", "op", op_code);
+    CompleteAsyncCommand(lock, true /* received */);
+    PumpAsyncCommands(lock);
+    return;
+  }
+
+  if (command_state_ == CommandState::Pending
+      && op_code == response_op_code_) {
     // If the supplied response buffer is too small, this is an error and it
     // must be increased in size.
     assert(response_size_ >= payload_size);
-    memcpy(response_, payload, payload_size);
-    cv_.notify_one();
-  } else if (op_code == Transport::OpCode::PutPdtResponse) {
-    if (global_metadata_monitoring_enabled_) {
+    memcpy(response_, payload, std::min(response_size_, payload_size));
+    TRACE_INSTANT_ARG("ResponseMatched", "op", op_code);
+    command_state_ = CommandState::Complete;
+    cv_.notify_all();
+    return;
+  }
+
+  lock.unlock();
+  TRACE_SCOPE_ARG("DispatchPut", "op", op_code);
+  ALLOC_SCOPE(RadioParse);
+  if (op_code == Transport::OpCode::PutPdtResponse) {
+    RecordTuneLatency(payload, payload_size);
+    if (IsMonitoring(MonitorFeature::GlobalMetadata)) {
       HandleMetadataPacket(payload, payload_size);
     } else {
       LOGD("Received unsolicited metadata change");
     }
+  } else if (op_code == Transport::OpCode::PutSignalResponse) {
+    if (IsMonitoring(MonitorFeature::SignalStrength)) {
+      HandleSignalPacket(payload, payload_size);
+    } else {
+      LOGD("Received unsolicited signal change");
+    }
+  } else if (op_code == Transport::OpCode::PutChannelResponse) {
+    if (IsMonitoring(MonitorFeature::TunedChannel)) {
+      HandleChannelPacket(payload, payload_size);
+    } else {
+      LOGD("Received unsolicited channel change");
+    }
   } else {
     LOGD("Unhandled op code: 0x%04" PRIx16, op_code);
   }
 }
 
+void Radio::OnLinkDown() {
+  {
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    if (!restore_state_.has_value()) {
+      restore_state_ = session_;
+    }
+
+    session_ = SessionState();
+  }
+
+  {
+    // Fail the outstanding commands rather than waiting for them to time out.
+    std::unique_lock<std::mutex> lock(mutex_);
+    link_up_ = false;
+    if (command_state_ == CommandState::Pending) {
+      command_state_ = CommandState::Failed;
+      cv_.notify_all();
+    }
+
+    if (async_active_) {
+      LOGE("Request 0x%04" PRIx16 " failed, link lost", static_cast<uint16_t>(
+          async_queue_[async_head_].request_op_code));
+      CompleteAsyncCommand(lock, false /* received */);
+    }
+
+    PumpAsyncCommands(lock);
+  }
+
+  // The radio may have been power cycled while the link was down, so what it
+  // was playing is not known until it sends metadata again.
+  now_playing_.Clear();
+  InvalidateAllQueries();
+}
+
+void Radio::OnLinkUp() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  link_up_ = true;
+  if (started_) {
+    restore_pending_ = true;
+    restore_cv_.notify_all();
+  } else {
+    lock.unlock();
+    RestoreSessionAsync();
+  }
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+    Radio::GetTimerDeadline() {
+  auto deadline = GetCoalescingDeadline();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (async_active_ && (!deadline.has_value()
+      || async_deadline_ < deadline.value())) {
+    deadline = async_deadline_;
+  }
+
+  return deadline;
+}
+
+void Radio::OnTimer() {
+  FlushCoalescedMetadata(std::chrono::steady_clock::now());
+
+  // Nothing waits for the response to an asynchronous command, such as a
+  // prefetch, so a lost response is timed out here.
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (async_active_ && std::chrono::steady_clock::now() >= async_deadline_) {
+    LOGE("Request 0x%04" PRIx16 " timed out", static_cast<uint16_t>(
+        async_queue_[async_head_].request_op_code));
+    CompleteAsyncCommand(lock, false /* received */);
+    PumpAsyncCommands(lock);
+  }
+}
+
+void Radio::RestoreLoop() {
+  Trace::SetThreadName("restore");
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    restore_cv_.wait(lock, [this]() {
+      return restore_pending_ || restore_exit_;
+    });
+
+    if (restore_exit_) {
+      break;
+    }
+
+    restore_pending_ = false;
+    for (int i = 0; i < kRestoreAttempts && link_up_ && !restore_exit_; i++) {
+      lock.unlock();
+      bool success = RestoreSession();
+      lock.lock();
+      if (success) {
+        break;
+      }
+
+      restore_cv_.wait_for(lock, kRestoreRetryDelay, [this]() {
+        return restore_exit_;
+      });
+    }
+  }
+}
+
+Radio::SessionState Radio::GetRestoreTarget(
+    const SessionState& saved) const {
+  SessionState current = GetSessionState();
+  SessionState desired = saved;
+  if (current.power_state.has_value()) {
+    desired.power_state = current.power_state;
+  }
+
+  if (current.channel_id.has_value()) {
+    desired.channel_id = current.channel_id;
+  }
+
+  desired.monitor_mask = monitor_mask_;
+  return desired;
+}
+
+void Radio::RestoreSessionAsync() {
+  std::optional<SessionState> restore_state;
+  {
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    restore_state = restore_state_;
+  }
+
+  if (!restore_state.has_value()) {
+    return;
+  }
+
+  SessionState current = GetSessionState();
+  SessionState desired = GetRestoreTarget(restore_state.value());
+  bool set_power_mode = desired.power_state.has_value()
+      && desired.power_state != current.power_state;
+  bool set_channel = desired.channel_id.has_value()
+      && desired.channel_id != current.channel_id;
+  // As in ApplySessionState, the monitoring state is always reissued.
+  bool set_monitoring = true;
+  {
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    restore_commands_pending_ = set_power_mode + set_channel + set_monitoring
+        + 1;
+    restore_failed_ = false;
+    restore_start_time_ = std::chrono::steady_clock::now();
+  }
+
+  // The commands are queued in the order used by ApplySessionState. A failure
+  // to queue counts as a failed command.
+  if (set_power_mode && !SetPowerModeAsync(desired.power_state.value(),
+                                           OnRestoreCommandComplete, this)) {
+    OnRestoreCommandComplete(this, false, nullptr, 0);
+  }
+
+  if (set_channel && !SetChannelAsync(desired.channel_id.value(),
+                                      OnRestoreCommandComplete, this)) {
+    OnRestoreCommandComplete(this, false, nullptr, 0);
+  }
+
+  if (set_monitoring && !SetMonitoringStateAsync(OnRestoreCommandComplete,
+                                                 this)) {
+    OnRestoreCommandComplete(this, false, nullptr, 0);
+  }
+
+  // The extra count held while queueing keeps the restore from finishing
+  // before every command has been queued.
+  OnRestoreCommandComplete(this, true, nullptr, 0);
+}
+
+void Radio::OnRestoreCommandComplete(void *context, bool success,
+                                     const uint8_t *response,
+                                     size_t response_size) {
+  auto *radio = static_cast<Radio *>(context);
+  std::lock_guard<std::mutex> lock(radio->session_mutex_);
+  radio->restore_failed_ |= !success;
+  if (--radio->restore_commands_pending_ > 0) {
+    return;
+  }
+
+  if (radio->restore_failed_) {
+    LOGE("Failed to restore session");
+  } else {
+    radio->restore_state_.reset();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - radio->restore_start_time_);
+    radio->last_restore_duration_ms_ = duration.count();
+    LOGI("Restored session in %" PRId64 " ms",
+         static_cast<int64_t>(duration.count()));
+  }
+}
+
+bool Radio::RestoreSession() {
+  auto start_time = std::chrono::steady_clock::now();
+  std::optional<SessionState> restore_state;
+  {
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    restore_state = restore_state_;
+  }
+
+  bool success = true;
+  if (restore_state.has_value()) {
+    SessionState desired = GetRestoreTarget(restore_state.value());
+    success = ApplySessionState(desired);
+    if (!success) {
+      LOGE("Failed to restore session");
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        restore_state_.reset();
+      }
+
+      auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start_time);
+      last_restore_duration_ms_ = duration.count();
+      LOGI("Restored session in %" PRId64 " ms",
+           static_cast<int64_t>(duration.count()));
+    }
+  }
+
+  return success;
+}
+
 bool Radio::SetMonitoringState() {
-  uint8_t request[5] = {0, 0, 0, static_cast<uint8_t>(
-      (global_metadata_monitoring_enabled_ << 3)),
-      0,
-  };
+  uint8_t monitor_mask = monitor_mask_;
+  uint8_t request[5] = {0, 0, 0, monitor_mask, 0};
   uint8_t response[2];
   bool success = SendCommand(
       Transport::OpCode::SetFeatureMonitorRequest,
@@ -247,13 +758,23 @@ bool Radio::SetMonitoringState() {
     auto status = UnpackStatus(response);
     success = (status == Status::Success);
     if (!success) {
-      LOGE("Set monitoring state failed with 0x%04", PRIx16, status);
+      LOGE("Set monitoring state failed with 0x%04" PRIx16, status);
+    } else {
+      ApplyCommand(Transport::OpCode::SetFeatureMonitorRequest, request);
     }
   }
 
   return success;
 }
 
+bool Radio::SetMonitoringStateAsync(CommandCallback callback, void *context) {
+  uint8_t request[5] = {0, 0, 0, monitor_mask_, 0};
+  return SendCommandAsync(
+      Transport::OpCode::SetFeatureMonitorRequest,
+      Transport::OpCode::SetFeatureMonitorResponse,
+      request, sizeof(request), 100ms, callback, context);
+}
+
 bool Radio::ParseMetadata(const uint8_t *payload, size_t size,
                           Metadata *data) {
   bool success = (size >= 2);
@@ -278,7 +799,8 @@ bool Radio::ParseMetadata(const uint8_t *payload, size_t size,
       }
 
       auto *str = reinterpret_cast<const char *>(&payload[parsing_offset]);
-      PopulateMetadataEventField(data, str_type, std::string(str, length));
+      PopulateMetadataEventField(data, str_type,
+                                 std::string_view(str, length));
       parsing_offset += length;
     }
   }
@@ -286,47 +808,252 @@ bool Radio::ParseMetadata(const uint8_t *payload, size_t size,
   return success;
 }
 
+void Radio::ApplyMetadata(const Metadata& data, NowPlaying *entry) {
+  if (data.artist.has_value()) {
+    entry->artist.Set(data.artist.value());
+  }
+
+  if (data.title.has_value()) {
+    entry->title.Set(data.title.value());
+  }
+
+  if (data.album.has_value()) {
+    entry->album.Set(data.album.value());
+  }
+
+  if (data.record_label.has_value()) {
+    entry->record_label.Set(data.record_label.value());
+  }
+
+  if (data.composer.has_value()) {
+    entry->composer.Set(data.composer.value());
+  }
+
+  if (data.alt_artist.has_value()) {
+    entry->alt_artist.Set(data.alt_artist.value());
+  }
+
+  if (data.comments.has_value()) {
+    entry->comments.Set(data.comments.value());
+  }
+}
+
 void Radio::HandleMetadataPacket(const uint8_t *payload, size_t size) {
   if (size < 2) {
     LOGE("Short metadata packet");
   } else {
     Metadata data;
     uint8_t channel_id = payload[0];
-    if (ParseMetadata(&payload[1], size - 1, &data)) {
-      event_handler_->OnMetadataChange(channel_id, data);
+    if (!ParseMetadata(&payload[1], size - 1, &data)) {
+      InvalidateQueries(Transport::OpCode::GetChannelRequest, channel_id);
+    } else {
+      UpdateCachedDescriptor(channel_id, &payload[1], size - 1);
+      now_playing_.Update(channel_id, [&](NowPlaying *entry) {
+        ApplyMetadata(data, entry);
+      });
+      if (!CoalesceMetadata(channel_id, &data)) {
+        DispatchMetadata(channel_id, data);
+      }
     }
   }
 }
 
+void Radio::DispatchMetadata(uint8_t channel_id, const Metadata& data) {
+  ALLOC_SCOPE(HandlerDispatch);
+  event_handler_->OnMetadataChange(channel_id, data);
+}
+
+bool Radio::CoalesceMetadata(uint8_t channel_id, Metadata *data) {
+  std::unique_lock<std::mutex> lock(coalesce_mutex_);
+  if (coalesce_window_.count() == 0) {
+    return false;
+  }
+
+  coalescing_stats_.packets++;
+  PendingMetadata& pending = coalesce_slots_[channel_id];
+  if (!pending.active) {
+    pending.active = true;
+    pending.deadline = std::chrono::steady_clock::now() + coalesce_window_;
+    pending.metadata = std::move(*data);
+    coalesce_active_count_++;
+    return true;
+  }
+
+  if (MergeMetadata(*data, &pending.metadata)) {
+    return true;
+  }
+
+  // The change conflicts with the pending one, which is delivered early so
+  // that this one can open a new window.
+  Metadata flushed = std::move(pending.metadata);
+  pending.deadline = std::chrono::steady_clock::now() + coalesce_window_;
+  pending.metadata = std::move(*data);
+  coalescing_stats_.events++;
+  coalescing_stats_.early_flushes++;
+  lock.unlock();
+
+  DispatchMetadata(channel_id, flushed);
+  return true;
+}
+
+bool Radio::MergeMetadata(const Metadata& part, Metadata *merged) {
+  auto agrees = [](const auto& part_field, const auto& merged_field) {
+    return !part_field.has_value() || !merged_field.has_value()
+        || std::string_view(part_field.value())
+            == std::string_view(merged_field.value());
+  };
+
+  bool promo_text_agrees = (part.promo_text.empty()
+      || merged->promo_text.empty()
+      || (part.promo_text.size() == merged->promo_text.size()
+          && std::equal(part.promo_text.begin(), part.promo_text.end(),
+                        merged->promo_text.begin(),
+                        [](const String& a, const String& b) {
+                          return std::string_view(a) == std::string_view(b);
+                        })));
+  if (!agrees(part.artist, merged->artist)
+      || !agrees(part.title, merged->title)
+      || !agrees(part.album, merged->album)
+      || !agrees(part.record_label, merged->record_label)
+      || !agrees(part.composer, merged->composer)
+      || !agrees(part.alt_artist, merged->alt_artist)
+      || !agrees(part.comments, merged->comments)
+      || !promo_text_agrees) {
+    return false;
+  }
+
+  auto merge = [](const auto& part_field, auto *merged_field) {
+    if (part_field.has_value() && !merged_field->has_value()) {
+      *merged_field = part_field;
+    }
+  };
+
+  merge(part.artist, &merged->artist);
+  merge(part.title, &merged->title);
+  merge(part.album, &merged->album);
+  merge(part.record_label, &merged->record_label);
+  merge(part.composer, &merged->composer);
+  merge(part.alt_artist, &merged->alt_artist);
+  merge(part.comments, &merged->comments);
+  if (merged->promo_text.empty()) {
+    merged->promo_text = part.promo_text;
+  }
+
+  return true;
+}
+
+void Radio::FlushCoalescedMetadata(std::chrono::steady_clock::time_point now) {
+  Metadata flushed;
+  std::unique_lock<std::mutex> lock(coalesce_mutex_);
+  for (size_t i = 0; i < coalesce_slots_.size() && coalesce_active_count_ > 0;
+       i++) {
+    PendingMetadata& pending = coalesce_slots_[i];
+    if (!pending.active || pending.deadline > now) {
+      continue;
+    }
+
+    flushed = std::move(pending.metadata);
+    pending.metadata = Metadata();
+    pending.active = false;
+    coalesce_active_count_--;
+    coalescing_stats_.events++;
+    lock.unlock();
+
+    DispatchMetadata(static_cast<uint8_t>(i), flushed);
+    lock.lock();
+  }
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+    Radio::GetCoalescingDeadline() const {
+  std::lock_guard<std::mutex> lock(coalesce_mutex_);
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  if (coalesce_active_count_ == 0) {
+    return deadline;
+  }
+
+  for (const auto& pending : coalesce_slots_) {
+    if (pending.active
+        && (!deadline.has_value() || pending.deadline < deadline.value())) {
+      deadline = pending.deadline;
+    }
+  }
+
+  return deadline;
+}
+
+void Radio::HandleSignalPacket(const uint8_t *payload, size_t size) {
+  if (size < 3) {
+    LOGE("Short signal packet");
+  } else if (!SignalStrengthIsValid(payload[0])
+      || !SignalStrengthIsValid(payload[1])
+      || !SignalStrengthIsValid(payload[2])) {
+    LOGE("Invalid signal packet");
+  } else {
+    InvalidateQueries(Transport::OpCode::GetSignalRequest);
+    ALLOC_SCOPE(HandlerDispatch);
+    event_handler_->OnSignalStrengthChange(
+        static_cast<SignalStrength>(payload[0]),
+        static_cast<SignalStrength>(payload[1]),
+        static_cast<SignalStrength>(payload[2]));
+  }
+}
+
+void Radio::HandleChannelPacket(const uint8_t *payload, size_t size) {
+  if (size < 1) {
+    LOGE("Short channel packet");
+  } else {
+    InvalidateQueries(Transport::OpCode::GetChannelRequest, payload[0]);
+    {
+      std::lock_guard<std::mutex> lock(session_mutex_);
+      session_.channel_id = payload[0];
+    }
+
+    ALLOC_SCOPE(HandlerDispatch);
+    event_handler_->OnTunedChannelChange(payload[0]);
+  }
+}
+
+Radio::String Radio::MakeString(std::string_view text) const {
+  if (!normalize_text_) {
+    return String(text);
+  }
+
+  char normalized[kMaxNormalizedSize];
+  size_t size = TextNormalizer::Normalize(text, normalized,
+                                          sizeof(normalized));
+  return String(std::string_view(normalized, size));
+}
+
 void Radio::PopulateMetadataEventField(
-    Metadata *data, uint8_t str_type, std::string str) {
+    Metadata *data, uint8_t str_type, std::string_view str) {
   switch (static_cast<MetadataType>(str_type)) {
     case MetadataType::Artist:
-      data->artist = str;
+      data->artist = MakeString(str);
       break;
     case MetadataType::Title:
-      data->title = str;
+      data->title = MakeString(str);
       break;
     case MetadataType::Album:
-      data->album = str;
+      data->album = MakeString(str);
       break;
     case MetadataType::RecordLabel:
-      data->record_label = str;
+      data->record_label = MakeString(str);
       break;
     case MetadataType::Composer:
-      data->composer = str;
+      data->composer = MakeString(str);
       break;
     case MetadataType::AltArtist:
-      data->alt_artist = str;
+      data->alt_artist = MakeString(str);
       break;
     case MetadataType::Comments:
-      data->comments = str;
+      data->comments = MakeString(str);
       break;
     case MetadataType::PromoText1:
     case MetadataType::PromoText2:
     case MetadataType::PromoText3:
     case MetadataType::PromoText4:
-      data->promo_text.push_back(str);
+      data->promo_text.push_back(MakeString(str));
       break;
     case MetadataType::SongId:
     case MetadataType::ArtistId:
@@ -344,34 +1071,553 @@ bool Radio::SendCommand(Transport::OpCode request_op_code,
                         const uint8_t *command, size_t command_size,
                         uint8_t *response, size_t response_size,
                         std::chrono::milliseconds timeout) {
+  TRACE_SCOPE_ARG("SendCommand", "op", request_op_code);
+  ALLOC_SCOPE(RadioCommand);
+  CommandWaiter waiter(this);
+  std::unique_lock<std::mutex> command_lock(command_mutex_, std::defer_lock);
+  {
+    TRACE_SCOPE("WaitCommandLock");
+    command_lock.lock();
+  }
+
   std::unique_lock<std::mutex> lock(mutex_);
+  WaitForAsyncCommand(lock);
+  if (!link_up_) {
+    LOGE("Request 0x%04" PRIx16 " failed, link is down",
+         static_cast<uint16_t>(request_op_code));
+    unanswered_commands_++;
+    return false;
+  }
+
   response_op_code_ = response_op_code;
   response_ = response;
   response_size_ = response_size;
+  command_state_ = CommandState::Pending;
 
+  // The lock is released while sending as the receive loop may need it to
+  // make space in the transmit queue.
+  lock.unlock();
   transport_.SendMessageFrame(request_op_code, command, command_size);
-  bool timed_out = (cv_.wait_for(lock, timeout) == std::cv_status::timeout);
-  if (timed_out) {
-    LOGE("Request 0x%04" PRIx16 " timed out", request_op_code);
+  lock.lock();
+
+  {
+    TRACE_SCOPE("WaitResponse");
+    cv_.wait_for(lock, timeout, [this]() {
+      return command_state_ != CommandState::Pending;
+    });
+  }
+
+  CommandState state = command_state_;
+  command_state_ = CommandState::Idle;
+  PumpAsyncCommands(lock);
+  if (state != CommandState::Complete) {
+    unanswered_commands_++;
+  }
+
+  if (state == CommandState::Pending) {
+    LOGE("Request 0x%04" PRIx16 " timed out",
+         static_cast<uint16_t>(request_op_code));
+  } else if (state == CommandState::Failed) {
+    LOGE("Request 0x%04" PRIx16 " failed, link lost",
+         static_cast<uint16_t>(request_op_code));
+  }
+
+  return (state == CommandState::Complete);
+}
+
+bool Radio::SendQuery(Transport::OpCode request_op_code,
+                      Transport::OpCode response_op_code,
+                      const uint8_t *command, size_t command_size,
+                      uint8_t *response, size_t response_size,
+                      std::chrono::milliseconds timeout) {
+  ALLOC_SCOPE(RadioCommand);
+#ifdef DOGTRICKS_NO_HEAP
+  {
+    std::lock_guard<std::mutex> lock(query_mutex_);
+    query_stats_.wire_requests++;
+  }
+
+  return SendCommand(request_op_code, response_op_code, command, command_size,
+                     response, response_size, timeout);
+#else
+  QueryKey key;
+  key.push_back(static_cast<uint16_t>(request_op_code) >> 8);
+  key.push_back(static_cast<uint16_t>(request_op_code));
+  key.insert(key.end(), command, command + command_size);
+
+  std::unique_lock<std::mutex> lock(query_mutex_);
+  auto now = std::chrono::steady_clock::now();
+  auto ttl = query_cache_ttls_.find(request_op_code);
+  if (ttl != query_cache_ttls_.end()) {
+    auto entry = query_cache_.find(key);
+    if (entry != query_cache_.end()) {
+      if (now < entry->second.expiry) {
+        query_stats_.cache_hits++;
+        if (entry->second.prefetched) {
+          query_stats_.prefetch_hits++;
+          entry->second.prefetched = false;
+        }
+
+        memcpy(response, entry->second.response.data(),
+               std::min(response_size, entry->second.response.size()));
+        return true;
+      }
+
+      query_cache_.erase(entry);
+    }
+  }
+
+  std::shared_ptr<QueryFlight> flight;
+  auto flight_it = query_flights_.find(key);
+  if (flight_it != query_flights_.end()) {
+    flight = flight_it->second;
+    query_stats_.coalesced++;
+    query_cv_.wait(lock, [&flight]() { return flight->done; });
+  } else {
+    flight = std::make_shared<QueryFlight>();
+    flight->response.resize(response_size);
+    query_flights_[key] = flight;
+    query_stats_.wire_requests++;
+    lock.unlock();
+
+    bool success = SendCommand(request_op_code, response_op_code,
+                               command, command_size,
+                               flight->response.data(), response_size,
+                               timeout);
+
+    lock.lock();
+    flight->success = success;
+    flight->done = true;
+    query_flights_.erase(key);
+
+    // Only successful responses are cached, and only if no event has
+    // indicated that the response may be out of date while it was in flight.
+    ttl = query_cache_ttls_.find(request_op_code);
+    if (success && ttl != query_cache_ttls_.end() && !flight->stale
+        && UnpackStatus(flight->response.data()) == Status::Success) {
+      QueryCacheEntry& entry = query_cache_[key];
+      entry.expiry = std::chrono::steady_clock::now() + ttl->second;
+      entry.response = flight->response;
+    }
+
+    query_cv_.notify_all();
+  }
+
+  if (flight->success) {
+    memcpy(response, flight->response.data(),
+           std::min(response_size, flight->response.size()));
+  }
+
+  return flight->success;
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::InvalidateQueries(Transport::OpCode request_op_code,
+                              std::optional<uint8_t> channel_id) {
+#ifndef DOGTRICKS_NO_HEAP
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  if (query_cache_ttls_.find(request_op_code) != query_cache_ttls_.end()) {
+    InvalidateQueriesLocked(request_op_code, channel_id);
+  }
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::UpdateCachedDescriptor(uint8_t channel_id,
+                                   const uint8_t *metadata, size_t size) {
+#ifndef DOGTRICKS_NO_HEAP
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  if (query_cache_ttls_.find(Transport::OpCode::GetChannelRequest)
+      == query_cache_ttls_.end()) {
+    return;
+  }
+
+  // An outstanding request may have been answered before the put, so it is
+  // still not cached, but a cached descriptor only needs the new fields.
+  auto descriptor = query_cache_.extract(GetDescriptorQueryKey(channel_id));
+  InvalidateQueriesLocked(Transport::OpCode::GetChannelRequest, channel_id);
+  if (!descriptor.empty() && MergeDescriptorMetadata(
+      metadata, size, &descriptor.mapped().response)) {
+    query_cache_.insert(std::move(descriptor));
+  }
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+#ifndef DOGTRICKS_NO_HEAP
+void Radio::InvalidateQueriesLocked(Transport::OpCode request_op_code,
+                                    std::optional<uint8_t> channel_id) {
+  // Keys start with the request op code followed by the request payload.
+  // For channel requests, the first byte of the payload is the channel, so
+  // the matching keys form one range of each map.
+  uint16_t op_code = static_cast<uint16_t>(request_op_code);
+  QueryKey prefix = {
+    static_cast<uint8_t>(op_code >> 8), static_cast<uint8_t>(op_code),
+  };
+  if (channel_id.has_value()) {
+    prefix.push_back(channel_id.value());
+  }
+
+  auto matches = [&prefix](const QueryKey& key) {
+    return key.size() >= prefix.size()
+        && std::equal(prefix.begin(), prefix.end(), key.begin());
+  };
+
+  auto flight = query_flights_.lower_bound(prefix);
+  for (; flight != query_flights_.end() && matches(flight->first); ++flight) {
+    flight->second->stale = true;
   }
 
-  return !timed_out;
+  auto entry = query_cache_.lower_bound(prefix);
+  while (entry != query_cache_.end() && matches(entry->first)) {
+    entry = query_cache_.erase(entry);
+  }
+
+  if (prefetch_active_
+      && request_op_code == Transport::OpCode::GetChannelRequest
+      && (!channel_id.has_value() || channel_id.value() == prefetch_channel_)) {
+    prefetch_invalidated_ = true;
+  }
+}
+
+bool Radio::MergeDescriptorMetadata(const uint8_t *metadata, size_t size,
+                                    std::vector<uint8_t> *response) {
+  // The metadata follows the header and the four length prefixed names, as
+  // parsed by GetChannelDescriptor.
+  const std::vector<uint8_t>& cached = *response;
+  size_t offset = 7;
+  for (size_t i = 0; i < 4 && offset < cached.size(); i++) {
+    offset += cached[offset] + 1;
+  }
+
+  if (offset >= cached.size()) {
+    return false;
+  }
+
+  // Note the types set by the put. Its fields were bounds checked when it was
+  // parsed.
+  bool replaced[UINT8_MAX + 1] = {};
+  size_t put_end = 1;
+  for (uint8_t i = 0; i < metadata[0] && put_end + 1 < size; i++) {
+    replaced[metadata[put_end]] = true;
+    put_end += metadata[put_end + 1] + 2;
+  }
+
+  std::vector<uint8_t> merged(cached.begin(), cached.begin() + offset + 1);
+  size_t field_count = metadata[0];
+  size_t field_offset = offset + 1;
+  for (uint8_t i = 0; i < cached[offset]; i++) {
+    if (field_offset + 1 >= cached.size()
+        || field_offset + cached[field_offset + 1] + 2 > cached.size()) {
+      return false;
+    }
+
+    size_t field_size = cached[field_offset + 1] + 2;
+    if (!replaced[cached[field_offset]]) {
+      merged.insert(merged.end(), cached.begin() + field_offset,
+                    cached.begin() + field_offset + field_size);
+      field_count++;
+    }
+
+    field_offset += field_size;
+  }
+
+  merged.insert(merged.end(), metadata + 1, metadata + put_end);
+  if (field_count > UINT8_MAX || merged.size() > UINT8_MAX) {
+    return false;
+  }
+
+  // Sized as the buffer of GetChannelDescriptor, as for a flight.
+  merged[offset] = static_cast<uint8_t>(field_count);
+  merged.resize(UINT8_MAX);
+  response->swap(merged);
+  return true;
+}
+#endif  // DOGTRICKS_NO_HEAP
+
+void Radio::InvalidateAllQueries() {
+#ifndef DOGTRICKS_NO_HEAP
+  std::lock_guard<std::mutex> lock(query_mutex_);
+  for (auto& flight : query_flights_) {
+    flight.second->stale = true;
+  }
+
+  query_cache_.clear();
+  prefetch_invalidated_ = prefetch_active_;
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::BeginTune(uint8_t channel_id) {
+  tune_start_ns_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count(),
+      std::memory_order_relaxed);
+  tune_channel_.store(channel_id, std::memory_order_release);
+}
+
+void Radio::CancelTune(uint8_t channel_id) {
+  int expected = channel_id;
+  tune_channel_.compare_exchange_strong(expected, kNoTune);
+}
+
+void Radio::RecordTuneLatency(const uint8_t *payload, size_t size) {
+  int expected = tune_channel_.load(std::memory_order_acquire);
+  if (expected != kNoTune && size > 0 && payload[0] == expected
+      && tune_channel_.compare_exchange_strong(expected, kNoTune)) {
+    int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    tune_latency_.Record(std::chrono::nanoseconds(
+        now_ns - tune_start_ns_.load(std::memory_order_relaxed)));
+  }
+}
+
+bool Radio::SchedulePrefetch(uint8_t channel_id) {
+#ifdef DOGTRICKS_NO_HEAP
+  return false;
+#else
+  {
+    std::lock_guard<std::mutex> lock(query_mutex_);
+    if (prefetch_adjacent_count_ == 0) {
+      return false;
+    }
+
+    // Channels are fetched nearest first, alternating up and down the
+    // lineup and wrapping at its ends, followed by recently tuned channels.
+    std::vector<uint8_t> candidates;
+    auto tuned = std::find(lineup_.begin(), lineup_.end(), channel_id);
+    if (tuned != lineup_.end()) {
+      size_t index = tuned - lineup_.begin();
+      size_t count = std::min(prefetch_adjacent_count_,
+                              (lineup_.size() - 1) / 2);
+      for (size_t distance = 1; distance <= count; distance++) {
+        candidates.push_back(lineup_[(index + distance) % lineup_.size()]);
+        candidates.push_back(lineup_[
+            (index + lineup_.size() - distance) % lineup_.size()]);
+      }
+    }
+
+    candidates.insert(candidates.end(), recent_channels_.begin(),
+                      recent_channels_.end());
+
+    auto now = std::chrono::steady_clock::now();
+    prefetch_queue_.clear();
+    for (uint8_t candidate : candidates) {
+      auto entry = query_cache_.find(GetDescriptorQueryKey(candidate));
+      bool cached = (entry != query_cache_.end() && now < entry->second.expiry);
+      if (candidate != channel_id && !cached
+          && std::find(prefetch_queue_.begin(), prefetch_queue_.end(),
+                       candidate) == prefetch_queue_.end()) {
+        prefetch_queue_.push_back(candidate);
+      }
+    }
+
+    recent_channels_.erase(std::remove(recent_channels_.begin(),
+        recent_channels_.end(), channel_id), recent_channels_.end());
+    recent_channels_.push_front(channel_id);
+    if (recent_channels_.size() > kRecentChannelCount) {
+      recent_channels_.pop_back();
+    }
+  }
+
+  PumpPrefetch();
+  return true;
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::PumpPrefetch() {
+#ifndef DOGTRICKS_NO_HEAP
+  uint8_t request[] = { 0, 0, 0, 0 };
+  {
+    std::lock_guard<std::mutex> lock(query_mutex_);
+    if (prefetch_active_ || prefetch_queue_.empty()
+        || command_waiters_.load() > 0) {
+      return;
+    }
+
+    prefetch_channel_ = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+    prefetch_active_ = true;
+    prefetch_invalidated_ = false;
+    request[0] = prefetch_channel_;
+  }
+
+  if (!SendCommandAsync(Transport::OpCode::GetChannelRequest,
+                        Transport::OpCode::GetChannelResponse,
+                        request, sizeof(request), 100ms,
+                        &Radio::OnPrefetchComplete, this)) {
+    std::lock_guard<std::mutex> lock(query_mutex_);
+    prefetch_active_ = false;
+    prefetch_queue_.clear();
+  }
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::OnPrefetchComplete(void *context, bool success,
+                               const uint8_t *response,
+                               size_t response_size) {
+#ifndef DOGTRICKS_NO_HEAP
+  Radio *radio = static_cast<Radio *>(context);
+  {
+    std::lock_guard<std::mutex> lock(radio->query_mutex_);
+    radio->prefetch_active_ = false;
+    auto ttl = radio->query_cache_ttls_.find(
+        Transport::OpCode::GetChannelRequest);
+    if (!success) {
+      // Give up on the rest rather than keep a failing link busy.
+      radio->prefetch_queue_.clear();
+    } else if (!radio->prefetch_invalidated_
+        && ttl != radio->query_cache_ttls_.end()) {
+      QueryCacheEntry& entry = radio->query_cache_[
+          GetDescriptorQueryKey(radio->prefetch_channel_)];
+      entry.expiry = std::chrono::steady_clock::now() + ttl->second;
+      // Sized as the buffer of GetChannelDescriptor, as for a flight.
+      entry.response.assign(response, response + response_size);
+      entry.response.resize(UINT8_MAX);
+      entry.prefetched = true;
+      radio->query_stats_.prefetches++;
+    }
+  }
+
+  radio->PumpPrefetch();
+#endif  // DOGTRICKS_NO_HEAP
+}
+
+void Radio::ApplyCommand(Transport::OpCode request_op_code,
+                         const uint8_t *command) {
+  switch (request_op_code) {
+    case Transport::OpCode::SetPowerModeRequest: {
+      std::lock_guard<std::mutex> lock(session_mutex_);
+      session_.power_state = static_cast<PowerState>(command[0]);
+      break;
+    }
+    case Transport::OpCode::SetChannelRequest: {
+      // While prefetching, the cached descriptor of the new channel is kept
+      // as it is likely to be requested next.
+      if (!SchedulePrefetch(command[0])) {
+        InvalidateQueries(Transport::OpCode::GetChannelRequest, command[0]);
+      }
+
+      std::lock_guard<std::mutex> lock(session_mutex_);
+      session_.channel_id = command[0];
+      break;
+    }
+    case Transport::OpCode::SetFeatureMonitorRequest: {
+      std::lock_guard<std::mutex> lock(session_mutex_);
+      session_.monitor_mask = command[3];
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void Radio::WaitForAsyncCommand(std::unique_lock<std::mutex>& lock) {
+  while (async_active_) {
+    // Without an external event loop calling ProcessDeadline, the deadline
+    // is enforced here.
+    cv_.wait_until(lock, async_deadline_);
+    if (async_active_
+        && std::chrono::steady_clock::now() >= async_deadline_) {
+      LOGE("Request 0x%04" PRIx16 " timed out", static_cast<uint16_t>(
+          async_queue_[async_head_].request_op_code));
+      CompleteAsyncCommand(lock, false /* received */);
+    }
+  }
+}
+
+void Radio::PumpAsyncCommands(std::unique_lock<std::mutex>& lock) {
+  while (!async_active_ && async_count_ > 0
+      && command_state_ == CommandState::Idle) {
+    if (!link_up_) {
+      LOGE("Request 0x%04" PRIx16 " failed, link is down",
+           static_cast<uint16_t>(async_queue_[async_head_].request_op_code));
+      CompleteAsyncCommand(lock, false /* received */);
+      continue;
+    }
+
+    // The command is copied as the lock is released while sending, for the
+    // same reason as in SendCommand.
+    AsyncCommand command = async_queue_[async_head_];
+    async_active_ = true;
+    async_deadline_ = std::chrono::steady_clock::now() + command.timeout;
+    lock.unlock();
+    transport_.SendMessageFrame(command.request_op_code, command.command,
+                                command.command_size);
+    lock.lock();
+  }
+}
+
+void Radio::CompleteAsyncCommand(std::unique_lock<std::mutex>& lock,
+                                 bool received) {
+  AsyncCommand command = async_queue_[async_head_];
+  async_head_ = (async_head_ + 1) % kAsyncCommandQueueSize;
+  async_count_--;
+  async_active_ = false;
+  if (!received) {
+    unanswered_commands_++;
+  }
+
+  uint8_t response[UINT8_MAX];
+  size_t response_size = received ? async_response_size_ : 0;
+  memcpy(response, async_response_, response_size);
+  cv_.notify_all();
+  lock.unlock();
+
+  bool success = received;
+  if (success) {
+    success = (response_size >= 2
+        && UnpackStatus(response) == Status::Success);
+    if (!success) {
+      LOGE("Request 0x%04" PRIx16 " failed with 0x%04" PRIx16,
+           static_cast<uint16_t>(command.request_op_code),
+           (response_size >= 2) ? Transport::UnpackUInt16(response) : 0);
+    } else {
+      ApplyCommand(command.request_op_code, command.command);
+    }
+  }
+
+  if (!success
+      && command.request_op_code == Transport::OpCode::SetChannelRequest) {
+    CancelTune(command.command[0]);
+  }
+
+  if (command.callback != nullptr) {
+    command.callback(command.context, success,
+                     received ? response : nullptr, response_size);
+  }
+
+  lock.lock();
 }
 
 bool Radio::WaitPut(Transport::OpCode put_op_code,
                     uint8_t *put, size_t put_size,
                     std::chrono::milliseconds timeout) {
+  std::lock_guard<std::mutex> command_lock(command_mutex_);
   std::unique_lock<std::mutex> lock(mutex_);
+  WaitForAsyncCommand(lock);
+  if (!link_up_) {
+    LOGE("Put 0x%04" PRIx16 " failed, link is down",
+         static_cast<uint16_t>(put_op_code));
+    return false;
+  }
+
   response_op_code_ = put_op_code;
   response_ = put;
   response_size_ = put_size;
+  command_state_ = CommandState::Pending;
+
+  cv_.wait_for(lock, timeout, [this]() {
+    return command_state_ != CommandState::Pending;
+  });
 
-  bool timed_out = (cv_.wait_for(lock, timeout) == std::cv_status::timeout);
-  if (timed_out) {
-    LOGE("Put 0x%04" PRIx16 " timed out", put_op_code);
+  CommandState state = command_state_;
+  command_state_ = CommandState::Idle;
+  PumpAsyncCommands(lock);
+  if (state == CommandState::Pending) {
+    LOGE("Put 0x%04" PRIx16 " timed out", static_cast<uint16_t>(put_op_code));
+  } else if (state == CommandState::Failed) {
+    LOGE("Put 0x%04" PRIx16 " failed, link lost",
+         static_cast<uint16_t>(put_op_code));
   }
 
-  return !timed_out;
+  return (state == CommandState::Complete);
 }
 
 }  // namespace dogtricks
@@ -17,13 +17,22 @@
 #ifndef DOGTRICKS_RADIO_H_
 #define DOGTRICKS_RADIO_H_
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "fixed_containers.h"
+#include "latency_histogram.h"
 #include "non_copyable.h"
+#include "now_playing_table.h"
 #include "transport.h"
 
 namespace dogtricks {
@@ -35,9 +44,39 @@ namespace dogtricks {
 class Radio : public Transport::EventHandler,
               public NonCopyable {
  public:
+  //! The maximum number of promotional strings in a metadata change.
+  static constexpr size_t kMaxPromoText = 4;
+
+  //! The maximum number of asynchronous commands that may be waiting.
+  static constexpr size_t kAsyncCommandQueueSize = 8;
+
+#ifdef DOGTRICKS_NO_HEAP
+  //! A typedef for a string sent by the radio, which is at most 255 bytes.
+  typedef FixedString<UINT8_MAX> String;
+
+  //! The maximum size of a string once normalized.
+  static constexpr size_t kMaxNormalizedSize = UINT8_MAX;
+
+  //! A typedef for a list of channels.
+  typedef FixedVector<uint8_t, UINT8_MAX + 1> ChannelList;
+
+  //! A typedef for a list of promotional strings.
+  typedef FixedVector<String, kMaxPromoText> PromoTextList;
+#else
+  //! A typedef for a string sent by the radio.
+  typedef std::string String;
+
+  //! The maximum size of a string once normalized, allowing every byte of a
+  //! Latin-1 string to be transcoded to two bytes of UTF-8.
+  static constexpr size_t kMaxNormalizedSize = 2 * UINT8_MAX;
+
   //! A typedef for a list of channels.
   typedef std::vector<uint8_t> ChannelList;
 
+  //! A typedef for a list of promotional strings.
+  typedef std::vector<String> PromoTextList;
+#endif  // DOGTRICKS_NO_HEAP
+
   /**
    * The possible power states of the radio.
    */
@@ -73,6 +112,28 @@ class Radio : public Transport::EventHandler,
    */
   static const char *GetSignalDescription(SignalStrength value);
 
+  /**
+   * The categories of unsolicited put messages that the radio can be asked to
+   * send. The value of each is the bit index in the feature monitor request.
+   */
+  enum class MonitorFeature : uint8_t {
+    //! Signal strength changes, delivered as PutSignalResponse.
+    SignalStrength = 0,
+
+    //! Changes to the channel being decoded, delivered as PutChannelResponse.
+    TunedChannel = 1,
+
+    //! Metadata changes for all channels, delivered as PutPdtResponse.
+    GlobalMetadata = 3,
+  };
+
+  /**
+   * @return the bit for the supplied feature in a monitor mask.
+   */
+  static uint8_t GetMonitorBit(MonitorFeature feature) {
+    return (1 << static_cast<uint8_t>(feature));
+  }
+
   /**
    * A grouping of metadata.
    *
@@ -81,28 +142,28 @@ class Radio : public Transport::EventHandler,
    */
   struct Metadata {
     //! Set when the artist changed.
-    std::optional<std::string> artist;
+    std::optional<String> artist;
 
     //! Set when the title changed.
-    std::optional<std::string> title;
+    std::optional<String> title;
 
     //! Set when the album changed.
-    std::optional<std::string> album;
+    std::optional<String> album;
 
     //! Set when the record label changes.
-    std::optional<std::string> record_label;
+    std::optional<String> record_label;
 
     //! Set when the composer changes.
-    std::optional<std::string> composer;
+    std::optional<String> composer;
 
     //! Set when the alternate artist changes.
-    std::optional<std::string> alt_artist;
+    std::optional<String> alt_artist;
 
     //! Set when the comments change.
-    std::optional<std::string> comments;
+    std::optional<String> comments;
 
     //! Promotional strings.
-    std::vector<std::string> promo_text;
+    PromoTextList promo_text;
   };
 
   /**
@@ -118,21 +179,72 @@ class Radio : public Transport::EventHandler,
     uint8_t category_id;
 
     //! The short name.
-    std::string short_name;
+    String short_name;
 
     //! The long name.
-    std::string long_name;
+    String long_name;
 
     //! The short category name.
-    std::string short_category_name;
+    String short_category_name;
 
     //! The long category name.
-    std::string long_category_name;
+    String long_category_name;
 
     //! The current metadata for the channel.
     Metadata metadata;
   };
 
+  /**
+   * The configuration of the radio that has been established by successful
+   * commands. This is what must be reissued to restore a session.
+   */
+  struct SessionState {
+    //! The power state of the radio, if known.
+    std::optional<PowerState> power_state;
+
+    //! The channel being decoded, if known.
+    std::optional<uint8_t> channel_id;
+
+    //! The bitmask of monitoring features that are enabled, indexed by
+    //! MonitorFeature.
+    uint8_t monitor_mask = 0;
+  };
+
+  /**
+   * Counters describing how idempotent queries were answered.
+   */
+  struct QueryStats {
+    //! The number of queries that were sent to the radio.
+    uint64_t wire_requests;
+
+    //! The number of queries that shared an identical outstanding request.
+    uint64_t coalesced;
+
+    //! The number of queries answered from the result cache.
+    uint64_t cache_hits;
+
+    //! The number of channel descriptors fetched speculatively.
+    uint64_t prefetches;
+
+    //! The number of queries answered by a speculatively fetched response.
+    uint64_t prefetch_hits;
+  };
+
+  /**
+   * Counters describing how metadata puts were coalesced into events.
+   */
+  struct CoalescingStats {
+    //! The number of metadata puts held for coalescing.
+    uint64_t packets;
+
+    //! The number of metadata events delivered for the held puts.
+    uint64_t events;
+
+    //! The number of events delivered before their window ended because a
+    //! put changed a pending field again.
+    uint64_t early_flushes;
+  };
+
   /**
    * Handles events from the radio such as status, metadata changes and
    * signal strength changes.
@@ -144,8 +256,36 @@ class Radio : public Transport::EventHandler,
      */
     virtual void OnMetadataChange(uint8_t channel_id,
                                   const Metadata& event) = 0;
+
+    /**
+     * Invoked when the signal strength has changed. This requires that the
+     * SignalStrength feature is being monitored.
+     */
+    virtual void OnSignalStrengthChange(SignalStrength summary,
+                                        SignalStrength satellite,
+                                        SignalStrength terrestrial) {}
+
+    /**
+     * Invoked when the channel being decoded has changed. This requires that
+     * the TunedChannel feature is being monitored.
+     */
+    virtual void OnTunedChannelChange(uint8_t channel_id) {}
   };
 
+  /**
+   * Invoked when an asynchronous command completes.
+   *
+   * @param context The context supplied with the command.
+   * @param success true if the radio responded with a success status, false
+   *                on failure, timeout or loss of the link.
+   * @param response The response payload, starting with the status, or
+   *                 nullptr if no response was received.
+   * @param response_size The size of the response payload.
+   */
+  typedef void (*CommandCallback)(void *context, bool success,
+                                  const uint8_t *response,
+                                  size_t response_size);
+
   /**
    * Setup the radio object with the desired link.
    * 
@@ -157,11 +297,13 @@ class Radio : public Transport::EventHandler,
 
   /**
    * Starts listening from the radio for packets if the transport was opened
-   * successfully. This function blocks or returns false.
+   * successfully. This function blocks or returns false. While started, the
+   * session state is restored from a helper thread whenever the transport
+   * reconnects.
    *
    * @return true when stopped, false if the transport is not open.
    */
-  bool Start() { return transport_.Start(); }
+  bool Start();
 
   /**
    * Stops the receive loop in the radio object. This causes the previous
@@ -169,6 +311,51 @@ class Radio : public Transport::EventHandler,
    */
   void Stop() { transport_.Stop(); }
 
+  /**
+   * @return the file descriptor for an external event loop to watch in place
+   *         of calling Start. See Transport::GetFd.
+   */
+  int GetFd() const {
+    return transport_.GetFd();
+  }
+
+  /**
+   * @return true if an external event loop must also watch for the file
+   *         descriptor becoming writable.
+   */
+  bool IsWritePending() const {
+    return transport_.IsWritePending();
+  }
+
+  /**
+   * Reads from the radio without blocking when the file descriptor is
+   * readable. Events and asynchronous command callbacks are invoked from
+   * this call.
+   */
+  void ProcessReadable() {
+    transport_.ProcessReadable();
+  }
+
+  /**
+   * Writes queued frames without blocking when the file descriptor is
+   * writable.
+   */
+  void ProcessWritable() {
+    transport_.ProcessWritable();
+  }
+
+  /**
+   * @return the time at which ProcessDeadline must next be called by an
+   *         external event loop, or no value if nothing is scheduled.
+   */
+  std::optional<std::chrono::steady_clock::time_point> GetNextDeadline();
+
+  /**
+   * Times out asynchronous commands, delivers coalesced metadata and reopens
+   * a lost device when due. This never blocks.
+   */
+  void ProcessDeadline();
+
   /**
    * @return true if the transport was opened successfully. This must be
    *         queried before other commands can be sent to the radio.
@@ -177,11 +364,88 @@ class Radio : public Transport::EventHandler,
     return transport_.IsOpen();
   }
 
+  /**
+   * Configures whether the transport reopens the serial device after a read
+   * or write failure instead of aborting. Commands fail immediately while
+   * the link is down and the session state is restored once it is back.
+   */
+  void SetReconnectEnabled(bool enabled) {
+    transport_.SetReconnectEnabled(enabled);
+  }
+
+  /**
+   * Enables or disables normalization of the text in channel descriptors and
+   * metadata. When enabled, each string is converted to valid UTF-8 (treating
+   * invalid UTF-8 as Latin-1), stripped of control characters and trimmed as
+   * it is parsed. See TextNormalizer.
+   *
+   * @param enabled true to normalize text, false to pass it through as sent.
+   */
+  void SetTextNormalizationEnabled(bool enabled) {
+    normalize_text_ = enabled;
+  }
+
+  /**
+   * @return the time taken to restore the session state after the most
+   *         recent reconnection, not including reopening the device.
+   */
+  std::chrono::milliseconds GetLastRestoreDuration() const {
+    return std::chrono::milliseconds(last_restore_duration_ms_);
+  }
+
+  /**
+   * @return the underlying transport, for querying link metrics.
+   */
+  const Transport& GetTransport() const {
+    return transport_;
+  }
+
+  /**
+   * @return the live table of what is playing on each channel. This is
+   *         updated from metadata puts and channel descriptors, cleared when
+   *         the radio is reset or the link is lost, and may be read from any
+   *         thread.
+   */
+  const NowPlayingTable& GetNowPlayingTable() const {
+    return now_playing_;
+  }
+
   /**
    * Issues a reset to the device.
    */
   bool Reset();
 
+  /**
+   * Brings the radio to full power, avoiding round trips that are not needed.
+   * The radio is probed with a single signal strength query. If it responds
+   * with a signal and was last known to be in full power mode, the supplied
+   * power mode and channel are adopted as the current session state. The
+   * monitoring state is not adopted, since the probe cannot confirm it. If
+   * it responds without a signal the power mode is reissued. If it does not
+   * respond it is optionally reset before the power mode is set.
+   *
+   * @param last_known The session state persisted from a previous run.
+   * @param allow_reset Whether to reset an unresponsive radio.
+   * @return true if successful, false otherwise.
+   */
+  bool WarmStart(const SessionState& last_known, bool allow_reset);
+
+  /**
+   * Issues the commands needed to move from the current session state to the
+   * supplied state. A power mode or channel that already matches is not
+   * reissued. The monitoring state is always reissued because it cannot be
+   * confirmed.
+   *
+   * @param desired The desired session state. Unset values are ignored.
+   * @return true if successful, false otherwise.
+   */
+  bool ApplySessionState(const SessionState& desired);
+
+  /**
+   * @return the configuration established by successful commands.
+   */
+  SessionState GetSessionState() const;
+
   /**
    * Sets the power state of the radio.
    *
@@ -210,13 +474,68 @@ class Radio : public Transport::EventHandler,
   bool GetSignalStrength(SignalStrength *summary, SignalStrength *satellite,
                          SignalStrength *terrestrial);
 
+  /**
+   * Enables or disables unsolicited updates for one monitoring feature. The
+   * state of the other features is preserved.
+   *
+   * @param feature The feature to configure.
+   * @param enabled Whether or not the radio should push changes.
+   * @return true if successful, false otherwise.
+   */
+  bool SetMonitoringEnabled(MonitorFeature feature, bool enabled);
+
   /**
    * Enables monitoring of metadata changes for all channels.
    *
    * @param enabled Whether or not to enable meta data monitoring.
    * @return true if successful, false otherwise.
    */
-  bool SetGlobalMetadataMonitoringEnabled(bool enabled);
+  bool SetGlobalMetadataMonitoringEnabled(bool enabled) {
+    return SetMonitoringEnabled(MonitorFeature::GlobalMetadata, enabled);
+  }
+
+  /**
+   * Queues a command to be sent once the radio is free and returns without
+   * waiting for the response. This is the way to issue commands when the
+   * radio is driven by an external event loop, from which the blocking
+   * commands must not be called as they wait on that loop. Timeouts are
+   * enforced by ProcessDeadline. Session state is tracked as for the
+   * blocking commands.
+   *
+   * @param request_op_code The request op code.
+   * @param response_op_code The expected response op code.
+   * @param command The command payload, which is copied.
+   * @param command_size The size of the command payload.
+   * @param timeout The amount of time to wait for the response once sent.
+   * @param callback The callback to invoke on completion, or nullptr. This may
+   *                 be invoked before returning if the link is down.
+   * @param context The context to supply to the callback.
+   * @return true if queued, false if the queue is full.
+   */
+  bool SendCommandAsync(Transport::OpCode request_op_code,
+                        Transport::OpCode response_op_code,
+                        const uint8_t *command, size_t command_size,
+                        std::chrono::milliseconds timeout,
+                        CommandCallback callback, void *context);
+
+  /**
+   * Sets the power state of the radio without blocking. See SendCommandAsync.
+   */
+  bool SetPowerModeAsync(PowerState power_state, CommandCallback callback,
+                         void *context);
+
+  /**
+   * Sets the channel to decode without blocking. See SendCommandAsync.
+   */
+  bool SetChannelAsync(uint8_t channel_id, CommandCallback callback,
+                       void *context);
+
+  /**
+   * Enables or disables one monitoring feature without blocking. See
+   * SendCommandAsync.
+   */
+  bool SetMonitoringEnabledAsync(MonitorFeature feature, bool enabled,
+                                 CommandCallback callback, void *context);
 
   /**
    * Reads the list of channels from the radio.
@@ -232,11 +551,98 @@ class Radio : public Transport::EventHandler,
    */
   bool GetChannelDescriptor(uint8_t channel_id, ChannelDescriptor *descriptor);
 
+  /**
+   * Configures caching of successful responses to an idempotent request.
+   * GetSignalRequest, GetChannelListRequest and GetChannelRequest are
+   * supported. Cached responses are also discarded when an event indicates
+   * that they have changed, except that metadata for a channel is merged
+   * into its cached descriptor. Caching and coalescing are not available when
+   * built with DOGTRICKS_NO_HEAP.
+   *
+   * @param request_op_code The request to cache responses for.
+   * @param ttl How long a response remains valid. Zero disables caching.
+   */
+  void SetCacheTtl(Transport::OpCode request_op_code,
+                   std::chrono::milliseconds ttl);
+
+  /**
+   * @return a snapshot of the counters for idempotent queries.
+   */
+  QueryStats GetQueryStats() const;
+
+  /**
+   * @return the number of threads waiting on or sending a blocking command,
+   *         which is a measure of how busy the link is.
+   */
+  size_t GetCommandQueueDepth() const {
+    return static_cast<size_t>(command_waiters_.load());
+  }
+
+  /**
+   * @return the number of commands that timed out or were lost with the
+   *         link, as opposed to those that the radio answered with an error.
+   */
+  uint64_t GetUnansweredCommandCount() const {
+    return unanswered_commands_;
+  }
+
+  /**
+   * Configures speculative fetching of channel descriptors while the link is
+   * idle. After each channel change, the descriptors of the channels next to
+   * the new channel in the lineup and of recently tuned channels are fetched
+   * into the query cache one at a time, so that tuning to one of them is
+   * followed by a descriptor served from memory. A blocking command waits for
+   * at most one speculative request. The lineup is learned from
+   * GetChannelList. Prefetching is not available when built with
+   * DOGTRICKS_NO_HEAP.
+   *
+   * @param adjacent_count The number of channels on each side of the tuned
+   *                       channel to fetch. Zero disables prefetching.
+   * @param ttl How long fetched descriptors remain valid. This also sets the
+   *            cache lifetime of GetChannelRequest.
+   */
+  void SetDescriptorPrefetch(size_t adjacent_count,
+                             std::chrono::milliseconds ttl);
+
+  /**
+   * Configures merging of the metadata puts for a channel that arrive within
+   * a window into a single OnMetadataChange event. The first put for a
+   * channel opens its window and the merged change is delivered when the
+   * window ends, so events are delayed by at most the window. A put that
+   * changes a field that is already pending, such as the title of the next
+   * song, delivers the pending change first. The now playing table is still
+   * updated as each put arrives. Pending changes are delivered from the
+   * receive loop, or from ProcessDeadline with an external event loop.
+   * Storage for every channel is allocated on the first call, so this must
+   * be called before the radio is started when built with DOGTRICKS_NO_HEAP.
+   *
+   * @param window The coalescing window. Zero disables coalescing.
+   */
+  void SetMetadataCoalescing(std::chrono::milliseconds window);
+
+  /**
+   * @return the counters for metadata coalescing.
+   */
+  CoalescingStats GetCoalescingStats() const;
+
+  /**
+   * @return the latencies from requesting a channel change to the first
+   *         metadata received for the new channel.
+   */
+  const LatencyHistogram& GetTuneLatency() const {
+    return tune_latency_;
+  }
+
  protected:
   // Transport::EventHandler methods.
   virtual void OnPacketReceived(Transport::OpCode op_code,
                                 const uint8_t *payload,
                                 size_t payload_size) override;
+  virtual void OnLinkDown() override;
+  virtual void OnLinkUp() override;
+  virtual std::optional<std::chrono::steady_clock::time_point>
+      GetTimerDeadline() override;
+  virtual void OnTimer() override;
 
  private:
   /**
@@ -259,6 +665,36 @@ class Radio : public Transport::EventHandler,
     Empty = 0xe0,
   };
 
+  /**
+   * The progress of the outstanding command.
+   */
+  enum class CommandState : uint8_t {
+    //! No command is outstanding.
+    Idle,
+
+    //! A command is waiting for its response.
+    Pending,
+
+    //! The response has been received.
+    Complete,
+
+    //! The link was lost before the response was received.
+    Failed,
+  };
+
+  //! The number of attempts made to restore the session after reconnecting.
+  static constexpr int kRestoreAttempts = 3;
+
+  //! The number of recently tuned channels whose descriptors are prefetched.
+  static constexpr size_t kRecentChannelCount = 4;
+
+  //! Marks that no channel change is being timed.
+  static constexpr int kNoTune = -1;
+
+  //! The delay between attempts to restore the session.
+  static constexpr std::chrono::milliseconds kRestoreRetryDelay =
+      std::chrono::milliseconds(500);
+
   /**
    * Possible status codes returned by the radio.
    */
@@ -280,23 +716,309 @@ class Radio : public Transport::EventHandler,
   //! The underlying transport to send/receive messages with.
   Transport transport_;
 
+  //! The mutex held for the duration of a command so that only one is
+  //! outstanding with the radio at a time.
+  std::mutex command_mutex_;
+
   //! The mutex to lock shared state.
   std::mutex mutex_;
 
   //! The condition variable used to resume a waiting command.
   std::condition_variable cv_;
 
+  //! The progress of the outstanding command.
+  CommandState command_state_ = CommandState::Idle;
+
   //! The expected response to the current outstanding message.
-  Transport::OpCode response_op_code_;
+  Transport::OpCode response_op_code_ = Transport::OpCode::SetPowerModeRequest;
 
   //! The response buffer to populate with the next response if matching.
-  uint8_t *response_;
+  uint8_t *response_ = nullptr;
 
   //! The size of the response buffer to populate.
-  size_t response_size_;
+  size_t response_size_ = 0;
+
+  //! Set to false while the transport is reconnecting.
+  bool link_up_ = true;
+
+  /**
+   * A command queued by SendCommandAsync.
+   */
+  struct AsyncCommand {
+    //! The request op code.
+    Transport::OpCode request_op_code;
+
+    //! The expected response op code.
+    Transport::OpCode response_op_code;
+
+    //! The command payload.
+    uint8_t command[UINT8_MAX];
+
+    //! The size of the command payload.
+    size_t command_size;
+
+    //! The amount of time to wait for the response once sent.
+    std::chrono::milliseconds timeout;
+
+    //! The callback to invoke on completion.
+    CommandCallback callback;
+
+    //! The context to supply to the callback.
+    void *context;
+  };
+
+  //! The ring of asynchronous commands, the oldest of which may be
+  //! outstanding.
+  AsyncCommand async_queue_[kAsyncCommandQueueSize];
+
+  //! The index of the oldest asynchronous command.
+  size_t async_head_ = 0;
+
+  //! The number of asynchronous commands in the queue.
+  size_t async_count_ = 0;
+
+  //! Set to true while the oldest asynchronous command has been sent and is
+  //! waiting for its response. Blocking commands wait for it to complete.
+  bool async_active_ = false;
+
+  //! The time at which the outstanding asynchronous command times out.
+  std::chrono::steady_clock::time_point async_deadline_;
+
+  //! The response to the outstanding asynchronous command.
+  uint8_t async_response_[UINT8_MAX];
+
+  //! The size of the response to the outstanding asynchronous command.
+  size_t async_response_size_ = 0;
+
+  //! Set to true while Start is running, in which case the session is
+  //! restored by the restore thread rather than with asynchronous commands.
+  bool started_ = false;
+
+  //! The condition variable used to wake the restore thread.
+  std::condition_variable restore_cv_;
 
-  //! Set to true when metadata monitoring is enabled.
-  bool global_metadata_monitoring_enabled_ = false;
+  //! Set to true when the link has been reestablished and the session state
+  //! must be restored.
+  bool restore_pending_ = false;
+
+  //! Set to true when the restore thread must exit.
+  bool restore_exit_ = false;
+
+  //! The session state captured when the link was lost, cleared once it has
+  //! been restored. Locked by the session mutex.
+  std::optional<SessionState> restore_state_;
+
+  //! The time taken by the most recent restore in milliseconds.
+  std::atomic<int64_t> last_restore_duration_ms_ = 0;
+
+  //! The number of asynchronous restore commands that have not completed.
+  //! Locked by the session mutex.
+  size_t restore_commands_pending_ = 0;
+
+  //! Set to true if an asynchronous restore command failed. Locked by the
+  //! session mutex.
+  bool restore_failed_ = false;
+
+  //! The time at which the asynchronous restore started. Locked by the
+  //! session mutex.
+  std::chrono::steady_clock::time_point restore_start_time_;
+
+  //! Set to true when text sent by the radio is normalized as it is parsed.
+  std::atomic<bool> normalize_text_ = false;
+
+#ifndef DOGTRICKS_NO_HEAP
+  /**
+   * An idempotent request that is outstanding with the radio. Identical
+   * requests made while it is outstanding wait for and share its response.
+   */
+  struct QueryFlight {
+    //! Set to true when the request has completed.
+    bool done = false;
+
+    //! Set to true if the request completed successfully.
+    bool success = false;
+
+    //! Set to true if an event indicated that the response may be out of
+    //! date while the request was outstanding, so it must not be cached.
+    bool stale = false;
+
+    //! The response to the request.
+    std::vector<uint8_t> response;
+  };
+
+  /**
+   * A cached response to an idempotent request.
+   */
+  struct QueryCacheEntry {
+    //! The time after which this response must not be used.
+    std::chrono::steady_clock::time_point expiry;
+
+    //! The response to the request.
+    std::vector<uint8_t> response;
+
+    //! Set to true if the response was fetched speculatively and has not
+    //! been used yet.
+    bool prefetched = false;
+  };
+
+  //! A typedef for the key of a query, the request op code and payload.
+  typedef std::vector<uint8_t> QueryKey;
+
+  /**
+   * @return the key of the query for the descriptor of a channel.
+   */
+  static QueryKey GetDescriptorQueryKey(uint8_t channel_id) {
+    uint16_t op_code = static_cast<uint16_t>(
+        Transport::OpCode::GetChannelRequest);
+    return { static_cast<uint8_t>(op_code >> 8),
+             static_cast<uint8_t>(op_code), channel_id, 0, 0, 0 };
+  }
+
+  //! The condition variable used to resume queries waiting on a flight.
+  std::condition_variable query_cv_;
+
+  //! The outstanding idempotent requests.
+  std::map<QueryKey, std::shared_ptr<QueryFlight>> query_flights_;
+
+  //! The cached responses to idempotent requests.
+  std::map<QueryKey, QueryCacheEntry> query_cache_;
+
+  //! The cache lifetime for each request op code with caching enabled.
+  std::map<Transport::OpCode, std::chrono::milliseconds> query_cache_ttls_;
+
+  //! The number of channels on each side of the tuned channel to prefetch,
+  //! or zero if prefetching is disabled.
+  size_t prefetch_adjacent_count_ = 0;
+
+  //! The channels returned by the most recent GetChannelList.
+  std::vector<uint8_t> lineup_;
+
+  //! The most recently tuned channels, most recent first.
+  std::deque<uint8_t> recent_channels_;
+
+  //! The channels waiting to be prefetched.
+  std::deque<uint8_t> prefetch_queue_;
+
+  //! Set to true while a prefetch is outstanding.
+  bool prefetch_active_ = false;
+
+  //! The channel being prefetched.
+  uint8_t prefetch_channel_ = 0;
+
+  //! Set to true if the descriptor being prefetched was invalidated while
+  //! the prefetch was outstanding.
+  bool prefetch_invalidated_ = false;
+#endif  // DOGTRICKS_NO_HEAP
+
+  //! The mutex to lock the query flights, cache and counters.
+  mutable std::mutex query_mutex_;
+
+  //! The counters for idempotent queries.
+  QueryStats query_stats_ = {};
+
+  //! The number of threads in SendCommand. Prefetches are only sent when
+  //! there are none, so that they do not delay blocking commands.
+  std::atomic<int> command_waiters_ = 0;
+
+  //! The number of commands that timed out or were lost with the link.
+  std::atomic<uint64_t> unanswered_commands_ = 0;
+
+  //! The channel whose first metadata completes a tune latency measurement,
+  //! or kNoTune.
+  std::atomic<int> tune_channel_ = kNoTune;
+
+  //! The time at which the timed channel change was requested.
+  std::atomic<int64_t> tune_start_ns_ = 0;
+
+  //! The latencies from requesting a channel change to its first metadata.
+  LatencyHistogram tune_latency_;
+
+  /**
+   * The metadata of a channel being coalesced.
+   */
+  struct PendingMetadata {
+    //! Set to true while the slot holds metadata.
+    bool active = false;
+
+    //! The time at which the metadata is delivered.
+    std::chrono::steady_clock::time_point deadline;
+
+    //! The merged metadata.
+    Metadata metadata;
+  };
+
+  //! The mutex to lock the coalescing window, slots and counters.
+  mutable std::mutex coalesce_mutex_;
+
+  //! The metadata coalescing window, or zero if coalescing is disabled.
+  std::chrono::milliseconds coalesce_window_ = std::chrono::milliseconds(0);
+
+  //! The metadata being coalesced, indexed by channel and allocated when
+  //! coalescing is first enabled.
+  std::vector<PendingMetadata> coalesce_slots_;
+
+  //! The number of slots holding metadata.
+  size_t coalesce_active_count_ = 0;
+
+  //! The counters for metadata coalescing.
+  CoalescingStats coalescing_stats_ = {};
+
+  //! The bitmask of monitoring features that are enabled, indexed by
+  //! MonitorFeature. This is read by the receive thread to filter puts.
+  std::atomic<uint8_t> monitor_mask_ = 0;
+
+  //! The mutex to lock the session state.
+  mutable std::mutex session_mutex_;
+
+  //! The configuration established by successful commands.
+  SessionState session_;
+
+  //! What is playing on each channel.
+  NowPlayingTable now_playing_;
+
+  /**
+   * @return true if the supplied feature is enabled in the monitor mask.
+   */
+  bool IsMonitoring(MonitorFeature feature) const {
+    return (monitor_mask_ & GetMonitorBit(feature)) != 0;
+  }
+
+  /**
+   * Waits for the link to be reestablished and restores the session state
+   * until the receive loop stops. Runs on a helper thread started by Start.
+   */
+  void RestoreLoop();
+
+  /**
+   * Computes the session state to restore, keeping settings that have been
+   * changed since the link came back.
+   *
+   * @param saved The session state captured when the link was lost.
+   * @return the session state to restore.
+   */
+  SessionState GetRestoreTarget(const SessionState& saved) const;
+
+  /**
+   * Queues asynchronous commands to reissue the session state captured when
+   * the link was lost. Used in place of the restore thread when the radio is
+   * driven by an external event loop.
+   */
+  void RestoreSessionAsync();
+
+  /**
+   * Tracks the completion of the commands queued by RestoreSessionAsync.
+   */
+  static void OnRestoreCommandComplete(void *context, bool success,
+                                       const uint8_t *response,
+                                       size_t response_size);
+
+  /**
+   * Reissues the session state captured when the link was lost. Settings
+   * that have been changed since the link came back are not overwritten.
+   *
+   * @return true if successful, false otherwise.
+   */
+  bool RestoreSession();
 
   /**
    * Sets the monitoring state based on the current configuration.
@@ -305,6 +1027,11 @@ class Radio : public Transport::EventHandler,
    */
   bool SetMonitoringState();
 
+  /**
+   * Queues a feature monitor command for the current monitor mask.
+   */
+  bool SetMonitoringStateAsync(CommandCallback callback, void *context);
+
   /**
    * Parses a metadata payload into a metadata object. It is assumed
    * that the first byte of the payload contains the number of fields in the
@@ -318,6 +1045,15 @@ class Radio : public Transport::EventHandler,
   bool ParseMetadata(const uint8_t *payload, size_t size,
                      Metadata *data);
 
+  /**
+   * Applies the fields that are set in a metadata change to a now playing
+   * entry.
+   *
+   * @param data The metadata to apply.
+   * @param entry The entry to update.
+   */
+  static void ApplyMetadata(const Metadata& data, NowPlaying *entry);
+
   /**
    * Parses a metadata packet and posts an event to the event handler with the
    * change in state.
@@ -327,6 +1063,62 @@ class Radio : public Transport::EventHandler,
    */
   void HandleMetadataPacket(const uint8_t *payload, size_t size);
 
+  /**
+   * Delivers a metadata change to the event handler.
+   */
+  void DispatchMetadata(uint8_t channel_id, const Metadata& data);
+
+  /**
+   * Holds a metadata change to be merged with those that follow it for the
+   * same channel, first delivering the pending change of the channel if it
+   * cannot be merged with it.
+   *
+   * @param channel_id The channel that the change applies to.
+   * @param data The change, which is moved from if it is held.
+   * @return true if the change was held, false if coalescing is disabled.
+   */
+  bool CoalesceMetadata(uint8_t channel_id, Metadata *data);
+
+  /**
+   * Merges a metadata change into a pending change, unless the change sets
+   * a field that is already pending to a different value.
+   *
+   * @param part The change to merge.
+   * @param merged The pending change, which is left unmodified on failure.
+   * @return true if the change was merged.
+   */
+  static bool MergeMetadata(const Metadata& part, Metadata *merged);
+
+  /**
+   * Delivers the pending metadata changes whose windows have ended.
+   *
+   * @param now The current time, or time_point::max() to deliver all.
+   */
+  void FlushCoalescedMetadata(std::chrono::steady_clock::time_point now);
+
+  /**
+   * @return the earliest time at which a pending metadata change is due, or
+   *         no value if none is pending.
+   */
+  std::optional<std::chrono::steady_clock::time_point>
+      GetCoalescingDeadline() const;
+
+  /**
+   * Parses a signal strength put and posts an event to the event handler.
+   *
+   * @param payload The payload to parse.
+   * @param size The size of the payload to parse.
+   */
+  void HandleSignalPacket(const uint8_t *payload, size_t size);
+
+  /**
+   * Parses a tuned channel put and posts an event to the event handler.
+   *
+   * @param payload The payload to parse.
+   * @param size The size of the payload to parse.
+   */
+  void HandleChannelPacket(const uint8_t *payload, size_t size);
+
   /**
    * Populates a field within a metadata with the supplied string and type.
    *
@@ -336,7 +1128,15 @@ class Radio : public Transport::EventHandler,
    * @param str The string to attach to the supplied event.
    */
   void PopulateMetadataEventField(Metadata *data,
-                                  uint8_t str_type, std::string str);
+                                  uint8_t str_type, std::string_view str);
+
+  /**
+   * Creates a string from text sent by the radio, normalizing it if enabled.
+   *
+   * @param text The text sent by the radio.
+   * @return the string.
+   */
+  String MakeString(std::string_view text) const;
 
   /**
    * Sends a comment through the transport and populates the response buffer if
@@ -357,6 +1157,163 @@ class Radio : public Transport::EventHandler,
                    uint8_t *response, size_t response_size,
                    std::chrono::milliseconds timeout);
 
+  /**
+   * Sends an idempotent request, sharing the response with identical requests
+   * that are outstanding and answering from the cache if enabled. The
+   * arguments match SendCommand.
+   *
+   * @return true if successful, false on timeout.
+   */
+  bool SendQuery(Transport::OpCode request_op_code,
+                 Transport::OpCode response_op_code,
+                 const uint8_t *command, size_t command_size,
+                 uint8_t *response, size_t response_size,
+                 std::chrono::milliseconds timeout);
+
+  /**
+   * Discards cached responses for the supplied request op code, and marks
+   * matching outstanding requests so that their responses are not cached.
+   * This does nothing unless caching is enabled for the op code.
+   *
+   * @param request_op_code The request to discard responses for.
+   * @param channel_id If set, only responses to requests for this channel
+   *                   are discarded.
+   */
+  void InvalidateQueries(Transport::OpCode request_op_code,
+                         std::optional<uint8_t> channel_id = std::nullopt);
+
+  /**
+   * Applies a metadata put to the cached descriptor of its channel instead of
+   * discarding it, so that prefetched descriptors remain usable while
+   * metadata is monitored. Other responses for the channel are invalidated as
+   * by InvalidateQueries.
+   *
+   * @param channel_id The channel the put applies to.
+   * @param metadata The metadata of the put, starting with the field count.
+   *                 This must have been validated by ParseMetadata.
+   * @param size The size of the metadata.
+   */
+  void UpdateCachedDescriptor(uint8_t channel_id, const uint8_t *metadata,
+                              size_t size);
+
+#ifndef DOGTRICKS_NO_HEAP
+  /**
+   * Performs InvalidateQueries with the query mutex held.
+   */
+  void InvalidateQueriesLocked(Transport::OpCode request_op_code,
+                               std::optional<uint8_t> channel_id);
+
+  /**
+   * Replaces the metadata fields of a channel descriptor response with the
+   * fields of the same type from a metadata put, and adds the others.
+   *
+   * @param metadata The metadata of the put, starting with the field count.
+   * @param size The size of the metadata.
+   * @param response The response to update.
+   * @return true if successful, false if the response could not be parsed or
+   *         the merged response does not fit.
+   */
+  static bool MergeDescriptorMetadata(const uint8_t *metadata, size_t size,
+                                      std::vector<uint8_t> *response);
+#endif  // DOGTRICKS_NO_HEAP
+
+  /**
+   * Discards all cached responses.
+   */
+  void InvalidateAllQueries();
+
+  /**
+   * Counts a thread in SendCommand for its lifetime and sends the next
+   * prefetch once no thread is left.
+   */
+  class CommandWaiter : public NonCopyable {
+   public:
+    CommandWaiter(Radio *radio) : radio_(radio) {
+      radio_->command_waiters_++;
+    }
+
+    ~CommandWaiter() {
+      if (--radio_->command_waiters_ == 0) {
+        radio_->PumpPrefetch();
+      }
+    }
+
+   private:
+    //! The radio that the thread is sending a command with.
+    Radio *radio_;
+  };
+
+  /**
+   * Starts timing a channel change, replacing any change being timed.
+   */
+  void BeginTune(uint8_t channel_id);
+
+  /**
+   * Stops timing a channel change that failed.
+   */
+  void CancelTune(uint8_t channel_id);
+
+  /**
+   * Completes the timed channel change if the metadata is for its channel.
+   */
+  void RecordTuneLatency(const uint8_t *payload, size_t size);
+
+  /**
+   * Queues the descriptors of the channels adjacent to the supplied channel
+   * and of recently tuned channels to be prefetched, replacing any not yet
+   * sent.
+   *
+   * @return true if prefetching is enabled, false otherwise.
+   */
+  bool SchedulePrefetch(uint8_t channel_id);
+
+  /**
+   * Sends the next prefetch if the link is idle. The radio mutex must not be
+   * held.
+   */
+  void PumpPrefetch();
+
+  /**
+   * Caches the response to a prefetch and sends the next one.
+   */
+  static void OnPrefetchComplete(void *context, bool success,
+                                 const uint8_t *response,
+                                 size_t response_size);
+
+  /**
+   * Records the effect of a successful command on the session state.
+   *
+   * @param request_op_code The request op code.
+   * @param command The command payload.
+   */
+  void ApplyCommand(Transport::OpCode request_op_code, const uint8_t *command);
+
+  /**
+   * Waits for the outstanding asynchronous command to complete, timing it out
+   * once its deadline has passed.
+   *
+   * @param lock The lock on the mutex.
+   */
+  void WaitForAsyncCommand(std::unique_lock<std::mutex>& lock);
+
+  /**
+   * Sends queued asynchronous commands while the radio is free. Commands are
+   * failed rather than sent while the link is down.
+   *
+   * @param lock The lock on the mutex, which is released while sending.
+   */
+  void PumpAsyncCommands(std::unique_lock<std::mutex>& lock);
+
+  /**
+   * Removes the oldest asynchronous command from the queue and invokes its
+   * callback.
+   *
+   * @param lock The lock on the mutex, which is released for the callback.
+   * @param received Whether the response was received.
+   */
+  void CompleteAsyncCommand(std::unique_lock<std::mutex>& lock,
+                            bool received);
+
   /**
    * Waits for the supplied put command and populates the put buffer if
    * supplied.
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "radio_group.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <thread>
+
+#include "log.h"
+
+namespace dogtricks {
+
+RadioGroup::RadioGroup(const std::vector<Radio *>& radios) {
+  for (Radio *radio : radios) {
+    auto link = std::make_unique<Link>();
+    link->index = links_.size();
+    link->radio = radio;
+    links_.push_back(std::move(link));
+  }
+}
+
+bool RadioGroup::GetChannelList(Radio::ChannelList *channels) {
+  return Route([channels](Radio *radio) {
+    return radio->GetChannelList(channels);
+  });
+}
+
+bool RadioGroup::GetChannelDescriptor(uint8_t channel_id,
+                                      Radio::ChannelDescriptor *descriptor) {
+  return Route([channel_id, descriptor](Radio *radio) {
+    return radio->GetChannelDescriptor(channel_id, descriptor);
+  });
+}
+
+bool RadioGroup::GetSignalStrength(Radio::SignalStrength *summary,
+                                   Radio::SignalStrength *satellite,
+                                   Radio::SignalStrength *terrestrial) {
+  return Route([summary, satellite, terrestrial](Radio *radio) {
+    return radio->GetSignalStrength(summary, satellite, terrestrial);
+  });
+}
+
+bool RadioGroup::GetLineup(std::vector<Radio::ChannelDescriptor> *descriptors) {
+  LineupScan scan;
+  if (!GetChannelList(&scan.channels)) {
+    return false;
+  }
+
+  size_t channel_count = scan.channels.size();
+  scan.descriptors = descriptors;
+  descriptors->clear();
+  descriptors->resize(channel_count);
+  scan.pending.reserve(channel_count);
+  for (size_t i = channel_count; i > 0; i--) {
+    scan.pending.push_back(i - 1);
+  }
+
+  std::vector<Link *> scan_links;
+  {
+    std::lock_guard<std::mutex> lock(health_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& link : links_) {
+      if (IsHealthy(*link, now)) {
+        scan_links.push_back(link.get());
+      }
+    }
+  }
+
+  // The calling thread scans on the first link and a thread is started for
+  // each of the others.
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < scan_links.size(); i++) {
+    threads.emplace_back(&RadioGroup::ScanLineup, this, scan_links[i], &scan);
+  }
+
+  if (!scan_links.empty()) {
+    ScanLineup(scan_links[0], &scan);
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // A radio that answers with an error fails the scan, as the others would
+  // answer the same.
+  if (scan.rejected) {
+    LOGE("Failed to read the lineup, a channel query was rejected");
+    return false;
+  }
+
+  // The channels left were abandoned by a link or not answered, so each is
+  // routed on its own, which also tries the links being skipped.
+  scan.failed.insert(scan.failed.end(), scan.pending.begin(),
+                     scan.pending.end());
+  bool success = true;
+  for (size_t i = 0; success && i < scan.failed.size(); i++) {
+    size_t index = scan.failed[i];
+    success = GetChannelDescriptor(scan.channels[index],
+                                   &(*descriptors)[index]);
+  }
+
+  return success;
+}
+
+RadioGroup::LinkStats RadioGroup::GetLinkStats(size_t index) const {
+  LinkStats stats = {};
+  if (index < links_.size()) {
+    const Link& link = *links_[index];
+    std::lock_guard<std::mutex> lock(health_mutex_);
+    stats.queries = link.queries;
+    stats.failures = link.failures;
+    stats.healthy = IsHealthy(link, std::chrono::steady_clock::now());
+  }
+
+  return stats;
+}
+
+size_t RadioGroup::ChooseLink(const std::vector<bool>& tried) {
+  std::lock_guard<std::mutex> lock(health_mutex_);
+  auto now = std::chrono::steady_clock::now();
+  size_t start = next_link_++;
+  size_t best = links_.size();
+  size_t best_load = 0;
+  size_t fallback = links_.size();
+  for (size_t i = 0; i < links_.size(); i++) {
+    size_t index = (start + i) % links_.size();
+    const Link& link = *links_[index];
+    if (tried[index]) {
+      continue;
+    }
+
+    if (IsHealthy(link, now)) {
+      size_t load = link.in_flight + link.radio->GetCommandQueueDepth();
+      if (best == links_.size() || load < best_load) {
+        best = index;
+        best_load = load;
+      }
+    } else if (fallback == links_.size()
+        || link.skip_until < links_[fallback]->skip_until) {
+      fallback = index;
+    }
+  }
+
+  return (best != links_.size()) ? best : fallback;
+}
+
+bool RadioGroup::IsHealthy(const Link& link,
+                           std::chrono::steady_clock::time_point now) const {
+  return link.radio->IsOpen() && now >= link.skip_until;
+}
+
+template <typename Query>
+bool RadioGroup::RunQuery(Link *link, Query query, bool *answered) {
+  uint64_t unanswered = link->radio->GetUnansweredCommandCount();
+  link->in_flight++;
+  bool success = query(link->radio);
+  link->in_flight--;
+
+  // A failure counts against the link only if a command went unanswered
+  // while the query ran.
+  *answered = (success
+      || link->radio->GetUnansweredCommandCount() == unanswered);
+  std::lock_guard<std::mutex> lock(health_mutex_);
+  link->queries++;
+  if (*answered) {
+    link->consecutive_failures = 0;
+    link->skip_until = {};
+  } else {
+    link->failures++;
+    auto backoff = std::min<std::chrono::milliseconds>(
+        kInitialBackoff * (1 << std::min<uint32_t>(
+            link->consecutive_failures, 16)),
+        kMaxBackoff);
+    link->consecutive_failures++;
+    link->skip_until = std::chrono::steady_clock::now() + backoff;
+    LOGD("Radio %zu in group did not answer, skipping for %" PRId64 " ms",
+         link->index, static_cast<int64_t>(backoff.count()));
+  }
+
+  return success;
+}
+
+template <typename Query>
+bool RadioGroup::Route(Query query) {
+  std::vector<bool> tried(links_.size());
+  for (size_t attempt = 0; attempt < links_.size(); attempt++) {
+    size_t index = ChooseLink(tried);
+    if (index == links_.size()) {
+      break;
+    }
+
+    if (attempt > 0) {
+      failovers_++;
+    }
+
+    tried[index] = true;
+    bool answered;
+    bool success = RunQuery(links_[index].get(), query, &answered);
+    if (success || answered) {
+      return success;
+    }
+  }
+
+  return false;
+}
+
+void RadioGroup::ScanLineup(Link *link, LineupScan *scan) {
+  while (true) {
+    size_t index;
+    {
+      std::lock_guard<std::mutex> lock(scan->mutex);
+      if (scan->pending.empty()) {
+        break;
+      }
+
+      index = scan->pending.back();
+      scan->pending.pop_back();
+    }
+
+    bool answered;
+    uint8_t channel_id = scan->channels[index];
+    Radio::ChannelDescriptor *descriptor = &(*scan->descriptors)[index];
+    bool success = RunQuery(link, [channel_id, descriptor](Radio *radio) {
+      return radio->GetChannelDescriptor(channel_id, descriptor);
+    }, &answered);
+    if (success) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(scan->mutex);
+    if (answered) {
+      // An error answer fails the whole scan, so the other links stop too.
+      scan->rejected = true;
+      scan->pending.clear();
+      break;
+    }
+
+    // A link that did not answer stops scanning and leaves the rest of the
+    // lineup to the others.
+    scan->failed.push_back(index);
+    failovers_++;
+    break;
+  }
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_RADIO_GROUP_H_
+#define DOGTRICKS_RADIO_GROUP_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "non_copyable.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+/**
+ * Spreads read-only queries over several radios that receive the same
+ * broadcast. Each query goes to the least busy healthy radio and fails over
+ * to the next if that radio does not answer. A query that a radio answers
+ * with an error is not retried, as the others would answer the same. A radio
+ * that does not answer is skipped for a backoff that doubles with each
+ * consecutive failure. Lineup scans are split across every healthy radio in
+ * parallel. The radios must be started or driven by an event loop, as the
+ * queries block. This is thread-safe.
+ */
+class RadioGroup : public NonCopyable {
+ public:
+  /**
+   * Counters describing the queries routed to one radio, captured together.
+   */
+  struct LinkStats {
+    //! The number of queries sent to the radio that have completed.
+    uint64_t queries;
+
+    //! The number of queries that the radio did not answer.
+    uint64_t failures;
+
+    //! Set to true if the radio is not being skipped after a failure.
+    bool healthy;
+  };
+
+  //! The time for which a radio is skipped after its first failure.
+  static constexpr std::chrono::milliseconds kInitialBackoff =
+      std::chrono::milliseconds(500);
+
+  //! The longest time for which a failing radio is skipped.
+  static constexpr std::chrono::milliseconds kMaxBackoff =
+      std::chrono::milliseconds(30000);
+
+  /**
+   * Setup a group of radios, which must outlive the group.
+   */
+  RadioGroup(const std::vector<Radio *>& radios);
+
+  /**
+   * Reads the list of channels from the least busy radio. See
+   * Radio::GetChannelList.
+   */
+  bool GetChannelList(Radio::ChannelList *channels);
+
+  /**
+   * Obtains the details of a channel from the least busy radio. See
+   * Radio::GetChannelDescriptor.
+   */
+  bool GetChannelDescriptor(uint8_t channel_id,
+                            Radio::ChannelDescriptor *descriptor);
+
+  /**
+   * Reads the signal strength from the least busy radio. See
+   * Radio::GetSignalStrength.
+   */
+  bool GetSignalStrength(Radio::SignalStrength *summary,
+                         Radio::SignalStrength *satellite,
+                         Radio::SignalStrength *terrestrial);
+
+  /**
+   * Reads the descriptor of every channel in the lineup. The descriptors are
+   * fetched by one thread per healthy radio, each taking the next channel as
+   * it finishes the last, so faster links fetch more. The channels of a
+   * radio that does not answer are fetched by the others. The scan stops
+   * without retrying if a radio answers with an error.
+   *
+   * @param descriptors Populated with the descriptors in lineup order.
+   * @return true if every descriptor was read, false otherwise.
+   */
+  bool GetLineup(std::vector<Radio::ChannelDescriptor> *descriptors);
+
+  /**
+   * @return the number of radios in the group.
+   */
+  size_t GetRadioCount() const {
+    return links_.size();
+  }
+
+  /**
+   * @return the counters of the radio at the supplied index.
+   */
+  LinkStats GetLinkStats(size_t index) const;
+
+  /**
+   * @return the number of queries retried on another radio after a failure.
+   */
+  uint64_t GetFailoverCount() const {
+    return failovers_;
+  }
+
+ private:
+  /**
+   * The routing state of one radio.
+   */
+  struct Link {
+    //! The index of the radio in the group.
+    size_t index;
+
+    //! The radio.
+    Radio *radio;
+
+    //! The number of queries from the group outstanding on the radio.
+    std::atomic<size_t> in_flight = 0;
+
+    //! The number of queries sent to the radio that have completed. Locked
+    //! by the health mutex.
+    uint64_t queries = 0;
+
+    //! The number of queries that the radio did not answer. Locked by the
+    //! health mutex.
+    uint64_t failures = 0;
+
+    //! The number of failures since the last success. Locked by the health
+    //! mutex.
+    uint32_t consecutive_failures = 0;
+
+    //! The time before which the radio is skipped. Locked by the health
+    //! mutex.
+    std::chrono::steady_clock::time_point skip_until;
+  };
+
+  /**
+   * The state of a lineup scan shared by the scanning threads.
+   */
+  struct LineupScan {
+    //! The channels to fetch.
+    Radio::ChannelList channels;
+
+    //! The descriptors, in the order of the channels.
+    std::vector<Radio::ChannelDescriptor> *descriptors;
+
+    //! The indices of the channels not yet fetched, popped lowest first.
+    std::vector<size_t> pending;
+
+    //! The indices of the channels that a radio did not answer, to be
+    //! retried.
+    std::vector<size_t> failed;
+
+    //! Set to true if a radio answered a query with an error.
+    bool rejected = false;
+
+    //! The mutex to lock the pending and failed channels and the rejection.
+    std::mutex mutex;
+  };
+
+  //! The radios, in the order supplied.
+  std::vector<std::unique_ptr<Link>> links_;
+
+  //! The mutex to lock the health and counters of the links.
+  mutable std::mutex health_mutex_;
+
+  //! The link at which ties in load are broken, rotated on each query.
+  std::atomic<size_t> next_link_ = 0;
+
+  //! The number of queries retried on another radio.
+  std::atomic<uint64_t> failovers_ = 0;
+
+  /**
+   * Chooses the link for a query. Healthy links with the lowest load are
+   * preferred. If every untried link is being skipped, the one that became
+   * unhealthy first is chosen, so that a recovered radio is found again.
+   *
+   * @param tried The links already tried for the query, which are excluded.
+   * @return the index of the link, or the number of links if all are tried.
+   */
+  size_t ChooseLink(const std::vector<bool>& tried);
+
+  /**
+   * @return true if the link is not being skipped and its device is open.
+   */
+  bool IsHealthy(const Link& link,
+                 std::chrono::steady_clock::time_point now) const;
+
+  /**
+   * Runs a query on a link and records whether the radio answered.
+   *
+   * @param link The link to query.
+   * @param query A callable taking a Radio pointer and returning true on
+   *              success.
+   * @param answered Populated with whether the radio answered, which is
+   *                 true on success or if it answered with an error.
+   * @return true if successful, false otherwise.
+   */
+  template <typename Query>
+  bool RunQuery(Link *link, Query query, bool *answered);
+
+  /**
+   * Runs a query on the least busy link, failing over to the others in turn
+   * while they do not answer.
+   *
+   * @param query A callable taking a Radio pointer and returning true on
+   *              success.
+   * @return true if successful, false otherwise.
+   */
+  template <typename Query>
+  bool Route(Query query);
+
+  /**
+   * Fetches descriptors of the lineup on one link until none are left or
+   * the link does not answer. See GetLineup.
+   */
+  void ScanLineup(Link *link, LineupScan *scan);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_RADIO_GROUP_H_
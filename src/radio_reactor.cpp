@@ -0,0 +1,363 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "radio_reactor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "realtime.h"
+#include "trace.h"
+
+namespace dogtricks {
+
+RadioReactor::RadioReactor(EventHandler *event_handler, size_t shard_count)
+    : event_handler_(event_handler), requested_shard_count_(shard_count) {}
+
+RadioReactor::~RadioReactor() {
+  Stop();
+}
+
+bool RadioReactor::AddDevice(const char *path, uint32_t *device_id) {
+  if (started_) {
+    LOGE("Devices must be added before starting the reactor");
+    return false;
+  }
+
+  auto device = std::make_unique<Device>();
+  device->reactor = this;
+  device->id = static_cast<uint32_t>(devices_.size());
+  device->timer.context = device.get();
+  device->radio = std::make_unique<Radio>(path, device.get());
+  if (!device->radio->IsOpen()) {
+    LOGE("Failed to open radio %s", path);
+    return false;
+  }
+
+  *device_id = device->id;
+  devices_.push_back(std::move(device));
+  return true;
+}
+
+Radio *RadioReactor::GetRadio(uint32_t device_id) {
+  return (device_id < devices_.size()) ? devices_[device_id]->radio.get()
+                                       : nullptr;
+}
+
+bool RadioReactor::Start(bool pin_threads) {
+  if (devices_.empty() || started_) {
+    LOGE("Reactor has no devices or is already started");
+    return false;
+  }
+
+  shards_.clear();
+  stopping_ = false;
+
+  size_t shard_count = requested_shard_count_;
+  if (shard_count == 0) {
+    shard_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  shard_count = std::min(shard_count, devices_.size());
+  auto now = std::chrono::steady_clock::now();
+  bool success = true;
+  for (size_t i = 0; success && i < shard_count; i++) {
+    auto shard = std::make_unique<Shard>(i, now);
+    shard->pending_tasks.reserve(kMaxPendingTasks);
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    success = (shard->epoll_fd >= 0 && pipe(shard->wake_fds) == 0
+        && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fds[0],
+                     &event) == 0);
+    if (!success) {
+      LOGE("Failed to create reactor shard: %s", strerror(errno));
+    } else {
+      fcntl(shard->wake_fds[0], F_SETFL, O_NONBLOCK);
+      fcntl(shard->wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    shards_.push_back(std::move(shard));
+  }
+
+  started_ = true;
+  if (!success) {
+    Stop();
+    return false;
+  }
+
+  // Deal the radios out so that each shard has a near equal number.
+  for (const auto& device : devices_) {
+    Shard *shard = shards_[device->id % shards_.size()].get();
+    device->shard = shard;
+    shard->devices.push_back(device.get());
+    UpdateDevice(device.get());
+  }
+
+  for (const auto& shard : shards_) {
+    shard->thread = std::thread(&RadioReactor::RunShard, this, shard.get(),
+                                pin_threads);
+  }
+
+  LOGD("Started %zu radios on %zu reactor shards", devices_.size(),
+       shards_.size());
+  return true;
+}
+
+void RadioReactor::Stop() {
+  if (!started_) {
+    return;
+  }
+
+  stopping_ = true;
+  for (const auto& shard : shards_) {
+    if (shard->thread.joinable()) {
+      Wake(shard.get());
+      shard->thread.join();
+    }
+
+    for (Device *device : shard->devices) {
+      shard->timers.Cancel(&device->timer);
+      device->shard = nullptr;
+      device->registered_fd = -1;
+    }
+
+    for (int *fd : {&shard->epoll_fd, &shard->wake_fds[0],
+                    &shard->wake_fds[1]}) {
+      if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  started_ = false;
+}
+
+bool RadioReactor::Post(uint32_t device_id, Task task, void *context) {
+  if (device_id >= devices_.size()) {
+    return false;
+  }
+
+  Device *device = devices_[device_id].get();
+  Shard *shard = device->shard;
+  if (shard == nullptr) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(shard->task_mutex);
+    if (shard->pending_tasks.size() >= kMaxPendingTasks) {
+      LOGE("Reactor shard %zu task queue is full", shard->index);
+      return false;
+    }
+
+    shard->pending_tasks.push_back({device, task, context});
+  }
+
+  Wake(shard);
+  return true;
+}
+
+RadioReactor::ShardStats RadioReactor::GetShardStats(
+    size_t shard_index) const {
+  ShardStats stats = {};
+  if (shard_index < shards_.size()) {
+    const Shard& shard = *shards_[shard_index];
+    stats.devices = shard.devices.size();
+    stats.wakeups = shard.wakeups;
+    stats.io_events = shard.io_events;
+    stats.timer_expirations = shard.timer_expirations;
+    stats.tasks = shard.tasks;
+  }
+
+  return stats;
+}
+
+void RadioReactor::RunShard(Shard *shard, bool pin_thread) {
+  Trace::SetThreadName("reactor");
+  if (pin_thread) {
+    unsigned int cpu_count = std::max(std::thread::hardware_concurrency(), 1u);
+    Realtime::SetCpuAffinity(static_cast<int>(shard->index % cpu_count));
+  }
+
+  struct epoll_event events[kMaxEvents];
+  while (!stopping_) {
+    int timeout_ms = -1;
+    auto next_expiry = shard->timers.GetNextExpiry();
+    if (next_expiry.has_value()) {
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+          next_expiry.value() - std::chrono::steady_clock::now());
+      timeout_ms = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+    }
+
+    int event_count = epoll_wait(shard->epoll_fd, events, kMaxEvents,
+                                 timeout_ms);
+    if (event_count < 0) {
+      if (errno != EINTR) {
+        LOGE("Failed to wait on reactor shard %zu: %s", shard->index,
+             strerror(errno));
+        break;
+      }
+
+      continue;
+    }
+
+    shard->wakeups++;
+    for (int i = 0; i < event_count; i++) {
+      Device *device = static_cast<Device *>(events[i].data.ptr);
+      if (device == nullptr) {
+        char buffer[64];
+        while (read(shard->wake_fds[0], buffer, sizeof(buffer)) > 0) {}
+        RunPendingTasks(shard);
+        continue;
+      }
+
+      shard->io_events++;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        device->radio->ProcessReadable();
+      }
+
+      if (events[i].events & EPOLLOUT) {
+        device->radio->ProcessWritable();
+      }
+
+      UpdateDevice(device);
+    }
+
+    shard->timer_expirations += shard->timers.Advance(
+        std::chrono::steady_clock::now(), &RadioReactor::OnTimerExpired);
+  }
+}
+
+void RadioReactor::RunPendingTasks(Shard *shard) {
+  // Tasks are taken in a batch so that they may post further tasks.
+  PendingTask tasks[kMaxPendingTasks];
+  size_t task_count;
+  {
+    std::lock_guard<std::mutex> lock(shard->task_mutex);
+    task_count = shard->pending_tasks.size();
+    std::copy(shard->pending_tasks.begin(), shard->pending_tasks.end(),
+              tasks);
+    shard->pending_tasks.clear();
+  }
+
+  for (size_t i = 0; i < task_count; i++) {
+    tasks[i].task(tasks[i].device->radio.get(), tasks[i].context);
+    UpdateDevice(tasks[i].device);
+  }
+
+  shard->tasks += task_count;
+}
+
+void RadioReactor::UpdateDevice(Device *device) {
+  Radio *radio = device->radio.get();
+  Shard *shard = device->shard;
+  int fd = radio->GetFd();
+  uint32_t events = EPOLLIN | (radio->IsWritePending() ? EPOLLOUT : 0);
+  uint64_t disconnects = radio->GetTransport().GetLinkStats().disconnects;
+  if (fd != device->registered_fd
+      || disconnects != device->registered_disconnects) {
+    if (device->registered_fd >= 0) {
+      // This fails harmlessly if the descriptor was already closed.
+      epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, device->registered_fd,
+                nullptr);
+      device->registered_fd = -1;
+    }
+
+    if (fd >= 0) {
+      struct epoll_event event = {};
+      event.events = events;
+      event.data.ptr = device;
+      if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+        device->registered_fd = fd;
+        device->registered_events = events;
+        device->registered_disconnects = disconnects;
+      } else {
+        LOGE("Failed to watch radio %" PRIu32 ": %s", device->id,
+             strerror(errno));
+      }
+    }
+  } else if (fd >= 0 && events != device->registered_events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.ptr = device;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+      device->registered_events = events;
+    } else {
+      LOGE("Failed to update watch of radio %" PRIu32 ": %s", device->id,
+           strerror(errno));
+    }
+  }
+
+  auto deadline = radio->GetNextDeadline();
+  if (deadline.has_value()) {
+    shard->timers.Schedule(&device->timer, deadline.value());
+  } else {
+    shard->timers.Cancel(&device->timer);
+  }
+}
+
+void RadioReactor::OnTimerExpired(TimerWheel::Timer *timer) {
+  Device *device = static_cast<Device *>(timer->context);
+  device->radio->ProcessDeadline();
+  device->reactor->UpdateDevice(device);
+}
+
+void RadioReactor::Wake(Shard *shard) {
+  char value = 1;
+  ssize_t result = write(shard->wake_fds[1], &value, sizeof(value));
+  (void)result;
+}
+
+EventSource RadioReactor::GetEventSource(const Device& device) {
+  EventSource source;
+  source.device_id = device.id;
+  source.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  return source;
+}
+
+void RadioReactor::Device::OnMetadataChange(uint8_t channel_id,
+                                            const Radio::Metadata& metadata) {
+  std::lock_guard<std::mutex> lock(reactor->merge_mutex_);
+  reactor->event_handler_->OnMetadataChange(GetEventSource(*this), channel_id,
+                                            metadata);
+}
+
+void RadioReactor::Device::OnSignalStrengthChange(
+    Radio::SignalStrength summary, Radio::SignalStrength satellite,
+    Radio::SignalStrength terrestrial) {
+  std::lock_guard<std::mutex> lock(reactor->merge_mutex_);
+  reactor->event_handler_->OnSignalStrengthChange(
+      GetEventSource(*this), summary, satellite, terrestrial);
+}
+
+void RadioReactor::Device::OnTunedChannelChange(uint8_t channel_id) {
+  std::lock_guard<std::mutex> lock(reactor->merge_mutex_);
+  reactor->event_handler_->OnTunedChannelChange(GetEventSource(*this),
+                                                channel_id);
+}
+
+}  // namespace dogtricks
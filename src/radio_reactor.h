@@ -0,0 +1,363 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_RADIO_REACTOR_H_
+#define DOGTRICKS_RADIO_REACTOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "non_copyable.h"
+#include "radio.h"
+#include "timer_wheel.h"
+
+namespace dogtricks {
+
+/**
+ * Identifies the radio that an event in a merged stream came from and when it
+ * was received.
+ */
+struct EventSource {
+  //! The index of the radio in the order it was added to the reactor.
+  uint32_t device_id;
+
+  //! The steady clock time at which the event was merged into the stream.
+  int64_t timestamp_ns;
+};
+
+/**
+ * Drives many radios from a few threads. Each thread owns a shard of the
+ * radios and waits on them with epoll, using the external event loop API of
+ * Radio in place of a receive thread per radio. Command deadlines and
+ * reconnect attempts are kept on a timer wheel per shard. Events from every
+ * radio are merged into a single stream in which handler calls never overlap
+ * and timestamps never decrease.
+ */
+class RadioReactor : public NonCopyable {
+ public:
+  /**
+   * The receiver of the merged event stream. Calls are made from the shard
+   * threads, one at a time.
+   */
+  class EventHandler {
+   public:
+    virtual ~EventHandler() {}
+
+    /**
+     * Invoked when a radio reports a metadata change.
+     */
+    virtual void OnMetadataChange(const EventSource& source,
+                                  uint8_t channel_id,
+                                  const Radio::Metadata& metadata) {}
+
+    /**
+     * Invoked when a radio reports a signal strength change.
+     */
+    virtual void OnSignalStrengthChange(const EventSource& source,
+                                        Radio::SignalStrength summary,
+                                        Radio::SignalStrength satellite,
+                                        Radio::SignalStrength terrestrial) {}
+
+    /**
+     * Invoked when a radio reports a tuned channel change.
+     */
+    virtual void OnTunedChannelChange(const EventSource& source,
+                                      uint8_t channel_id) {}
+  };
+
+  /**
+   * A task to run on the thread that owns a radio. Tasks must only use the
+   * asynchronous commands of the radio, as the blocking commands wait on the
+   * thread that the task runs on.
+   */
+  typedef void (*Task)(Radio *radio, void *context);
+
+  /**
+   * Counters describing the work done by a shard.
+   */
+  struct ShardStats {
+    //! The number of radios owned by the shard.
+    size_t devices;
+
+    //! The number of times the shard thread returned from epoll_wait.
+    uint64_t wakeups;
+
+    //! The number of readiness events handled.
+    uint64_t io_events;
+
+    //! The number of radio deadlines expired from the timer wheel.
+    uint64_t timer_expirations;
+
+    //! The number of posted tasks run.
+    uint64_t tasks;
+  };
+
+  //! The most tasks that may wait to run on each shard.
+  static constexpr size_t kMaxPendingTasks = 64;
+
+  /**
+   * Setup an empty reactor.
+   *
+   * @param event_handler The receiver of the merged event stream.
+   * @param shard_count The number of threads to drive the radios with, or
+   *                    zero for one per CPU. This is limited to the number
+   *                    of radios.
+   */
+  RadioReactor(EventHandler *event_handler, size_t shard_count = 0);
+
+  /**
+   * Stops the shard threads if they are running.
+   */
+  ~RadioReactor();
+
+  /**
+   * Opens a radio and adds it to the reactor. This must be called before
+   * Start.
+   *
+   * @param path The path of the serial device.
+   * @param device_id Populated with the id of the radio in the event stream.
+   * @return true if the device was opened, false otherwise.
+   */
+  bool AddDevice(const char *path, uint32_t *device_id);
+
+  /**
+   * @return the radio with the supplied id, or nullptr if there is none. The
+   *         radio must only be used from a posted task while started.
+   */
+  Radio *GetRadio(uint32_t device_id);
+
+  /**
+   * @return the number of radios added.
+   */
+  size_t GetDeviceCount() const {
+    return devices_.size();
+  }
+
+  /**
+   * Divides the radios among the shards and starts a thread for each.
+   *
+   * @param pin_threads Whether to pin each shard thread to its own CPU. This
+   *                    logs and carries on if not permitted.
+   * @return true if successful, false otherwise.
+   */
+  bool Start(bool pin_threads = false);
+
+  /**
+   * Stops the shard threads and waits for them to exit. The counters of the
+   * shards remain available until the next Start.
+   */
+  void Stop();
+
+  /**
+   * Queues a task to run on the thread that owns a radio. This may be called
+   * from any thread once started.
+   *
+   * @param device_id The id of the radio to supply to the task.
+   * @param task The task to run.
+   * @param context The context to supply to the task.
+   * @return true if queued, false if not started, the id is unknown or the
+   *         queue is full.
+   */
+  bool Post(uint32_t device_id, Task task, void *context);
+
+  /**
+   * @return the number of shards of the last Start, or zero if never
+   *         started.
+   */
+  size_t GetShardCount() const {
+    return shards_.size();
+  }
+
+  /**
+   * @return the counters of a shard.
+   */
+  ShardStats GetShardStats(size_t shard_index) const;
+
+ private:
+  //! The time covered by each slot of the timer wheels.
+  static constexpr std::chrono::milliseconds kTimerTick =
+      std::chrono::milliseconds(1);
+
+  //! The number of slots in each timer wheel.
+  static constexpr size_t kTimerSlots = 1024;
+
+  //! The most readiness events handled per call to epoll_wait.
+  static constexpr int kMaxEvents = 64;
+
+  struct Shard;
+
+  /**
+   * A radio and its registration with the shard that owns it.
+   */
+  struct Device : public Radio::EventHandler {
+    //! The reactor that the radio belongs to.
+    RadioReactor *reactor;
+
+    //! The id of the radio in the event stream.
+    uint32_t id;
+
+    //! The shard that owns the radio once started.
+    Shard *shard = nullptr;
+
+    //! The radio.
+    std::unique_ptr<Radio> radio;
+
+    //! The timer for the next deadline of the radio.
+    TimerWheel::Timer timer;
+
+    //! The file descriptor registered with epoll, or -1 if none.
+    int registered_fd = -1;
+
+    //! The epoll events registered for the file descriptor.
+    uint32_t registered_events = 0;
+
+    //! The number of link losses when the file descriptor was registered. A
+    //! reopened device may reuse the number of the closed descriptor, whose
+    //! registration was dropped by the kernel.
+    uint64_t registered_disconnects = 0;
+
+    // Radio::EventHandler methods.
+    void OnMetadataChange(uint8_t channel_id,
+                          const Radio::Metadata& metadata) override;
+    void OnSignalStrengthChange(Radio::SignalStrength summary,
+                                Radio::SignalStrength satellite,
+                                Radio::SignalStrength terrestrial) override;
+    void OnTunedChannelChange(uint8_t channel_id) override;
+  };
+
+  /**
+   * A task waiting to run on a shard.
+   */
+  struct PendingTask {
+    //! The radio to supply to the task.
+    Device *device;
+
+    //! The task to run.
+    Task task;
+
+    //! The context to supply to the task.
+    void *context;
+  };
+
+  /**
+   * A thread and the radios that it drives.
+   */
+  struct Shard {
+    //! The index of the shard.
+    size_t index;
+
+    //! The epoll instance watching the radios and the wake pipe.
+    int epoll_fd = -1;
+
+    //! The pipe used to wake the shard for posted tasks and stopping.
+    int wake_fds[2] = {-1, -1};
+
+    //! The radios owned by the shard.
+    std::vector<Device *> devices;
+
+    //! The deadlines of the radios.
+    TimerWheel timers;
+
+    //! The mutex to lock the pending tasks.
+    std::mutex task_mutex;
+
+    //! The tasks waiting to run, with room for kMaxPendingTasks.
+    std::vector<PendingTask> pending_tasks;
+
+    //! The number of returns from epoll_wait.
+    std::atomic<uint64_t> wakeups = 0;
+
+    //! The number of readiness events handled.
+    std::atomic<uint64_t> io_events = 0;
+
+    //! The number of radio deadlines expired.
+    std::atomic<uint64_t> timer_expirations = 0;
+
+    //! The number of posted tasks run.
+    std::atomic<uint64_t> tasks = 0;
+
+    //! The thread that drives the radios.
+    std::thread thread;
+
+    Shard(size_t shard_index, std::chrono::steady_clock::time_point start)
+        : index(shard_index), timers(kTimerTick, kTimerSlots, start) {}
+  };
+
+  //! The receiver of the merged event stream.
+  EventHandler * const event_handler_;
+
+  //! The number of shards requested, or zero for one per CPU.
+  const size_t requested_shard_count_;
+
+  //! The radios in order of id.
+  std::vector<std::unique_ptr<Device>> devices_;
+
+  //! The shards, populated by Start.
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  //! Set to true between Start and Stop.
+  bool started_ = false;
+
+  //! Set to true to make the shard threads exit.
+  std::atomic<bool> stopping_ = false;
+
+  //! The mutex that serializes the merged event stream.
+  std::mutex merge_mutex_;
+
+  /**
+   * Drives the radios of a shard until stopped.
+   */
+  void RunShard(Shard *shard, bool pin_thread);
+
+  /**
+   * Runs the tasks posted to a shard.
+   */
+  void RunPendingTasks(Shard *shard);
+
+  /**
+   * Brings the epoll registration and timer of a radio up to date after it
+   * has done work, as its file descriptor, write interest and next deadline
+   * may have changed.
+   */
+  void UpdateDevice(Device *device);
+
+  /**
+   * Processes the deadline of a radio whose timer expired.
+   */
+  static void OnTimerExpired(TimerWheel::Timer *timer);
+
+  /**
+   * Wakes a shard thread.
+   */
+  static void Wake(Shard *shard);
+
+  /**
+   * Obtains the source of an event being merged into the stream. Must be
+   * called with merge_mutex_ held so that timestamps follow stream order.
+   */
+  static EventSource GetEventSource(const Device& device);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_RADIO_REACTOR_H_
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "realtime.h"
+
+#include <alloca.h>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+namespace dogtricks {
+
+bool Realtime::LockMemory() {
+  bool success = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+  if (!success) {
+    LOGE("Failed to lock memory, continuing without: %s", strerror(errno));
+  }
+
+  return success;
+}
+
+bool Realtime::SetFifoPriority(int priority) {
+  int min_priority = sched_get_priority_min(SCHED_FIFO);
+  int max_priority = sched_get_priority_max(SCHED_FIFO);
+  bool success = (priority >= min_priority && priority <= max_priority);
+  if (!success) {
+    LOGE("Real-time priority %d is outside %d to %d", priority,
+         min_priority, max_priority);
+  } else {
+    struct sched_param param = {};
+    param.sched_priority = priority;
+    int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    success = (result == 0);
+    if (!success) {
+      LOGE("Failed to set real-time priority, continuing without: %s",
+           strerror(result));
+    }
+  }
+
+  return success;
+}
+
+bool Realtime::SetCpuAffinity(int cpu) {
+#ifdef __linux__
+  bool success = (cpu >= 0 && cpu < CPU_SETSIZE);
+  if (!success) {
+    LOGE("Invalid CPU %d", cpu);
+  } else {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    success = (result == 0);
+    if (!success) {
+      LOGE("Failed to pin to CPU %d, continuing without: %s", cpu,
+           strerror(result));
+    }
+  }
+
+  return success;
+#else
+  LOGE("CPU affinity is not supported on this platform");
+  return false;
+#endif  // __linux__
+}
+
+void Realtime::PrefaultStack(size_t size) {
+  // Touch one byte per page. The volatile buffer prevents the compiler from
+  // eliding the writes or the allocation.
+  constexpr size_t kPageSize = 4096;
+  volatile char *stack = static_cast<volatile char *>(alloca(size));
+  for (size_t i = 0; i < size; i += kPageSize) {
+    stack[i] = 0;
+  }
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_REALTIME_H_
+#define DOGTRICKS_REALTIME_H_
+
+#include <cstddef>
+
+namespace dogtricks {
+
+/**
+ * Helpers to reduce the scheduling jitter of latency sensitive threads. Each
+ * helper logs and returns false if it lacks the privileges or platform
+ * support it needs, leaving the thread or process as it was, so that callers
+ * may continue without real-time guarantees.
+ */
+class Realtime {
+ public:
+  //! The default amount of stack to fault in for a real-time thread.
+  static constexpr size_t kDefaultPrefaultStackSize = 256 * 1024;
+
+  /**
+   * Locks all current and future pages of the process into memory so that
+   * page faults do not stall real-time threads.
+   *
+   * @return true if successful, false otherwise.
+   */
+  static bool LockMemory();
+
+  /**
+   * Moves the calling thread to the SCHED_FIFO scheduling class.
+   *
+   * @param priority The real-time priority, from 1 to 99.
+   * @return true if successful, false otherwise.
+   */
+  static bool SetFifoPriority(int priority);
+
+  /**
+   * Pins the calling thread to a single CPU.
+   *
+   * @param cpu The index of the CPU to run on.
+   * @return true if successful, false otherwise.
+   */
+  static bool SetCpuAffinity(int cpu);
+
+  /**
+   * Touches the supplied amount of stack below the caller so that it is
+   * mapped before it is needed. This is most useful after LockMemory.
+   *
+   * @param size The number of bytes of stack to fault in.
+   */
+  static void PrefaultStack(size_t size = kDefaultPrefaultStackSize);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_REALTIME_H_
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <string>
+#include <tclap/CmdLine.h>
+#include <thread>
+#include <unistd.h>
+
+#include "event_ring.h"
+#include "log.h"
+
+using dogtricks::EventRingReader;
+
+//! A description of the program.
+constexpr char kDescription[] =
+    "Copies binary event records from a dogtricks event ring to stdout.";
+
+//! The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+//! The time to sleep when the reader has caught up with the writer.
+constexpr std::chrono::milliseconds kIdleSleep(1);
+
+//! Cleared when SIGINT or SIGTERM is raised.
+std::atomic<bool> gRunning(true);
+
+/**
+ * Handle signals to stop reading gracefully.
+ */
+void SignalHandler(int signal) {
+  gRunning = false;
+}
+
+int main(int argc, char **argv) {
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<std::string> name_arg("", "name",
+      "the name of the event ring to read",
+      false /* req */, "/dogtricks", "name", cmd);
+  cmd.parse(argc, argv);
+
+  EventRingReader reader(name_arg.getValue().c_str());
+  bool success = reader.Open();
+  if (success) {
+    std::signal(SIGINT, SignalHandler);
+    std::signal(SIGTERM, SignalHandler);
+
+    uint64_t records = 0;
+    while (gRunning) {
+      std::string_view record;
+      if (!reader.Peek(&record)) {
+        std::this_thread::sleep_for(kIdleSleep);
+      } else {
+        // The record is copied out before it is validated, so a torn record
+        // must not be written.
+        std::string copy(record);
+        if (reader.Consume()) {
+          records++;
+          if (write(STDOUT_FILENO, copy.data(), copy.size()) < 0) {
+            break;
+          }
+        }
+      }
+    }
+
+    LOGI("Event ring:");
+    LOGI("  records: %" PRIu64, records);
+    LOGI("  overruns: %" PRIu64, reader.GetOverrunCount());
+  }
+
+  return (success ? 0 : -1);
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "script_runner.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "log.h"
+
+namespace dogtricks {
+namespace {
+
+//! The longest line read from a script.
+constexpr size_t kMaxLineSize = 1024;
+
+//! The most times a single line may repeat a command.
+constexpr unsigned long kMaxRepeatCount = UINT16_MAX;
+
+/**
+ * Parses a decimal number that must not exceed the supplied maximum.
+ */
+bool ParseNumber(const std::string& text, unsigned long max,
+                 unsigned long *value) {
+  char *end = nullptr;
+  errno = 0;
+  *value = strtoul(text.c_str(), &end, 10);
+  return (!text.empty() && isdigit(static_cast<unsigned char>(text[0]))
+      && *end == '\0' && errno == 0 && *value <= max);
+}
+
+/**
+ * Splits a line into words separated by whitespace.
+ */
+std::vector<std::string> SplitWords(const std::string& text) {
+  std::vector<std::string> words;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    while (pos < text.size()
+        && isspace(static_cast<unsigned char>(text[pos]))) {
+      pos++;
+    }
+
+    size_t start = pos;
+    while (pos < text.size()
+        && !isspace(static_cast<unsigned char>(text[pos]))) {
+      pos++;
+    }
+
+    if (pos > start) {
+      words.push_back(text.substr(start, pos - start));
+    }
+  }
+
+  return words;
+}
+
+}  // namespace
+
+bool ScriptRunner::Load(const char *path) {
+  bool from_stdin = (strcmp(path, "-") == 0);
+  FILE *file = from_stdin ? stdin : fopen(path, "r");
+  bool success = (file != nullptr);
+  if (!success) {
+    LOGE("Failed to open script %s: %s", path, strerror(errno));
+  } else {
+    commands_.clear();
+    char line[kMaxLineSize];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+      line_number++;
+      success &= ParseLine(line_number, line);
+    }
+
+    if (!from_stdin) {
+      fclose(file);
+    }
+  }
+
+  return success;
+}
+
+bool ScriptRunner::Run(Radio *radio, OutputWriter *writer) {
+  radio_ = radio;
+  writer_ = writer;
+  results_.clear();
+  results_.resize(commands_.size());
+  stopping_ = false;
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < kPipelineDepth; i++) {
+    workers.emplace_back(&ScriptRunner::WorkerLoop, this);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  size_t next = 0;
+  for (size_t i = 0; i < commands_.size(); i++) {
+    if (IsPipelined(commands_[i])) {
+      // At most kPipelineDepth commands run ahead of the results written so
+      // that a slow command does not hold an unbounded number of results.
+      if (i - next >= kPipelineDepth) {
+        WriteResults(lock, &next, i - kPipelineDepth + 1, true /* wait */);
+      }
+
+      queue_.push_back(i);
+      cv_.notify_all();
+    } else {
+      WriteResults(lock, &next, i, true /* wait */);
+      lock.unlock();
+      Execute(commands_[i], &results_[i]);
+      lock.lock();
+      results_[i].done = true;
+    }
+
+    WriteResults(lock, &next, i + 1, false /* wait */);
+  }
+
+  WriteResults(lock, &next, commands_.size(), true /* wait */);
+  stopping_ = true;
+  cv_.notify_all();
+  lock.unlock();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  bool success = true;
+  for (const auto& result : results_) {
+    success &= result.success;
+  }
+
+  return success;
+}
+
+bool ScriptRunner::ParseLine(size_t line, const std::string& text) {
+  std::vector<std::string> words = SplitWords(text);
+  if (words.empty() || words[0][0] == '#') {
+    return true;
+  }
+
+  Command command;
+  command.line = line;
+  for (const auto& word : words) {
+    command.text += (command.text.empty() ? "" : " ") + word;
+  }
+
+  unsigned long first = 0;
+  unsigned long last = 0;
+  unsigned long count = 1;
+  const std::string& name = words[0];
+  bool success = true;
+  if (name == "get_channel" && words.size() == 2) {
+    command.op = Op::GetChannel;
+    size_t separator = words[1].find("..");
+    if (separator == std::string::npos) {
+      success = ParseNumber(words[1], UINT8_MAX, &first);
+      last = first;
+    } else {
+      success = ParseNumber(words[1].substr(0, separator), UINT8_MAX, &first)
+          && ParseNumber(words[1].substr(separator + 2), UINT8_MAX, &last)
+          && first <= last;
+    }
+  } else if (name == "list_channels" && words.size() == 1) {
+    command.op = Op::ListChannels;
+  } else if (name == "signal" && words.size() <= 2) {
+    command.op = Op::GetSignal;
+    if (words.size() == 2) {
+      success = ParseNumber(words[1], kMaxRepeatCount, &count) && count > 0;
+    }
+  } else if (name == "set_channel" && words.size() == 2) {
+    command.op = Op::SetChannel;
+    success = ParseNumber(words[1], UINT8_MAX, &first);
+    command.channel_id = static_cast<uint8_t>(first);
+  } else if (name == "power" && words.size() == 2) {
+    command.op = Op::SetPowerMode;
+    if (words[1] == "full") {
+      command.power_state = Radio::PowerState::FullMode;
+    } else if (words[1] == "sleep") {
+      command.power_state = Radio::PowerState::SleepMode;
+    } else {
+      success = false;
+    }
+  } else if (name == "reset" && words.size() == 1) {
+    command.op = Op::Reset;
+  } else if (name == "sleep" && words.size() == 2) {
+    command.op = Op::Sleep;
+    unsigned long duration_ms = 0;
+    success = ParseNumber(words[1], UINT32_MAX, &duration_ms);
+    command.duration = std::chrono::milliseconds(duration_ms);
+  } else {
+    success = false;
+  }
+
+  if (!success) {
+    LOGE("Invalid command on line %zu: %s", line, command.text.c_str());
+  } else if (command.op == Op::GetChannel) {
+    for (unsigned long channel_id = first; channel_id <= last; channel_id++) {
+      command.channel_id = static_cast<uint8_t>(channel_id);
+      commands_.push_back(command);
+    }
+  } else {
+    for (unsigned long i = 0; i < count; i++) {
+      command.sequential = (i > 0);
+      commands_.push_back(command);
+    }
+  }
+
+  return success;
+}
+
+void ScriptRunner::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      break;
+    }
+
+    size_t index = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    Execute(commands_[index], &results_[index]);
+    lock.lock();
+    results_[index].done = true;
+    cv_.notify_all();
+  }
+}
+
+void ScriptRunner::Execute(const Command& command, Result *result) {
+  auto start_time = std::chrono::steady_clock::now();
+  bool success = true;
+  switch (command.op) {
+    case Op::GetChannel: {
+      Radio::ChannelDescriptor descriptor;
+      success = radio_->GetChannelDescriptor(command.channel_id, &descriptor);
+      if (success) {
+        result->descriptors.push_back(std::move(descriptor));
+      }
+      break;
+    }
+    case Op::ListChannels: {
+      Radio::ChannelList channels;
+      success = radio_->GetChannelList(&channels);
+      for (uint8_t channel_id : channels) {
+        Radio::ChannelDescriptor descriptor;
+        if (!radio_->GetChannelDescriptor(channel_id, &descriptor)) {
+          success = false;
+        } else {
+          result->descriptors.push_back(std::move(descriptor));
+        }
+      }
+      break;
+    }
+    case Op::GetSignal:
+      success = radio_->GetSignalStrength(
+          &result->summary, &result->satellite, &result->terrestrial);
+      result->has_signal = success;
+      break;
+    case Op::SetChannel:
+      success = radio_->SetChannel(command.channel_id);
+      break;
+    case Op::SetPowerMode:
+      success = radio_->SetPowerMode(command.power_state);
+      break;
+    case Op::Reset:
+      success = radio_->Reset();
+      break;
+    case Op::Sleep:
+      std::this_thread::sleep_for(command.duration);
+      break;
+  }
+
+  result->success = success;
+  result->elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start_time);
+}
+
+void ScriptRunner::WriteResults(std::unique_lock<std::mutex>& lock,
+                                size_t *next, size_t end, bool wait) {
+  while (*next < end) {
+    if (wait) {
+      cv_.wait(lock, [&]() { return results_[*next].done; });
+    } else if (!results_[*next].done) {
+      break;
+    }
+
+    // A finished result is no longer touched by the threads, so it is
+    // written without the lock.
+    const Command& command = commands_[*next];
+    const Result& result = results_[*next];
+    lock.unlock();
+    writer_->BeginBatch();
+    for (const auto& descriptor : result.descriptors) {
+      writer_->WriteChannelDescriptor(descriptor);
+    }
+
+    if (result.has_signal) {
+      writer_->WriteSignalStrength(result.summary, result.satellite,
+                                   result.terrestrial);
+    }
+
+    writer_->WriteCommandResult(command.line, command.text, result.success,
+                                result.elapsed);
+    writer_->EndBatch();
+    lock.lock();
+    (*next)++;
+  }
+}
+
+}  // namespace dogtricks
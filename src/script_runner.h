@@ -0,0 +1,215 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_SCRIPT_RUNNER_H_
+#define DOGTRICKS_SCRIPT_RUNNER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "non_copyable.h"
+#include "output_writer.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+/**
+ * Runs a script of commands against a radio in a single session. Each line
+ * of a script holds one command. Blank lines and lines starting with '#' are
+ * ignored. The commands are:
+ *
+ *   get_channel <id>[..<id>]   writes the descriptor of each channel
+ *   list_channels              writes the descriptor of every channel
+ *   signal [count]             writes the signal strength count times
+ *   set_channel <id>           tunes to a channel
+ *   power <full|sleep>         sets the power mode
+ *   reset                      resets the radio
+ *   sleep <ms>                 pauses the script
+ *
+ * Commands that only read from the radio are independent of each other and
+ * are run by a pool of threads, so that the next request is waiting as soon
+ * as the radio finishes the previous one. The other commands wait for the
+ * commands before them to finish and run alone. The polls of a repeated
+ * signal command also run one after another, since concurrent polls would
+ * share a single request to the radio. Results are written in
+ * script order, each followed by a command result record with its timing.
+ */
+class ScriptRunner : public NonCopyable {
+ public:
+  //! The number of reading commands that may run at once.
+  static constexpr size_t kPipelineDepth = 4;
+
+  /**
+   * Reads and parses a script. Ranges and counts are expanded into one
+   * command each.
+   *
+   * @param path The path of the script, or "-" to read standard input.
+   * @return true if the script was read and every line is valid, false
+   *         otherwise.
+   */
+  bool Load(const char *path);
+
+  /**
+   * Runs the loaded script. Every command runs even if an earlier one fails.
+   *
+   * @param radio The radio to run commands against.
+   * @param writer The writer to write results to.
+   * @return true if every command succeeded, false otherwise.
+   */
+  bool Run(Radio *radio, OutputWriter *writer);
+
+ private:
+  /**
+   * The supported commands.
+   */
+  enum class Op {
+    GetChannel,
+    ListChannels,
+    GetSignal,
+    SetChannel,
+    SetPowerMode,
+    Reset,
+    Sleep,
+  };
+
+  /**
+   * A command parsed from a script.
+   */
+  struct Command {
+    //! The operation to perform.
+    Op op;
+
+    //! The line of the script the command is on.
+    size_t line;
+
+    //! The text of the line, without surrounding whitespace.
+    std::string text;
+
+    //! The channel to get or set.
+    uint8_t channel_id = 0;
+
+    //! The power mode to set.
+    Radio::PowerState power_state = Radio::PowerState::FullMode;
+
+    //! The time to pause for.
+    std::chrono::milliseconds duration{0};
+
+    //! Set if the command must wait for the commands before it even though
+    //! it only reads, such as each repeat of a signal poll after the first.
+    bool sequential = false;
+  };
+
+  /**
+   * The outcome of a command, held until earlier results are written.
+   */
+  struct Result {
+    //! Set once the command has finished.
+    bool done = false;
+
+    //! Whether the command succeeded.
+    bool success = false;
+
+    //! The time taken to execute the command.
+    std::chrono::microseconds elapsed{0};
+
+    //! The channels read by the command.
+    std::vector<Radio::ChannelDescriptor> descriptors;
+
+    //! Set when the command read the signal strength.
+    bool has_signal = false;
+
+    //! The summary signal strength.
+    Radio::SignalStrength summary;
+
+    //! The satellite signal strength.
+    Radio::SignalStrength satellite;
+
+    //! The terrestrial signal strength.
+    Radio::SignalStrength terrestrial;
+  };
+
+  //! The radio to run commands against while running.
+  Radio *radio_ = nullptr;
+
+  //! The writer to write results to while running.
+  OutputWriter *writer_ = nullptr;
+
+  //! The commands of the loaded script.
+  std::vector<Command> commands_;
+
+  //! The results of the commands, indexed as the commands.
+  std::vector<Result> results_;
+
+  //! The mutex to protect the work queue and results.
+  std::mutex mutex_;
+
+  //! Signalled when work is queued or a command finishes.
+  std::condition_variable cv_;
+
+  //! The indices of reading commands waiting for a thread.
+  std::deque<size_t> queue_;
+
+  //! Set to true to stop the threads once the queue is empty.
+  bool stopping_ = false;
+
+  /**
+   * Parses one line of a script, appending the commands it holds.
+   *
+   * @return true if the line is valid, false otherwise.
+   */
+  bool ParseLine(size_t line, const std::string& text);
+
+  /**
+   * @return true if the command only reads from the radio and may run
+   *         alongside the commands before it.
+   */
+  static bool IsPipelined(const Command& command) {
+    return ((command.op == Op::GetChannel || command.op == Op::ListChannels
+        || command.op == Op::GetSignal) && !command.sequential);
+  }
+
+  /**
+   * Runs reading commands from the queue until stopped.
+   */
+  void WorkerLoop();
+
+  /**
+   * Executes a command and populates its result. The lock must not be held.
+   */
+  void Execute(const Command& command, Result *result);
+
+  /**
+   * Writes the results of finished commands in order, starting with the
+   * supplied index, optionally waiting for them to finish.
+   *
+   * @param lock The lock on the mutex.
+   * @param next The index of the next result to write, which is advanced.
+   * @param end The index to wait for and stop at.
+   * @param wait Whether to wait for unfinished commands before end.
+   */
+  void WriteResults(std::unique_lock<std::mutex>& lock, size_t *next,
+                    size_t end, bool wait);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_SCRIPT_RUNNER_H_
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_SKETCHES_H_
+#define DOGTRICKS_SKETCHES_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace dogtricks {
+
+/**
+ * Tracks the most frequent keys in a stream in fixed memory using the
+ * Space-Saving algorithm. Any key that makes up more than 1/N of the stream
+ * is retained. When the table is full, the least frequent key is replaced
+ * and the new key inherits its count as the error bound, so each count
+ * overestimates the true count by at most its error.
+ */
+template <size_t N, size_t kMaxNameSize>
+class SpaceSaving {
+ public:
+  /**
+   * A retained key.
+   */
+  struct Entry {
+    //! The hash of the key.
+    uint64_t key;
+
+    //! The estimated number of occurrences.
+    uint64_t count;
+
+    //! The most that count may overestimate the number of occurrences by.
+    uint64_t error;
+
+    //! The size of the name.
+    uint8_t name_size;
+
+    //! A name to display for the key, truncated to the capacity.
+    char name[kMaxNameSize];
+
+    std::string_view GetName() const {
+      return std::string_view(name, name_size);
+    }
+  };
+
+  static_assert(kMaxNameSize <= UINT8_MAX, "The name size must fit a byte");
+
+  //! The number of keys retained.
+  static constexpr size_t kCapacity = N;
+
+  /**
+   * Counts an occurrence of a key. This scans the table, which is a constant
+   * cost for the small tables this is intended for.
+   *
+   * @param key The hash of the key.
+   * @param name The name to display for the key if it is added.
+   */
+  void Add(uint64_t key, std::string_view name) {
+    Entry *min_entry = nullptr;
+    for (size_t i = 0; i < size_; i++) {
+      if (entries_[i].key == key) {
+        entries_[i].count++;
+        return;
+      }
+
+      if (min_entry == nullptr || entries_[i].count < min_entry->count) {
+        min_entry = &entries_[i];
+      }
+    }
+
+    Entry *entry = min_entry;
+    uint64_t base_count = 0;
+    if (size_ < N) {
+      entry = &entries_[size_++];
+    } else {
+      base_count = min_entry->count;
+    }
+
+    entry->key = key;
+    entry->count = base_count + 1;
+    entry->error = base_count;
+    entry->name_size =
+        static_cast<uint8_t>(std::min(name.size(), kMaxNameSize));
+    memcpy(entry->name, name.data(), entry->name_size);
+  }
+
+  /**
+   * Copies the retained keys, most frequent first.
+   *
+   * @param entries The array to copy to, which must hold N entries.
+   * @return the number of entries copied.
+   */
+  size_t GetTop(Entry *entries) const {
+    std::copy(entries_, entries_ + size_, entries);
+    std::sort(entries, entries + size_, [](const Entry& a, const Entry& b) {
+      return a.count > b.count;
+    });
+    return size_;
+  }
+
+ private:
+  //! The retained keys.
+  Entry entries_[N];
+
+  //! The number of retained keys.
+  size_t size_ = 0;
+};
+
+/**
+ * Estimates the number of occurrences of any key in a stream with a
+ * count-min sketch of kDepth rows of kWidth counters. Estimates never
+ * undercount, and overcount by at most 2/kWidth of the stream with
+ * probability 1 - 2^-kDepth.
+ */
+template <size_t kDepth, size_t kWidth>
+class CountMinSketch {
+ public:
+  static_assert((kWidth & (kWidth - 1)) == 0, "The width must be a power of 2");
+
+  CountMinSketch() {
+    memset(counters_, 0, sizeof(counters_));
+  }
+
+  /**
+   * Counts an occurrence of the key with the supplied hash.
+   */
+  void Add(uint64_t key) {
+    for (size_t row = 0; row < kDepth; row++) {
+      uint32_t& counter = counters_[row][GetColumn(key, row)];
+      if (counter != UINT32_MAX) {
+        counter++;
+      }
+    }
+  }
+
+  /**
+   * @return the estimated number of occurrences of the key.
+   */
+  uint32_t Estimate(uint64_t key) const {
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < kDepth; row++) {
+      estimate = std::min(estimate, counters_[row][GetColumn(key, row)]);
+    }
+
+    return estimate;
+  }
+
+ private:
+  //! The counters for each row.
+  uint32_t counters_[kDepth][kWidth];
+
+  /**
+   * Derives the column for a row from the two halves of the hash.
+   */
+  static size_t GetColumn(uint64_t key, size_t row) {
+    uint32_t low = static_cast<uint32_t>(key);
+    uint32_t high = static_cast<uint32_t>(key >> 32) | 1;
+    return (low + row * high) & (kWidth - 1);
+  }
+};
+
+/**
+ * Estimates the number of distinct keys in a stream with a HyperLogLog of
+ * 2^kPrecision one-byte registers. The standard error is about
+ * 1.04 / sqrt(2^kPrecision). Keys must be well mixed 64-bit hashes.
+ */
+template <int kPrecision>
+class HyperLogLog {
+ public:
+  static_assert(kPrecision >= 4 && kPrecision <= 16,
+                "The precision must be between 4 and 16");
+
+  //! The number of registers.
+  static constexpr size_t kRegisterCount = static_cast<size_t>(1) << kPrecision;
+
+  HyperLogLog() { Reset(); }
+
+  /**
+   * Adds the key with the supplied hash.
+   */
+  void Add(uint64_t key) {
+    size_t index = key >> (64 - kPrecision);
+    uint64_t remaining = (key << kPrecision)
+        | (static_cast<uint64_t>(1) << (kPrecision - 1));
+    uint8_t rank = static_cast<uint8_t>(__builtin_clzll(remaining) + 1);
+    registers_[index] = std::max(registers_[index], rank);
+  }
+
+  /**
+   * Adds the keys of another sketch to this one.
+   */
+  void Merge(const HyperLogLog& other) {
+    for (size_t i = 0; i < kRegisterCount; i++) {
+      registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+  }
+
+  /**
+   * @return the estimated number of distinct keys added.
+   */
+  uint64_t Estimate() const {
+    double sum = 0.0;
+    size_t zero_registers = 0;
+    for (size_t i = 0; i < kRegisterCount; i++) {
+      sum += std::ldexp(1.0, -registers_[i]);
+      zero_registers += (registers_[i] == 0);
+    }
+
+    double count = static_cast<double>(kRegisterCount);
+    double alpha = 0.7213 / (1.0 + 1.079 / count);
+    double estimate = alpha * count * count / sum;
+
+    // Small cardinalities are estimated more accurately by linear counting.
+    if (estimate <= 2.5 * count && zero_registers > 0) {
+      estimate = count * std::log(count / zero_registers);
+    }
+
+    return static_cast<uint64_t>(estimate + 0.5);
+  }
+
+  /**
+   * Discards all keys.
+   */
+  void Reset() {
+    memset(registers_, 0, sizeof(registers_));
+  }
+
+ private:
+  //! The largest rank observed for the keys mapped to each register.
+  uint8_t registers_[kRegisterCount];
+};
+
+/**
+ * Counts events over a sliding window of N buckets in fixed memory. The
+ * window slides one bucket at a time, so the oldest bucket may be partially
+ * outside of the window.
+ */
+template <size_t N>
+class SlidingWindowCounter {
+ public:
+  /**
+   * Setup an empty counter.
+   *
+   * @param bucket_ns The duration of each bucket in nanoseconds.
+   */
+  explicit SlidingWindowCounter(uint64_t bucket_ns) : bucket_ns_(bucket_ns) {
+    std::fill(epochs_, epochs_ + N, UINT64_MAX);
+    std::fill(counts_, counts_ + N, 0);
+  }
+
+  /**
+   * Counts events at the supplied time.
+   *
+   * @param now_ns The current monotonic time in nanoseconds.
+   * @param count The number of events.
+   */
+  void Add(uint64_t now_ns, uint32_t count = 1) {
+    uint64_t epoch = now_ns / bucket_ns_;
+    size_t index = epoch % N;
+    if (epochs_[index] != epoch) {
+      epochs_[index] = epoch;
+      counts_[index] = 0;
+    }
+
+    counts_[index] += count;
+  }
+
+  /**
+   * @param now_ns The current monotonic time in nanoseconds.
+   * @return the number of events in the window ending at the supplied time.
+   */
+  uint64_t GetSum(uint64_t now_ns) const {
+    uint64_t epoch = now_ns / bucket_ns_;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < N; i++) {
+      if (epochs_[i] <= epoch && epoch - epochs_[i] < N) {
+        sum += counts_[i];
+      }
+    }
+
+    return sum;
+  }
+
+ private:
+  //! The duration of each bucket.
+  const uint64_t bucket_ns_;
+
+  //! The epoch that each bucket counts, or UINT64_MAX if it is unused.
+  uint64_t epochs_[N];
+
+  //! The number of events in each bucket.
+  uint32_t counts_[N];
+};
+
+/**
+ * Estimates the number of distinct keys over a sliding window of N buckets,
+ * each with a HyperLogLog that is merged with the others when queried.
+ */
+template <int kPrecision, size_t N>
+class SlidingWindowDistinct {
+ public:
+  /**
+   * Setup an empty window.
+   *
+   * @param bucket_ns The duration of each bucket in nanoseconds.
+   */
+  explicit SlidingWindowDistinct(uint64_t bucket_ns) : bucket_ns_(bucket_ns) {
+    std::fill(epochs_, epochs_ + N, UINT64_MAX);
+  }
+
+  /**
+   * Adds the key with the supplied hash at the supplied time.
+   */
+  void Add(uint64_t now_ns, uint64_t key) {
+    uint64_t epoch = now_ns / bucket_ns_;
+    size_t index = epoch % N;
+    if (epochs_[index] != epoch) {
+      epochs_[index] = epoch;
+      buckets_[index].Reset();
+    }
+
+    buckets_[index].Add(key);
+  }
+
+  /**
+   * @return the estimated number of distinct keys in the window ending at
+   *         the supplied time.
+   */
+  uint64_t Estimate(uint64_t now_ns) const {
+    uint64_t epoch = now_ns / bucket_ns_;
+    HyperLogLog<kPrecision> merged;
+    for (size_t i = 0; i < N; i++) {
+      if (epochs_[i] <= epoch && epoch - epochs_[i] < N) {
+        merged.Merge(buckets_[i]);
+      }
+    }
+
+    return merged.Estimate();
+  }
+
+ private:
+  //! The duration of each bucket.
+  const uint64_t bucket_ns_;
+
+  //! The epoch that each bucket holds, or UINT64_MAX if it is unused.
+  uint64_t epochs_[N];
+
+  //! The keys added during each bucket.
+  HyperLogLog<kPrecision> buckets_[N];
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_SKETCHES_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "state_file.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "log.h"
+
+namespace dogtricks {
+
+bool StateFile::Load(Radio::SessionState *state) {
+  FILE *file = fopen(path_.c_str(), "r");
+  bool success = (file != nullptr);
+  if (!success) {
+    LOGD("No state loaded from %s: %s", path_.c_str(), strerror(errno));
+  } else {
+    char line[64];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+      unsigned int value;
+      if (sscanf(line, "power_mode=%u", &value) == 1) {
+        state->power_state = static_cast<Radio::PowerState>(value);
+      } else if (sscanf(line, "channel=%u", &value) == 1) {
+        state->channel_id = static_cast<uint8_t>(value);
+      } else if (sscanf(line, "monitor_mask=%u", &value) == 1) {
+        state->monitor_mask = static_cast<uint8_t>(value);
+      }
+    }
+
+    fclose(file);
+  }
+
+  return success;
+}
+
+bool StateFile::Save(const Radio::SessionState& state) {
+  std::string temp_path = path_ + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "w");
+  bool success = (file != nullptr);
+  if (!success) {
+    LOGE("Failed to open %s: %s", temp_path.c_str(), strerror(errno));
+  } else {
+    if (state.power_state.has_value()) {
+      fprintf(file, "power_mode=%" PRIu8 "\n",
+              static_cast<uint8_t>(state.power_state.value()));
+    }
+
+    if (state.channel_id.has_value()) {
+      fprintf(file, "channel=%" PRIu8 "\n", state.channel_id.value());
+    }
+
+    fprintf(file, "monitor_mask=%" PRIu8 "\n", state.monitor_mask);
+    success = (fclose(file) == 0);
+    if (success) {
+      success = (rename(temp_path.c_str(), path_.c_str()) == 0);
+    }
+
+    if (!success) {
+      LOGE("Failed to save state to %s: %s", path_.c_str(), strerror(errno));
+    }
+  }
+
+  return success;
+}
+
+}  // namespace dogtricks
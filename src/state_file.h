@@ -0,0 +1,65 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_STATE_FILE_H_
+#define DOGTRICKS_STATE_FILE_H_
+
+#include <string>
+
+#include "non_copyable.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+/**
+ * Persists the session state of a radio between runs so that a restart only
+ * needs to reissue the settings that differ.
+ */
+class StateFile : public NonCopyable {
+ public:
+  /**
+   * Setup the state file with the supplied path. The file is not accessed
+   * until it is loaded or saved.
+   *
+   * @param path The path of the file to store the state in.
+   */
+  StateFile(const char *path) : path_(path) {}
+
+  /**
+   * Loads the session state from the file. Unrecognized lines are ignored.
+   *
+   * @param state The state to populate.
+   * @return true if successful, false if the file could not be read.
+   */
+  bool Load(Radio::SessionState *state);
+
+  /**
+   * Saves the session state to the file. The file is replaced atomically so
+   * that an interrupted save does not leave a partial state behind.
+   *
+   * @param state The state to save.
+   * @return true if successful, false otherwise.
+   */
+  bool Save(const Radio::SessionState& state);
+
+ private:
+  //! The path of the file to store the state in.
+  std::string path_;
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_STATE_FILE_H_
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "string_pool.h"
+
+#include <functional>
+
+namespace dogtricks {
+
+StringPool::Handle::Handle(const Handle& other) : entry_(other.entry_) {
+  if (entry_ != nullptr) {
+    entry_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+StringPool::Handle& StringPool::Handle::operator=(const Handle& other) {
+  if (entry_ != other.entry_) {
+    Release();
+    entry_ = other.entry_;
+    if (entry_ != nullptr) {
+      entry_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  return *this;
+}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle&& other) noexcept {
+  if (this != &other) {
+    Release();
+    entry_ = other.entry_;
+    other.entry_ = nullptr;
+  }
+
+  return *this;
+}
+
+void StringPool::Handle::Release() {
+  if (entry_ == nullptr) {
+    return;
+  }
+
+  // Drop references without locking unless this may be the last one. An
+  // entry only reaches zero references with its shard locked, so Intern can
+  // never revive an entry that is being freed.
+  uint32_t refs = entry_->refs.load(std::memory_order_relaxed);
+  while (refs > 1) {
+    if (entry_->refs.compare_exchange_weak(refs, refs - 1,
+                                           std::memory_order_acq_rel)) {
+      entry_ = nullptr;
+      return;
+    }
+  }
+
+  Shard *shard = entry_->shard;
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  if (entry_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    shard->bytes -= entry_->value.size();
+    shard->entries.erase(shard->entries.find(entry_->value));
+  }
+
+  entry_ = nullptr;
+}
+
+StringPool::StringPool() : shards_(std::make_unique<Shard[]>(kShardCount)) {}
+
+StringPool::Handle StringPool::Intern(std::string_view value) {
+  if (value.empty()) {
+    return Handle();
+  }
+
+  lookups_.fetch_add(1, std::memory_order_relaxed);
+  size_t hash = std::hash<std::string_view>()(value);
+  Shard& shard = shards_[hash & (kShardCount - 1)];
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(value);
+  Entry *entry;
+  if (it != shard.entries.end()) {
+    entry = it->second.get();
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    bytes_saved_.fetch_add(value.size(), std::memory_order_relaxed);
+  } else {
+    auto new_entry = std::make_unique<Entry>();
+    new_entry->refs.store(1, std::memory_order_relaxed);
+    new_entry->shard = &shard;
+    new_entry->value = std::string(value);
+    entry = new_entry.get();
+
+    // The key refers to the value owned by the entry, which does not move.
+    shard.entries.emplace(entry->value, std::move(new_entry));
+    shard.bytes += value.size();
+  }
+
+  return Handle(entry);
+}
+
+StringPool::Stats StringPool::GetStats() const {
+  Stats stats;
+  for (size_t i = 0; i < kShardCount; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    stats.strings += shards_[i].entries.size();
+    stats.bytes += shards_[i].bytes;
+  }
+
+  stats.lookups = lookups_.load(std::memory_order_relaxed);
+  stats.hits = hits_.load(std::memory_order_relaxed);
+  stats.bytes_saved = bytes_saved_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void InternedMetadata::Apply(StringPool *pool,
+                             const Radio::Metadata& metadata) {
+  if (metadata.artist.has_value()) {
+    artist = pool->Intern(metadata.artist.value());
+  }
+
+  if (metadata.title.has_value()) {
+    title = pool->Intern(metadata.title.value());
+  }
+
+  if (metadata.album.has_value()) {
+    album = pool->Intern(metadata.album.value());
+  }
+
+  if (metadata.record_label.has_value()) {
+    record_label = pool->Intern(metadata.record_label.value());
+  }
+
+  if (metadata.composer.has_value()) {
+    composer = pool->Intern(metadata.composer.value());
+  }
+
+  if (metadata.alt_artist.has_value()) {
+    alt_artist = pool->Intern(metadata.alt_artist.value());
+  }
+
+  if (metadata.comments.has_value()) {
+    comments = pool->Intern(metadata.comments.value());
+  }
+
+  if (!metadata.promo_text.empty()) {
+    promo_text.clear();
+    for (const auto& text : metadata.promo_text) {
+      promo_text.push_back(pool->Intern(text));
+    }
+  }
+}
+
+Radio::Metadata InternedMetadata::ToMetadata() const {
+  Radio::Metadata metadata;
+  if (!artist.empty()) {
+    metadata.artist = Radio::String(artist.Get());
+  }
+
+  if (!title.empty()) {
+    metadata.title = Radio::String(title.Get());
+  }
+
+  if (!album.empty()) {
+    metadata.album = Radio::String(album.Get());
+  }
+
+  if (!record_label.empty()) {
+    metadata.record_label = Radio::String(record_label.Get());
+  }
+
+  if (!composer.empty()) {
+    metadata.composer = Radio::String(composer.Get());
+  }
+
+  if (!alt_artist.empty()) {
+    metadata.alt_artist = Radio::String(alt_artist.Get());
+  }
+
+  if (!comments.empty()) {
+    metadata.comments = Radio::String(comments.Get());
+  }
+
+  for (const auto& text : promo_text) {
+    metadata.promo_text.push_back(Radio::String(text.Get()));
+  }
+
+  return metadata;
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_STRING_POOL_H_
+#define DOGTRICKS_STRING_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "non_copyable.h"
+#include "radio.h"
+
+namespace dogtricks {
+
+/**
+ * A concurrent pool of interned strings. Each distinct string is stored once
+ * and shared through reference counted handles. A string is freed when its
+ * last handle is released. The pool is split into shards by hash, so threads
+ * interning unrelated strings rarely contend. Copying and releasing a handle
+ * does not lock unless it releases the last reference.
+ *
+ * The pool must outlive every handle obtained from it.
+ */
+class StringPool : public NonCopyable {
+ private:
+  struct Shard;
+
+  /**
+   * An interned string.
+   */
+  struct Entry {
+    //! The number of handles to this entry.
+    std::atomic<uint32_t> refs;
+
+    //! The shard that owns this entry.
+    Shard *shard;
+
+    //! The value of the string.
+    std::string value;
+  };
+
+ public:
+  /**
+   * A reference to an interned string. Handles to equal strings from the same
+   * pool compare equal in constant time. A default constructed handle refers
+   * to the empty string.
+   */
+  class Handle {
+   public:
+    Handle() = default;
+    Handle(const Handle& other);
+    Handle(Handle&& other) noexcept : entry_(other.entry_) {
+      other.entry_ = nullptr;
+    }
+
+    ~Handle() {
+      Release();
+    }
+
+    Handle& operator=(const Handle& other);
+    Handle& operator=(Handle&& other) noexcept;
+
+    /**
+     * @return the value of the string, which is valid while the handle is
+     *         held.
+     */
+    std::string_view Get() const {
+      return (entry_ == nullptr) ? std::string_view() : entry_->value;
+    }
+
+    /**
+     * @return true if the handle refers to the empty string.
+     */
+    bool empty() const {
+      return entry_ == nullptr;
+    }
+
+    bool operator==(const Handle& other) const {
+      return entry_ == other.entry_;
+    }
+
+    bool operator!=(const Handle& other) const {
+      return entry_ != other.entry_;
+    }
+
+   private:
+    friend class StringPool;
+
+    //! The interned string, or nullptr for the empty string.
+    Entry *entry_ = nullptr;
+
+    explicit Handle(Entry *entry) : entry_(entry) {}
+
+    /**
+     * Releases the reference held by this handle, if any.
+     */
+    void Release();
+  };
+
+  /**
+   * Metrics collected by the pool.
+   */
+  struct Stats {
+    //! The number of distinct strings currently held.
+    size_t strings = 0;
+
+    //! The number of bytes of string data currently held.
+    size_t bytes = 0;
+
+    //! The number of strings interned.
+    uint64_t lookups = 0;
+
+    //! The number of strings interned that were already held.
+    uint64_t hits = 0;
+
+    //! The number of bytes that would have been stored by copying each
+    //! interned string that was already held.
+    uint64_t bytes_saved = 0;
+  };
+
+  /**
+   * Setup an empty pool.
+   */
+  StringPool();
+
+  /**
+   * Obtains a handle to the supplied string, storing it if it is not already
+   * held.
+   *
+   * @param value The string to intern.
+   * @return a handle to the interned string.
+   */
+  Handle Intern(std::string_view value);
+
+  /**
+   * @return the metrics collected by the pool.
+   */
+  Stats GetStats() const;
+
+ private:
+  //! The number of shards. This must be a power of two.
+  static constexpr size_t kShardCount = 16;
+
+  /**
+   * A subset of the interned strings.
+   */
+  struct Shard {
+    //! The mutex to lock the entries.
+    std::mutex mutex;
+
+    //! The entries, keyed by a view of their own value.
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries;
+
+    //! The number of bytes of string data held by this shard.
+    size_t bytes = 0;
+  };
+
+  //! The shards of the pool.
+  std::unique_ptr<Shard[]> shards_;
+
+  //! The number of strings interned.
+  std::atomic<uint64_t> lookups_ = 0;
+
+  //! The number of strings interned that were already held.
+  std::atomic<uint64_t> hits_ = 0;
+
+  //! The number of bytes saved by interning strings that were already held.
+  std::atomic<uint64_t> bytes_saved_ = 0;
+};
+
+/**
+ * Metadata that holds interned handles instead of copies of each string, for
+ * components that retain metadata for a long time.
+ */
+struct InternedMetadata {
+  //! The artist, or empty if not set.
+  StringPool::Handle artist;
+
+  //! The title, or empty if not set.
+  StringPool::Handle title;
+
+  //! The album, or empty if not set.
+  StringPool::Handle album;
+
+  //! The record label, or empty if not set.
+  StringPool::Handle record_label;
+
+  //! The composer, or empty if not set.
+  StringPool::Handle composer;
+
+  //! The alternate artist, or empty if not set.
+  StringPool::Handle alt_artist;
+
+  //! The comments, or empty if not set.
+  StringPool::Handle comments;
+
+  //! Promotional strings.
+  std::vector<StringPool::Handle> promo_text;
+
+  /**
+   * Applies the fields that are set in a metadata change, interning them in
+   * the supplied pool.
+   *
+   * @param pool The pool to intern strings in.
+   * @param metadata The change to apply.
+   */
+  void Apply(StringPool *pool, const Radio::Metadata& metadata);
+
+  /**
+   * @return a copy of the metadata with the non-empty fields set.
+   */
+  Radio::Metadata ToMetadata() const;
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_STRING_POOL_H_
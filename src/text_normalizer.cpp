@@ -0,0 +1,357 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "text_normalizer.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define DOGTRICKS_TEXT_NEON
+#endif
+
+namespace dogtricks {
+
+namespace {
+
+//! The number of bytes scanned at a time by the vector fast paths.
+constexpr size_t kVectorSize = 16;
+
+/**
+ * @return true if the byte is printable ASCII.
+ */
+inline bool IsPrintableAscii(uint8_t byte) {
+  return (byte >= 0x20) && (byte < 0x7f);
+}
+
+/**
+ * @return the number of leading bytes that are ASCII.
+ */
+size_t CountAscii(const uint8_t *data, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    __m128i chunk = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(&data[i]));
+    int mask = _mm_movemask_epi8(chunk);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(DOGTRICKS_TEXT_NEON)
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    if (vmaxvq_u8(vld1q_u8(&data[i])) >= 0x80) {
+      break;
+    }
+  }
+#endif
+  while ((i < size) && (data[i] < 0x80)) {
+    i++;
+  }
+
+  return i;
+}
+
+/**
+ * @return the number of leading bytes that are printable ASCII.
+ */
+size_t CountPrintableAscii(const uint8_t *data, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    __m128i chunk = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(&data[i]));
+    // The comparison is signed, so bytes with the high bit set also compare
+    // less than a space.
+    __m128i special = _mm_or_si128(_mm_cmplt_epi8(chunk, space),
+                                   _mm_cmpeq_epi8(chunk, del));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(DOGTRICKS_TEXT_NEON)
+  const uint8x16_t space = vdupq_n_u8(0x20);
+  const uint8x16_t del = vdupq_n_u8(0x7f);
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    uint8x16_t chunk = vld1q_u8(&data[i]);
+    uint8x16_t special = vorrq_u8(vcltq_u8(chunk, space),
+                                  vcgeq_u8(chunk, del));
+    if (vmaxvq_u8(special) != 0) {
+      break;
+    }
+  }
+#endif
+  while ((i < size) && IsPrintableAscii(data[i])) {
+    i++;
+  }
+
+  return i;
+}
+
+/**
+ * Decodes the multibyte UTF-8 sequence at the start of the supplied bytes.
+ *
+ * @param data The bytes to decode, starting with a non-ASCII lead byte.
+ * @param size The number of bytes available.
+ * @param code_point Populated with the decoded code point.
+ * @return the length of the sequence, or zero if it is malformed.
+ */
+size_t DecodeSequence(const uint8_t *data, size_t size,
+                      uint32_t *code_point) {
+  uint8_t lead = data[0];
+  size_t length;
+  uint32_t value;
+  uint32_t minimum;
+  if ((lead & 0xe0) == 0xc0) {
+    length = 2;
+    value = lead & 0x1f;
+    minimum = 0x80;
+  } else if ((lead & 0xf0) == 0xe0) {
+    length = 3;
+    value = lead & 0x0f;
+    minimum = 0x800;
+  } else if ((lead & 0xf8) == 0xf0) {
+    length = 4;
+    value = lead & 0x07;
+    minimum = 0x10000;
+  } else {
+    return 0;
+  }
+
+  if (length > size) {
+    return 0;
+  }
+
+  for (size_t i = 1; i < length; i++) {
+    if ((data[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    value = (value << 6) | (data[i] & 0x3f);
+  }
+
+  bool surrogate = (value >= 0xd800) && (value <= 0xdfff);
+  if ((value < minimum) || surrogate || (value > 0x10ffff)) {
+    return 0;
+  }
+
+  *code_point = value;
+  return length;
+}
+
+/**
+ * Appends bytes to the output if they fit.
+ *
+ * @return true if the bytes were appended.
+ */
+inline bool Append(const void *data, size_t size, char *output,
+                   size_t capacity, size_t *output_size) {
+  if ((capacity - *output_size) < size) {
+    return false;
+  }
+
+  memcpy(&output[*output_size], data, size);
+  *output_size += size;
+  return true;
+}
+
+}  // anonymous namespace
+
+bool TextNormalizer::IsValidUtf8(std::string_view text) {
+  auto *data = reinterpret_cast<const uint8_t *>(text.data());
+  size_t size = text.size();
+  size_t i = 0;
+  while (i < size) {
+    i += CountAscii(&data[i], size - i);
+    if (i < size) {
+      uint32_t code_point;
+      size_t length = DecodeSequence(&data[i], size - i, &code_point);
+      if (length == 0) {
+        return false;
+      }
+      i += length;
+    }
+  }
+
+  return true;
+}
+
+size_t TextNormalizer::Normalize(std::string_view text, char *output,
+                                 size_t capacity) {
+  auto *data = reinterpret_cast<const uint8_t *>(text.data());
+  size_t size = text.size();
+  bool utf8 = IsValidUtf8(text);
+
+  // The size of the output up to the last character that was not whitespace,
+  // used to trim trailing whitespace.
+  size_t trimmed_size = 0;
+  size_t output_size = 0;
+  size_t i = 0;
+  while (i < size) {
+    size_t run = CountPrintableAscii(&data[i], size - i);
+    if (run > 0) {
+      const uint8_t *start = &data[i];
+      size_t length = run;
+      i += run;
+      if (output_size == 0) {
+        while ((length > 0) && (*start == ' ')) {
+          start++;
+          length--;
+        }
+      }
+
+      // ASCII text can be truncated anywhere.
+      size_t available = capacity - output_size;
+      bool truncated = (length > available);
+      if (truncated) {
+        length = available;
+      }
+      memcpy(&output[output_size], start, length);
+      output_size += length;
+
+      size_t last = length;
+      while ((last > 0) && (start[last - 1] == ' ')) {
+        last--;
+      }
+      if (last > 0) {
+        trimmed_size = output_size - length + last;
+      }
+      if (truncated) {
+        break;
+      }
+      continue;
+    }
+
+    uint8_t byte = data[i];
+    uint8_t encoded[4];
+    size_t encoded_size = 0;
+    bool whitespace = false;
+    if (byte < 0x80) {
+      // A control character. Tabs and line breaks separate words so they
+      // become spaces, everything else is dropped.
+      whitespace = (byte == '\t') || (byte == '\n') || (byte == '\r');
+      if (whitespace) {
+        encoded[0] = ' ';
+        encoded_size = 1;
+      }
+      i++;
+    } else if (utf8) {
+      uint32_t code_point = 0;
+      size_t length = DecodeSequence(&data[i], size - i, &code_point);
+      if ((code_point >= 0x80) && (code_point < 0xa0)) {
+        // A C1 control character.
+      } else if (code_point == 0xa0) {
+        // A no-break space.
+        whitespace = true;
+        encoded[0] = ' ';
+        encoded_size = 1;
+      } else {
+        memcpy(encoded, &data[i], length);
+        encoded_size = length;
+      }
+      i += length;
+    } else {
+      // A Latin-1 character, which maps directly to a code point.
+      if (byte >= 0xa0) {
+        whitespace = (byte == 0xa0);
+        if (whitespace) {
+          encoded[0] = ' ';
+          encoded_size = 1;
+        } else {
+          encoded[0] = 0xc0 | (byte >> 6);
+          encoded[1] = 0x80 | (byte & 0x3f);
+          encoded_size = 2;
+        }
+      }
+      i++;
+    }
+
+    if ((encoded_size == 0) || (whitespace && (output_size == 0))) {
+      continue;
+    }
+    if (!Append(encoded, encoded_size, output, capacity, &output_size)) {
+      break;
+    }
+    if (!whitespace) {
+      trimmed_size = output_size;
+    }
+  }
+
+  return trimmed_size;
+}
+
+size_t TextNormalizer::FoldCase(std::string_view text, char *output,
+                                size_t capacity) {
+  auto *data = reinterpret_cast<const uint8_t *>(text.data());
+  auto *folded = reinterpret_cast<uint8_t *>(output);
+  size_t size = (text.size() < capacity) ? text.size() : capacity;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i before_upper = _mm_set1_epi8('A' - 1);
+  const __m128i after_upper = _mm_set1_epi8('Z' + 1);
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    __m128i chunk = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(&data[i]));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, before_upper),
+                                  _mm_cmplt_epi8(chunk, after_upper));
+    chunk = _mm_or_si128(chunk, _mm_and_si128(upper, case_bit));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&folded[i]), chunk);
+  }
+#elif defined(DOGTRICKS_TEXT_NEON)
+  const uint8x16_t first_upper = vdupq_n_u8('A');
+  const uint8x16_t last_upper = vdupq_n_u8('Z');
+  const uint8x16_t case_bit = vdupq_n_u8(0x20);
+  for (; (i + kVectorSize) <= size; i += kVectorSize) {
+    uint8x16_t chunk = vld1q_u8(&data[i]);
+    uint8x16_t upper = vandq_u8(vcgeq_u8(chunk, first_upper),
+                                vcleq_u8(chunk, last_upper));
+    vst1q_u8(&folded[i], vorrq_u8(chunk, vandq_u8(upper, case_bit)));
+  }
+#endif
+  for (; i < size; i++) {
+    uint8_t byte = data[i];
+    folded[i] = ((byte >= 'A') && (byte <= 'Z')) ? (byte | 0x20) : byte;
+  }
+
+  // Latin-1 uppercase letters, U+00C0 to U+00DE other than the multiplication
+  // sign, are encoded as 0xc3 0x80 to 0xc3 0x9e and fold by setting the same
+  // bit in the continuation byte. The vector pass never touches these bytes.
+  const void *found = memchr(folded, 0xc3, size);
+  while (found != nullptr) {
+    size_t offset = static_cast<const uint8_t *>(found) - folded + 1;
+    if ((offset < size) && (folded[offset] >= 0x80) &&
+        (folded[offset] <= 0x9e) && (folded[offset] != 0x97)) {
+      folded[offset] |= 0x20;
+    }
+    found = memchr(&folded[offset], 0xc3, size - offset);
+  }
+
+  // Avoid splitting a sequence when the key was truncated.
+  while ((size > 0) && (size < text.size()) &&
+         ((data[size] & 0xc0) == 0x80)) {
+    size--;
+  }
+
+  return size;
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_TEXT_NORMALIZER_H_
+#define DOGTRICKS_TEXT_NORMALIZER_H_
+
+#include <cstddef>
+#include <string_view>
+
+namespace dogtricks {
+
+/**
+ * Cleans up text sent by the radio. Printable ASCII, which is nearly all
+ * metadata, is scanned 16 bytes at a time with SSE2 or NEON where available
+ * and copied through in bulk. All functions write into caller-provided
+ * storage and never allocate.
+ */
+class TextNormalizer {
+ public:
+  /**
+   * Checks whether the supplied bytes are well-formed UTF-8, rejecting
+   * overlong encodings, surrogates and code points beyond U+10FFFF.
+   *
+   * @param text The bytes to check.
+   * @return true if the bytes are valid UTF-8.
+   */
+  static bool IsValidUtf8(std::string_view text);
+
+  /**
+   * Normalizes text into valid UTF-8. Text that is not valid UTF-8 is
+   * assumed to be Latin-1 and transcoded. Tabs and line breaks become spaces
+   * and other control characters, including NUL padding and C1 controls, are
+   * removed. Leading and trailing whitespace is trimmed. The output is
+   * truncated at a code point boundary if it does not fit.
+   *
+   * @param text The text to normalize.
+   * @param output The buffer to write the normalized text to. This must not
+   *               overlap the input.
+   * @param capacity The size of the output buffer. Latin-1 text may need up
+   *                 to twice the size of the input.
+   * @return the size of the normalized text.
+   */
+  static size_t Normalize(std::string_view text, char *output,
+                          size_t capacity);
+
+  /**
+   * Produces a key for case-insensitive matching of normalized text by
+   * folding ASCII and Latin-1 uppercase letters to lowercase. Other
+   * characters are copied unchanged.
+   *
+   * @param text The normalized text to fold.
+   * @param output The buffer to write the key to. This may be the same as
+   *               the input.
+   * @param capacity The size of the output buffer. The key is never longer
+   *                 than the input.
+   * @return the size of the key.
+   */
+  static size_t FoldCase(std::string_view text, char *output,
+                         size_t capacity);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_TEXT_NORMALIZER_H_
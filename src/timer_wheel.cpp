@@ -0,0 +1,143 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace dogtricks {
+
+TimerWheel::TimerWheel(std::chrono::nanoseconds tick, size_t slot_count,
+                       std::chrono::steady_clock::time_point start)
+    : tick_(tick), start_(start), slots_(std::max(slot_count, size_t(1))) {}
+
+void TimerWheel::Schedule(Timer *timer,
+                          std::chrono::steady_clock::time_point deadline) {
+  Cancel(timer);
+
+  // Deadlines in the past are placed in the current slot so that the next
+  // call to Advance finds them.
+  uint64_t tick = std::max(GetTick(deadline), current_tick_);
+  timer->deadline = deadline;
+  timer->slot = tick % slots_.size();
+  timer->prev = nullptr;
+  timer->next = slots_[timer->slot];
+  if (timer->next != nullptr) {
+    timer->next->prev = timer;
+  }
+
+  slots_[timer->slot] = timer;
+  timer->armed = true;
+  armed_count_++;
+}
+
+void TimerWheel::Cancel(Timer *timer) {
+  if (timer->armed) {
+    Unlink(timer);
+    timer->armed = false;
+    armed_count_--;
+  }
+}
+
+size_t TimerWheel::Advance(std::chrono::steady_clock::time_point now,
+                           ExpiryCallback callback) {
+  uint64_t target_tick = std::max(GetTick(now), current_tick_);
+  uint64_t tick_count = std::min<uint64_t>(target_tick - current_tick_ + 1,
+                                           slots_.size());
+
+  // Collect the expired timers first so that callbacks may schedule timers
+  // into the slots being walked.
+  Timer *expired = nullptr;
+  size_t expired_count = 0;
+  for (uint64_t i = 0; i < tick_count; i++) {
+    Timer *timer = slots_[(current_tick_ + i) % slots_.size()];
+    while (timer != nullptr) {
+      Timer *next = timer->next;
+      if (timer->deadline <= now) {
+        Unlink(timer);
+        timer->armed = false;
+        armed_count_--;
+        timer->next = expired;
+        expired = timer;
+        expired_count++;
+      }
+
+      timer = next;
+    }
+  }
+
+  current_tick_ = target_tick;
+  while (expired != nullptr) {
+    Timer *timer = expired;
+    expired = timer->next;
+    timer->next = nullptr;
+    callback(timer);
+  }
+
+  return expired_count;
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+    TimerWheel::GetNextExpiry() const {
+  if (armed_count_ == 0) {
+    return std::nullopt;
+  }
+
+  for (uint64_t i = 0; i < slots_.size(); i++) {
+    uint64_t tick = current_tick_ + i;
+    std::optional<std::chrono::steady_clock::time_point> earliest;
+    for (const Timer *timer = slots_[tick % slots_.size()]; timer != nullptr;
+         timer = timer->next) {
+      // Timers for later revolutions share the slot and are skipped.
+      if (GetTick(timer->deadline) <= tick
+          && (!earliest.has_value() || timer->deadline < earliest.value())) {
+        earliest = timer->deadline;
+      }
+    }
+
+    if (earliest.has_value()) {
+      return earliest;
+    }
+  }
+
+  return start_ + tick_ * (current_tick_ + slots_.size());
+}
+
+uint64_t TimerWheel::GetTick(
+    std::chrono::steady_clock::time_point time) const {
+  if (time <= start_) {
+    return 0;
+  }
+
+  return static_cast<uint64_t>((time - start_) / tick_);
+}
+
+void TimerWheel::Unlink(Timer *timer) {
+  if (timer->prev != nullptr) {
+    timer->prev->next = timer->next;
+  } else {
+    slots_[timer->slot] = timer->next;
+  }
+
+  if (timer->next != nullptr) {
+    timer->next->prev = timer->prev;
+  }
+
+  timer->prev = nullptr;
+  timer->next = nullptr;
+}
+
+}  // namespace dogtricks
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_TIMER_WHEEL_H_
+#define DOGTRICKS_TIMER_WHEEL_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "non_copyable.h"
+
+namespace dogtricks {
+
+/**
+ * A hashed timer wheel. Timers are kept in intrusive lists in slots of a fixed
+ * tick, so scheduling and cancelling are constant time and the wheel does not
+ * allocate after construction. Timers further out than one revolution wait in
+ * their slot for the revolutions in between. This is not thread-safe.
+ */
+class TimerWheel : public NonCopyable {
+ public:
+  /**
+   * A timer that is linked into the wheel while armed. The owner embeds it
+   * and must cancel it before destroying it.
+   */
+  struct Timer {
+    //! The time at which the timer expires.
+    std::chrono::steady_clock::time_point deadline;
+
+    //! A pointer for the owner of the timer, supplied to the expiry callback.
+    void *context = nullptr;
+
+    //! The neighbours of the timer in its slot.
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+
+    //! The slot that the timer is linked into while armed.
+    size_t slot = 0;
+
+    //! Set to true while the timer is linked into the wheel.
+    bool armed = false;
+  };
+
+  /**
+   * A callback invoked for each timer that expires. The timer is disarmed
+   * before the callback, which may schedule it again.
+   */
+  typedef void (*ExpiryCallback)(Timer *timer);
+
+  /**
+   * Setup an empty wheel.
+   *
+   * @param tick The time covered by each slot.
+   * @param slot_count The number of slots in one revolution.
+   * @param start The time of the first tick.
+   */
+  TimerWheel(std::chrono::nanoseconds tick, size_t slot_count,
+             std::chrono::steady_clock::time_point start);
+
+  /**
+   * Arms a timer, moving it if it is already armed. Deadlines in the past
+   * expire on the next call to Advance.
+   */
+  void Schedule(Timer *timer, std::chrono::steady_clock::time_point deadline);
+
+  /**
+   * Disarms a timer if it is armed.
+   */
+  void Cancel(Timer *timer);
+
+  /**
+   * Expires the timers with deadlines at or before the supplied time.
+   *
+   * @param now The current time.
+   * @param callback The callback to invoke for each expired timer.
+   * @return the number of timers expired.
+   */
+  size_t Advance(std::chrono::steady_clock::time_point now,
+                 ExpiryCallback callback);
+
+  /**
+   * @return the earliest time at which Advance may have a timer to expire, or
+   *         no value if no timer is armed. This is exact for deadlines within
+   *         one revolution and otherwise the start of the next revolution.
+   */
+  std::optional<std::chrono::steady_clock::time_point> GetNextExpiry() const;
+
+  /**
+   * @return the number of armed timers.
+   */
+  size_t GetArmedCount() const {
+    return armed_count_;
+  }
+
+ private:
+  //! The time covered by each slot.
+  const std::chrono::nanoseconds tick_;
+
+  //! The time of tick zero.
+  const std::chrono::steady_clock::time_point start_;
+
+  //! The head of the list of timers in each slot.
+  std::vector<Timer *> slots_;
+
+  //! The next tick to be expired by Advance.
+  uint64_t current_tick_ = 0;
+
+  //! The number of armed timers.
+  size_t armed_count_ = 0;
+
+  /**
+   * @return the tick containing the supplied time, or zero before the start.
+   */
+  uint64_t GetTick(std::chrono::steady_clock::time_point time) const;
+
+  /**
+   * Removes a timer from the list of its slot.
+   */
+  void Unlink(Timer *timer);
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_TIMER_WHEEL_H_
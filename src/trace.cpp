@@ -0,0 +1,239 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace dogtricks {
+
+namespace {
+
+/**
+ * A recorded trace event.
+ */
+struct TraceEvent {
+  //! The name of the event.
+  const char *name;
+
+  //! The name of the argument, or nullptr.
+  const char *arg_name;
+
+  //! The value of the argument.
+  uint64_t arg;
+
+  //! The start of the event.
+  int64_t start_ns;
+
+  //! The duration of the event, or -1 for an instantaneous event.
+  int64_t duration_ns;
+};
+
+/**
+ * The events recorded by one thread. The buffer is locked by the owning
+ * thread while recording, which is uncontended unless the trace is being
+ * written out.
+ */
+struct ThreadBuffer {
+  //! The mutex to lock the events.
+  std::mutex mutex;
+
+  //! The ID of the thread in the trace.
+  uint32_t tid = 0;
+
+  //! The name of the thread, or nullptr.
+  const char *name = nullptr;
+
+  //! The events, used as a ring.
+  std::vector<TraceEvent> events;
+
+  //! The total number of events recorded.
+  uint64_t count = 0;
+};
+
+//! The mutex to lock the registry of thread buffers.
+std::mutex gRegistryMutex;
+
+//! The buffers of all threads that have recorded events. These outlive their
+//! threads so that their events can still be written out.
+std::vector<std::shared_ptr<ThreadBuffer>> gRegistry;
+
+//! The name of the calling thread.
+thread_local const char *tThreadName = nullptr;
+
+//! The buffer of the calling thread, created when it first records.
+thread_local ThreadBuffer *tThreadBuffer = nullptr;
+
+/**
+ * @return the buffer of the calling thread.
+ */
+ThreadBuffer *GetThreadBuffer() {
+  if (tThreadBuffer == nullptr) {
+    auto buffer = std::make_shared<ThreadBuffer>();
+    buffer->events.resize(Trace::kEventsPerThread);
+    buffer->name = tThreadName;
+
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    buffer->tid = static_cast<uint32_t>(gRegistry.size() + 1);
+    gRegistry.push_back(buffer);
+    tThreadBuffer = buffer.get();
+  }
+
+  return tThreadBuffer;
+}
+
+/**
+ * Records an event on the calling thread.
+ */
+void Record(const TraceEvent& event) {
+  ThreadBuffer *buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  buffer->events[buffer->count % Trace::kEventsPerThread] = event;
+  buffer->count++;
+}
+
+/**
+ * Writes a string to a JSON file, escaping quotes and backslashes.
+ */
+void WriteJsonString(FILE *file, const char *value) {
+  fputc('"', file);
+  for (const char *c = value; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+    }
+
+    fputc(*c, file);
+  }
+
+  fputc('"', file);
+}
+
+}  // namespace
+
+std::atomic<bool> Trace::enabled_(false);
+
+void Trace::SetThreadName(const char *name) {
+  tThreadName = name;
+  if (tThreadBuffer != nullptr) {
+    std::lock_guard<std::mutex> lock(tThreadBuffer->mutex);
+    tThreadBuffer->name = name;
+  }
+}
+
+void Trace::Instant(const char *name, const char *arg_name, uint64_t arg) {
+  Record({name, arg_name, arg, Now(), -1});
+}
+
+void Trace::Complete(const char *name, const char *arg_name, uint64_t arg,
+                     int64_t start_ns, int64_t end_ns) {
+  Record({name, arg_name, arg, start_ns, end_ns - start_ns});
+}
+
+int64_t Trace::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Trace::WriteJson(const char *path) {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(gRegistryMutex);
+    buffers = gRegistry;
+  }
+
+  FILE *file = fopen(path, "w");
+  bool success = (file != nullptr);
+  if (!success) {
+    LOGE("Failed to open trace file %s: %s", path, strerror(errno));
+  } else {
+    int pid = getpid();
+    bool first = true;
+    size_t event_count = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+    for (const auto& buffer : buffers) {
+      // Copy the events out so that the owning thread is only blocked for
+      // the length of the copy.
+      std::vector<TraceEvent> events;
+      const char *name;
+      {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        name = buffer->name;
+        size_t size = std::min<uint64_t>(buffer->count, kEventsPerThread);
+        events.reserve(size);
+        for (uint64_t i = buffer->count - size; i < buffer->count; i++) {
+          events.push_back(buffer->events[i % kEventsPerThread]);
+        }
+      }
+
+      if (name != nullptr) {
+        fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+                "\"tid\":%" PRIu32 ",\"args\":{\"name\":",
+                first ? "" : ",\n", pid, buffer->tid);
+        WriteJsonString(file, name);
+        fputs("}}", file);
+        first = false;
+      }
+
+      for (const TraceEvent& event : events) {
+        fprintf(file, "%s{\"ph\":\"%s\",\"pid\":%d,\"tid\":%" PRIu32
+                ",\"ts\":%.3f,", first ? "" : ",\n",
+                event.duration_ns < 0 ? "i" : "X", pid, buffer->tid,
+                event.start_ns / 1000.0);
+        if (event.duration_ns >= 0) {
+          fprintf(file, "\"dur\":%.3f,", event.duration_ns / 1000.0);
+        } else {
+          fputs("\"s\":\"t\",", file);
+        }
+
+        fputs("\"name\":", file);
+        WriteJsonString(file, event.name);
+        if (event.arg_name != nullptr) {
+          fputs(",\"args\":{", file);
+          WriteJsonString(file, event.arg_name);
+          fprintf(file, ":%" PRIu64 "}", event.arg);
+        }
+
+        fputc('}', file);
+        first = false;
+      }
+
+      event_count += events.size();
+    }
+
+    fputs("]}\n", file);
+    success = (fclose(file) == 0);
+    if (!success) {
+      LOGE("Failed to write trace file %s: %s", path, strerror(errno));
+    } else {
+      LOGI("Wrote %zu trace events to %s", event_count, path);
+    }
+  }
+
+  return success;
+}
+
+}  // namespace dogtricks
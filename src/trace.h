@@ -0,0 +1,164 @@
+/*
+ * Copyright 2018 Andrew Rossignol (andrew.rossignol@gmail.com)
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOGTRICKS_TRACE_H_
+#define DOGTRICKS_TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Trace points record into per-thread buffers that can be written out in the
+// Chrome trace event format, which Perfetto and chrome://tracing load. Trace
+// points are compiled out unless DOGTRICKS_ENABLE_TRACE is defined, and cost
+// a single relaxed load when compiled in but not enabled at runtime. Names
+// and argument names must be string literals.
+
+#define TRACE_CONCAT_INNER(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef DOGTRICKS_ENABLE_TRACE
+
+#define TRACE_SCOPE(name) \
+    ::dogtricks::TraceScope TRACE_CONCAT(trace_scope_, __LINE__)( \
+        name, nullptr, 0)
+#define TRACE_SCOPE_ARG(name, arg_name, arg) \
+    ::dogtricks::TraceScope TRACE_CONCAT(trace_scope_, __LINE__)( \
+        name, arg_name, static_cast<uint64_t>(arg))
+#define TRACE_INSTANT(name) do { \
+    if (::dogtricks::Trace::IsEnabled()) { \
+      ::dogtricks::Trace::Instant(name, nullptr, 0); \
+    } \
+  } while (0)
+#define TRACE_INSTANT_ARG(name, arg_name, arg) do { \
+    if (::dogtricks::Trace::IsEnabled()) { \
+      ::dogtricks::Trace::Instant(name, arg_name, static_cast<uint64_t>(arg)); \
+    } \
+  } while (0)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SCOPE_ARG(name, arg_name, arg) do {} while (0)
+#define TRACE_INSTANT(name) do {} while (0)
+#define TRACE_INSTANT_ARG(name, arg_name, arg) do {} while (0)
+
+#endif  // DOGTRICKS_ENABLE_TRACE
+
+namespace dogtricks {
+
+/**
+ * The process-wide trace recorder.
+ */
+class Trace {
+ public:
+#ifdef DOGTRICKS_ENABLE_TRACE
+  //! Set when trace points are compiled in.
+  static constexpr bool kCompiledIn = true;
+#else
+  //! Set when trace points are compiled in.
+  static constexpr bool kCompiledIn = false;
+#endif  // DOGTRICKS_ENABLE_TRACE
+
+  //! The number of events retained per thread. Older events are overwritten.
+  static constexpr size_t kEventsPerThread = 16384;
+
+  /**
+   * Starts or stops recording events.
+   */
+  static void SetEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  /**
+   * @return true if events are being recorded.
+   */
+  static bool IsEnabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Names the calling thread in the trace.
+   *
+   * @param name The name of the thread, which must be a string literal.
+   */
+  static void SetThreadName(const char *name);
+
+  /**
+   * Records an instantaneous event on the calling thread.
+   */
+  static void Instant(const char *name, const char *arg_name, uint64_t arg);
+
+  /**
+   * Records an event with a duration on the calling thread.
+   */
+  static void Complete(const char *name, const char *arg_name, uint64_t arg,
+                       int64_t start_ns, int64_t end_ns);
+
+  /**
+   * @return the current time on the trace clock in nanoseconds.
+   */
+  static int64_t Now();
+
+  /**
+   * Writes the events recorded by all threads as Chrome trace JSON. Recording
+   * may continue while the events are written.
+   *
+   * @param path The path of the file to write.
+   * @return true if successful, false otherwise.
+   */
+  static bool WriteJson(const char *path);
+
+ private:
+  //! Set when events are being recorded.
+  static std::atomic<bool> enabled_;
+};
+
+/**
+ * Records the duration of a scope as a trace event.
+ */
+class TraceScope {
+ public:
+  TraceScope(const char *name, const char *arg_name, uint64_t arg)
+      : name_(name), arg_name_(arg_name), arg_(arg),
+        start_ns_(Trace::IsEnabled() ? Trace::Now() : -1) {}
+
+  ~TraceScope() {
+    if (start_ns_ >= 0) {
+      Trace::Complete(name_, arg_name_, arg_, start_ns_, Trace::Now());
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  //! The name of the event.
+  const char *name_;
+
+  //! The name of the argument, or nullptr.
+  const char *arg_name_;
+
+  //! The value of the argument.
+  uint64_t arg_;
+
+  //! The start of the scope, or -1 if tracing was disabled.
+  int64_t start_ns_;
+};
+
+}  // namespace dogtricks
+
+#endif  // DOGTRICKS_TRACE_H_
@@ -16,66 +16,110 @@
 
 #include "transport.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
+#include <climits>
 #include <cstring>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif  // __linux__
 #include <termios.h>
 #include <unistd.h>
 
+#include "alloc_tracker.h"
+#include "flight_recorder.h"
 #include "log.h"
+#include "trace.h"
 
 namespace dogtricks {
 
-Transport::Transport(const char *path, EventHandler& event_handler)
-    : event_handler_(event_handler) {
-  fd_ = open(path, O_RDWR | O_NOCTTY);
-  if (fd_ < 0) {
-    LOGE("Error opening device: %s (%d)", strerror(errno), errno);
-  } else {
-    LOGD("Serial device opened");
+namespace {
 
-    // Configure the UART.
-    struct termios options;
-    memset(&options, 0, sizeof(struct termios));
-    cfmakeraw(&options);
+/**
+ * Records the header of an unescaped frame in the flight recorder.
+ *
+ * @param type RxFrame or TxFrame.
+ * @param frame The unescaped frame, starting with the sync byte.
+ * @param checksum_valid Whether the checksum of the frame is valid.
+ */
+void RecordFrameHeader(FlightRecorder::RecordType type, const uint8_t *frame,
+                       bool checksum_valid) {
+  FlightRecorder::FrameHeader header = {};
+  header.sequence_number = frame[3];
+  header.frame_type = frame[4];
+  header.length = frame[5];
+  if (header.length >= 2) {
+    header.op_code[0] = frame[6];
+    header.op_code[1] = frame[7];
+  }
 
-    if (cfsetspeed(&options, 57600) < 0) {
-      LOGE("Error setting speed");
-    } else {
-      options.c_cflag |= CS8 | CLOCAL | CREAD;
-      options.c_iflag = IGNPAR;
-      options.c_cc[VMIN] = 0;
-      options.c_cc[VTIME] = 10;
-      if (tcsetattr(fd_, TCSANOW, &options) < 0) {
-        LOGE("Failed to set serial port attributes");
-      } else {
-#ifdef __APPLE__
-        // HACK: It seems like reading/writing from a tty device too soon after
-        // opening the device can cause failures to read/write. Insert a small
-        // delay after finishing device initialization.
-        usleep(100000);
-#endif  // __APPLE__
-      }
-    }
+  header.checksum_valid = checksum_valid;
+  FlightRecorder::Record(type, &header, sizeof(header));
+}
+
+}  // anonymous namespace
+
+Transport::Transport(const char *path, EventHandler& event_handler)
+    : path_(path), fd_(-1), receiving_(false), event_handler_(event_handler) {
+  size_t separator = path_.rfind('/');
+  watch_directory_ = (separator == std::string::npos) ? "."
+      : (separator == 0) ? "/" : path_.substr(0, separator);
+
+  if (pipe(wake_fds_) < 0) {
+    FATAL_ERROR("Failed to create wake pipe with %s (%d)",
+                strerror(errno), errno);
   }
+
+  fcntl(wake_fds_[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_fds_[1], F_SETFL, O_NONBLOCK);
+  OpenDevice();
 }
 
 Transport::~Transport() {
   if (IsOpen()) {
     close(fd_);
   }
+
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
 }
 
 bool Transport::Start() {
   receiving_ = (fd_ > 0);
   bool running = receiving_;
   while(receiving_) {
-    ReceiveFrame();
+    // Acks accumulated while parsing the last read are written along with any
+    // pending requests before waiting for more bytes.
+    FlushTxQueue();
+    auto deadline = event_handler_.GetTimerDeadline();
+    int timeout_ms = -1;
+    if (deadline.has_value()) {
+      // Round up so that the loop does not wake just before the deadline.
+      auto remaining = deadline.value() - std::chrono::steady_clock::now()
+          + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1);
+      timeout_ms = static_cast<int>(std::clamp<int64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              remaining).count(), 0, INT_MAX));
+    }
+
+    WaitForIo(timeout_ms);
+    ParseRxBuffer();
+    if (link_lost_) {
+      Reconnect();
+    }
+
+    if (deadline.has_value()
+        && std::chrono::steady_clock::now() >= deadline.value()) {
+      event_handler_.OnTimer();
+    }
   }
 
   return running;
@@ -83,11 +127,86 @@ bool Transport::Start() {
 
 void Transport::Stop() {
   receiving_ = false;
+  Wake();
+}
+
+bool Transport::IsWritePending() const {
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  return (tx_count_ > 0);
+}
+
+void Transport::ProcessReadable() {
+  if (!link_lost_) {
+    WaitForIo(0 /* timeout_ms */);
+    ParseRxBuffer();
+    FlushTxQueue();
+  }
+
+  if (link_lost_) {
+    ProcessDeadline();
+  }
+}
+
+void Transport::ProcessWritable() {
+  FlushTxQueue();
+  if (link_lost_) {
+    ProcessDeadline();
+  }
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+    Transport::GetNextDeadline() const {
+  if (!link_lost_) {
+    return std::nullopt;
+  }
+
+  // A lost device is closed right away and then reopened with backoff.
+  return IsOpen() ? std::chrono::steady_clock::now() : reconnect_deadline_;
+}
+
+void Transport::ProcessDeadline() {
+  if (!link_lost_) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (IsOpen()) {
+    BeginReconnect();
+    reconnect_backoff_ms_ = kReconnectMinBackoffMs;
+    reconnect_deadline_ = now;
+  }
+
+  if (now >= reconnect_deadline_) {
+    if (access(path_.c_str(), F_OK) == 0 && OpenDevice()) {
+      link_lost_ = false;
+      FinishReconnect();
+    } else {
+      reconnect_deadline_ = now
+          + std::chrono::milliseconds(reconnect_backoff_ms_);
+      reconnect_backoff_ms_ = std::min(reconnect_backoff_ms_ * 2,
+                                       kReconnectMaxBackoffMs);
+    }
+  }
+}
+
+Transport::LinkStats Transport::GetLinkStats() const {
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  LinkStats stats = link_stats_;
+  stats.connected = IsOpen();
+  return stats;
+}
+
+Transport::TxQueueStats Transport::GetTxQueueStats() const {
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  TxQueueStats stats = tx_stats_;
+  stats.depth = tx_count_;
+  return stats;
 }
 
 void Transport::SendMessageFrame(OpCode op_code, const uint8_t *payload,
                                  size_t size) {
   assert(size <= UINT8_MAX);
+  TRACE_SCOPE_ARG("SendMessageFrame", "op", op_code);
 
   // Setup the message header.
   size_t message_pos = 0;
@@ -110,61 +229,123 @@ void Transport::SendMessageFrame(OpCode op_code, const uint8_t *payload,
   int8_t checksum = ComputeSum(message_buffer, message_pos);
   message_buffer[message_pos++] = -checksum;
 
-  SendFrame(message_buffer, message_pos);
+  SendFrame(message_buffer, message_pos, false /* is_ack */);
+  if (receiving_) {
+    Wake();
+  } else {
+    // Without a receive loop to wake, such as when driven by an external
+    // event loop, the frame is written right away.
+    FlushTxQueue();
+  }
 }
 
-void Transport::ReceiveFrame() {
-  // Sync to the next frame.
-  uint8_t message_buffer[kMessageBufferSize] = {};
-  while (ReadRawByte(&message_buffer[0]) && message_buffer[0] != kSyncByte) {}
+void Transport::ParseRxBuffer() {
+  while (rx_pos_ < rx_size_) {
+    uint8_t byte = rx_buffer_[rx_pos_++];
+    if (rx_frame_size_ == 0) {
+      // Sync to the next frame.
+      if (byte != kSyncByte) {
+        rx_skipped_++;
+        continue;
+      }
 
-  // Read the fields of the header.
-  bool success = true;
-  size_t pos = 1;
-  success &= ReadByte(&message_buffer[pos++]);
-  success &= ReadByte(&message_buffer[pos++]);
-  success &= ReadByte(&message_buffer[pos++]);
-  success &= ReadByte(&message_buffer[pos++]);
-  success &= ReadByte(&message_buffer[pos++]);
+      if (rx_skipped_ > 0) {
+        TRACE_INSTANT_ARG("Resync", "skipped", rx_skipped_);
+        rx_skipped_ = 0;
+      }
+    } else if (rx_escape_pending_) {
+      rx_escape_pending_ = false;
+      if (byte == kEscapedSyncByte) {
+        byte = kSyncByte;
+      } else if (byte != kEscapeByte) {
+        // TODO: This is due to an invalid escape sequence received from
+        // hardware. This failure should be propagated but this is simpler.
+        FlightRecorder::RecordNote("Invalid escape sequence 0x%02x", byte);
+        FATAL_ERROR("Invalid escape sequence");
+      }
+    } else if (byte == kEscapeByte) {
+      rx_escape_pending_ = true;
+      continue;
+    }
 
-  // Read the payload.
-  for (size_t i = 0; success && i < message_buffer[5]; i++) {
-    success &= ReadByte(&message_buffer[pos++]);
-  }
+    rx_frame_[rx_frame_size_++] = byte;
 
-  // Read the checksum.
-  success &= ReadByte(&message_buffer[pos++]);
+    // A frame is complete after the six byte header, the payload and the
+    // checksum.
+    if (rx_frame_size_ > 5
+        && rx_frame_size_ == static_cast<size_t>(rx_frame_[5]) + 7) {
+      HandleFrame(rx_frame_, rx_frame_size_);
+      rx_frame_size_ = 0;
+    }
+  }
+}
 
-  // Compute the checksum.
-  if (success) {
-    int8_t computed_sum = ComputeSum(message_buffer, pos - 1);
-    int8_t received_sum = message_buffer[pos - 1];
+void Transport::HandleFrame(const uint8_t *frame, size_t size) {
+  ALLOC_SCOPE(TransportRx);
+  int8_t computed_sum = ComputeSum(frame, size - 1);
+  int8_t received_sum = frame[size - 1];
+  bool checksum_valid =
+      (static_cast<uint8_t>(computed_sum + received_sum) == 0);
+  RecordFrameHeader(FlightRecorder::RecordType::RxFrame, frame,
+                    checksum_valid);
+  if (!checksum_valid) {
+    TRACE_INSTANT("ChecksumFailure");
+    LOGE("Invalid checksum %" PRId8 " vs %" PRId8,
+         computed_sum, received_sum);
+    return;
+  }
 
-    if (static_cast<uint8_t>(computed_sum + received_sum) != 0) {
-      LOGE("Invalid checksum %" PRId8 " vs %" PRId8,
-           computed_sum, received_sum);
+  uint8_t sequence_number = frame[3];
+  uint8_t frame_type = frame[4];
+  if (frame_type == kMessageFrame) {
+    // A retransmission means the ack was lost, so ack it again but do not
+    // deliver it twice.
+    SendAckFrame(sequence_number);
+    if (!AcceptRxFrame(frame)) {
+      TRACE_INSTANT_ARG("DuplicateFrame", "seq", sequence_number);
+      LOGD("Dropped retransmitted frame %" PRIu8, sequence_number);
+      std::lock_guard<std::mutex> lock(tx_mutex_);
+      link_stats_.duplicate_frames++;
+    } else if (frame[5] < 2) {
+      LOGE("Frame with short payload %" PRIu8, frame[5]);
     } else {
-      uint8_t sequence_number = message_buffer[3];
-      uint8_t frame_type = message_buffer[4];
-      if (frame_type == kMessageFrame) {
-        SendAckFrame(sequence_number);
-        if (message_buffer[5] < 2) {
-          LOGE("Frame with short payload %" PRIu8, message_buffer[5]);
-        } else {
-          auto op_code = static_cast<OpCode>(UnpackUInt16(&message_buffer[6]));
-          uint8_t *payload = &message_buffer[8];
-          size_t payload_size = message_buffer[5] - 2;
-          event_handler_.OnPacketReceived(op_code, payload, payload_size);
-        }
-      } else if (frame_type == kAckFrame) {
-        // TODO: Handle this and other Nack frames.
-      } else {
-        LOGD("Received frame type %" PRIu8, frame_type);
-      }
+      auto op_code = static_cast<OpCode>(UnpackUInt16(&frame[6]));
+      TRACE_SCOPE_ARG("FrameReceived", "op", op_code);
+      dispatch_latency_.Record(
+          std::chrono::steady_clock::now() - rx_wakeup_time_);
+      const uint8_t *payload = &frame[8];
+      size_t payload_size = frame[5] - 2;
+      event_handler_.OnPacketReceived(op_code, payload, payload_size);
     }
+  } else if (frame_type == kAckFrame) {
+    TRACE_INSTANT_ARG("AckReceived", "seq", sequence_number);
+    // TODO: Handle this and other Nack frames.
+  } else {
+    LOGD("Received frame type %" PRIu8, frame_type);
   }
 }
 
+bool Transport::AcceptRxFrame(const uint8_t *frame) {
+  if (rx_recent_reset_.exchange(false, std::memory_order_acquire)) {
+    rx_recent_count_ = 0;
+    rx_recent_next_ = 0;
+  }
+
+  RxFrameId id = {frame[3], frame[5], frame[frame[5] + 6]};
+  for (size_t i = 0; i < rx_recent_count_; i++) {
+    const RxFrameId& recent = rx_recent_[i];
+    if (recent.sequence_number == id.sequence_number
+        && recent.size == id.size && recent.checksum == id.checksum) {
+      return false;
+    }
+  }
+
+  rx_recent_[rx_recent_next_] = id;
+  rx_recent_next_ = (rx_recent_next_ + 1) % kRxDuplicateWindow;
+  rx_recent_count_ = std::min(rx_recent_count_ + 1, kRxDuplicateWindow);
+  return true;
+}
+
 void Transport::SendAckFrame(uint8_t sequence_number) {
   // Setup the message header.
   size_t message_pos = 0;
@@ -179,35 +360,315 @@ void Transport::SendAckFrame(uint8_t sequence_number) {
   // Insert the checksum.
   int8_t checksum = ComputeSum(message_buffer, message_pos);
   message_buffer[message_pos++] = -checksum;
-  SendFrame(message_buffer, message_pos);
+  SendFrame(message_buffer, message_pos, true /* is_ack */);
 }
 
-void Transport::SendFrame(const uint8_t *frame, size_t size) {
-  bool success = true;
-  size_t tx_buffer_pos = 0;
-  uint8_t tx_buffer[kTxRxBufferSize];
-  tx_buffer[tx_buffer_pos++] = kSyncByte;
-  for (size_t i = 1; success && i < size; i++) {
-    success &= InsertByte(frame[i], tx_buffer, &tx_buffer_pos,
-                          sizeof(tx_buffer));
-    // If a byte fails to insert, this is programming error and the buffer must
-    // be increased in size.
-    assert(success);
-  }
-
-  if (success) {
-    size_t write_pos = 0;
-    while (write_pos < tx_buffer_pos) {
-      ssize_t result = write(fd_, &tx_buffer[write_pos],
-                             tx_buffer_pos - write_pos);
-      if (result < 0) {
-        FATAL_ERROR("Failed to write to serial device with %s (%d)",
-                    strerror(errno), errno);
+void Transport::SendFrame(const uint8_t *frame, size_t size, bool is_ack) {
+  std::unique_lock<std::mutex> lock(tx_mutex_);
+  if (fd_ < 0) {
+    // Frames for a lost link are dropped rather than being sent to the
+    // device once it reconnects. Commands waiting on them fail fast.
+    LOGD("Dropping frame, link is down");
+    return;
+  }
+
+  if (tx_count_ == kTxQueueSize) {
+    lock.unlock();
+    FlushTxQueue();
+    lock.lock();
+  }
+
+  if (!is_ack) {
+    // Message frames are sent from command threads which can afford to wait
+    // for the receive loop to make space.
+    tx_cv_.wait_for(lock, std::chrono::milliseconds(kTxQueueTimeoutMs),
+                    [this]() { return tx_count_ < kTxQueueSize; });
+  }
+
+  if (tx_count_ == kTxQueueSize) {
+    if (is_ack) {
+      tx_stats_.dropped_acks++;
+    } else {
+      LOGE("Dropping frame, tx queue is full");
+    }
+  } else {
+    TxFrame& tx_frame = tx_queue_[(tx_head_ + tx_count_) % kTxQueueSize];
+    bool success = true;
+    tx_frame.size = 0;
+    tx_frame.data[tx_frame.size++] = kSyncByte;
+    for (size_t i = 1; success && i < size; i++) {
+      success &= InsertByte(frame[i], tx_frame.data, &tx_frame.size,
+                            sizeof(tx_frame.data));
+      // If a byte fails to insert, this is programming error and the buffer
+      // must be increased in size.
+      assert(success);
+    }
+
+    if (success) {
+      RecordFrameHeader(FlightRecorder::RecordType::TxFrame, frame,
+                        true /* checksum_valid */);
+      tx_count_++;
+      tx_stats_.frames_queued++;
+      if (tx_count_ > tx_stats_.peak_depth) {
+        tx_stats_.peak_depth = tx_count_;
+      }
+    }
+  }
+}
+
+void Transport::FlushTxQueue() {
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  if (tx_count_ == 0 || fd_ < 0) {
+    return;
+  }
+
+  TRACE_SCOPE_ARG("FlushTxQueue", "frames", tx_count_);
+  struct iovec iov[kTxQueueSize];
+  for (size_t i = 0; i < tx_count_; i++) {
+    TxFrame& tx_frame = tx_queue_[(tx_head_ + i) % kTxQueueSize];
+    size_t offset = (i == 0) ? tx_offset_ : 0;
+    iov[i].iov_base = &tx_frame.data[offset];
+    iov[i].iov_len = tx_frame.size - offset;
+  }
+
+  ssize_t result = writev(fd_, iov, static_cast<int>(tx_count_));
+  if (result < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      tx_stats_.would_block_count++;
+    } else if (errno != EINTR) {
+      HandleIoError("write to");
+    }
+  } else {
+    tx_stats_.write_calls++;
+    size_t written = static_cast<size_t>(result);
+    for (size_t i = 0, recorded = 0; recorded < written; i++) {
+      size_t size = std::min(iov[i].iov_len, written - recorded);
+      FlightRecorder::Record(FlightRecorder::RecordType::TxBytes,
+                             iov[i].iov_base, size);
+      recorded += size;
+    }
+
+    while (written > 0) {
+      size_t remaining = tx_queue_[tx_head_].size - tx_offset_;
+      if (written < remaining) {
+        tx_offset_ += written;
+        written = 0;
+      } else {
+        written -= remaining;
+        tx_offset_ = 0;
+        tx_head_ = (tx_head_ + 1) % kTxQueueSize;
+        tx_count_--;
+        tx_stats_.frames_written++;
+      }
+    }
+
+    tx_cv_.notify_all();
+  }
+}
+
+void Transport::Wake() {
+  uint8_t value = 0;
+  // A full pipe already guarantees a wakeup, so the result is ignored.
+  ssize_t result = write(wake_fds_[1], &value, sizeof(value));
+  (void)result;
+}
+
+void Transport::WaitForIo(int timeout_ms) {
+  bool tx_pending;
+  {
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+    tx_pending = (tx_count_ > 0);
+  }
+
+  struct pollfd fds[2] = {};
+  fds[0].fd = fd_;
+  fds[0].events = POLLIN | (tx_pending ? POLLOUT : 0);
+  fds[1].fd = wake_fds_[0];
+  fds[1].events = POLLIN;
+  if (poll(fds, 2, timeout_ms) < 0) {
+    if (errno != EINTR) {
+      FATAL_ERROR("Failed to poll serial device with %s (%d)",
+                  strerror(errno), errno);
+    }
+  }
+
+  auto wakeup_time = std::chrono::steady_clock::now();
+
+  if (fds[1].revents & POLLIN) {
+    uint8_t drain[16];
+    while (read(wake_fds_[0], drain, sizeof(drain)) > 0) {}
+  }
+
+  if (fds[0].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) {
+    ssize_t result = read(fd_, rx_buffer_, sizeof(rx_buffer_));
+    if (result < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        HandleIoError("read from");
+      }
+    } else if (result == 0) {
+      if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        errno = EIO;
+        HandleIoError("read from");
+      }
+    } else {
+      FlightRecorder::Record(FlightRecorder::RecordType::RxBytes, rx_buffer_,
+                             static_cast<size_t>(result));
+      rx_wakeup_time_ = wakeup_time;
+      rx_pos_ = 0;
+      rx_size_ = static_cast<size_t>(result);
+    }
+  }
+}
+
+bool Transport::OpenDevice() {
+  int fd = open(path_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    LOGE("Error opening device: %s (%d)", strerror(errno), errno);
+  } else {
+    LOGD("Serial device opened");
+
+    // Configure the UART.
+    struct termios options;
+    memset(&options, 0, sizeof(struct termios));
+    cfmakeraw(&options);
+
+    if (cfsetspeed(&options, 57600) < 0) {
+      LOGE("Error setting speed");
+    } else {
+      options.c_cflag |= CS8 | CLOCAL | CREAD;
+      options.c_iflag = IGNPAR;
+      options.c_cc[VMIN] = 0;
+      options.c_cc[VTIME] = 0;
+      if (tcsetattr(fd, TCSANOW, &options) < 0) {
+        LOGE("Failed to set serial port attributes");
       } else {
-        write_pos += result;
+#ifdef __APPLE__
+        // HACK: It seems like reading/writing from a tty device too soon after
+        // opening the device can cause failures to read/write. Insert a small
+        // delay after finishing device initialization.
+        usleep(100000);
+#endif  // __APPLE__
       }
     }
   }
+
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  fd_ = fd;
+  return (fd >= 0);
+}
+
+void Transport::CloseDevice() {
+  std::lock_guard<std::mutex> lock(tx_mutex_);
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+
+  // Anything queued or partially parsed belongs to the lost link.
+  tx_head_ = 0;
+  tx_count_ = 0;
+  tx_offset_ = 0;
+  rx_pos_ = 0;
+  rx_size_ = 0;
+  rx_frame_size_ = 0;
+  rx_escape_pending_ = false;
+  rx_skipped_ = 0;
+  rx_recent_count_ = 0;
+  rx_recent_next_ = 0;
+  tx_cv_.notify_all();
+}
+
+void Transport::HandleIoError(const char *operation) {
+  int error = errno;
+  FlightRecorder::RecordNote("Failed to %s device: %s", operation,
+                             strerror(error));
+  errno = error;
+  if (!reconnect_enabled_) {
+    FATAL_ERROR("Failed to %s serial device with %s (%d)",
+                operation, strerror(errno), errno);
+  } else if (!link_lost_) {
+    LOGE("Failed to %s serial device with %s (%d), reconnecting",
+         operation, strerror(errno), errno);
+    link_lost_ = true;
+    Wake();
+  }
+}
+
+void Transport::Reconnect() {
+  BeginReconnect();
+
+  int watch_fd = -1;
+#ifdef __linux__
+  // Watch the directory containing the device so that its reappearance (or a
+  // permission change once udev has finished with it) ends the backoff early.
+  watch_fd = inotify_init1(IN_NONBLOCK);
+  if (watch_fd >= 0) {
+    if (inotify_add_watch(watch_fd, watch_directory_.c_str(),
+                          IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+      close(watch_fd);
+      watch_fd = -1;
+    }
+  }
+#endif  // __linux__
+
+  int backoff_ms = kReconnectMinBackoffMs;
+  while (receiving_) {
+    if (access(path_.c_str(), F_OK) == 0 && OpenDevice()) {
+      break;
+    }
+
+    struct pollfd fds[2] = {};
+    fds[0].fd = wake_fds_[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = watch_fd;
+    fds[1].events = POLLIN;
+    poll(fds, (watch_fd >= 0) ? 2 : 1, backoff_ms);
+
+    uint8_t drain[256];
+    while (read(wake_fds_[0], drain, sizeof(drain)) > 0) {}
+    if (watch_fd >= 0) {
+      while (read(watch_fd, drain, sizeof(drain)) > 0) {}
+    }
+
+    backoff_ms = std::min(backoff_ms * 2, kReconnectMaxBackoffMs);
+  }
+
+  if (watch_fd >= 0) {
+    close(watch_fd);
+  }
+
+  link_lost_ = false;
+  if (IsOpen()) {
+    FinishReconnect();
+  }
+}
+
+void Transport::BeginReconnect() {
+  FlightRecorder::RecordNote("Link lost");
+  link_lost_time_ = std::chrono::steady_clock::now();
+  CloseDevice();
+  {
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+    link_stats_.disconnects++;
+  }
+
+  event_handler_.OnLinkDown();
+}
+
+void Transport::FinishReconnect() {
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - link_lost_time_);
+  {
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+    link_stats_.reconnects++;
+    link_stats_.last_reconnect_duration = duration;
+    link_stats_.total_downtime += duration;
+  }
+
+  FlightRecorder::RecordNote("Link restored");
+  LOGI("Reconnected to serial device in %" PRId64 " ms",
+       static_cast<int64_t>(duration.count()));
+  event_handler_.OnLinkUp();
 }
 
 bool Transport::InsertByte(uint8_t byte, uint8_t *buffer,
@@ -237,39 +698,4 @@ int8_t Transport::ComputeSum(const uint8_t *buffer, size_t size) {
   return sum;
 }
 
-bool Transport::ReadByte(uint8_t *byte) {
-  bool success = ReadRawByte(byte);
-  if (success) {
-    if (*byte == kEscapeByte) {
-      success = ReadRawByte(byte);
-      if (success) {
-        if (*byte == kEscapedSyncByte) {
-          *byte = kSyncByte;
-        } else if (*byte == kEscapeByte) {
-          *byte = kEscapeByte;
-        } else {
-          // TODO: This is due to an invalid escape sequence received from
-          // hardware. This failure should be propagated but this is simpler.
-          FATAL_ERROR("Invalid escape sequence");
-        }
-      }
-    }
-  }
-
-  return success;
-}
-
-bool Transport::ReadRawByte(uint8_t *byte) {
-  ssize_t result = 0;
-  while (result == 0 && receiving_) {
-    result = read(fd_, byte, 1);
-    if (result < 0) {
-      FATAL_ERROR("Failed to read from serial device with %s (%d)",
-                  strerror(errno), errno);
-    }
-  }
-
-  return receiving_;
-}
-
 }  // namespace dogtricks
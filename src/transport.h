@@ -17,9 +17,16 @@
 #ifndef DOGTRICKS_TRANSPORT_H_
 #define DOGTRICKS_TRANSPORT_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
 
+#include "latency_histogram.h"
 #include "non_copyable.h"
 
 namespace dogtricks {
@@ -49,6 +56,8 @@ class Transport : public NonCopyable {
     GetSignalResponse = 0x6018,
     PutModuleReadyResponse = 0x8000,
     PutPdtResponse = 0x8001,
+    PutChannelResponse = 0x800a,
+    PutSignalResponse = 0x8018,
   };
 
   /**
@@ -59,6 +68,56 @@ class Transport : public NonCopyable {
     return ((buffer[0] << 8) | buffer[1]);
   }
 
+  /**
+   * A snapshot of the outgoing frame queue metrics.
+   */
+  struct TxQueueStats {
+    //! The number of frames waiting to be written.
+    size_t depth;
+
+    //! The largest number of frames that have been waiting at once.
+    size_t peak_depth;
+
+    //! The number of frames that have been added to the queue.
+    uint64_t frames_queued;
+
+    //! The number of frames that have been completely written.
+    uint64_t frames_written;
+
+    //! The number of writev calls used to write the frames.
+    uint64_t write_calls;
+
+    //! The number of times the device was not ready to accept more bytes.
+    uint64_t would_block_count;
+
+    //! The number of ack frames dropped because the queue was full.
+    uint64_t dropped_acks;
+  };
+
+  /**
+   * A snapshot of the link availability metrics.
+   */
+  struct LinkStats {
+    //! Whether the serial device is currently open.
+    bool connected;
+
+    //! The number of times the link has been lost.
+    uint64_t disconnects;
+
+    //! The number of times the link has been reestablished.
+    uint64_t reconnects;
+
+    //! The time taken to reopen the device after the most recent loss.
+    std::chrono::milliseconds last_reconnect_duration;
+
+    //! The total time spent reopening the device.
+    std::chrono::milliseconds total_downtime;
+
+    //! The number of retransmitted message frames that were acked again but
+    //! not delivered.
+    uint64_t duplicate_frames;
+  };
+
   /**
    * The event handler for the transport to notify the application layers of
    * status changes.
@@ -72,6 +131,34 @@ class Transport : public NonCopyable {
      */
     virtual void OnPacketReceived(OpCode op_code, const uint8_t *payload,
                                   size_t payload_size) = 0;
+
+    /**
+     * Invoked from the receive loop when the serial device has been lost and
+     * reconnection is enabled. Frames cannot be sent until OnLinkUp.
+     */
+    virtual void OnLinkDown() {}
+
+    /**
+     * Invoked from the receive loop when the serial device has been reopened
+     * after a loss. The radio may need to be reconfigured.
+     */
+    virtual void OnLinkUp() {}
+
+    /**
+     * @return the time at which OnTimer should next be invoked by the
+     *         receive loop started with Start, or no value if nothing is
+     *         scheduled. This is polled on each pass of the loop.
+     */
+    virtual std::optional<std::chrono::steady_clock::time_point>
+        GetTimerDeadline() {
+      return std::nullopt;
+    }
+
+    /**
+     * Invoked from the receive loop started with Start once the time
+     * returned by GetTimerDeadline has passed.
+     */
+    virtual void OnTimer() {}
   };
 
   /**
@@ -85,7 +172,9 @@ class Transport : public NonCopyable {
   ~Transport();
 
   /**
-   * Starts reception of frames from the device.
+   * Starts reception of frames from the device. This blocks until Stop is
+   * called. To drive the transport from an external event loop instead, see
+   * ProcessReadable.
    *
    * @return true if the transport is open, false otherwise.
    */
@@ -104,7 +193,46 @@ class Transport : public NonCopyable {
   void Stop();
 
   /**
-   * Sends a frame to the radio with the supplied attributes.
+   * Configures how read and write failures are handled. When enabled, the
+   * receive loop closes the device and reopens it with backoff once it
+   * reappears. When disabled (the default), failures are fatal.
+   */
+  void SetReconnectEnabled(bool enabled) {
+    reconnect_enabled_ = enabled;
+  }
+
+  /**
+   * Forgets the recently delivered frames used to recognize retransmissions,
+   * for when the radio has restarted its sequence numbers, such as after a
+   * reset. The frames are forgotten by the receive loop before it handles
+   * the next frame, so this may be called from any thread.
+   */
+  void ResetRxWindow() {
+    rx_recent_reset_.store(true, std::memory_order_release);
+  }
+
+  /**
+   * @return a snapshot of the link availability metrics.
+   */
+  LinkStats GetLinkStats() const;
+
+  /**
+   * @return a snapshot of the outgoing frame queue metrics.
+   */
+  TxQueueStats GetTxQueueStats() const;
+
+  /**
+   * @return the latencies from the receive loop waking with bytes from the
+   *         device to the frame completed by those bytes being dispatched to
+   *         the event handler.
+   */
+  const LatencyHistogram& GetDispatchLatency() const {
+    return dispatch_latency_;
+  }
+
+  /**
+   * Queues a frame to the radio with the supplied attributes. The frame is
+   * written by the receive loop, coalesced with any other pending frames.
    *
    * @param op_code The op code to send.
    * @param payload The payload to send.
@@ -113,10 +241,51 @@ class Transport : public NonCopyable {
   void SendMessageFrame(OpCode op_code, const uint8_t *payload, size_t size);
 
   /**
-   * Receives a frame from the radio. This is a blocking call. The
-   * OnPacketReceived event handler is invoked when a frame is read.
+   * @return the file descriptor of the serial device for an external event
+   *         loop to watch, or -1 while the device is closed. The device is
+   *         reopened after a loss, so this must be queried again after each
+   *         call to ProcessReadable, ProcessWritable or ProcessDeadline.
+   */
+  int GetFd() const {
+    return fd_;
+  }
+
+  /**
+   * @return true if frames are waiting to be written, in which case an
+   *         external event loop must also watch for the file descriptor
+   *         becoming writable.
+   */
+  bool IsWritePending() const;
+
+  /**
+   * Reads the bytes available from the device and dispatches the frames that
+   * they complete, then writes the acks for those frames. This performs at
+   * most one read and never blocks. Partial frames are retained until the
+   * next call. This is for use from an external event loop, in place of
+   * Start, when the file descriptor is readable. Readiness must be
+   * level-triggered as a single call may not drain the device.
+   */
+  void ProcessReadable();
+
+  /**
+   * Writes as many queued frames as the device will accept without blocking.
+   * This is for use from an external event loop when the file descriptor is
+   * writable.
+   */
+  void ProcessWritable();
+
+  /**
+   * @return the time at which ProcessDeadline must next be called by an
+   *         external event loop, or no value if nothing is scheduled. While
+   *         the link is down this is the next attempt to reopen the device.
+   */
+  std::optional<std::chrono::steady_clock::time_point> GetNextDeadline() const;
+
+  /**
+   * Performs work scheduled by GetNextDeadline that is due. This never
+   * blocks.
    */
-  void ReceiveFrame();
+  void ProcessDeadline();
 
  private:
   //! The size of the message buffer.
@@ -125,6 +294,24 @@ class Transport : public NonCopyable {
   //! The size of the tx/rx frame buffers.
   static constexpr size_t kTxRxBufferSize = UINT8_MAX + 128;
 
+  //! The maximum number of frames that may be waiting to be written.
+  static constexpr size_t kTxQueueSize = 32;
+
+  //! The number of recently delivered message frames that an inbound frame
+  //! is compared with to detect a retransmission. The radio only resends a
+  //! frame while waiting for its ack, so this need only cover a few frames.
+  static constexpr size_t kRxDuplicateWindow = 16;
+
+  //! The amount of time to wait for space in the tx queue before dropping a
+  //! message frame.
+  static constexpr int kTxQueueTimeoutMs = 100;
+
+  //! The initial delay between attempts to reopen a lost device.
+  static constexpr int kReconnectMinBackoffMs = 50;
+
+  //! The longest delay between attempts to reopen a lost device.
+  static constexpr int kReconnectMaxBackoffMs = 5000;
+
   //! The sync byte used to indicate a start of message.
   static constexpr uint8_t kSyncByte = 0xa4;
 
@@ -143,11 +330,130 @@ class Transport : public NonCopyable {
   //! The value for an Ack frame.
   static constexpr uint8_t kAckFrame = 0x80;
 
-  //! The file descriptor used to communicate with the serial device.
-  int fd_;
+  //! The path of the serial device, retained to reopen it.
+  std::string path_;
+
+  //! The directory containing the serial device, watched while reconnecting.
+  //! This is computed up front so that reconnecting does not allocate.
+  std::string watch_directory_;
+
+  //! The file descriptor used to communicate with the serial device. This is
+  //! only changed by the receive loop while holding the tx mutex.
+  std::atomic<int> fd_;
+
+  //! Set to true to reopen the device after a failure rather than aborting.
+  std::atomic<bool> reconnect_enabled_ = false;
+
+  //! Set to true when a read or write has failed and the receive loop must
+  //! reopen the device.
+  std::atomic<bool> link_lost_ = false;
+
+  //! The link availability metrics. Connected is populated on request.
+  LinkStats link_stats_ = {};
+
+  //! The time at which the link was most recently lost.
+  std::chrono::steady_clock::time_point link_lost_time_;
+
+  //! The time of the next attempt to reopen a lost device when driven by an
+  //! external event loop.
+  std::chrono::steady_clock::time_point reconnect_deadline_;
+
+  //! The delay before the following attempt to reopen a lost device when
+  //! driven by an external event loop.
+  int reconnect_backoff_ms_ = kReconnectMinBackoffMs;
 
   //! Set to true when the transport is receiving frames.
-  bool receiving_;
+  std::atomic<bool> receiving_;
+
+  //! The pipe used to wake the receive loop. The read end is at index 0.
+  int wake_fds_[2] = {-1, -1};
+
+  //! The buffer of bytes read from the serial device but not yet parsed.
+  uint8_t rx_buffer_[kTxRxBufferSize];
+
+  //! The position of the next byte to parse in the rx buffer.
+  size_t rx_pos_ = 0;
+
+  //! The number of valid bytes in the rx buffer.
+  size_t rx_size_ = 0;
+
+  //! The unescaped frame being assembled from the rx buffer, which is empty
+  //! until a sync byte is found.
+  uint8_t rx_frame_[kMessageBufferSize];
+
+  //! The number of bytes of the frame that have been assembled.
+  size_t rx_frame_size_ = 0;
+
+  //! Set to true when the last byte parsed was an escape byte.
+  bool rx_escape_pending_ = false;
+
+  //! The number of bytes discarded while searching for a sync byte.
+  size_t rx_skipped_ = 0;
+
+  /**
+   * The identity of a message frame received from the radio.
+   */
+  struct RxFrameId {
+    //! The sequence number of the frame.
+    uint8_t sequence_number;
+
+    //! The size of the payload.
+    uint8_t size;
+
+    //! The checksum of the frame.
+    uint8_t checksum;
+  };
+
+  //! The most recently delivered message frames, used as a ring to recognize
+  //! retransmissions.
+  RxFrameId rx_recent_[kRxDuplicateWindow] = {};
+
+  //! The number of valid entries in the recent frames.
+  size_t rx_recent_count_ = 0;
+
+  //! The index of the next entry to replace in the recent frames.
+  size_t rx_recent_next_ = 0;
+
+  //! Set to true to forget the recent frames before the next is handled.
+  std::atomic<bool> rx_recent_reset_ = false;
+
+  //! The time at which the receive loop woke to read the rx buffer.
+  std::chrono::steady_clock::time_point rx_wakeup_time_;
+
+  //! The latencies from waking with bytes to dispatching a frame.
+  LatencyHistogram dispatch_latency_;
+
+  /**
+   * A wire-format (escaped) frame waiting to be written.
+   */
+  struct TxFrame {
+    //! The encoded frame.
+    uint8_t data[kTxRxBufferSize];
+
+    //! The size of the encoded frame.
+    size_t size;
+  };
+
+  //! The mutex to lock the tx queue.
+  mutable std::mutex tx_mutex_;
+
+  //! The condition variable used to wait for space in the tx queue.
+  std::condition_variable tx_cv_;
+
+  //! The ring of frames waiting to be written.
+  TxFrame tx_queue_[kTxQueueSize];
+
+  //! The index of the oldest frame in the tx queue.
+  size_t tx_head_ = 0;
+
+  //! The number of frames in the tx queue.
+  size_t tx_count_ = 0;
+
+  //! The number of bytes of the oldest frame that have already been written.
+  size_t tx_offset_ = 0;
+
+  //! The metrics for the tx queue. The depth is populated on request.
+  TxQueueStats tx_stats_ = {};
 
   //! The event handler for the transport.
   EventHandler& event_handler_;
@@ -158,35 +464,112 @@ class Transport : public NonCopyable {
   uint8_t sequence_number_ = 0;
 
   /**
-   * TODO: Docs.
+   * Queues an ack for the supplied sequence number. Acks are dropped rather
+   * than blocking the receive loop if the tx queue is full as the radio will
+   * retransmit the frame.
    */
   void SendAckFrame(uint8_t sequence_number);
 
   /**
-   * TODO: Docs.
+   * Escapes the supplied frame and adds it to the tx queue.
+   *
+   * @param frame The unescaped frame, starting with the sync byte.
+   * @param size The size of the frame.
+   * @param is_ack Whether the frame is an ack sent from the receive loop.
    */
-  void SendFrame(const uint8_t *frame, size_t size);
+  void SendFrame(const uint8_t *frame, size_t size, bool is_ack);
 
   /**
-   * Inserts an escaped byte into the buffer.
+   * Writes as many queued frames as the device will accept with a single
+   * writev. This never blocks.
    */
-  bool InsertByte(uint8_t byte, uint8_t *buffer, size_t *pos, size_t size);
+  void FlushTxQueue();
 
   /**
-   * Computes the checksum of the frame in wire-format.
+   * Opens and configures the serial device.
+   *
+   * @return true if successful, false otherwise.
    */
-  int8_t ComputeSum(const uint8_t *buffer, size_t size);
+  bool OpenDevice();
 
   /**
-   * Reads a byte from the serial device. This may read multiple bytes if they
-   * require escaping.
+   * Closes the serial device and discards queued and partially received
+   * frames.
    */
-  bool ReadByte(uint8_t *byte);
+  void CloseDevice();
 
   /**
-   * Reads one raw byte from the serial device.
+   * Handles a failure to read from or write to the device, using errno for
+   * the cause. This is fatal unless reconnection is enabled.
+   *
+   * @param operation A description of the failed operation for logging.
+   */
+  void HandleIoError(const char *operation);
+
+  /**
+   * Closes the lost device and blocks until it has been reopened or the
+   * transport is stopped. Invoked from the receive loop.
+   */
+  void Reconnect();
+
+  /**
+   * Closes the lost device, records the loss and notifies the event handler.
+   */
+  void BeginReconnect();
+
+  /**
+   * Records the device having been reopened and notifies the event handler.
+   */
+  void FinishReconnect();
+
+  /**
+   * Wakes the receive loop if it is waiting for the device.
+   */
+  void Wake();
+
+  /**
+   * Waits for the device to become readable, for queued frames to become
+   * writable or for a wake. Received bytes are read into the rx buffer.
+   *
+   * @param timeout_ms The longest time to wait, or -1 to wait indefinitely.
+   */
+  void WaitForIo(int timeout_ms);
+
+  /**
+   * Parses the bytes in the rx buffer, dispatching each frame completed.
+   */
+  void ParseRxBuffer();
+
+  /**
+   * Verifies the checksum of a complete unescaped frame and dispatches it.
+   *
+   * @param frame The frame, starting with the sync byte.
+   * @param size The size of the frame, including the checksum.
    */
-  bool ReadRawByte(uint8_t *byte);
+  void HandleFrame(const uint8_t *frame, size_t size);
+
+  /**
+   * Compares a message frame with the recently delivered frames, and
+   * remembers it if it is new. Frames match on their sequence number, size
+   * and checksum, so a radio that restarts its sequence numbers is not
+   * mistaken for a retransmission unless it repeats a recent frame exactly.
+   * Matching by recency rather than by numeric order handles sequence
+   * numbers wrapping from 255 to 0.
+   *
+   * @param frame The frame, starting with the sync byte.
+   * @return true if the frame is new and should be delivered.
+   */
+  bool AcceptRxFrame(const uint8_t *frame);
+
+  /**
+   * Inserts an escaped byte into the buffer.
+   */
+  bool InsertByte(uint8_t byte, uint8_t *buffer, size_t *pos, size_t size);
+
+  /**
+   * Computes the checksum of the frame in wire-format.
+   */
+  int8_t ComputeSum(const uint8_t *buffer, size_t size);
 };
 
 }  // namespace dogtricks